@@ -22,12 +22,19 @@
 #    include <config.h>
 #endif
 
+#include <sys/stat.h>
+
 #include <stdlib.h>
 
 #include <errno.h>
 #include <limits.h>
 #include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <neon/ne_session.h> // XXX Which ones of these do we actually need?
 #include <neon/ne_redirect.h>
@@ -37,9 +44,11 @@
 #include <neon/ne_xml.h>
 
 #include "accuraterip.h"
+#include "cache.h"
 #include "configuration.h"
 #include "gzip.h"
 #include "ratelimit.h"
+#include "store.h"
 
 #define USE_EAC 1
 
@@ -87,6 +96,18 @@ struct _userdata
      * structure.
      */
     size_t capacity;
+
+    /* The reader that parses the response when a copy of it is kept
+     * for the persistent store, see _store_reader()
+     */
+    ne_block_reader reader;
+
+    /* Copy of the uncompressed response, its length, and its capacity
+     * in octets
+     */
+    void *raw;
+    size_t raw_len;
+    size_t raw_capacity;
 };
 
 
@@ -299,6 +320,48 @@ struct _position
 #endif
 
 
+/* The response cache
+ *
+ * Parsed responses are kept in a cache keyed on their path, see
+ * cache.h.  Several threads can look up responses concurrently under
+ * the read lock.  Insertion and eviction take the write lock.
+ *
+ * Callers get a pointer to a response inside the cache.  That
+ * response is pinned for the calling thread until the thread looks up
+ * another response in the same context, and pinned responses are
+ * never evicted.  Failed lookups are not cached, but their responses
+ * are pinned the same way, so that they can be inspected.
+ */
+#define ACCURATERIP_CACHE_BUDGET (64 * 1024 * 1024)
+
+struct _cache_node
+{
+    /* The response itself, first so that a pointer to the response
+     * is a pointer to the node
+     */
+    struct _cache response;
+
+    /* The context whose cache holds the node
+     */
+    struct accuraterip_context *ctx;
+
+    /* The entry of the node in the cache.  Each thread that has the
+     * node pinned holds a reference to it, also if the node is not
+     * cached.
+     */
+    struct cache_entry entry;
+
+    /* Neighbours in the list of uncached nodes
+     */
+    struct _cache_node *prev;
+    struct _cache_node *next;
+
+    /* Non-zero if the node is in the cache
+     */
+    int cached;
+};
+
+
 /* XXX Opaque structure!
  */
 struct accuraterip_context
@@ -330,23 +393,627 @@ struct accuraterip_context
      */
     ne_session *session_localhost;
 
-    /* The cache, a list of parsed responses
-     *
-     * The cache will grow until memory is exhausted, if necessary.
-     * XXX Should the cache perhaps be global?  And it should be
-     * limited!
+    /* neon sessions must not be used by more than one thread at a
+     * time.  Each lock is held while its session is used, see
+     * _get_accuraterip().
+     */
+    pthread_mutex_t lock_session;
+#ifdef USE_EAC
+    pthread_mutex_t lock_session_eac;
+#endif
+    pthread_mutex_t lock_session_localhost;
+
+    /* The cache of parsed responses, see _cache_find() and
+     * _cache_commit()
      *
-     * XXX Mind the access of the cache: it may be accessed by several
-     * readers simultaneously, but only one writer at the time.
+     * The lock protects the hash table and the lists.  XXX Should the
+     * cache perhaps be global?
      */
-    struct _cache *cache;
+    pthread_rwlock_t lock;
 
-    /* Number of cached responses
+    /* Cached responses, keyed on their path
      */
-    size_t nmemb;
+    struct cache cache;
+
+    /* List of responses that are pinned but not cached
+     */
+    struct _cache_node *uncached;
+
+    /* The response pinned by each thread
+     */
+    pthread_key_t pin;
 };
 
 
+/* The _response_free() function releases everything held by the
+ * response @p response, but not the response itself.
+ */
+static void
+_response_free(struct _cache *response)
+{
+    size_t i;
+
+    if (response->entries != NULL) {
+        for (i = 0; i < response->nmemb; i++)
+            free(response->entries[i].chunks);
+        free(response->entries);
+    }
+
+    if (response->entry_eac != NULL) {
+        if (response->entry_eac->tracks != NULL) {
+            for (i = 0; i < response->entry_eac->n_tracks; i++) {
+                free(response->entry_eac->tracks[i].blocks_whole);
+                free(response->entry_eac->tracks[i].blocks_part);
+            }
+            free(response->entry_eac->tracks);
+        }
+        free(response->entry_eac);
+    }
+
+    if (response->error != NULL)
+        free(response->error);
+
+    if (response->path != NULL)
+        free(response->path);
+}
+
+
+/* The _node_new() function allocates a node for a response which is
+ * yet to be fetched.  The status of the response is initialised to
+ * -1.
+ */
+static struct _cache_node *
+_node_new(struct accuraterip_context *ctx)
+{
+    struct _cache_node *node;
+
+    node = malloc(sizeof(struct _cache_node));
+    if (node == NULL)
+        return (NULL);
+
+    node->response.entries = NULL;
+    node->response.entry_eac = NULL;
+    node->response.error = NULL;
+    node->response.path = NULL;
+    node->response.nmemb = 0;
+    node->response.status = -1;
+
+    node->ctx = ctx;
+    cache_entry_init(&node->entry);
+    node->prev = NULL;
+    node->next = NULL;
+    node->cached = 0;
+
+    return (node);
+}
+
+
+static void
+_node_free(struct _cache_node *node)
+{
+    _response_free(&node->response);
+    free(node);
+}
+
+
+/* The _node_evict() function frees a node evicted from the cache.
+ */
+static void
+_node_evict(struct cache_entry *entry)
+{
+    _node_free(CACHE_CONTAINER(entry, struct _cache_node, entry));
+}
+
+
+/* The _node_size() function returns an estimate of the memory used by
+ * the node @p node, in octets.
+ */
+static size_t
+_node_size(const struct _cache_node *node)
+{
+    const struct _cache *response;
+    size_t i, size;
+
+    response = &node->response;
+    size = sizeof(struct _cache_node);
+    if (response->path != NULL)
+        size += strlen(response->path) + 1;
+    if (response->error != NULL)
+        size += strlen(response->error) + 1;
+
+    size += response->nmemb * sizeof(struct _entry);
+    for (i = 0; i < response->nmemb; i++)
+        size += response->entries[i].track_count * sizeof(struct _chunk);
+
+    if (response->entry_eac != NULL) {
+        size += sizeof(struct _entry_eac);
+        size += response->entry_eac->n_tracks * sizeof(struct _track_eac);
+        for (i = 0; i < response->entry_eac->n_tracks; i++) {
+            size += (response->entry_eac->tracks[i].n_blocks_whole +
+                     response->entry_eac->tracks[i].n_blocks_part) *
+                sizeof(struct _block_eac);
+        }
+    }
+
+    return (size);
+}
+
+
+/* The _unpin() function releases the pin of the calling thread on @p
+ * node.  A node that is not in the cache is freed once the last pin
+ * is released.  Cached nodes cannot be evicted while they are pinned,
+ * so whether @p node is cached does not change under the feet of a
+ * thread that has it pinned.
+ */
+static void
+_unpin(void *arg)
+{
+    struct accuraterip_context *ctx;
+    struct _cache_node *node;
+    int cached;
+
+
+    /* The node must not be touched once the pin is released, unless
+     * it is an uncached node, which is not shared.
+     */
+    node = arg;
+    cached = node->cached;
+    if (cache_unref(&node->entry) > 0 || cached)
+        return;
+
+    ctx = node->ctx;
+    if (pthread_rwlock_wrlock(&ctx->lock) != 0)
+        return;
+    if (node->prev != NULL)
+        node->prev->next = node->next;
+    else
+        ctx->uncached = node->next;
+    if (node->next != NULL)
+        node->next->prev = node->prev;
+    pthread_rwlock_unlock(&ctx->lock);
+
+    _node_free(node);
+}
+
+
+/* The _pin() function makes @p node, which the caller has already
+ * referenced, the response pinned by the calling thread, and releases
+ * the response that was pinned before.
+ */
+static const struct _cache *
+_pin(struct accuraterip_context *ctx, struct _cache_node *node)
+{
+    struct _cache_node *prev;
+
+    prev = pthread_getspecific(ctx->pin);
+    if (pthread_setspecific(ctx->pin, node) != 0) {
+        _unpin(node);
+        return (NULL);
+    }
+    if (prev != NULL)
+        _unpin(prev);
+    return (&node->response);
+}
+
+
+/* The _cache_find() function returns the cached response for @p path,
+ * pinned for the calling thread, or @c NULL if there is no such
+ * response.  It updates the hit rate.
+ */
+static const struct _cache *
+_cache_find(struct accuraterip_context *ctx, const char *path)
+{
+    struct cache_entry *entry;
+    size_t h;
+
+
+    __atomic_add_fetch(&ctx->hit_rate[1], 1, __ATOMIC_RELAXED);
+    h = cache_hash(path);
+
+    if (pthread_rwlock_rdlock(&ctx->lock) != 0)
+        return (NULL);
+    entry = cache_find(&ctx->cache, path, h);
+    if (entry != NULL) {
+        cache_ref(entry);
+        cache_hit(entry);
+    }
+    pthread_rwlock_unlock(&ctx->lock);
+
+    if (entry == NULL)
+        return (NULL);
+    __atomic_add_fetch(&ctx->hit_rate[0], 1, __ATOMIC_RELAXED);
+    return (_pin(ctx, CACHE_CONTAINER(entry, struct _cache_node, entry)));
+}
+
+
+/* The _cache_commit() function enters the freshly fetched response in
+ * @p node into the cache if the lookup was successful, and returns it
+ * pinned for the calling thread.  If another thread cached a response
+ * for the same path in the meantime, that response is returned
+ * instead and @p node is discarded.  Unsuccessful responses are not
+ * cached.
+ */
+static const struct _cache *
+_cache_commit(struct accuraterip_context *ctx, struct _cache_node *node)
+{
+    struct cache_entry *other;
+    size_t h;
+
+
+    if (pthread_rwlock_wrlock(&ctx->lock) != 0) {
+        _node_free(node);
+        return (NULL);
+    }
+
+    cache_ref(&node->entry);
+    if (node->response.status != 0 || node->response.path == NULL) {
+        node->prev = NULL;
+        node->next = ctx->uncached;
+        if (ctx->uncached != NULL)
+            ctx->uncached->prev = node;
+        ctx->uncached = node;
+        pthread_rwlock_unlock(&ctx->lock);
+        return (_pin(ctx, node));
+    }
+
+    h = cache_hash(node->response.path);
+    other = cache_find(&ctx->cache, node->response.path, h);
+    if (other != NULL) {
+        cache_ref(other);
+        pthread_rwlock_unlock(&ctx->lock);
+        _node_free(node);
+        return (_pin(ctx, CACHE_CONTAINER(other, struct _cache_node, entry)));
+    }
+
+    if (cache_insert(&ctx->cache,
+                     &node->entry,
+                     node->response.path,
+                     h,
+                     _node_size(node)) != 0) {
+        pthread_rwlock_unlock(&ctx->lock);
+        _node_free(node);
+        return (NULL);
+    }
+    node->cached = 1;
+
+    pthread_rwlock_unlock(&ctx->lock);
+    return (_pin(ctx, node));
+}
+
+
+void
+accuraterip_set_cache_budget(struct accuraterip_context *ctx, size_t budget)
+{
+    if (pthread_rwlock_wrlock(&ctx->lock) != 0)
+        return;
+    cache_set_budget(&ctx->cache, budget);
+    pthread_rwlock_unlock(&ctx->lock);
+}
+
+
+/* The persistent store
+ *
+ * Uncompressed responses are saved on disk under the path they were
+ * requested from, below the directory set by accuraterip_store_init().
+ * Each record starts with a header that holds the time it expires,
+ * so that responses are fetched again once in a while, as their
+ * confidence changes.  A 4xx response is recorded without a payload,
+ * and expires sooner.  Records are parsed again when they are loaded,
+ * and entered in the cache as if they had come from the network.
+ * The payload is kept exactly as the server sent it, but the header
+ * is in native byte order.
+ *
+ * Records are installed with store_commit().  Two albums that look
+ * up the same disc at the same time each write the same response,
+ * and the one that is renamed last wins.
+ */
+#define ACCURATERIP_STORE_MAGIC "sndchkar"
+#define ACCURATERIP_STORE_VERSION 1
+
+static char *_store_path = NULL;
+static time_t _store_ttl = 0;
+static time_t _store_ttl_404 = 0;
+static pthread_mutex_t _store_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+struct _store_header
+{
+    char magic[8];
+    uint32_t version;
+
+    /* The status of the response: 0 if successful, +1 if it was not
+     * found
+     */
+    uint32_t status;
+
+    /* Time after which the record should not be used, in seconds
+     * since the Epoch
+     */
+    int64_t expires;
+
+    /* Length of the payload that follows the header, in octets
+     */
+    uint64_t len;
+};
+
+
+int
+accuraterip_store_init(const char *path, time_t ttl, time_t ttl_404)
+{
+    char *p;
+
+    if (pthread_mutex_lock(&_store_mutex) != 0)
+        return (-1);
+
+    p = NULL;
+    if (path != NULL) {
+        if (store_mkdir(path) != 0 || (p = strdup(path)) == NULL) {
+            pthread_mutex_unlock(&_store_mutex);
+            return (-1);
+        }
+    }
+
+    if (_store_path != NULL)
+        free(_store_path);
+    _store_path = p;
+    _store_ttl = ttl;
+    _store_ttl_404 = ttl_404;
+
+    if (pthread_mutex_unlock(&_store_mutex) != 0)
+        return (-1);
+    return (0);
+}
+
+
+/* The _store_reader() function keeps a copy of the uncompressed
+ * response for the store, and passes it on to the actual reader.
+ */
+static int
+_store_reader(void *userdata, const char *buf, size_t len)
+{
+    struct _userdata *ud;
+    void *p;
+    size_t capacity;
+
+
+    /* If the copy cannot be grown, drop it but keep counting, so
+     * that _store_put() knows the response is incomplete.  This is
+     * not an error for the actual reader.
+     */
+    ud = (struct _userdata *)userdata;
+    if (len > 0 && (ud->raw != NULL || ud->raw_len == 0)) {
+        if (ud->raw_len + len > ud->raw_capacity) {
+            capacity = ud->raw_capacity > 0 ? ud->raw_capacity : 4096;
+            while (capacity < ud->raw_len + len)
+                capacity *= 2;
+            p = realloc(ud->raw, capacity);
+            if (p == NULL) {
+                free(ud->raw);
+                ud->raw = NULL;
+                ud->raw_capacity = 0;
+            } else {
+                ud->raw = p;
+                ud->raw_capacity = capacity;
+            }
+        }
+
+        if (ud->raw != NULL)
+            memcpy((char *)ud->raw + ud->raw_len, buf, len);
+    }
+    ud->raw_len += len;
+
+    return (ud->reader(userdata, buf, len));
+}
+
+
+/* The _path_valid() function returns non-zero if @p path is an
+ * absolute path on the server that may be used as a name in the
+ * store: it must not have any empty, "." or ".." components that
+ * would lead outside the store or onto another record.
+ */
+static int
+_path_valid(const char *path)
+{
+    const char *p;
+    size_t len;
+
+
+    if (path == NULL || path[0] != '/')
+        return (0);
+
+    for (p = path + 1; ; p += len + 1) {
+        len = strcspn(p, "/");
+        if (len == 0 ||
+            (len == 1 && p[0] == '.') ||
+            (len == 2 && p[0] == '.' && p[1] == '.')) {
+            return (0);
+        }
+        if (p[len] == '\0')
+            break;
+    }
+
+    return (1);
+}
+
+
+/* The _store_file() function returns the name of the record for @p
+ * path in the store, or @c NULL if @p path is not valid.  The name
+ * must be freed by the caller.
+ */
+static char *
+_store_file(const char *path)
+{
+    char *file;
+    size_t len;
+
+    if (_path_valid(path) == 0) {
+        errno = EINVAL;
+        return (NULL);
+    }
+
+    len = strlen(_store_path) + strlen(path) + 1;
+    file = malloc(len);
+    if (file == NULL)
+        return (NULL);
+    snprintf(file, len, "%s%s", _store_path, path);
+
+    return (file);
+}
+
+
+/* The _store_put() function writes the response for @p path, as held
+ * by @p ud, to the store.  Only successful responses and responses
+ * that were not found are written.  Failure to write the record is
+ * not an error for the caller.
+ *
+ * @return 0 if successful, -1 otherwise
+ */
+static int
+_store_put(const char *path, const struct _userdata *ud)
+{
+    struct _store_header header;
+    FILE *stream;
+    char *file, *tmp;
+    int ret;
+
+
+    if (_store_path == NULL ||
+        ud->result->status < 0 ||
+        (ud->result->status == 0 && ud->raw == NULL && ud->raw_len > 0)) {
+        return (-1);
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ACCURATERIP_STORE_MAGIC, 8);
+    header.version = ACCURATERIP_STORE_VERSION;
+    header.status = ud->result->status;
+    header.expires = time(NULL) +
+        (ud->result->status == 0 ? _store_ttl : _store_ttl_404);
+    header.len = ud->result->status == 0 ? ud->raw_len : 0;
+
+
+    /* The record goes below the store, under the path it was
+     * requested from.
+     */
+    file = _store_file(path);
+    if (file == NULL)
+        return (-1);
+    stream = store_create(file, &tmp);
+    if (stream == NULL) {
+        free(file);
+        return (-1);
+    }
+
+    ret = 0;
+    if (fwrite(&header, sizeof(header), 1, stream) != 1 ||
+        (header.len > 0 &&
+         fwrite(ud->raw, 1, header.len, stream) != header.len)) {
+        ret = -1;
+    }
+    ret = store_commit(stream, tmp, file, ret);
+
+    free(file);
+    return (ret);
+}
+
+
+/* The _store_get() function enters the record for @p path into the
+ * cache of @p ctx, after parsing it with @p reader, and returns the
+ * response.  Records that have expired are ignored, and so are
+ * records for responses that were not found unless @p negative is
+ * non-zero.
+ *
+ * @return The response if there is a valid record, @c NULL otherwise
+ */
+static const struct _cache *
+_store_get(struct accuraterip_context *ctx,
+           const char *path,
+           ne_block_reader reader,
+           ne_session *session,
+           int negative)
+{
+    struct _store_header header;
+    struct _cache_node *node;
+    struct _userdata ud;
+    FILE *stream;
+    char *file, *raw;
+
+
+    if (_store_path == NULL)
+        return (NULL);
+
+    file = _store_file(path);
+    if (file == NULL)
+        return (NULL);
+    stream = fopen(file, "r");
+    free(file);
+    if (stream == NULL)
+        return (NULL);
+
+    if (fread(&header, sizeof(header), 1, stream) != 1 ||
+        memcmp(header.magic, ACCURATERIP_STORE_MAGIC, 8) != 0 ||
+        header.version != ACCURATERIP_STORE_VERSION ||
+        header.status > 1 ||
+        (header.status != 0 && (negative == 0 || header.len != 0)) ||
+        header.expires <= time(NULL) ||
+        header.len > SIZE_MAX) {
+        fclose(stream);
+        return (NULL);
+    }
+
+    raw = malloc(header.len > 0 ? header.len : 1);
+    if (raw == NULL ||
+        fread(raw, 1, header.len, stream) != header.len ||
+        fgetc(stream) != EOF) {
+        if (raw != NULL)
+            free(raw);
+        fclose(stream);
+        return (NULL);
+    }
+    fclose(stream);
+
+    node = _node_new(ctx);
+    if (node == NULL) {
+        free(raw);
+        return (NULL);
+    }
+
+
+    /* Parse the payload as if it had been received in one block,
+     * followed by the final, empty block.
+     */
+    ud.result = &node->response;
+    ud.session = session;
+#ifdef USE_EAC
+    ud.session_eac = session;
+#endif
+    ud.session_localhost = session;
+    ud.buf = NULL;
+    ud.len = 0;
+    ud.capacity = 0;
+
+    if (header.status == 0) {
+        if ((header.len > 0 && reader(&ud, raw, header.len) != 0) ||
+            reader(&ud, NULL, 0) != 0 ||
+            (node->response.path = strdup(path)) == NULL) {
+            if (ud.buf != NULL)
+                free(ud.buf);
+            free(raw);
+            _node_free(node);
+            return (NULL);
+        }
+        node->response.status = 0;
+    } else {
+        node->response.status = +1;
+    }
+    if (ud.buf != NULL)
+        free(ud.buf);
+    free(raw);
+
+    return (_cache_commit(ctx, node));
+}
+
+
 struct accuraterip_context *
 accuraterip_new(const char *hostname, unsigned int port)
 {
@@ -362,8 +1029,27 @@ accuraterip_new(const char *hostname, unsigned int port)
     ctx->session_eac = NULL;
 #endif
     ctx->session_localhost = NULL;
-    ctx->cache = NULL;
-    ctx->nmemb = 0;
+    cache_init(&ctx->cache, ACCURATERIP_CACHE_BUDGET, NULL, _node_evict);
+    ctx->uncached = NULL;
+
+    errno = pthread_rwlock_init(&ctx->lock, NULL);
+    if (errno != 0) {
+        free(ctx);
+        return (NULL);
+    }
+
+    errno = pthread_key_create(&ctx->pin, _unpin);
+    if (errno != 0) {
+        pthread_rwlock_destroy(&ctx->lock);
+        free(ctx);
+        return (NULL);
+    }
+
+    pthread_mutex_init(&ctx->lock_session, NULL);
+#ifdef USE_EAC
+    pthread_mutex_init(&ctx->lock_session_eac, NULL);
+#endif
+    pthread_mutex_init(&ctx->lock_session_localhost, NULL);
 
 
     /* Because it is not clear whether ne_sock_init() sets errno on
@@ -374,6 +1060,13 @@ accuraterip_new(const char *hostname, unsigned int port)
      * XXX See http://www.webdav.org/neon/doc/html/refproxy.html
      */
     if (ne_sock_init() != 0) {
+        pthread_mutex_destroy(&ctx->lock_session);
+#ifdef USE_EAC
+        pthread_mutex_destroy(&ctx->lock_session_eac);
+#endif
+        pthread_mutex_destroy(&ctx->lock_session_localhost);
+        pthread_key_delete(ctx->pin);
+        pthread_rwlock_destroy(&ctx->lock);
         free(ctx);
         errno = EIO;
         return (NULL);
@@ -410,36 +1103,27 @@ accuraterip_new(const char *hostname, unsigned int port)
 void
 accuraterip_free(struct accuraterip_context *ctx)
 {
-    struct _cache *response;
-    size_t i, j;
+    struct _cache_node *node;
 
 
-    /* Free the cache, if allocated.
+    /* Free the cache, including any responses that are still
+     * pinned.  Deleting the key does not run its destructor.
      */
     printf("Cached %zd AccurateRip response%s, hit rate %ld%% (%zd/%zd).\n",
-           ctx->nmemb,
-           ctx->nmemb == 1 ? "" : "s",
+           ctx->cache.nmemb,
+           ctx->cache.nmemb == 1 ? "" : "s",
            ctx->hit_rate[1] > 0
            ? lrintf(100.0f * ctx->hit_rate[0] / ctx->hit_rate[1]) : 0,
            ctx->hit_rate[0], ctx->hit_rate[1]);
 
-    if (ctx->cache != NULL) {
-        for (i = 0; i < ctx->nmemb; i++) {
-            response = ctx->cache + i;
-
-            for (j = 0; j < response->nmemb; j++)
-                free(response->entries[j].chunks);
-            free(response->entries);
-
-            if (response->error != NULL)
-                free(response->error);
-
-            if (response->path != NULL)
-                free(response->path);
-        }
-
-        free(ctx->cache);
+    pthread_key_delete(ctx->pin);
+    cache_clear(&ctx->cache);
+    while (ctx->uncached != NULL) {
+        node = ctx->uncached;
+        ctx->uncached = node->next;
+        _node_free(node);
     }
+    pthread_rwlock_destroy(&ctx->lock);
 
 
     /* ne_session_destroy() and ne_sock_exit() cannot fail.  XXX Zap
@@ -452,6 +1136,12 @@ accuraterip_free(struct accuraterip_context *ctx)
     ne_session_destroy(ctx->session_localhost);
     ne_sock_exit();
 
+    pthread_mutex_destroy(&ctx->lock_session);
+#ifdef USE_EAC
+    pthread_mutex_destroy(&ctx->lock_session_eac);
+#endif
+    pthread_mutex_destroy(&ctx->lock_session_localhost);
+
     free(ctx);
 }
 
@@ -551,6 +1241,7 @@ _block_reader(void *userdata, const char *buf, size_t len)
 
         if (ud->buf != NULL)
             free(ud->buf);
+        ud->buf = NULL;
         ud->capacity = 0;
         ud->len = 0;
 
@@ -1296,52 +1987,52 @@ _mkpath_eac(Mb5Disc disc)
  *             0 Success
  */
 static const struct _cache *
-_get_accuraterip(struct accuraterip_context *ctx, const char *path)
+_fetch_accuraterip(struct accuraterip_context *ctx, const char *path)
 {
     struct _userdata ud;
+    const struct _cache *response;
+    struct _cache_node *node;
     struct gzip_context *gc;
     ne_request *request;
 //    const ne_status *status;
-    void *p;
-    size_t i;
     int ret;
 
 
-    /* Traverse the cache in reverse order and return the first
-     * matching entry.
+    /* Return the cached response, if any.
      */
-    ctx->hit_rate[1] += 1;
-    for (i = ctx->nmemb; i-- > 0; ) {
-        if (strcmp(ctx->cache[i].path, path) == 0) {
-            ctx->hit_rate[0] += 1;
-            return (ctx->cache + i);
-        }
-    }
+    response = _cache_find(ctx, path);
+    if (response != NULL)
+        return (response);
 //    printf("   Looking up ->%s<-\n", path);
 
 
-    /* Create and initialise a new result entry in the cache.
-     * Initialise the userdata structure for _block_reader().
+    /* Failing that, return the stored response, if any.  Neither the
+     * network nor the rate limiter is involved in this case.
      */
-    p = realloc(ctx->cache, (ctx->nmemb + 1) * sizeof(struct _cache));
-    if (p == NULL) {
+    response = _store_get(ctx, path, _block_reader, ctx->session, 1);
+    if (response != NULL)
+        return (response);
+
+
+    /* Create and initialise a new result, which is entered in the
+     * cache once it has been fetched.  Initialise the userdata
+     * structure for _block_reader().
+     */
+    node = _node_new(ctx);
+    if (node == NULL) {
         ne_set_error(ctx->session, "%s", strerror(errno));
         return (NULL);
     }
-    ctx->cache = p;
-
-    ctx->cache[ctx->nmemb].entries = NULL;
-    ctx->cache[ctx->nmemb].entry_eac = NULL;
-    ctx->cache[ctx->nmemb].error = NULL;
-    ctx->cache[ctx->nmemb].path = NULL;
-    ctx->cache[ctx->nmemb].nmemb = 0;
-    ctx->cache[ctx->nmemb].status = -1;
 
-    ud.result = ctx->cache + ctx->nmemb;
+    ud.result = &node->response;
     ud.session = ctx->session;
     ud.buf = NULL;
     ud.len = 0;
     ud.capacity = 0;
+    ud.reader = _block_reader;
+    ud.raw = NULL;
+    ud.raw_len = 0;
+    ud.raw_capacity = 0;
 
 
     /* Create the request, only accepting successful responses, and
@@ -1352,9 +2043,11 @@ _get_accuraterip(struct accuraterip_context *ctx, const char *path)
      *
      * XXX Synchronise comment with AcoustID ditto.
      */
-    gc = gzip_new(ctx->session, _block_reader, &ud);
+    gc = gzip_new(
+        ctx->session, _store_path != NULL ? _store_reader : _block_reader, &ud);
     if (gc == NULL) {
         ne_set_error(ctx->session, "%s", strerror(errno));
+        _node_free(node);
         return (NULL); // XXX should be -1?
     }
 
@@ -1416,8 +2109,6 @@ Chunk 3/3:
      */
     path = "/accuraterip/a/a/3/dBAR-003-0002c3aa-0009f0cc-30065d04.bin";
 #endif
-    printf("PATH: %s\n", path);
-
     request = ne_request_create(ctx->session, "GET", path);
     ne_add_request_header(request,
                           "Accept-Encoding",
@@ -1426,6 +2117,7 @@ Chunk 3/3:
         request, ne_accept_2xx, gzip_inflate_reader, gc);
     if (ratelimit_accuraterip() != 0) {
         ne_set_error(ctx->session, "%s", strerror(errno));
+        _node_free(node);
         return (NULL);
     }
 
@@ -1445,23 +2137,31 @@ Chunk 3/3:
 
         switch (ne_get_status(request)->klass) {
         case 2:
-            /* Successful lookup: increase the count of cached
-             * responses.
+            /* Successful lookup: the response is cached by
+             * _cache_commit().
              */
-            ctx->nmemb += 1;
             ud.result->path = strdup(path);
             if (ud.result->path == NULL) {
                 ne_set_error(ctx->session, "%s", strerror(errno));
+                if (ud.raw != NULL)
+                    free(ud.raw);
+                _node_free(node);
                 return (NULL);
             }
             ud.result->status = 0;
             break;
 
         case 4:
-            /* Handle 404 separately.  XXX This should probably be
-             * cached, too, because repeated lookup should yield the
-             * same result.  Same applies to the case below.
+            /* Only 404 means that the disc is not in the database.
+             * That answer is cached in memory, and kept in the
+             * persistent store for the time-to-live of negative
+             * records.  Any other client error is a failed lookup,
+             * which is neither cached nor stored.
              */
+            if (ne_get_status(request)->code != 404) {
+                ud.result->status = -1;
+                break;
+            }
             ud.result->status = +1;
             break;
 
@@ -1492,9 +2192,45 @@ Chunk 3/3:
     ne_request_destroy(request);
     if (gzip_free(gc) != 0) {
         ne_set_error(ctx->session, "%s", strerror(errno));
+        if (ud.raw != NULL)
+            free(ud.raw);
+        _node_free(node);
         return (NULL); // XXX Should be -1?
     }
-    return (ud.result);
+
+
+    /* Save the response in the persistent store, so that it does not
+     * have to be fetched again until it expires.
+     */
+    _store_put(path, &ud);
+    if (ud.raw != NULL)
+        free(ud.raw);
+    return (_cache_commit(ctx, node));
+}
+
+
+/* The _get_accuraterip() function returns the response for @p path
+ * like _fetch_accuraterip(), but holds the lock on the session while
+ * the response is fetched, so that the context can be shared between
+ * threads.  Cached responses are returned without taking the lock;
+ * _fetch_accuraterip() checks the cache again once it is held, in
+ * case another thread fetched the same response in the meantime.
+ */
+static const struct _cache *
+_get_accuraterip(struct accuraterip_context *ctx, const char *path)
+{
+    const struct _cache *response;
+
+    response = _cache_find(ctx, path);
+    if (response != NULL)
+        return (response);
+
+    if (pthread_mutex_lock(&ctx->lock_session) != 0)
+        return (NULL);
+    response = _fetch_accuraterip(ctx, path);
+    pthread_mutex_unlock(&ctx->lock_session);
+
+    return (response);
 }
 
 
@@ -1502,52 +2238,52 @@ Chunk 3/3:
 /* XXX EAC
  */
 static const struct _cache *
-_get_eac(struct accuraterip_context *ctx, const char *path)
+_fetch_eac(struct accuraterip_context *ctx, const char *path)
 {
     struct _userdata ud;
+    const struct _cache *response;
+    struct _cache_node *node;
     struct gzip_context *gc;
     ne_request *request;
 //    const ne_status *status;
-    void *p;
-    size_t i;
     int ret;
 
 
-    /* Traverse the cache in reverse order and return the first
-     * matching entry.
+    /* Return the cached response, if any.
      */
-    ctx->hit_rate[1] += 1;
-    for (i = ctx->nmemb; i-- > 0; ) {
-        if (strcmp(ctx->cache[i].path, path) == 0) {
-            ctx->hit_rate[0] += 1;
-            return (ctx->cache + i);
-        }
-    }
+    response = _cache_find(ctx, path);
+    if (response != NULL)
+        return (response);
 //    printf("   Looking up ->%s<-\n", path);
 
 
-    /* Create and initialise a new result entry in the cache.
-     * Initialise the userdata structure for _block_reader().
+    /* Failing that, return the stored response, if any.  Neither the
+     * network nor the rate limiter is involved in this case.
+     */
+    response = _store_get(ctx, path, _block_reader_eac, ctx->session_eac, 1);
+    if (response != NULL)
+        return (response);
+
+
+    /* Create and initialise a new result, which is entered in the
+     * cache once it has been fetched.  Initialise the userdata
+     * structure for _block_reader().
      */
-    p = realloc(ctx->cache, (ctx->nmemb + 1) * sizeof(struct _cache));
-    if (p == NULL) {
+    node = _node_new(ctx);
+    if (node == NULL) {
         ne_set_error(ctx->session_eac, "%s", strerror(errno));
         return (NULL);
     }
-    ctx->cache = p;
 
-    ctx->cache[ctx->nmemb].entries = NULL;
-    ctx->cache[ctx->nmemb].entry_eac = NULL;
-    ctx->cache[ctx->nmemb].error = NULL;
-    ctx->cache[ctx->nmemb].path = NULL;
-    ctx->cache[ctx->nmemb].nmemb = 0;
-    ctx->cache[ctx->nmemb].status = -1;
-
-    ud.result = ctx->cache + ctx->nmemb;
+    ud.result = &node->response;
     ud.session_eac = ctx->session_eac;
     ud.buf = NULL;
     ud.len = 0;
     ud.capacity = 0;
+    ud.reader = _block_reader_eac;
+    ud.raw = NULL;
+    ud.raw_len = 0;
+    ud.raw_capacity = 0;
 
 
     /* Create the request, only accepting successful responses, and
@@ -1558,9 +2294,12 @@ _get_eac(struct accuraterip_context *ctx, const char *path)
      *
      * XXX Synchronise comment with AcoustID ditto.
      */
-    gc = gzip_new(ctx->session_eac, _block_reader_eac, &ud);
+    gc = gzip_new(ctx->session_eac,
+                  _store_path != NULL ? _store_reader : _block_reader_eac,
+                  &ud);
     if (gc == NULL) {
         ne_set_error(ctx->session_eac, "%s", strerror(errno));
+        _node_free(node);
         return (NULL); // XXX should be -1?
     }
 
@@ -1574,6 +2313,7 @@ _get_eac(struct accuraterip_context *ctx, const char *path)
         request, ne_accept_2xx, gzip_inflate_reader, gc);
     if (ratelimit_accuraterip() != 0) {
         ne_set_error(ctx->session_eac, "%s", strerror(errno));
+        _node_free(node);
         return (NULL);
     }
 
@@ -1593,25 +2333,30 @@ _get_eac(struct accuraterip_context *ctx, const char *path)
 
         switch (ne_get_status(request)->klass) {
         case 2:
-            /* Successful lookup: increase the count of cached
-             * responses.
+            /* Successful lookup: the response is cached by
+             * _cache_commit().
              */
             printf("GOT CASE 2(a)\n");
-            ctx->nmemb += 1;
             ud.result->path = strdup(path);
             if (ud.result->path == NULL) {
                 ne_set_error(ctx->session_eac, "%s", strerror(errno));
+                if (ud.raw != NULL)
+                    free(ud.raw);
+                _node_free(node);
                 return (NULL);
             }
             ud.result->status = 0;
             break;
 
         case 4:
-            /* Handle 404 separately.  XXX This should probably be
-             * cached, too, because repeated lookup should yield the
-             * same result.  Same applies to the case below.
+            /* As for AccurateRip, only 404 is a negative answer that
+             * is cached and stored; see _fetch_accuraterip().
              */
             printf("GOT CASE 4(a)\n");
+            if (ne_get_status(request)->code != 404) {
+                ud.result->status = -1;
+                break;
+            }
             ud.result->status = +1;
             break;
 
@@ -1642,9 +2387,40 @@ _get_eac(struct accuraterip_context *ctx, const char *path)
     ne_request_destroy(request);
     if (gzip_free(gc) != 0) {
         ne_set_error(ctx->session_eac, "%s", strerror(errno));
+        if (ud.raw != NULL)
+            free(ud.raw);
+        _node_free(node);
         return (NULL); // XXX Should be -1?
     }
-    return (ud.result);
+
+
+    /* Save the response in the persistent store, so that it does not
+     * have to be fetched again until it expires.
+     */
+    _store_put(path, &ud);
+    if (ud.raw != NULL)
+        free(ud.raw);
+    return (_cache_commit(ctx, node));
+}
+
+
+/* See _get_accuraterip()
+ */
+static const struct _cache *
+_get_eac(struct accuraterip_context *ctx, const char *path)
+{
+    const struct _cache *response;
+
+    response = _cache_find(ctx, path);
+    if (response != NULL)
+        return (response);
+
+    if (pthread_mutex_lock(&ctx->lock_session_eac) != 0)
+        return (NULL);
+    response = _fetch_eac(ctx, path);
+    pthread_mutex_unlock(&ctx->lock_session_eac);
+
+    return (response);
 }
 #endif
 
@@ -1653,53 +2429,57 @@ _get_eac(struct accuraterip_context *ctx, const char *path)
  * outside this function?
  */
 static const struct _cache *
-_get_localhost(struct accuraterip_context *ctx, const char *discid, const char *path)
+_fetch_localhost(struct accuraterip_context *ctx, const char *discid, const char *path)
 {
     struct _userdata ud;
+    const struct _cache *response;
+    struct _cache_node *node;
     struct gzip_context *gc;
     ne_request *request;
 //    const ne_status *status;
-    void *p;
-//    size_t i;
     int ret;
 
 #if 0
-    /* Traverse the cache in reverse order and return the first
-     * matching entry.
-     */
-    ctx->hit_rate[1] += 1;
-    for (i = ctx->nmemb; i-- > 0; ) {
-        if (strcmp(ctx->cache[i].path, path) == 0) {
-            ctx->hit_rate[0] += 1;
-            return (ctx->cache + i);
-        }
-    }
+    /* Return the cached response, if any.
+     */
+    response = _cache_find(ctx, path);
+    if (response != NULL)
+        return (response);
 //    printf("   Looking up ->%s<-\n", path);
 #endif
 
 
-    /* Create and initialise a new result entry in the cache.
-     * Initialise the userdata structure for _block_reader().
+    /* Return the stored response for the fallback path, if any.
+     * Responses that were not found are not used, because the mapper
+     * may redirect elsewhere.
      */
-    p = realloc(ctx->cache, (ctx->nmemb + 1) * sizeof(struct _cache));
-    if (p == NULL) {
+    if (path != NULL) {
+        response = _store_get(
+            ctx, path, _block_reader, ctx->session_localhost, 0);
+        if (response != NULL)
+            return (response);
+    }
+
+
+    /* Create and initialise a new result, which is entered in the
+     * cache once it has been fetched.  Initialise the userdata
+     * structure for _block_reader().
+     */
+    node = _node_new(ctx);
+    if (node == NULL) {
         ne_set_error(ctx->session_localhost, "%s", strerror(errno));
         return (NULL);
     }
-    ctx->cache = p;
-
-    ctx->cache[ctx->nmemb].entries = NULL;
-    ctx->cache[ctx->nmemb].entry_eac = NULL;
-    ctx->cache[ctx->nmemb].error = NULL;
-    ctx->cache[ctx->nmemb].path = NULL;
-    ctx->cache[ctx->nmemb].nmemb = 0;
-    ctx->cache[ctx->nmemb].status = -1;
 
-    ud.result = ctx->cache + ctx->nmemb;
+    ud.result = &node->response;
     ud.session_localhost = ctx->session_localhost;
     ud.buf = NULL;
     ud.len = 0;
     ud.capacity = 0;
+    ud.reader = _block_reader_localhost;
+    ud.raw = NULL;
+    ud.raw_len = 0;
+    ud.raw_capacity = 0;
 
 
     /* Create the request, only accepting successful responses, and
@@ -1710,9 +2490,13 @@ _get_localhost(struct accuraterip_context *ctx, const char *discid, const char *
      *
      * XXX Synchronise comment with AcoustID ditto.
      */
-    gc = gzip_new(ctx->session_localhost, _block_reader_localhost, &ud);
+    gc = gzip_new(ctx->session_localhost,
+                  _store_path != NULL && path != NULL
+                  ? _store_reader : _block_reader_localhost,
+                  &ud);
     if (gc == NULL) {
         ne_set_error(ctx->session_localhost, "%s", strerror(errno));
+        _node_free(node);
         return (NULL); // XXX should be -1?
     }
 
@@ -1727,6 +2511,7 @@ _get_localhost(struct accuraterip_context *ctx, const char *discid, const char *
 #if 0
     if (ratelimit_accuraterip() != 0) {
         ne_set_error(ctx->session_localhost, "%s", strerror(errno));
+        _node_free(node);
         return (NULL);
     }
 #endif
@@ -1747,26 +2532,39 @@ _get_localhost(struct accuraterip_context *ctx, const char *discid, const char *
 
         switch (ne_get_status(request)->klass) {
         case 2:
-            /* Successful lookup: increase the count of cached
-             * responses.
+            /* Successful lookup: the response is cached by
+             * _cache_commit().
              */
             printf("GOT CASE 2(b)\n");
-            ctx->nmemb += 1;
             ud.result->path = strdup(path);
             if (ud.result->path == NULL) {
                 ne_set_error(ctx->session_localhost, "%s", strerror(errno));
+                ne_request_destroy(request);
+                gzip_free(gc);
+                if (ud.raw != NULL)
+                    free(ud.raw);
+                _node_free(node);
                 return (NULL);
             }
             ud.result->status = 0;
             break;
 
         case 4:
-            /* Handle 404 separately.  XXX This should probably be
-             * cached, too, because repeated lookup should yield the
-             * same result.  Same applies to the case below.
+            /* A 404 means that the mapper does not know the disc, and
+             * the lookup falls back on AccurateRip, where the answer
+             * is cached and stored as usual.  Any other client error
+             * is a failed lookup.
              */
             printf("GOT CASE 4(b)\n");
-            ud.result->status = +1;
+            if (ne_get_status(request)->code != 404) {
+                ud.result->status = -1;
+                break;
+            }
+            ne_request_destroy(request);
+            gzip_free(gc);
+            if (ud.raw != NULL)
+                free(ud.raw);
+            _node_free(node);
             /* XXX Better construct path from disc here, but then
              * connection issues should also go this route.
              *
@@ -1785,8 +2583,12 @@ _get_localhost(struct accuraterip_context *ctx, const char *discid, const char *
         /* "Connection refused" (the server is not running).  XXX
          * Should treat this the same way as a 404.
          */
-       ud.result->status = +1;
-       return (_get_accuraterip(ctx, path));
+        ne_request_destroy(request);
+        gzip_free(gc);
+        if (ud.raw != NULL)
+            free(ud.raw);
+        _node_free(node);
+        return (_get_accuraterip(ctx, path));
 
     case NE_REDIRECT:
         /* This is the interesting bit
@@ -1811,7 +2613,17 @@ _get_localhost(struct accuraterip_context *ctx, const char *discid, const char *
              * XXX What about the case where redirect cannot be
              * parsed?  And redirect must be freed?
              */
-            return (_get_accuraterip(ctx, redirect->path));
+            if (strncmp(redirect->path, "/accuraterip/", 13) == 0 &&
+                _path_valid(redirect->path) != 0) {
+                response = _get_accuraterip(ctx, redirect->path);
+                ne_request_destroy(request);
+                gzip_free(gc);
+                if (ud.raw != NULL)
+                    free(ud.raw);
+                _node_free(node);
+                return (response);
+            }
+            printf("Ignoring redirect to ->%s<-\n", redirect->path);
         }
     }
 
@@ -1835,14 +2647,46 @@ _get_localhost(struct accuraterip_context *ctx, const char *discid, const char *
     ne_request_destroy(request);
     if (gzip_free(gc) != 0) {
         ne_set_error(ctx->session_localhost, "%s", strerror(errno));
+        if (ud.raw != NULL)
+            free(ud.raw);
+        _node_free(node);
         return (NULL); // XXX Should be -1?
     }
-    return (ud.result);
+
+
+    /* Save the response under the fallback path, where it is found
+     * by _store_get() above the next time around.
+     */
+    if (path != NULL)
+        _store_put(path, &ud);
+    if (ud.raw != NULL)
+        free(ud.raw);
+    return (_cache_commit(ctx, node));
+}
+
+
+/* See _get_accuraterip().  The mapper is always asked, so there is no
+ * cache to check first.  A fallback to _get_accuraterip() takes the
+ * lock on the AccurateRip session while this one is held, never the
+ * other way around.
+ */
+static const struct _cache *
+_get_localhost(struct accuraterip_context *ctx, const char *discid, const char *path)
+{
+    const struct _cache *response;
+
+    if (pthread_mutex_lock(&ctx->lock_session_localhost) != 0)
+        return (NULL);
+    response = _fetch_localhost(ctx, discid, path);
+    pthread_mutex_unlock(&ctx->lock_session_localhost);
+
+    return (response);
 }
 
 
 /* Query the AccurateRip database.  The response must not be freed
- * because it is internal to the cache.
+ * because it is internal to the cache.  It remains valid until the
+ * calling thread queries the same context again.
  *
  * Made public 2016-04-27 for tagger refactor
  */
@@ -3189,11 +4033,16 @@ _cfg2_score_configuration(
         if (path == NULL) {
             if (errno == EINVAL || errno == ENOMSG)
                 continue;
+            _match_release_free(match_release);
             return (NULL);
         }
 
+
+        /* Ask the mapper like _cfg3_check_release() does, so that
+         * the response it fetched is found in the cache.
+         */
         printf("HATTNE 2 is checking url ->%s<-\n", path);
-        response = _get_accuraterip(ctx, path);
+        response = _get_localhost(ctx, cfg->media[i].discid_str, path);
         free(path);
 
 
@@ -3202,6 +4051,7 @@ _cfg2_score_configuration(
          */
         if (response == NULL || response->status < 0) {
             printf("FATAL ERROR: ->%s<-\n", ne_get_error(ctx->session));
+            _match_release_free(match_release);
             errno = EIO;
             return (NULL);
         } else if (response->status > 0) {
@@ -3446,38 +4296,75 @@ _cfg2_apply_accuraterip_result(Mb5MediumList MediumList,
 
 
 /**** NEWER IMPLEMENTATION START ****/
-// XXX OUCH! There could be more than one matching track for the
-// position!  Need to fold this loop into the code below!
-// Only return the first match for now!
+/* The _ctx_at_position() function returns the stream of the track at
+ * @p position on @p disc.  There could be more than one matching
+ * track for the position, and each track could match more than one
+ * stream.  If @p medium is not @c NULL and @p disc is its selected
+ * disc, the stream that the assignment solved by
+ * _cfg2_first_configuration() put at the position is preferred.
+ * Otherwise, or if that stream does not match any track at the
+ * position, the first match is returned.
+ */
 static struct fingersum_context *
-_ctx_at_position(
-    struct fingersum_context **ctxs, struct fp3_disc *disc, size_t position)
+_ctx_at_position(struct fingersum_context **ctxs,
+                 const struct _cfg2_medium *medium,
+                 struct fp3_disc *disc,
+                 size_t position)
 {
+    struct _cfg2_track *assigned;
     struct fp3_track *track;
-    size_t i;
+    struct fingersum_context *first;
+    size_t i, index, l;
+
+
+    assigned = NULL;
+    if (medium != NULL && medium->discid_str != NULL &&
+        strcmp(medium->discid_str, disc->id) == 0 &&
+        position > 0 && position <= medium->n_tracks) {
+        assigned = medium->tracks + position - 1;
+        if (assigned->selected >= assigned->nmemb)
+            assigned = NULL;
+    }
 
+    first = NULL;
     for (i = 0; i < disc->nmemb; i++) {
         track = disc->tracks[i];
+        if (track->position != position || track->nmemb == 0)
+            continue;
+
+        if (first == NULL)
+            first = ctxs[track->indices[0]];
+        if (assigned == NULL)
+            break;
 
-        if (track->position == position && track->nmemb > 0)
-            return (ctxs[track->indices[0]]);
+        index = assigned->streams[assigned->selected].index;
+        for (l = 0; l < track->nmemb; l++) {
+            if (track->indices[l] == index)
+                return (ctxs[index]);
+        }
     }
 
-    return (NULL);
+    return (first);
 }
 
 
 // XXX  Fix stuff up here!
 /* If release knew about the AccurateRip ID, MediumList probably would
  * not be needed here!
+ *
+ * If @p cfg is not @c NULL, it holds the best track configuration of
+ * the release, and its assignment of streams to tracks decides which
+ * streams are checked on the selected discs; see _ctx_at_position().
  */
 void
 _cfg3_check_release(struct accuraterip_context *ctx,
                     struct fingersum_context **ctxs,
                     struct fp3_release *release,
-                    Mb5MediumList MediumList)
+                    Mb5MediumList MediumList,
+                    const struct _cfg2_cfg *cfg)
 {
     size_t i, j, k;
+    const struct _cfg2_medium *assigned;
     struct fp3_medium *medium;
     struct fp3_disc *disc;
     struct fp3_track *track;
@@ -3498,6 +4385,12 @@ _cfg3_check_release(struct accuraterip_context *ctx,
         if (Medium == NULL)
             continue;
 
+        assigned = NULL;
+        if (cfg != NULL &&
+            medium->position > 0 && medium->position <= cfg->n_media) {
+            assigned = cfg->media + medium->position - 1;
+        }
+
         printf("check #2 %zd\n", medium->nmemb_discs);
         for (j = 0; j < medium->nmemb_discs; j++) {
             disc = medium->discs[j];
@@ -3545,9 +4438,12 @@ _cfg3_check_release(struct accuraterip_context *ctx,
 
                 track = disc->tracks[k];
 
-                leader = _ctx_at_position(ctxs, disc, track->position - 1);
-                center = _ctx_at_position(ctxs, disc, track->position);
-                trailer = _ctx_at_position(ctxs, disc, track->position + 1);
+                leader = _ctx_at_position(
+                    ctxs, assigned, disc, track->position - 1);
+                center = _ctx_at_position(
+                    ctxs, assigned, disc, track->position);
+                trailer = _ctx_at_position(
+                    ctxs, assigned, disc, track->position + 1);
 
 
                 /* XXX Should also transport CRC, CRC (EAC), and
@@ -3555,7 +4451,10 @@ _cfg3_check_release(struct accuraterip_context *ctx,
                  *
                  * Unless stuff is really finished by now, there
                  * will be a lot of time spent IN SINGLE-THREADED
-                 * MODE here, waiting for stuff to finish.
+                 * MODE here, waiting for stuff to finish.  Only the
+                 * center is decoded in full; of the leader and the
+                 * trailer, only the samples at the boundaries are
+                 * needed.
                  */
                 result_3 = fingersum_get_result_3(leader, center, trailer);
                 if (result_3 == NULL)
@@ -3603,7 +4502,8 @@ k, l, m, result_3->checksums[m].checksum_v2, chunk->CRC, result_3->checksums[m].
                 _score_track(response,
                              track->position - 1, // XXX zero-based!
                              leader,
-                             _ctx_at_position(ctxs, disc, track->position),
+                             _ctx_at_position(
+                                 ctxs, assigned, disc, track->position),
                              trailer,
                              &match); // XXX
 
@@ -3667,9 +4567,12 @@ k, l, m, result_3->checksums[m].checksum_v2, chunk->CRC, result_3->checksums[m].
 
                 track = disc->tracks[k];
 
-                leader = _ctx_at_position(ctxs, disc, track->position - 1);
-                center = _ctx_at_position(ctxs, disc, track->position);
-                trailer = _ctx_at_position(ctxs, disc, track->position + 1);
+                leader = _ctx_at_position(
+                    ctxs, assigned, disc, track->position - 1);
+                center = _ctx_at_position(
+                    ctxs, assigned, disc, track->position);
+                trailer = _ctx_at_position(
+                    ctxs, assigned, disc, track->position + 1);
 
 
                 /* XXX Should also transport CRC, CRC (EAC), and
@@ -3749,38 +4652,50 @@ accuraterip_url(struct accuraterip_context *ctx,
 //                size_t nmemb,
                 Mb5MediumList ml)
 {
-
-#if 1
-    _cfg3_check_release(ctx, ctxs, release, ml);
-    return (NULL);
-#endif
-
-    struct _position *best, *positions;
-//    size_t i;
-//    int confidence, confidence_max;
-
-
-    // We have release->nmemb streams.
-    positions = calloc(release->nmemb, sizeof(struct _position));
-    if (positions == NULL)
-        ; // XXX
-
-    best = calloc(release->nmemb, sizeof(struct _position));
-    if (best == NULL)
-        ; // XXX
-
-//    confidence_max = 0;
-
 #if 1
-    // XXX Test new stuff
     struct _cfg2_cfg *cfg_cfg;
     struct _match_release *result, *result_best;
-//    long int d;
+    size_t *discs_best;
+    size_t i, rank, rank_best;
+    long int residual_max;
+    int ret, status;
+
 
+    /* Rank the discs of each medium, and find the configuration with
+     * the smallest residual.  Any failure to do so is a failure to
+     * match the release, not a reason to give up on the album.
+     */
     cfg_cfg = _cfg2_first_disc_configuration(ml);
     if (cfg_cfg == NULL) {
         fprintf(stderr, "  _cfg2_first_disc_configuration() failed\n");
-        exit(-1);
+        return (NULL);
+    }
+
+    ret = _cfg2_solve_disc_configuration(cfg_cfg, ml, release, ctxs);
+    if (ret < 0) {
+        fprintf(stderr, "  _cfg2_solve_disc_configuration() failed\n");
+        _cfg2_cfg_free(cfg_cfg);
+        return (NULL);
+    }
+
+    discs_best = calloc(
+        cfg_cfg->n_media > 0 ? cfg_cfg->n_media : 1, sizeof(size_t));
+    if (discs_best == NULL) {
+        _cfg2_cfg_free(cfg_cfg);
+        return (NULL);
+    }
+
+
+    /* Score the tracks of every disc against AccurateRip.  The best
+     * track configuration on the best discs, as solved by the
+     * assignment, decides which stream is checked at each position of
+     * those discs.
+     */
+    if (ret == 0 &&
+        _cfg2_first_configuration(cfg_cfg, ml, release, ctxs) == 0) {
+        _cfg3_check_release(ctx, ctxs, release, ml, cfg_cfg);
+    } else {
+        _cfg3_check_release(ctx, ctxs, release, ml, NULL);
     }
 
 
@@ -3796,79 +4711,108 @@ accuraterip_url(struct accuraterip_context *ctx,
      *
      * IDEA: Reintroduce the lower bound; don't even bother with any
      * of this if the lower bound is greater than the current best.
+     *
+     * The lower bound is back: the discs of each medium are visited
+     * in order of increasing bound, and a disc configuration is only
+     * visited if its bound does not exceed the residual of the
+     * incumbent.  Only zero-residual configurations are scored, so
+     * the incumbent residual is zero from the start, and everything
+     * but the discs that can possibly yield a perfect fit is pruned
+     * without a single AccurateRip lookup.  Should nonzero residuals
+     * ever be admitted, residual_max must follow the best scored
+     * configuration.
+     *
+     * The discs are now independent, too: each medium was ranked on
+     * its own, and its discs are visited in order of increasing
+     * residual.  If the best discs of two media conflict, the
+     * bounded step backtracks to the next best ones.  If any medium
+     * cannot be configured at all, there is nothing to score.
      */
+    residual_max = 0;
     result_best = NULL;
-    for ( ; ; ) {
+    rank_best = 0;
+    while (ret == 0 &&
+           _cfg2_lower_bound_configuration(cfg_cfg) <= residual_max) {
         printf("### New iteration\n");
         _cfg2_dump_disc_configuration(cfg_cfg);
 
 
-        /* Get the first valid track configuration
-         *
-         * XXX This function should probably accept a valid
-         * configuration.  It is not clear how to deal with the case
-         * when there are no valid configurations (i.e. what are the
-         * confidences in that case)?.
-         *
-         * XXX No need to try to score against AccurateRip unless the
-         * residual is is zero!
+        /* The track configurations come in order of increasing
+         * residual.  On compilations, many tracks may have the same
+         * length, and then there are several configurations with the
+         * same residual that only AccurateRip can tell apart.  Score
+         * them all, and remember the disc configuration and the rank
+         * of the best one, so that it can be restored below.
          */
-        if (_cfg2_first_configuration(cfg_cfg, ml, release, ctxs) == 0 &&
-            _cfg2_residual_configuration(cfg_cfg) == 0) {
+        for (status = _cfg2_first_configuration(cfg_cfg, ml, release, ctxs),
+                 rank = 0;
+             status == 0 &&
+                 _cfg2_residual_configuration(cfg_cfg) <= residual_max;
+             status = _cfg2_next_configuration(cfg_cfg), rank++) {
 
             result = _cfg2_score_configuration(ctx, cfg_cfg, ml, ctxs);
             if (result == NULL)
-                ; // XXX
+                continue;
 
-            printf("CHECKING FOR UPDATE...\n");
-            if (result_best == NULL) {
-                printf("UPDATING BEST #1\n");
-                result_best = result;
-            } else if(_match_release_compar(result_best, result) > 0) {
-                printf("UPDATING BEST #2\n");
-                _match_release_free(result_best);
+            if (result_best == NULL ||
+                _match_release_compar(result_best, result) > 0) {
+                if (result_best != NULL)
+                    _match_release_free(result_best);
                 result_best = result;
+                for (i = 0; i < cfg_cfg->n_media; i++)
+                    discs_best[i] = cfg_cfg->media[i].selected_disc;
+                rank_best = rank;
             } else {
                 _match_release_free(result);
             }
         }
-//        sleep(1);
 
 
-        /* Generate the next disc configuration!
+        /* Generate the next disc configuration that is not pruned.
          */
-        if (_cfg2_next_disc_configuration(cfg_cfg, ml) != 0)
+        if (_cfg2_next_bounded_disc_configuration(
+                cfg_cfg, residual_max) != 0) {
             break;
+        }
     }
 
 
-    /* XXX Need to think about this!  Should probably return the
-     * configuration for this release and continuously update the best
-     * configuration outside this function, and THEN apply the best
-     * configuration if appropriate.
+    /* Return to the best configuration, and apply it to the release.
+     * The configurations are enumerated deterministically, so
+     * stepping through the same number of track configurations on
+     * the same discs gets there.
+     *
+     * XXX Should probably return the configuration for this release
+     * and continuously update the best configuration outside this
+     * function, and THEN apply the best configuration if
+     * appropriate.
      */
-    printf("EXHAUSTED\n");
-
     if (result_best != NULL) {
-        printf("applying\n");
-        if (_cfg2_apply_accuraterip_result(
+        _cfg2_select_disc_configuration(cfg_cfg, discs_best);
+        status = _cfg2_first_configuration(cfg_cfg, ml, release, ctxs);
+        for (rank = 0; status == 0 && rank < rank_best; rank++)
+            status = _cfg2_next_configuration(cfg_cfg);
+
+        if (status != 0 || _cfg2_apply_accuraterip_result(
                 ml, release, cfg_cfg, result_best) != 0) {
-            printf("releasing 1\n");
+            fprintf(stderr, "  _cfg2_apply_accuraterip_result() failed\n");
             _match_release_free(result_best);
-            printf("  _cfg2_apply_accuraterip_result() failed\n");
-            exit(-1);
+            result_best = NULL;
         }
-        printf("releasing 2\n");
-//        _match_release_free(result_best); // Cannot free return value!
     }
 
-//    printf("All done, call again! Confidence %d, confidence_max %d\n",
-//           match_release_best.confidence, match_release_best.confidence_max);
+    free(discs_best);
+    _cfg2_cfg_free(cfg_cfg);
 
     return (result_best);
 #else
-    int ret;
+    struct _position *best, *positions;
     struct _match match_release, match_release_best;
+    size_t i;
+    int ret;
+
+    positions = calloc(release->nmemb, sizeof(struct _position));
+    best = calloc(release->nmemb, sizeof(struct _position));
 
     match_release_best.confidence = 0;
     match_release_best.confidence_max = 0;
@@ -46,6 +46,8 @@ ACCURATERIP_BEGIN_C_DECLS
  * https://acoustid.org/webservice
  */
 
+#include <time.h>
+
 #include <musicbrainz5/mb5_c.h>
 
 #include "fingersum.h"
@@ -73,6 +75,49 @@ void
 accuraterip_free(struct accuraterip_context *ctx);
 
 
+/* Limit the memory used by the cache of AccurateRip responses.  The
+ * least recently used responses are evicted until the estimated size
+ * of the cache is within @p budget octets.  Responses that are in use
+ * by some thread are never evicted, so the cache may temporarily
+ * exceed its budget.  The default budget is 64 MiB.
+ *
+ * @param ctx    AccurateRip context
+ * @param budget Maximum size of the cache, in octets
+ */
+void
+accuraterip_set_cache_budget(struct accuraterip_context *ctx, size_t budget);
+
+
+/* Default time to live of stored responses, in seconds.  Responses
+ * that were not found are looked up again sooner, because discs are
+ * continually added to the AccurateRip database.
+ */
+#define ACCURATERIP_STORE_TTL (7 * 24 * 60 * 60)
+#define ACCURATERIP_STORE_TTL_404 (24 * 60 * 60)
+
+
+/* Enable or disable the persistent response store.  Responses from
+ * AccurateRip and EAC are saved below the directory @p path, under
+ * the path they were requested from, and used instead of the network
+ * until they expire.  Successful responses expire after @p ttl
+ * seconds, responses that were not found after @p ttl_404 seconds.
+ * The directory, and any missing parents, are created if necessary.
+ * A @p path of @c NULL disables the store, which is the default.
+ *
+ * This function should be called before any AccurateRip contexts are
+ * created.
+ *
+ * @param path    Path to the store directory, or @c NULL
+ * @param ttl     Time to live of successful responses, in seconds
+ * @param ttl_404 Time to live of responses that were not found
+ * @return        0 if successful, -1 otherwise.  If an error occurs,
+ *                the global variable @c errno is set to indicate the
+ *                error.
+ */
+int
+accuraterip_store_init(const char *path, time_t ttl, time_t ttl_404);
+
+
 /**
  * @brief Retrieve result from pool context
  *
@@ -0,0 +1,288 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil; tab-width: 8 -*- */
+
+/*-
+ * Copyright © 2019, Johan Hattne
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice appear
+ * in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS.  IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS
+ * OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#    include <config.h>
+#endif
+
+#include <stdlib.h>
+
+#include <string.h>
+
+#include "cache.h"
+
+
+void
+cache_init(struct cache *cache,
+           size_t budget,
+           int (*evictable)(const struct cache_entry *entry),
+           void (*evict)(struct cache_entry *entry))
+{
+    cache->buckets = NULL;
+    cache->nbuckets = 0;
+    cache->head = NULL;
+    cache->tail = NULL;
+    cache->nmemb = 0;
+    cache->size = 0;
+    cache->budget = budget;
+    cache->evictable = evictable;
+    cache->evict = evict;
+}
+
+
+void
+cache_clear(struct cache *cache)
+{
+    struct cache_entry *entry;
+
+    while (cache->head != NULL) {
+        entry = cache->head;
+        cache->head = entry->next;
+        cache->evict(entry);
+    }
+    cache->tail = NULL;
+
+    if (cache->buckets != NULL)
+        free(cache->buckets);
+    cache->buckets = NULL;
+    cache->nbuckets = 0;
+    cache->nmemb = 0;
+    cache->size = 0;
+}
+
+
+/* FNV-1a
+ */
+size_t
+cache_hash(const char *key)
+{
+    size_t h;
+
+    for (h = 2166136261U; *key != '\0'; key++)
+        h = (h ^ (unsigned char)*key) * 16777619U;
+    return (h);
+}
+
+
+void
+cache_entry_init(struct cache_entry *entry)
+{
+    entry->key = NULL;
+    entry->hash = 0;
+    entry->size = 0;
+    entry->refs = 0;
+    entry->referenced = 0;
+    entry->chain = NULL;
+    entry->prev = NULL;
+    entry->next = NULL;
+}
+
+
+struct cache_entry *
+cache_find(const struct cache *cache, const char *key, size_t hash)
+{
+    struct cache_entry *entry;
+
+    if (cache->nbuckets == 0)
+        return (NULL);
+
+    for (entry = cache->buckets[hash & (cache->nbuckets - 1)];
+         entry != NULL; entry = entry->chain) {
+        if (entry->hash == hash && strcmp(entry->key, key) == 0)
+            return (entry);
+    }
+
+    return (NULL);
+}
+
+
+/* The _grow() function doubles the number of buckets in the hash
+ * table of @p cache and rehashes the entries.
+ */
+static int
+_grow(struct cache *cache)
+{
+    struct cache_entry **buckets, *entry;
+    size_t i, nbuckets;
+
+    nbuckets = cache->nbuckets > 0 ? 2 * cache->nbuckets : 64;
+    buckets = calloc(nbuckets, sizeof(struct cache_entry *));
+    if (buckets == NULL)
+        return (-1);
+
+    for (entry = cache->head; entry != NULL; entry = entry->next) {
+        i = entry->hash & (nbuckets - 1);
+        entry->chain = buckets[i];
+        buckets[i] = entry;
+    }
+
+    if (cache->buckets != NULL)
+        free(cache->buckets);
+    cache->buckets = buckets;
+    cache->nbuckets = nbuckets;
+    return (0);
+}
+
+
+int
+cache_insert(struct cache *cache,
+             struct cache_entry *entry,
+             const char *key,
+             size_t hash,
+             size_t size)
+{
+    size_t i;
+
+
+    /* Double the number of buckets once the load factor would exceed
+     * one.
+     */
+    if (cache->nmemb >= cache->nbuckets && _grow(cache) != 0)
+        return (-1);
+
+    entry->key = key;
+    entry->hash = hash;
+    entry->size = size;
+
+    i = hash & (cache->nbuckets - 1);
+    entry->chain = cache->buckets[i];
+    cache->buckets[i] = entry;
+
+    entry->prev = NULL;
+    entry->next = cache->head;
+    if (cache->head != NULL)
+        cache->head->prev = entry;
+    else
+        cache->tail = entry;
+    cache->head = entry;
+
+    cache->size += size;
+    cache->nmemb += 1;
+    cache_evict(cache);
+
+    return (0);
+}
+
+
+void
+cache_remove(struct cache *cache, struct cache_entry *entry)
+{
+    struct cache_entry **p;
+
+    for (p = &cache->buckets[entry->hash & (cache->nbuckets - 1)];
+         *p != entry; p = &(*p)->chain)
+        ;
+    *p = entry->chain;
+
+    if (entry->prev != NULL)
+        entry->prev->next = entry->next;
+    else
+        cache->head = entry->next;
+    if (entry->next != NULL)
+        entry->next->prev = entry->prev;
+    else
+        cache->tail = entry->prev;
+
+    entry->chain = NULL;
+    entry->prev = NULL;
+    entry->next = NULL;
+
+    cache->size -= entry->size;
+    cache->nmemb -= 1;
+}
+
+
+void
+cache_resize(struct cache *cache, struct cache_entry *entry, size_t size)
+{
+    cache->size += size - entry->size;
+    entry->size = size;
+}
+
+
+void
+cache_evict(struct cache *cache)
+{
+    struct cache_entry *entry;
+    size_t n;
+
+
+    /* Every entry is visited at most twice: once to clear its mark,
+     * once more to evict it.
+     */
+    for (n = 2 * cache->nmemb; n > 0 && cache->size > cache->budget; n--) {
+        entry = cache->tail;
+        if (entry == NULL)
+            break;
+
+        if (__atomic_exchange_n(&entry->referenced, 0, __ATOMIC_RELAXED) ||
+            __atomic_load_n(&entry->refs, __ATOMIC_ACQUIRE) > 0 ||
+            (cache->evictable != NULL && cache->evictable(entry) == 0)) {
+            if (entry != cache->head) {
+                cache->tail = entry->prev;
+                cache->tail->next = NULL;
+                entry->prev = NULL;
+                entry->next = cache->head;
+                cache->head->prev = entry;
+                cache->head = entry;
+            }
+            continue;
+        }
+
+        cache_remove(cache, entry);
+        cache->evict(entry);
+    }
+}
+
+
+void
+cache_set_budget(struct cache *cache, size_t budget)
+{
+    cache->budget = budget;
+    cache_evict(cache);
+}
+
+
+void
+cache_hit(struct cache_entry *entry)
+{
+    __atomic_store_n(&entry->referenced, 1, __ATOMIC_RELAXED);
+}
+
+
+void
+cache_ref(struct cache_entry *entry)
+{
+    __atomic_add_fetch(&entry->refs, 1, __ATOMIC_ACQ_REL);
+}
+
+
+size_t
+cache_unref(struct cache_entry *entry)
+{
+    return (__atomic_sub_fetch(&entry->refs, 1, __ATOMIC_ACQ_REL));
+}
+
+
+size_t
+cache_refs(const struct cache_entry *entry)
+{
+    return (__atomic_load_n(&entry->refs, __ATOMIC_ACQUIRE));
+}
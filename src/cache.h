@@ -0,0 +1,338 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil; tab-width: 8 -*- */
+
+/*-
+ * Copyright © 2019, Johan Hattne
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice appear
+ * in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS.  IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS
+ * OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef CACHE_H
+#define CACHE_H 1
+
+#ifdef __cplusplus
+#  define CACHE_BEGIN_C_DECLS extern "C" {
+#  define CACHE_END_C_DECLS   }
+#else
+#  define CACHE_BEGIN_C_DECLS
+#  define CACHE_END_C_DECLS
+#endif
+
+CACHE_BEGIN_C_DECLS
+
+/**
+ * @file cache.h
+ * @brief In-memory cache with a size budget
+ *
+ * The AccurateRip responses and the MusicBrainz queries are both kept
+ * in a cache of this kind.  Entries are kept in a hash table keyed on
+ * a string, with chaining.  A doubly linked list through all entries
+ * orders them by insertion; eviction walks it from the oldest end and
+ * gives every entry that was hit since the last pass a second chance
+ * (the CLOCK approximation of LRU).  Marking an entry as hit does not
+ * modify the table or the list, so that lookups can run concurrently.
+ * Entries are evicted until their estimated size is within the budget
+ * of the cache.  Entries that are referenced are never evicted.
+ *
+ * The cache does not allocate its entries: a struct cache_entry is
+ * embedded in the structure that is cached, and CACHE_CONTAINER()
+ * gets back from the entry to that structure.  Neither does the cache
+ * lock anything.  The caller must serialise the functions below that
+ * modify the cache, but cache_find(), cache_ref(), and cache_unref()
+ * may be called concurrently with each other.
+ */
+
+#include <stddef.h>
+
+
+/**
+ * @brief Entry in a cache
+ *
+ * Apart from the key, the members are private to the cache.
+ */
+struct cache_entry
+{
+    /* The key of the entry, owned by the caller, and its hash
+     */
+    const char *key;
+    size_t hash;
+
+    /* Estimated size of the cached structure, in octets
+     */
+    size_t size;
+
+    /* Number of references to the entry, and non-zero if the entry
+     * was hit since the last eviction pass.  Only accessed
+     * atomically.
+     */
+    size_t refs;
+    int referenced;
+
+    /* Next entry in the same hash bucket, and the neighbours in the
+     * list of all entries
+     */
+    struct cache_entry *chain;
+    struct cache_entry *prev;
+    struct cache_entry *next;
+};
+
+
+/**
+ * @brief Cache
+ *
+ * The members are private to the cache, except that the caller may
+ * walk the list of entries from @c head through @c next, and read @c
+ * nmemb.
+ */
+struct cache
+{
+    /* Hash table of entries.  The number of buckets is always zero or
+     * a power of two.
+     */
+    struct cache_entry **buckets;
+    size_t nbuckets;
+
+    /* List of all entries, newest first
+     */
+    struct cache_entry *head;
+    struct cache_entry *tail;
+
+    /* Number of entries, their estimated size, and the size the cache
+     * is kept within, in octets
+     */
+    size_t nmemb;
+    size_t size;
+    size_t budget;
+
+    /* Optional function that returns zero if an unreferenced entry
+     * must nevertheless be kept, and the function that frees an
+     * evicted entry
+     */
+    int (*evictable)(const struct cache_entry *entry);
+    void (*evict)(struct cache_entry *entry);
+};
+
+
+/**
+ * @brief Get the structure that embeds a cache entry
+ *
+ * @param entry  Pointer to the struct cache_entry
+ * @param type   Type of the embedding structure
+ * @param member Name of the struct cache_entry within @p type
+ */
+#define CACHE_CONTAINER(entry, type, member) \
+    ((type *)((char *)(entry) - offsetof(type, member)))
+
+
+/**
+ * @brief Static initialiser for an empty cache
+ *
+ * @param budget    Size the cache is kept within, in octets
+ * @param evictable Function that returns zero for entries that must
+ *                  be kept, or @c NULL
+ * @param evict     Function that frees an evicted entry
+ */
+#define CACHE_INITIALIZER(budget, evictable, evict) \
+    { NULL, 0, NULL, NULL, 0, 0, (budget), (evictable), (evict) }
+
+
+/**
+ * @brief Initialise an empty cache
+ *
+ * @param cache     The cache
+ * @param budget    Size the cache is kept within, in octets
+ * @param evictable Function that returns zero for entries that must
+ *                  be kept, or @c NULL
+ * @param evict     Function that frees an evicted entry
+ */
+void
+cache_init(struct cache *cache,
+           size_t budget,
+           int (*evictable)(const struct cache_entry *entry),
+           void (*evict)(struct cache_entry *entry));
+
+
+/**
+ * @brief Free all entries
+ *
+ * Every entry is passed to the evict function of @p cache, whether
+ * it is referenced or not.  The cache is left empty, and can be used
+ * again.
+ *
+ * @param cache The cache
+ */
+void
+cache_clear(struct cache *cache);
+
+
+/**
+ * @brief Hash a key
+ *
+ * @param key The key
+ * @return    32-bit FNV-1a hash of @p key
+ */
+size_t
+cache_hash(const char *key);
+
+
+/**
+ * @brief Initialise an entry that is not in any cache
+ *
+ * The entry starts out unreferenced.
+ *
+ * @param entry The entry
+ */
+void
+cache_entry_init(struct cache_entry *entry);
+
+
+/**
+ * @brief Look up an entry
+ *
+ * The entry is neither referenced nor marked as hit, see cache_ref()
+ * and cache_hit().
+ *
+ * @param cache The cache
+ * @param key   The key
+ * @param hash  Hash of @p key, as returned by cache_hash()
+ * @return      The entry, or @c NULL if there is no entry for @p key
+ */
+struct cache_entry *
+cache_find(const struct cache *cache, const char *key, size_t hash);
+
+
+/**
+ * @brief Insert an entry
+ *
+ * @p entry is inserted as the newest entry, and the cache is brought
+ * within its budget by cache_evict().  Unless @p entry is referenced,
+ * or rejected by the evictable function, it may therefore be evicted
+ * before cache_insert() returns.  The caller must make sure that
+ * there is no entry for @p key already.
+ *
+ * @param cache The cache
+ * @param entry The entry
+ * @param key   The key, which must remain valid while @p entry is
+ *              cached
+ * @param hash  Hash of @p key, as returned by cache_hash()
+ * @param size  Estimated size of the structure embedding @p entry,
+ *              in octets
+ * @return      0 if successful, -1 otherwise.  If an error occurs,
+ *              the global variable @c errno is set to indicate the
+ *              error, and @p entry is not inserted.
+ */
+int
+cache_insert(struct cache *cache,
+             struct cache_entry *entry,
+             const char *key,
+             size_t hash,
+             size_t size);
+
+
+/**
+ * @brief Remove an entry without freeing it
+ *
+ * @param cache The cache
+ * @param entry The entry, which must be in @p cache
+ */
+void
+cache_remove(struct cache *cache, struct cache_entry *entry);
+
+
+/**
+ * @brief Update the estimated size of an entry
+ *
+ * The cache is not brought within its budget, see cache_evict().
+ *
+ * @param cache The cache
+ * @param entry The entry, which must be in @p cache
+ * @param size  Estimated size of the structure embedding @p entry,
+ *              in octets
+ */
+void
+cache_resize(struct cache *cache, struct cache_entry *entry, size_t size);
+
+
+/**
+ * @brief Evict entries until the cache is within its budget
+ *
+ * Unreferenced entries that were not hit since the last pass, and
+ * that are not rejected by the evictable function, are removed and
+ * passed to the evict function, oldest first.  Entries that were hit
+ * lose their mark and are moved to the front instead, as are
+ * referenced and rejected entries.  Every entry is visited at most
+ * twice, so the cache may remain over budget.
+ *
+ * @param cache The cache
+ */
+void
+cache_evict(struct cache *cache);
+
+
+/**
+ * @brief Change the budget of a cache
+ *
+ * Entries are evicted if the cache exceeds the new budget.
+ *
+ * @param cache  The cache
+ * @param budget Size the cache is kept within, in octets
+ */
+void
+cache_set_budget(struct cache *cache, size_t budget);
+
+
+/**
+ * @brief Mark an entry as hit
+ *
+ * The entry gets a second chance on the next eviction pass.
+ *
+ * @param entry The entry
+ */
+void
+cache_hit(struct cache_entry *entry);
+
+
+/**
+ * @brief Take a reference to an entry
+ *
+ * A referenced entry is not evicted.
+ *
+ * @param entry The entry
+ */
+void
+cache_ref(struct cache_entry *entry);
+
+
+/**
+ * @brief Drop a reference to an entry
+ *
+ * @param entry The entry
+ * @return      The number of references that remain
+ */
+size_t
+cache_unref(struct cache_entry *entry);
+
+
+/**
+ * @brief Get the number of references to an entry
+ *
+ * @param entry The entry
+ * @return      The number of references
+ */
+size_t
+cache_refs(const struct cache_entry *entry);
+
+CACHE_END_C_DECLS
+
+#endif /* !CACHE_H */
@@ -23,12 +23,15 @@
 #include <stdio.h>
 
 #include <limits.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <neon/ne_string.h>
 
 #include "configuration.h"
 #include "fingersum.h"
+#include "pool.h"
+#include "simpleq.h"
 
 
 /* MusicBrainz disc identifiers are 28 characters long, see
@@ -239,6 +242,10 @@ _cfg2_medium_init(struct _cfg2_medium *medium)
     medium->discid_str = NULL;
     medium->n_tracks = 0;
     medium->tracks = NULL;
+    medium->n_discs = 0;
+    medium->selected_disc = 0;
+    medium->discids = NULL;
+    medium->bounds = NULL;
 }
 
 
@@ -247,6 +254,7 @@ _cfg2_cfg_init(struct _cfg2_cfg *cfg)
 {
     cfg->n_media = 0;
     cfg->media = NULL;
+    cfg->ranking = NULL;
 }
 
 
@@ -271,14 +279,30 @@ _cfg2_medium_free(struct _cfg2_medium *medium)
             _cfg2_track_free(medium->tracks + i);
         free(medium->tracks);
     }
+
+    if (medium->discids != NULL) {
+        for (i = 0; i < medium->n_discs; i++)
+            free(medium->discids[i]);
+        free(medium->discids);
+    }
+
+    if (medium->bounds != NULL)
+        free(medium->bounds);
 }
 
 
 static void
+_cfg2_ranking_free(struct _cfg2_ranking *ranking);
+
+
+void
 _cfg2_cfg_free(struct _cfg2_cfg *cfg)
 {
     size_t i;
 
+    if (cfg->ranking != NULL)
+        _cfg2_ranking_free(cfg->ranking);
+
     if (cfg->media != NULL) {
         for (i = 0; i < cfg->n_media; i++)
             _cfg2_medium_free(cfg->media + i);
@@ -383,8 +407,10 @@ _cfg2_track_assign(struct _cfg2_track *track,
      * Find all streams which match the recording corresponding to the
      * track and append them to the track's streams array.  Record the
      * index of the matching stream and the residual to the duration
-     * of the corresponding track on the disc.
+     * of the corresponding track on the disc.  Any streams from a
+     * previous assignment are released first.
      */
+    _cfg2_track_free(track);
     track->nmemb = 0;
     track->streams = NULL;
     for (i = 0; i < release->nmemb; i++) {
@@ -573,6 +599,284 @@ _cfg2_next_disc_configuration(struct _cfg2_cfg *cfg, Mb5MediumList MediumList)
 }
 
 
+/* The _cfg2_medium_bound() function assigns the candidate streams to
+ * the tracks of @p medium for the disc @p Disc, and returns the lower
+ * bound of the residual of the medium on that disc.  The streams of
+ * each track are sorted in order of increasing magnitude of the
+ * residual, so the bound is the sum of the first residual of every
+ * track that has a candidate stream.
+ *
+ * @param Disc Can be @c NULL, in which case the bound is zero
+ * @param n    Set to the number of tracks with at least one candidate
+ *             stream
+ * @return     The lower bound, or negative on failure
+ */
+static long int
+_cfg2_medium_bound(struct _cfg2_medium *medium,
+                   Mb5Medium Medium,
+                   Mb5Disc Disc,
+                   struct fp3_release *release,
+                   struct fingersum_context **ctxs,
+                   size_t *n)
+{
+    Mb5Track Track;
+    Mb5TrackList TrackList;
+    struct _cfg2_track *track;
+    size_t j;
+    long int bound;
+
+    TrackList = mb5_medium_get_tracklist(Medium);
+    if (TrackList == NULL)
+        return (-1);
+
+    bound = 0;
+    *n = 0;
+    for (j = 0; j < medium->n_tracks; j++) {
+        Track = _cfg2_track_at_position(TrackList, j + 1);
+        if (Track == NULL)
+            continue;
+
+        track = medium->tracks + j;
+        if (_cfg2_track_assign(track, Disc, Track, release, ctxs) != 0)
+            return (-1);
+
+        if (track->nmemb > 0) {
+            if (track->selected < track->nmemb)
+                bound += abs(track->streams[0].residual);
+            *n += 1;
+        }
+    }
+
+    return (bound);
+}
+
+
+/* The _cfg2_medium_discs() function collects the discids of @p
+ * Medium in @p medium, and sorts them in order of increasing lower
+ * bound.  A medium without a single track that matches a stream is
+ * left with only its first disc: its bound is zero for every disc,
+ * and enumerating them would not change anything, c.f.
+ * _cfg2_next_disc_configuration().
+ *
+ * @return Zero on success, non-zero otherwise
+ */
+static int
+_cfg2_medium_discs(struct _cfg2_medium *medium,
+                   Mb5Medium Medium,
+                   struct fp3_release *release,
+                   struct fingersum_context **ctxs)
+{
+    Mb5Disc Disc;
+    Mb5DiscList DiscList;
+    void *p;
+    char *discid;
+    size_t j, k, n;
+    long int bound;
+
+
+    DiscList = mb5_medium_get_disclist(Medium);
+    if (DiscList == NULL)
+        return (0);
+
+
+    /* Collect the discids in lexicographic order, which is the order
+     * _cfg2_next_disc_configuration() visits them in.
+     */
+    for ( ; ; ) {
+        discid = _cfg2_next_discid(
+            DiscList, medium->n_discs > 0 ?
+            medium->discids[medium->n_discs - 1] : NULL);
+        if (discid == NULL)
+            break;
+
+        p = realloc(medium->discids, (medium->n_discs + 1) * sizeof(char *));
+        if (p == NULL) {
+            free(discid);
+            return (-1);
+        }
+        medium->discids = p;
+
+        p = realloc(medium->bounds, (medium->n_discs + 1) * sizeof(long int));
+        if (p == NULL) {
+            free(discid);
+            return (-1);
+        }
+        medium->bounds = p;
+
+        medium->discids[medium->n_discs] = discid;
+        medium->n_discs += 1;
+    }
+
+
+    /* Calculate the bound of each disc and insert it in order.  Discs
+     * with equal bounds stay in lexicographic order.
+     */
+    for (j = 0; j < medium->n_discs; j++) {
+        Disc = _cfg2_disc_with_id(Medium, medium->discids[j]);
+        bound = _cfg2_medium_bound(medium, Medium, Disc, release, ctxs, &n);
+        if (bound < 0)
+            return (-1);
+
+        if (n == 0) {
+            medium->bounds[0] = 0;
+            for (k = 1; k < medium->n_discs; k++)
+                free(medium->discids[k]);
+            medium->n_discs = 1;
+            break;
+        }
+
+        discid = medium->discids[j];
+        for (k = j; k > 0 && medium->bounds[k - 1] > bound; k--) {
+            medium->discids[k] = medium->discids[k - 1];
+            medium->bounds[k] = medium->bounds[k - 1];
+        }
+        medium->discids[k] = discid;
+        medium->bounds[k] = bound;
+    }
+
+    return (0);
+}
+
+
+/* Set the discid of @p medium to that of its selected disc.
+ */
+static void
+_cfg2_medium_select_disc(struct _cfg2_medium *medium)
+{
+    char *discid;
+
+    if (medium->selected_disc >= medium->n_discs)
+        return;
+
+    discid = ne_strdup(medium->discids[medium->selected_disc]);
+    if (medium->discid_str != NULL)
+        free(medium->discid_str);
+    medium->discid_str = discid;
+}
+
+
+/* The _cfg2_bound_disc_configuration() function prepares @p cfg for a
+ * branch-and-bound search over its disc configurations.  For each
+ * medium, all its discids are collected and sorted in order of
+ * increasing lower bound, and the disc with the smallest bound is
+ * selected.  The configuration is thus the one with the smallest
+ * lower bound, and _cfg2_next_bounded_disc_configuration() steps
+ * through the remaining ones.
+ *
+ * Because the bounds of the media add up, and the discs of each
+ * medium are sorted, a disc configuration whose bound exceeds the
+ * current best cannot be improved by moving any medium to a later
+ * disc.  That is what allows entire subtrees to be pruned.
+ *
+ * @return Zero on success, non-zero otherwise
+ */
+int
+_cfg2_bound_disc_configuration(struct _cfg2_cfg *cfg,
+                               Mb5MediumList MediumList,
+                               struct fp3_release *release,
+                               struct fingersum_context **ctxs)
+{
+    Mb5Medium Medium;
+    size_t i;
+
+    for (i = 0; i < cfg->n_media; i++) {
+        Medium = _cfg2_medium_at_position(MediumList, i + 1);
+        if (Medium == NULL)
+            continue;
+
+        if (_cfg2_medium_discs(cfg->media + i, Medium, release, ctxs) != 0)
+            return (-1);
+
+        cfg->media[i].selected_disc = 0;
+        _cfg2_medium_select_disc(cfg->media + i);
+    }
+
+    return (0);
+}
+
+
+/* The _cfg2_select_disc_configuration() function selects the disc
+ * @p selected[i] on the i:th medium of @p cfg, where the discs are
+ * indexed as in _cfg2_bound_disc_configuration() or
+ * _cfg2_solve_disc_configuration().  This restores a disc
+ * configuration saved from the selected_disc members of the media.
+ */
+void
+_cfg2_select_disc_configuration(struct _cfg2_cfg *cfg, const size_t *selected)
+{
+    size_t i;
+
+    for (i = 0; i < cfg->n_media; i++) {
+        if (selected[i] >= cfg->media[i].n_discs)
+            continue;
+        cfg->media[i].selected_disc = selected[i];
+        _cfg2_medium_select_disc(cfg->media + i);
+    }
+}
+
+
+/* @return The lower bound of the residual of the currently selected
+ *         disc configuration
+ */
+long int
+_cfg2_lower_bound_configuration(const struct _cfg2_cfg *cfg)
+{
+    size_t i;
+    long int bound;
+
+    bound = 0;
+    for (i = 0; i < cfg->n_media; i++) {
+        if (cfg->media[i].selected_disc < cfg->media[i].n_discs)
+            bound += cfg->media[i].bounds[cfg->media[i].selected_disc];
+    }
+
+    return (bound);
+}
+
+
+/* The _cfg2_next_bounded_disc_configuration() function steps @p cfg
+ * to the next disc configuration whose lower bound does not exceed @p
+ * bound.  It counts like _cfg2_next_disc_configuration(), but in
+ * order of increasing bound on each medium.  When advancing a medium
+ * makes the configuration exceed @p bound, so would all subsequent
+ * discs on that medium, and the medium is reset and the step carried
+ * to the next one.  The configuration must have been prepared by
+ * _cfg2_bound_disc_configuration().
+ *
+ * The caller may lower @p bound between calls as better
+ * configurations are found; the search only gets tighter.
+ *
+ * @return Zero on success, non-zero if exhausted
+ */
+int
+_cfg2_next_bounded_disc_configuration(struct _cfg2_cfg *cfg, long int bound)
+{
+    struct _cfg2_medium *medium;
+    size_t i, j;
+
+    for (i = 0; i < cfg->n_media; i++) {
+        medium = cfg->media + i;
+        if (medium->selected_disc + 1 < medium->n_discs) {
+            medium->selected_disc += 1;
+            if (_cfg2_lower_bound_configuration(cfg) <= bound)
+                break;
+        }
+        medium->selected_disc = 0;
+    }
+
+    if (i >= cfg->n_media)
+        return (-1); // EXHAUSTED
+
+
+    /* Update the discids of the media that were stepped or reset.
+     */
+    for (j = 0; j <= i; j++)
+        _cfg2_medium_select_disc(cfg->media + j);
+
+    return (0);
+}
+
+
 /* A configuration is valid if and only if each stream occurs at most
  * once.
  */
@@ -677,6 +981,7 @@ _cfg2_dump_disc_configuration(const struct _cfg2_cfg *cfg)
 }
 
 
+#if 0 // XXX Superseded by _cfg2_ranking_next()
 /*** XXX THIS IS WHERE WE'RE AT ***/
 /* @return Zero if exhausted, non-zero if a step was taken
  */
@@ -713,6 +1018,7 @@ _cfg2_step_forward_new(struct _cfg2_cfg *cfg)
 
     return (0);
 }
+#endif
 
 
 #if 0
@@ -832,6 +1138,466 @@ _cfg2_step_backward(struct _cfg2_cfg *cfg, int r_max)
 #endif
 
 
+/* A solution of the assignment problem under the constraints of its
+ * cost matrix.  Constraints are expressed by setting costs to the
+ * infinity of the ranking: an excluded pair is infinite, and a forced
+ * pair makes all other pairs in its row and column infinite.
+ */
+struct _cfg2_solution
+{
+    /* Constrained cost matrix, n_rows by n_cols, in row-major order
+     */
+    long int *costs;
+
+    /* Column assigned to each row
+     */
+    size_t *cols;
+
+    /* Total cost of the assignment
+     */
+    long int cost;
+
+    SIMPLEQ_ENTRY(_cfg2_solution) solutions;
+};
+
+
+/* Ranking of the valid track configurations in order of increasing
+ * residual, using Murty's algorithm.  The rows are the tracks with
+ * candidate streams, the columns the streams that are candidates for
+ * any track, and the cost of a pair the magnitude of the residual.
+ * Pairs that are not candidates have infinite cost.
+ */
+struct _cfg2_ranking
+{
+    size_t n_rows;
+    size_t n_cols;
+
+    /* Track of each row, and stream index of each column
+     */
+    struct _cfg2_track **tracks;
+    size_t *indices;
+
+    /* A cost larger than that of any valid configuration
+     */
+    long int inf;
+
+    /* Pending solutions, sorted in order of increasing cost
+     */
+    SIMPLEQ_HEAD(, _cfg2_solution) solutions;
+};
+
+
+/* The _cfg2_hungarian() function solves the rectangular assignment
+ * problem for the @p n by @p m cost matrix @p costs, where @p n must
+ * not exceed @p m, with the Hungarian algorithm in O(n^2 m) time.
+ * Every row is assigned a distinct column.  The column of each row is
+ * stored in @p cols.
+ *
+ * The arrays are one-based, as in the usual presentation of the
+ * algorithm; column zero is a fictitious column that holds the row
+ * being added.
+ *
+ * @return The cost of the assignment, or negative on failure
+ */
+long int
+_cfg2_hungarian(const long int *costs, size_t n, size_t m, size_t *cols)
+{
+    long int *minv, *u, *v;
+    size_t *p, *way;
+    char *used;
+    size_t i, i0, j, j0, j1;
+    long int cost, cur, delta;
+
+
+    u = calloc(n + 1, sizeof(long int));
+    v = calloc(m + 1, sizeof(long int));
+    minv = calloc(m + 1, sizeof(long int));
+    p = calloc(m + 1, sizeof(size_t));
+    way = calloc(m + 1, sizeof(size_t));
+    used = calloc(m + 1, sizeof(char));
+    if (u == NULL || v == NULL || minv == NULL ||
+        p == NULL || way == NULL || used == NULL) {
+        cost = -1;
+        goto out;
+    }
+
+
+    /* Add the rows one at a time, and find the shortest augmenting
+     * path from the new row to a free column while maintaining the
+     * potentials u and v.
+     */
+    for (i = 1; i <= n; i++) {
+        p[0] = i;
+        j0 = 0;
+        for (j = 0; j <= m; j++) {
+            minv[j] = LONG_MAX;
+            used[j] = 0;
+        }
+
+        do {
+            used[j0] = 1;
+            i0 = p[j0];
+            delta = LONG_MAX;
+            j1 = 0;
+            for (j = 1; j <= m; j++) {
+                if (used[j] != 0)
+                    continue;
+
+                cur = costs[(i0 - 1) * m + j - 1] - u[i0] - v[j];
+                if (cur < minv[j]) {
+                    minv[j] = cur;
+                    way[j] = j0;
+                }
+                if (minv[j] < delta) {
+                    delta = minv[j];
+                    j1 = j;
+                }
+            }
+
+            for (j = 0; j <= m; j++) {
+                if (used[j] != 0) {
+                    u[p[j]] += delta;
+                    v[j] -= delta;
+                } else {
+                    minv[j] -= delta;
+                }
+            }
+            j0 = j1;
+        } while (p[j0] != 0);
+
+        do {
+            j1 = way[j0];
+            p[j0] = p[j1];
+            j0 = j1;
+        } while (j0 != 0);
+    }
+
+    for (j = 1; j <= m; j++) {
+        if (p[j] != 0)
+            cols[p[j] - 1] = j - 1;
+    }
+
+    cost = 0;
+    for (i = 0; i < n; i++)
+        cost += costs[i * m + cols[i]];
+
+out:
+    if (u != NULL)
+        free(u);
+    if (v != NULL)
+        free(v);
+    if (minv != NULL)
+        free(minv);
+    if (p != NULL)
+        free(p);
+    if (way != NULL)
+        free(way);
+    if (used != NULL)
+        free(used);
+
+    return (cost);
+}
+
+
+static void
+_cfg2_solution_free(struct _cfg2_solution *solution)
+{
+    if (solution->costs != NULL)
+        free(solution->costs);
+    if (solution->cols != NULL)
+        free(solution->cols);
+    free(solution);
+}
+
+
+/* The _cfg2_ranking_add() function solves the assignment problem for
+ * the constrained cost matrix @p costs and inserts the solution in
+ * @p ranking after all pending solutions that are not more costly.
+ * The ranking takes ownership of @p costs.  If the constraints do
+ * not admit a valid configuration, @p costs is released and nothing
+ * is inserted.
+ *
+ * @return Zero on success, non-zero otherwise
+ */
+static int
+_cfg2_ranking_add(struct _cfg2_ranking *ranking, long int *costs)
+{
+    struct _cfg2_solution *prev, *s, *solution;
+
+
+    solution = malloc(sizeof(struct _cfg2_solution));
+    if (solution == NULL) {
+        free(costs);
+        return (-1);
+    }
+
+    solution->costs = costs;
+    solution->cols = calloc(
+        ranking->n_rows > 0 ? ranking->n_rows : 1, sizeof(size_t));
+    if (solution->cols == NULL) {
+        _cfg2_solution_free(solution);
+        return (-1);
+    }
+
+    solution->cost = _cfg2_hungarian(
+        costs, ranking->n_rows, ranking->n_cols, solution->cols);
+    if (solution->cost < 0) {
+        _cfg2_solution_free(solution);
+        return (-1);
+    }
+
+    if (solution->cost >= ranking->inf) {
+        _cfg2_solution_free(solution);
+        return (0);
+    }
+
+    prev = NULL;
+    SIMPLEQ_FOREACH(s, &ranking->solutions, solutions) {
+        if (s->cost > solution->cost)
+            break;
+        prev = s;
+    }
+
+    if (prev == NULL) {
+        SIMPLEQ_INSERT_HEAD(&ranking->solutions, solution, solutions);
+    } else {
+        SIMPLEQ_INSERT_AFTER(
+            &ranking->solutions, prev, solution, solutions);
+    }
+
+    return (0);
+}
+
+
+static void
+_cfg2_ranking_free(struct _cfg2_ranking *ranking)
+{
+    struct _cfg2_solution *solution;
+
+    while (!SIMPLEQ_EMPTY(&ranking->solutions)) {
+        solution = SIMPLEQ_FIRST(&ranking->solutions);
+        SIMPLEQ_REMOVE_HEAD(&ranking->solutions, solutions);
+        _cfg2_solution_free(solution);
+    }
+
+    if (ranking->tracks != NULL)
+        free(ranking->tracks);
+    if (ranking->indices != NULL)
+        free(ranking->indices);
+    free(ranking);
+}
+
+
+/* The _cfg2_ranking_new() function sets up the assignment problem for
+ * the tracks of @p cfg and their candidate streams, as assigned by
+ * _cfg2_track_assign(), and solves it.  Tracks that have been left
+ * unselected, because their residuals cannot be calculated, stay
+ * unselected.  If there are more tracks than streams, there is no
+ * valid configuration, and the ranking is empty.
+ *
+ * @return The ranking, or @c NULL on failure
+ */
+static struct _cfg2_ranking *
+_cfg2_ranking_new(const struct _cfg2_cfg *cfg)
+{
+    struct _cfg2_ranking *ranking;
+    struct _cfg2_track *track;
+    long int *costs;
+    void *p;
+    size_t c, i, j, k, r;
+    long int cost, max;
+
+
+    ranking = malloc(sizeof(struct _cfg2_ranking));
+    if (ranking == NULL)
+        return (NULL);
+    ranking->n_rows = 0;
+    ranking->n_cols = 0;
+    ranking->tracks = NULL;
+    ranking->indices = NULL;
+    ranking->inf = 1;
+    SIMPLEQ_INIT(&ranking->solutions);
+
+
+    /* Collect the rows and the columns.
+     */
+    for (i = 0; i < cfg->n_media; i++) {
+        for (j = 0; j < cfg->media[i].n_tracks; j++) {
+            track = cfg->media[i].tracks + j;
+            if (track->nmemb == 0 || track->selected >= track->nmemb)
+                continue;
+
+            p = realloc(ranking->tracks,
+                        (ranking->n_rows + 1) * sizeof(struct _cfg2_track *));
+            if (p == NULL) {
+                _cfg2_ranking_free(ranking);
+                return (NULL);
+            }
+            ranking->tracks = p;
+            ranking->tracks[ranking->n_rows++] = track;
+
+            for (k = 0; k < track->nmemb; k++) {
+                for (c = 0; c < ranking->n_cols; c++) {
+                    if (ranking->indices[c] == track->streams[k].index)
+                        break;
+                }
+                if (c < ranking->n_cols)
+                    continue;
+
+                p = realloc(ranking->indices,
+                            (ranking->n_cols + 1) * sizeof(size_t));
+                if (p == NULL) {
+                    _cfg2_ranking_free(ranking);
+                    return (NULL);
+                }
+                ranking->indices = p;
+                ranking->indices[ranking->n_cols++] = track->streams[k].index;
+            }
+        }
+    }
+
+    if (ranking->n_rows > ranking->n_cols)
+        return (ranking);
+
+
+    /* Fill in the cost matrix.  Infinity exceeds the sum of the
+     * largest cost in each row, and therefore the cost of any valid
+     * configuration.
+     */
+    costs = calloc(ranking->n_rows * ranking->n_cols + 1, sizeof(long int));
+    if (costs == NULL) {
+        _cfg2_ranking_free(ranking);
+        return (NULL);
+    }
+
+    for (r = 0; r < ranking->n_rows; r++) {
+        track = ranking->tracks[r];
+        max = 0;
+        for (k = 0; k < track->nmemb; k++) {
+            cost = abs(track->streams[k].residual);
+            if (cost > max)
+                max = cost;
+        }
+        ranking->inf += max;
+    }
+
+    for (r = 0; r < ranking->n_rows; r++) {
+        track = ranking->tracks[r];
+        for (c = 0; c < ranking->n_cols; c++)
+            costs[r * ranking->n_cols + c] = ranking->inf;
+
+        for (k = 0; k < track->nmemb; k++) {
+            for (c = 0; ranking->indices[c] != track->streams[k].index; c++)
+                ;
+            costs[r * ranking->n_cols + c] = abs(track->streams[k].residual);
+        }
+    }
+
+    if (_cfg2_ranking_add(ranking, costs) != 0) {
+        _cfg2_ranking_free(ranking);
+        return (NULL);
+    }
+
+    return (ranking);
+}
+
+
+/* The _cfg2_ranking_next() function applies the next best valid
+ * configuration to the tracks of the ranking.  The solution space of
+ * the applied configuration is partitioned as in Murty's algorithm:
+ * the i:th subproblem keeps the assignments of the first i - 1 rows,
+ * and excludes the assignment of the i:th row.  The subproblems are
+ * solved and queued, so each call costs at most n_rows solutions of
+ * the assignment problem.
+ *
+ * @return Zero on success, non-zero if exhausted or on failure
+ */
+static int
+_cfg2_ranking_next(struct _cfg2_ranking *ranking)
+{
+    struct _cfg2_solution *solution;
+    struct _cfg2_track *track;
+    long int *child, *costs;
+    size_t c, k, n, r, t;
+
+
+    if (SIMPLEQ_EMPTY(&ranking->solutions))
+        return (-1); // EXHAUSTED
+    solution = SIMPLEQ_FIRST(&ranking->solutions);
+    SIMPLEQ_REMOVE_HEAD(&ranking->solutions, solutions);
+
+
+    /* Select the assigned stream of each track.
+     */
+    for (r = 0; r < ranking->n_rows; r++) {
+        track = ranking->tracks[r];
+        for (k = 0; k < track->nmemb; k++) {
+            if (track->streams[k].index ==
+                ranking->indices[solution->cols[r]]) {
+                track->selected = k;
+                break;
+            }
+        }
+    }
+
+
+    /* Partition the remaining solution space.  The cost matrix of the
+     * solution accumulates the forced assignments as the rows are
+     * traversed.
+     */
+    n = ranking->n_rows * ranking->n_cols;
+    costs = solution->costs;
+    for (r = 0; r < ranking->n_rows; r++) {
+        c = solution->cols[r];
+
+        child = malloc((n + 1) * sizeof(long int));
+        if (child == NULL) {
+            _cfg2_solution_free(solution);
+            return (-1);
+        }
+        memcpy(child, costs, n * sizeof(long int));
+        child[r * ranking->n_cols + c] = ranking->inf;
+        if (_cfg2_ranking_add(ranking, child) != 0) {
+            _cfg2_solution_free(solution);
+            return (-1);
+        }
+
+        for (t = 0; t < ranking->n_cols; t++) {
+            if (t != c)
+                costs[r * ranking->n_cols + t] = ranking->inf;
+        }
+        for (t = 0; t < ranking->n_rows; t++) {
+            if (t != r)
+                costs[t * ranking->n_cols + c] = ranking->inf;
+        }
+    }
+
+    _cfg2_solution_free(solution);
+    return (0);
+}
+
+
+/* The _cfg2_rank_configurations() function ranks the valid track
+ * configurations of @p cfg, given the candidate streams of its
+ * tracks, and selects the streams of the best one.
+ * _cfg2_next_configuration() selects the others in order of
+ * increasing residual.
+ *
+ * @return Zero on success, non-zero if there is no valid
+ *         configuration or on failure
+ */
+int
+_cfg2_rank_configurations(struct _cfg2_cfg *cfg)
+{
+    if (cfg->ranking != NULL)
+        _cfg2_ranking_free(cfg->ranking);
+    cfg->ranking = _cfg2_ranking_new(cfg);
+    if (cfg->ranking == NULL)
+        return (-1);
+    return (_cfg2_ranking_next(cfg->ranking));
+}
+
+
 /* This generates the best configuration when the disc indices are set
  * to zero.
  *
@@ -857,7 +1623,6 @@ _cfg2_first_configuration(struct _cfg2_cfg *cfg,
 //    struct _cfg2_cfg *cfg;
 //    size_t index, k, l;
     size_t i, j;
-    int r; //, r_new;
 
 
     /* XXX There may not be a disc, but there should always be a
@@ -893,13 +1658,10 @@ _cfg2_first_configuration(struct _cfg2_cfg *cfg,
     }
 
 
-    /* Find the best valid configuration.  Chose the next best
-     * configuration
-     *
-     * XXX THIS IS COMPLETELY UNTESTED!  Needs a fair amount of
-     * thought, still!  Test on Beach Boys, Weather Report, etc.
+    /* Find the best valid configuration.
      *
-     * Notes from manuscript:
+     * Notes from manuscript, on stepping through the configurations
+     * by residual increments:
      *
      *  (1) What's the smallest we can add?  Try to add all, in order
      *  of increasing magnitude, stop after first.  XXX PROBLEM: WE
@@ -908,54 +1670,16 @@ _cfg2_first_configuration(struct _cfg2_cfg *cfg,
      *  (2) What's the largest we can remove?  Try to remove all, in
      *  order of decreasing magnitude.
      *
-     * XXX CONTINUE HERE
-     *
-     * This is all changed, now.  Check the best (trivial)
-     * configuration.  If this is a zero-residual configuration, check
-     * all subsequent configuration that do not increase the
-     * (absolute) residual until a valid configuration is found.  This
-     * is therefore not guaranteed to be unique.
+     * The stepping search could not backtrack, and blew up on
+     * compilations where many tracks have nearly the same length.
+     * Assigning streams to tracks is an assignment problem, which is
+     * now solved exactly by _cfg2_ranking_next().  The configuration
+     * has the smallest residual of all valid configurations, but is
+     * not necessarily unique: _cfg2_next_configuration() returns the
+     * others in order of increasing residual.
      */
-#if 0 // DUMPER DUPLICATE -- REMOVE AT WILL
-    printf("*** First configuration TRIVIAL CONFIGURATION ***\n");
-    _cfg2_dump_track_configuration(cfg);
-#endif
-
-    r = _cfg2_residual_configuration(cfg);
-    if (r != 0)
-        return (-1); // XXX Only care about zero-residual configurations
-
-    while (_cfg2_configuration_is_valid(cfg) == 0) {
-        int r_tmp;
-
-        printf("## r=%d\n", r); //# STRAYING INTO THE UNKNOWN ###\n");
-//        sleep(1);
-
-#if 0
-        r_tmp = _cfg2_step_forward(cfg);
-        if (r_tmp < 0) {
-            printf("EXHAUSTED!\n");
-            break;
-        }
-        r += r_tmp;
-
-        r_tmp = _cfg2_step_backward(cfg, r_tmp);
-        if (r_tmp < 0)
-            ; // XXX Moving on...
-        else {
-            printf("      subtracting %d\n", r_tmp);
-            r -= r_tmp;
-        }
-#else
-        r_tmp = _cfg2_step_forward_new(cfg);
-        printf("_cfg2_step_forward_new() returned %d\n", r_tmp);
-        if (r_tmp == 0)
-            return (-1); // XXX EXHAUSTED--should return NULL?
-#endif
-
-        printf("## r=%d [CHECK]\n", r); //# STRAYING INTO THE UNKNOWN ###\n");
-        r = _cfg2_residual_configuration(cfg); // r_new;
-    }
+    if (_cfg2_rank_configurations(cfg) != 0)
+        return (-1);
 
 #if 0 // DUMPER
     printf("*** First configuration ***\n");
@@ -966,6 +1690,15 @@ _cfg2_first_configuration(struct _cfg2_cfg *cfg,
 }
 
 
+int
+_cfg2_next_configuration(struct _cfg2_cfg *cfg)
+{
+    if (cfg->ranking == NULL)
+        return (-1);
+    return (_cfg2_ranking_next(cfg->ranking));
+}
+
+
 /* This is really another scoring function.  A configuration is scored
  * based on its distance in duration to the release in MB.  Very
  * similar to _cfg2_first_configuration() above?
@@ -996,3 +1729,245 @@ _cfg2_residual_configuration(const struct _cfg2_cfg *cfg)
 
     return (residual);
 }
+
+
+/* Argument to and result of _cfg2_solve_medium().
+ */
+struct _cfg2_medium_arg
+{
+    struct _cfg2_medium *medium;
+    Mb5Medium Medium;
+    struct fp3_release *release;
+    struct fingersum_context **ctxs;
+
+    /* Zero if the medium has a valid track configuration, non-zero
+     * otherwise
+     */
+    int status;
+};
+
+
+/* The _cfg2_medium_configuration() function finds the best valid
+ * track configuration of @p medium on the disc @p Disc, in the same
+ * way _cfg2_first_configuration() does for all media.  Streams only
+ * have to be unique within the medium.  A failure to solve the
+ * assignment problem is indistinguishable from the lack of a valid
+ * configuration.
+ *
+ * @return Residual of the configuration, @c LONG_MAX if there is no
+ *         valid configuration, or negative on failure
+ */
+static long int
+_cfg2_medium_configuration(struct _cfg2_medium *medium,
+                           Mb5Medium Medium,
+                           Mb5Disc Disc,
+                           struct fp3_release *release,
+                           struct fingersum_context **ctxs)
+{
+    struct _cfg2_cfg cfg;
+    struct _cfg2_ranking *ranking;
+    size_t n;
+    int ret;
+
+    if (_cfg2_medium_bound(medium, Medium, Disc, release, ctxs, &n) < 0)
+        return (-1);
+
+    cfg.n_media = 1;
+    cfg.media = medium;
+    cfg.ranking = NULL;
+    ranking = _cfg2_ranking_new(&cfg);
+    if (ranking == NULL)
+        return (-1);
+    ret = _cfg2_ranking_next(ranking);
+    _cfg2_ranking_free(ranking);
+    if (ret != 0)
+        return (LONG_MAX);
+
+    return (_cfg2_residual_configuration(&cfg));
+}
+
+
+/* The _cfg2_solve_medium() function ranks the discs of a single
+ * medium by the residual of their best valid track configuration.
+ * On return, the medium retains every disc that admits a valid track
+ * configuration, in order of increasing residual, each with that
+ * residual as its bound, and the first of them is selected.  Discs
+ * with equal residuals stay in order of increasing lower bound.
+ *
+ * The residual of a disc is exact for the medium on its own, and
+ * therefore still a lower bound once streams have to be unique
+ * across media.  The sub-optimal discs are kept so that
+ * _cfg2_next_bounded_disc_configuration() can fall back on them when
+ * the optimal discs of two media conflict.
+ *
+ * The function only touches its own medium, and runs on the pool
+ * concurrently with the other media of the release.  It must not
+ * wait on the pool; see _cfg2_solve_disc_configuration().
+ *
+ * @return @p arg on success, @c NULL on failure
+ */
+static void *
+_cfg2_solve_medium(void *arg)
+{
+    struct _cfg2_medium_arg *ma;
+    struct _cfg2_medium *medium;
+    Mb5Disc Disc;
+    char *discid;
+    size_t j, k, l;
+    long int residual;
+
+
+    ma = arg;
+    medium = ma->medium;
+    if (_cfg2_medium_discs(medium, ma->Medium, ma->release, ma->ctxs) != 0)
+        return (NULL);
+
+
+    /* Insert each disc with a valid track configuration among the
+     * first k discs, in order of increasing residual, and release the
+     * others.  Because j never falls behind k, the discs that have
+     * not been visited yet are not overwritten.
+     */
+    k = 0;
+    for (j = 0; j < medium->n_discs; j++) {
+        Disc = _cfg2_disc_with_id(ma->Medium, medium->discids[j]);
+        residual = _cfg2_medium_configuration(
+            medium, ma->Medium, Disc, ma->release, ma->ctxs);
+        if (residual < 0) {
+            for (l = j; l < medium->n_discs; l++)
+                free(medium->discids[l]);
+            medium->n_discs = k;
+            return (NULL);
+        }
+
+        discid = medium->discids[j];
+        if (residual == LONG_MAX) {
+            free(discid);
+            continue;
+        }
+
+        for (l = k; l > 0 && medium->bounds[l - 1] > residual; l--) {
+            medium->discids[l] = medium->discids[l - 1];
+            medium->bounds[l] = medium->bounds[l - 1];
+        }
+        medium->discids[l] = discid;
+        medium->bounds[l] = residual;
+        k += 1;
+    }
+
+
+    /* A medium with discs, none of which have a valid track
+     * configuration, makes the entire release invalid.
+     */
+    ma->status = medium->n_discs > 0 && k == 0 ? 1 : 0;
+    medium->n_discs = k;
+
+    medium->selected_disc = 0;
+    _cfg2_medium_select_disc(medium);
+
+    return (arg);
+}
+
+
+/* The _cfg2_solve_disc_configuration() function prepares @p cfg for
+ * _cfg2_next_bounded_disc_configuration() like
+ * _cfg2_bound_disc_configuration(), but solves each medium
+ * separately first.
+ *
+ * Given a disc, the best track configuration of a medium does not
+ * depend on the discs of the other media, except through streams
+ * that are assigned to tracks on more than one medium.  Each medium
+ * can therefore be ranked on its own, on the pool, and the bound of
+ * every disc is then the exact residual of its medium rather than an
+ * estimate.  The first disc configuration combines the best disc of
+ * each medium.  Conflicts between media are caught by
+ * _cfg2_first_configuration() on the combined configuration, and
+ * _cfg2_next_bounded_disc_configuration() then backtracks across the
+ * media through their sub-optimal discs, in order of increasing
+ * bound.
+ *
+ * The media are submitted from, and waited for on, the calling
+ * thread, and _cfg2_solve_medium() itself never waits on the pool.
+ * If the caller is itself a pool worker, the media are solved inline
+ * instead, because a worker that blocks in pool_wait_any() could
+ * wait for jobs queued behind it.
+ *
+ * @return Zero on success, positive if a medium does not have any
+ *         valid track configuration, negative on failure
+ */
+int
+_cfg2_solve_disc_configuration(struct _cfg2_cfg *cfg,
+                               Mb5MediumList MediumList,
+                               struct fp3_release *release,
+                               struct fingersum_context **ctxs)
+{
+    Mb5Medium Medium;
+    struct _cfg2_medium_arg *args;
+    struct pool_context *pc;
+    void *arg, *value;
+    size_t i;
+    int ret;
+
+
+    args = calloc(
+        cfg->n_media > 0 ? cfg->n_media : 1, sizeof(struct _cfg2_medium_arg));
+    if (args == NULL)
+        return (-1);
+
+    pc = NULL;
+    if (pool_is_worker() == 0) {
+        pc = pool_new_pc(pool_nmemb_auto());
+        if (pc == NULL) {
+            free(args);
+            return (-1);
+        }
+    }
+
+    ret = 0;
+    for (i = 0; i < cfg->n_media; i++) {
+        Medium = _cfg2_medium_at_position(MediumList, i + 1);
+        if (Medium == NULL)
+            continue;
+
+        args[i].medium = cfg->media + i;
+        args[i].Medium = Medium;
+        args[i].release = release;
+        args[i].ctxs = ctxs;
+        args[i].status = 0;
+
+        if (pc == NULL) {
+            if (_cfg2_solve_medium(args + i) == NULL) {
+                ret = -1;
+                break;
+            }
+            if (ret == 0 && args[i].status != 0)
+                ret = 1;
+            continue;
+        }
+
+        if (pool_submit(pc, _cfg2_solve_medium, args + i) == NULL) {
+            ret = -1;
+            break;
+        }
+    }
+
+
+    /* Wait for all submitted media, even after a failure, because
+     * they refer to args.
+     */
+    while (pc != NULL) {
+        if (pool_wait_any(pc, &arg, &value) != 0)
+            break;
+
+        if (value == NULL)
+            ret = -1;
+        else if (ret == 0 && ((struct _cfg2_medium_arg *)arg)->status != 0)
+            ret = 1;
+    }
+
+    if (pc != NULL)
+        pool_free_pc(pc);
+    free(args);
+
+    return (ret);
+}
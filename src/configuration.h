@@ -127,9 +127,34 @@ struct _cfg2_medium
      */
 //    ssize_t *streams;
     struct _cfg2_track *tracks;
+
+    /* Number of candidate discs for this medium, and the index of
+     * the selected one.  Only set by _cfg2_bound_disc_configuration()
+     * and _cfg2_solve_disc_configuration(), zero otherwise.
+     */
+    size_t n_discs;
+    size_t selected_disc;
+
+    /* The candidate discids, sorted in order of increasing lower
+     * bound, and their lower bounds.  The lower bound of a disc is
+     * the total residual of the medium if every track were assigned
+     * its best stream, regardless of whether that stream is also
+     * assigned to another track.  No valid track configuration on the
+     * disc can do better.  After _cfg2_solve_disc_configuration(),
+     * the bound is the residual of the best valid track configuration
+     * of the medium on its own.
+     */
+    char **discids;
+    long int *bounds;
 };
 
 
+/* Ranking of the track configurations, private to the configuration
+ * module
+ */
+struct _cfg2_ranking;
+
+
 struct _cfg2_cfg
 {
     /* Number of media for this release
@@ -145,6 +170,12 @@ struct _cfg2_cfg
      */
 //    size_t *media;
     struct _cfg2_medium *media;
+
+    /* Pending track configurations for the current disc
+     * configuration, set by _cfg2_first_configuration() and consumed
+     * by _cfg2_next_configuration().
+     */
+    struct _cfg2_ranking *ranking;
 };
 
 
@@ -183,12 +214,45 @@ _cfg2_first_disc_configuration(Mb5MediumList MediumList);
 int
 _cfg2_next_disc_configuration(struct _cfg2_cfg *cfg, Mb5MediumList MediumList);
 
+int
+_cfg2_bound_disc_configuration(struct _cfg2_cfg *cfg,
+                               Mb5MediumList MediumList,
+                               struct fp3_release *release,
+                               struct fingersum_context **ctxs);
+
+int
+_cfg2_solve_disc_configuration(struct _cfg2_cfg *cfg,
+                               Mb5MediumList MediumList,
+                               struct fp3_release *release,
+                               struct fingersum_context **ctxs);
+
+long int
+_cfg2_lower_bound_configuration(const struct _cfg2_cfg *cfg);
+
+int
+_cfg2_next_bounded_disc_configuration(struct _cfg2_cfg *cfg, long int bound);
+
+void
+_cfg2_select_disc_configuration(struct _cfg2_cfg *cfg, const size_t *selected);
+
 int
 _cfg2_first_configuration(struct _cfg2_cfg *cfg,
                           Mb5MediumList MediumList,
                           struct fp3_release *release,
                           struct fingersum_context **ctxs);
 
+int
+_cfg2_next_configuration(struct _cfg2_cfg *cfg);
+
+int
+_cfg2_rank_configurations(struct _cfg2_cfg *cfg);
+
+long int
+_cfg2_hungarian(const long int *costs, size_t n, size_t m, size_t *cols);
+
+void
+_cfg2_cfg_free(struct _cfg2_cfg *cfg);
+
 int
 _cfg2_configuration_is_valid(const struct _cfg2_cfg *cfg);
 
@@ -22,6 +22,7 @@
 
 #include <iconv.h> // XXX WIP
 #include <pthread.h>
+#include <unistd.h>
 
 #define USE_CRC32 1
 
@@ -33,7 +34,18 @@
 #include <libavutil/opt.h>
 #include <libswresample/swresample.h>
 
+/* Vector kernels for the AccurateRip checksums are only built for
+ * x86 with a compiler that supports per-function target attributes.
+ */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  define FINGERSUM_SIMD_X86 1
+#  include <immintrin.h>
+#else
+#  define FINGERSUM_SIMD_X86 0
+#endif
+
 #include "fingersum.h"
+#include "store.h"
 
 
 /* Length of the audio data used for Chromaprint fingerprint
@@ -50,7 +62,19 @@
  */
 #define MAX_OFFSET (5 * 588 + 1024)
 
+/* Default half-width of the window of offsets searched by
+ * fingersum_find_offset(); see fingersum_set_offset_window().  The
+ * window may not exceed the five sectors of slack that samples,
+ * samples_end, and the EAC offset tables are sized for.
+ */
 #define MAX_OFFSET_2 1024
+#define MAX_WINDOW (5 * 588)
+
+/* Rough number of bytes held by the demuxer, the decoder, the
+ * resampler, and the Chromaprint context of a live context; see
+ * fingersum_get_size()
+ */
+#define FINGERSUM_DECODER_SIZE (1024 * 1024)
 
 
 /* XXX Think about these lengths, 5 * 558 - 1 or just 5 * 558?  (5 *
@@ -109,29 +133,45 @@ struct _fingersum_offset
      */
     int32_t offset;
 
-    /* See below: lead-in, bulk, lead-out.  For both v1 and v2:
-     *
-     * 0: checksum of first (5 * 588 - offset) samples, indexed from
-     * one.  These are not counted if the track is first on the disc.
-     *
-     * 1: The middle samples, everything between 0 and 2, indexed by
-     * natural index.
-     *
-     * 2: Checksum of last (5 * 588 - offset) samples, indexed from
-     * number of sample.  These are not counted if the track is last
-     * on the disc.
-     *
-     * 3: Last offset samples, indexed from 1.  These may need to be
-     * added to the next track if the offset is negative (XXX or is it
-     * positive?!)  NO -- THIS IS GONE, NOW!
+    /* Sum of the high words of the 64-bit v2 products, ((j -
+     * offset) * v) >> 32, over the middle region of the track.  This
+     * is the only part of the AccurateRip checksums that cannot be
+     * derived from offset-independent moments; see _feed_middle().
+     * Everything else is calculated on demand in _ar_cksum_range().
      */
-    uint32_t checksum_v1[3];
-    uint32_t checksum_v2[3];
+    uint32_t hi;
 
-#ifdef USE_CRC32 // XXX WIP
-    uLong crc32[3];
-    uLong crc32_skip_zero;
-#endif
+    /* Non-zero if the offset was added after part of the middle
+     * region had been fed, such that hi is incomplete.  The v1
+     * checksum is still available; the v2 checksum is not until the
+     * stream has been processed again; see fingersum_get_result_3().
+     */
+    int32_t pending;
+};
+
+
+/* Identity of the file backing a fingersum context, used to look up
+ * its record in the persistent cache
+ */
+struct _cache_key
+{
+    uint64_t dev;
+    uint64_t ino;
+    int64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+
+    /* CRC32 of the contents of the file, only valid if has_hash is
+     * non-zero
+     */
+    uint32_t hash;
+    int32_t has_hash;
+
+    /* Non-zero if the key identifies a regular file and the cache is
+     * enabled
+     */
+    int32_t valid;
+    int32_t pad;
 };
 
 
@@ -186,6 +226,28 @@ struct fingersum_context
      */
     AVStream *stream;
 
+    /* Time base of the stream, which remains known while the context
+     * is parked
+     */
+    AVRational time_base;
+
+    /* The stream the context reads from, such that the input context
+     * and the decoder can be opened again after fingersum_park()
+     */
+    FILE *file;
+
+    /* Path to the stream if it was opened with fingersum_open(), or
+     * @c NULL.  The context then owns the stream, which is closed
+     * while the context is parked and opened again by path.
+     */
+    char *path;
+
+    /* Number of channels and sample rate of the stream, which remain
+     * known while the context is parked
+     */
+    int channels;
+    int sample_rate;
+
     /* The Chromaprint context
      *
      * This member will be @c NULL if an external Chromaprint context
@@ -193,6 +255,12 @@ struct fingersum_context
      */
     ChromaprintContext *cc;
 
+    /* The Chromaprint context that the stream was started in, local or
+     * external.  An unfinished fingerprint can only be continued in
+     * the context it was fed to; see _resume().
+     */
+    ChromaprintContext *cc_started;
+
     /* The calculated Chromaprint fingerprint, compressed and encoded
      * in base-64 with the URL-safe scheme, or @c NULL if it not yet
      * available
@@ -202,6 +270,16 @@ struct fingersum_context
      */
     void *fingerprint;
 
+    /* Non-zero if the fingerprint was read from the cache, in which
+     * case it must be released with free(3) rather than
+     * chromaprint_dealloc()
+     */
+    int cached;
+
+    /* Key of the record for this context in the persistent cache
+     */
+    struct _cache_key key;
+
     /* Number of samples required to complete the Chromaprint
      * fingerprint
      */
@@ -221,18 +299,57 @@ struct fingersum_context
 //    struct _fingersum_checksum_v1 v1;
 //    struct _fingersum_checksum_v2 v2;
 
-    /* The offset sum, sum(i * v)
+    /* Half-width of the window of offsets searched by
+     * fingersum_find_offset(), in samples
+     */
+    size_t window;
+
+    /* The offset sum, sum(i * v), over (2 * window + 588 + 1)
+     * samples.  Allocated by _start(), and only for tracks that
+     * reach the window.
      *
      * XXX Really, no need to keep two arrays; can use the front and
      * the back as in Jon's math.
      */
-    uint32_t sof[2 * MAX_OFFSET_2 + 588 + 1];
+    uint32_t *sof;
+
+    /* The straight sum, sum(v), allocated along with sof
+     */
+    uint32_t *sum;
+
+    /* CRC32 of the sector at each offset in [-5 * 588, +5 * 588],
+     * allocated by _start() along with crc32_pre, and only for tracks
+     * long enough to hold the sectors
+     */
+    uint32_t *crc32_off;
+
+    /* Offset-independent moments of the middle region, i.e. all but
+     * the first and the last (2 * 5 * 588 + 1) samples: sum(j * v)
+     * and sum(v), where j is the one-based index of the stereo sample
+     * v.  Together with the retained samples at either end of the
+     * track, these determine the v1 checksum for any offset.
+     */
+    uint32_t mid_sof;
+    uint32_t mid_sum;
+
+#ifdef USE_CRC32 // XXX WIP
+    /* CRC32 of the first (2 * 5 * 588 + 1) samples, the middle
+     * region, and the last (2 * 5 * 588 + 1) samples
+     */
+    uLong crc32[3];
 
-    /* The straight sum, sum(v)
+    /* CRC32 of the whole track, skipping 16-bit samples that are
+     * zero, as reported by XLD
      */
-    uint32_t sum[2 * MAX_OFFSET_2 + 588 + 1];
+    uLong crc32_skip_zero;
 
-    uLong crc32_off[2 * 5 * 588 + 1];
+    /* CRC32 of each prefix of the region spanned by the sectors in
+     * crc32_off; crc32_pre[k] covers the first k samples of that
+     * region.  Only needed while the region is being decoded, and
+     * freed as soon as crc32_off is complete.
+     */
+    uint32_t *crc32_pre;
+#endif
 
 //    uint64_t prutt_1;
 //    uint64_t prutt_2;
@@ -254,6 +371,81 @@ struct fingersum_context
     uint32_t *samples;
     uint32_t *samples_end;
     uint64_t max_offset;
+
+    /* Non-zero if samples_end holds the last samples of the stream
+     * even though the stream has not been processed to the end; see
+     * _process_tail()
+     */
+    int tail;
+
+    /* Length of the audio data in stereo samples
+     *
+     * This is the duration of the stream, except for a track of a
+     * disc image, where it is the length of the track.
+     */
+    int64_t duration;
+
+    /* The disc image the track is part of, or @c NULL if the context
+     * decodes a stream of its own
+     *
+     * A track of an image shares the input context, the decoder, and
+     * the stream with the image, and must not release them in
+     * fingersum_free().
+     */
+    struct _image *image;
+
+    /* Metadata that overrides that of the stream, or @c NULL
+     *
+     * If non-null, it must be released in fingersum_free().
+     */
+    AVDictionary *metadata;
+};
+
+
+/* A disc image holds the tracks of a disc back to back in a single
+ * stream, as described by a CUE sheet.  The image is decoded by a
+ * context of its own, and the decoded samples are dispatched to the
+ * contexts of the tracks, such that the checksums and the
+ * fingerprints of all the tracks are calculated in a single pass.
+ * The image is released along with the last of its tracks.
+ */
+struct _image
+{
+    /* Mutex to serialise decoding, and to protect the accumulators of
+     * the tracks while the image is being decoded
+     */
+    pthread_mutex_t mutex;
+
+    /* The context that decodes the image
+     */
+    struct fingersum_context *ctx;
+
+    /* The tracks of the image, in order, or @c NULL for tracks that
+     * have been released
+     */
+    struct fingersum_context **tracks;
+
+    /* Zero-based index of the first stereo sample of each track in
+     * the image, followed by the length of the image
+     */
+    int64_t *starts;
+
+    /* Number of tracks
+     */
+    size_t nmemb;
+
+    /* Number of tracks not yet released
+     */
+    size_t refs;
+
+    /* Number of 16-bit samples decoded since the image was last
+     * rewound
+     */
+    uint64_t pos;
+
+    /* Non-zero if every track has seen all its samples
+     */
+    int done;
 };
 
 
@@ -263,8 +455,309 @@ struct fingersum_context
 static pthread_mutex_t _mutex = PTHREAD_MUTEX_INITIALIZER;
 
 
-/* The _init() function performs one-time initialisation of Libav.
- * The function is thread-safe and can be called multiple times.
+/* Kernels for the middle region of the AccurateRip checksums; see
+ * _feed_middle().  The _moments_*() kernels add sum(j * v) and sum(v)
+ * modulo 2^32 over the @p n stereo samples in @p v, where j is the
+ * one-based index of the sample, starting at @p j.  The _hi_*()
+ * kernels return the sum modulo 2^32 of the high words of the 64-bit
+ * products (l * v), where l starts at @p l.  Since there are no
+ * branches in the middle region, these map directly onto vector
+ * instructions.  The indices must fit in 32 bits, which limits a
+ * track to a little more than 27 hours at 44.1 kHz.
+ *
+ * The AVX2 and SSE4.1 kernels are selected at run time in _init(),
+ * depending on what the CPU supports; the portable kernels are used
+ * otherwise.
+ */
+static void
+_moments_portable(
+    const uint32_t *v, uint32_t j, size_t n, uint32_t *sof, uint32_t *sum)
+{
+    size_t i;
+    uint32_t a, b;
+
+    a = *sof;
+    b = *sum;
+    for (i = 0; i < n; i++) {
+        a += (j + (uint32_t)i) * v[i];
+        b += v[i];
+    }
+    *sof = a;
+    *sum = b;
+}
+
+
+static uint32_t
+_hi_portable(const uint32_t *v, uint32_t l, size_t n)
+{
+    size_t i;
+    uint32_t hi;
+
+    hi = 0;
+    for (i = 0; i < n; i++)
+        hi += ((uint64_t)(l + (uint32_t)i) * v[i]) >> 32;
+    return (hi);
+}
+
+
+#if FINGERSUM_SIMD_X86
+/* The SSE4.1 kernels process four stereo samples at a time.  The
+ * _mm_mul_epu32() intrinsic multiplies the even 32-bit lanes into
+ * 64-bit products, so the odd lanes are shifted down and multiplied
+ * separately.  The high words are accumulated in 64-bit lanes, which
+ * cannot overflow for any realistic track length.
+ */
+__attribute__((target("sse4.1")))
+static void
+_moments_sse41(
+    const uint32_t *v, uint32_t j, size_t n, uint32_t *sof, uint32_t *sum)
+{
+    __m128i a, b, idx, x;
+    uint32_t t[4];
+    size_t i;
+
+    a = _mm_setzero_si128();
+    b = _mm_setzero_si128();
+    idx = _mm_setr_epi32(j, j + 1, j + 2, j + 3);
+    for (i = 0; i + 4 <= n; i += 4) {
+        x = _mm_loadu_si128((const __m128i *)(v + i));
+        a = _mm_add_epi32(a, _mm_mullo_epi32(idx, x));
+        b = _mm_add_epi32(b, x);
+        idx = _mm_add_epi32(idx, _mm_set1_epi32(4));
+    }
+
+    _mm_storeu_si128((__m128i *)t, a);
+    *sof += t[0] + t[1] + t[2] + t[3];
+    _mm_storeu_si128((__m128i *)t, b);
+    *sum += t[0] + t[1] + t[2] + t[3];
+    _moments_portable(v + i, j + (uint32_t)i, n - i, sof, sum);
+}
+
+
+__attribute__((target("sse4.1")))
+static uint32_t
+_hi_sse41(const uint32_t *v, uint32_t l, size_t n)
+{
+    __m128i acc, idx, x;
+    uint64_t t[2];
+    size_t i;
+
+    acc = _mm_setzero_si128();
+    idx = _mm_setr_epi32(l, l + 1, l + 2, l + 3);
+    for (i = 0; i + 4 <= n; i += 4) {
+        x = _mm_loadu_si128((const __m128i *)(v + i));
+        acc = _mm_add_epi64(
+            acc, _mm_srli_epi64(_mm_mul_epu32(idx, x), 32));
+        acc = _mm_add_epi64(
+            acc, _mm_srli_epi64(
+                _mm_mul_epu32(
+                    _mm_srli_epi64(idx, 32), _mm_srli_epi64(x, 32)), 32));
+        idx = _mm_add_epi32(idx, _mm_set1_epi32(4));
+    }
+
+    _mm_storeu_si128((__m128i *)t, acc);
+    return (t[0] + t[1] + _hi_portable(v + i, l + (uint32_t)i, n - i));
+}
+
+
+/* The AVX2 kernels are the SSE4.1 kernels with eight lanes.
+ */
+__attribute__((target("avx2")))
+static void
+_moments_avx2(
+    const uint32_t *v, uint32_t j, size_t n, uint32_t *sof, uint32_t *sum)
+{
+    __m256i a, b, idx, x;
+    uint32_t t[8];
+    size_t i, k;
+
+    a = _mm256_setzero_si256();
+    b = _mm256_setzero_si256();
+    idx = _mm256_setr_epi32(
+        j, j + 1, j + 2, j + 3, j + 4, j + 5, j + 6, j + 7);
+    for (i = 0; i + 8 <= n; i += 8) {
+        x = _mm256_loadu_si256((const __m256i *)(v + i));
+        a = _mm256_add_epi32(a, _mm256_mullo_epi32(idx, x));
+        b = _mm256_add_epi32(b, x);
+        idx = _mm256_add_epi32(idx, _mm256_set1_epi32(8));
+    }
+
+    _mm256_storeu_si256((__m256i *)t, a);
+    for (k = 0; k < 8; k++)
+        *sof += t[k];
+    _mm256_storeu_si256((__m256i *)t, b);
+    for (k = 0; k < 8; k++)
+        *sum += t[k];
+    _moments_portable(v + i, j + (uint32_t)i, n - i, sof, sum);
+}
+
+
+__attribute__((target("avx2")))
+static uint32_t
+_hi_avx2(const uint32_t *v, uint32_t l, size_t n)
+{
+    __m256i acc, idx, x;
+    uint64_t t[4];
+    size_t i;
+
+    acc = _mm256_setzero_si256();
+    idx = _mm256_setr_epi32(
+        l, l + 1, l + 2, l + 3, l + 4, l + 5, l + 6, l + 7);
+    for (i = 0; i + 8 <= n; i += 8) {
+        x = _mm256_loadu_si256((const __m256i *)(v + i));
+        acc = _mm256_add_epi64(
+            acc, _mm256_srli_epi64(_mm256_mul_epu32(idx, x), 32));
+        acc = _mm256_add_epi64(
+            acc, _mm256_srli_epi64(
+                _mm256_mul_epu32(
+                    _mm256_srli_epi64(idx, 32),
+                    _mm256_srli_epi64(x, 32)), 32));
+        idx = _mm256_add_epi32(idx, _mm256_set1_epi32(8));
+    }
+
+    _mm256_storeu_si256((__m256i *)t, acc);
+    return (t[0] + t[1] + t[2] + t[3] +
+            _hi_portable(v + i, l + (uint32_t)i, n - i));
+}
+#endif
+
+
+/* The kernels in use, set once in _init()
+ */
+static void (*_moments)(
+    const uint32_t *, uint32_t, size_t, uint32_t *, uint32_t *) =
+    _moments_portable;
+static uint32_t (*_hi)(const uint32_t *, uint32_t, size_t) = _hi_portable;
+
+
+#ifdef USE_CRC32 // XXX WIP
+/* Lookup tables for slicing-by-8 CRC32, with the same polynomial as
+ * zlib's crc32(), and the operator that advances a CRC32 register past
+ * one sector of zeros.  Both are set once in _init().
+ */
+static uint32_t _crc32_table[8][256];
+static uint32_t _crc32_zeros[32];
+
+
+static uint32_t
+_crc32_byte(uint32_t c, unsigned char b)
+{
+    return ((c >> 8) ^ _crc32_table[0][(c ^ b) & 0xff]);
+}
+
+
+/* Advance the bit-inverted CRC32 register @p c past the eight octets
+ * at @p p.  The octets are assembled in little-endian order
+ * regardless of the byte order of the machine.
+ */
+static uint32_t
+_crc32_slice8(uint32_t c, const unsigned char *p)
+{
+    uint32_t a, b;
+
+    a = c ^ ((uint32_t)p[0] |
+             (uint32_t)p[1] << 8 |
+             (uint32_t)p[2] << 16 |
+             (uint32_t)p[3] << 24);
+    b = ((uint32_t)p[4] |
+         (uint32_t)p[5] << 8 |
+         (uint32_t)p[6] << 16 |
+         (uint32_t)p[7] << 24);
+
+    return (_crc32_table[7][a & 0xff] ^
+            _crc32_table[6][(a >> 8) & 0xff] ^
+            _crc32_table[5][(a >> 16) & 0xff] ^
+            _crc32_table[4][a >> 24] ^
+            _crc32_table[3][b & 0xff] ^
+            _crc32_table[2][(b >> 8) & 0xff] ^
+            _crc32_table[1][(b >> 16) & 0xff] ^
+            _crc32_table[0][b >> 24]);
+}
+
+
+/* The _crc32_frames() function updates the running CRC32 @p crc, as
+ * if by zlib's crc32(), with the @p n stereo samples at @p frames and
+ * returns the updated CRC32.  If @p crc_skip_zero is not @c NULL, the
+ * running CRC32 it points to is updated in the same pass with the
+ * 16-bit samples that are not zero.
+ */
+static uint32_t
+_crc32_frames(
+    uint32_t crc, const uint32_t *frames, size_t n, uLong *crc_skip_zero)
+{
+    const unsigned char *p;
+    const uint16_t *s;
+    uint32_t c, z;
+    size_t i, k;
+
+
+    p = (const unsigned char *)frames;
+    c = ~crc;
+    z = crc_skip_zero != NULL ? ~(uint32_t)*crc_skip_zero : 0;
+
+    for (i = 0; i + 2 <= n; i += 2, p += 8) {
+        c = _crc32_slice8(c, p);
+        if (crc_skip_zero == NULL)
+            continue;
+
+        s = (const uint16_t *)p;
+        if (s[0] != 0 && s[1] != 0 && s[2] != 0 && s[3] != 0) {
+            z = _crc32_slice8(z, p);
+        } else {
+            for (k = 0; k < 4; k++) {
+                if (s[k] != 0)
+                    z = _crc32_byte(_crc32_byte(z, p[2 * k]), p[2 * k + 1]);
+            }
+        }
+    }
+
+    if (i < n) {
+        for (k = 0; k < 4; k++)
+            c = _crc32_byte(c, p[k]);
+
+        if (crc_skip_zero != NULL) {
+            s = (const uint16_t *)p;
+            for (k = 0; k < 2; k++) {
+                if (s[k] != 0)
+                    z = _crc32_byte(_crc32_byte(z, p[2 * k]), p[2 * k + 1]);
+            }
+        }
+    }
+
+    if (crc_skip_zero != NULL)
+        *crc_skip_zero = ~z;
+    return (~c);
+}
+
+
+/* The _crc32_sector() function returns the CRC32 of the sector
+ * between two prefixes of a stream, given the CRC32 @p crc_head of
+ * the first prefix and the CRC32 @p crc_tail of the second prefix,
+ * which must be exactly one sector (588 stereo samples) longer.
+ * Since crc_tail = crc32_combine(crc_head, crc_sector, 588 * 4), and
+ * crc32_combine() is linear in its first argument, the CRC32 of the
+ * sector is crc_tail XOR crc32_combine(crc_head, 0, 588 * 4).  The
+ * latter is evaluated bit by bit using _crc32_zeros.
+ */
+static uint32_t
+_crc32_sector(uint32_t crc_head, uint32_t crc_tail)
+{
+    size_t b;
+
+    for (b = 0; crc_head != 0; b++, crc_head >>= 1) {
+        if (crc_head & 0x1)
+            crc_tail ^= _crc32_zeros[b];
+    }
+
+    return (crc_tail);
+}
+#endif
+
+
+/* The _init() function performs one-time initialisation of Libav,
+ * sets up the CRC32 tables, and selects the checksum kernels for the
+ * CPU.  The function is thread-safe and can be called multiple
+ * times.
  *
  * @return 0 if successful, -1 otherwise.  If an error occurs, the
  *         global variable @c errno is set to indicate the error.
@@ -273,6 +766,8 @@ static int
 _init()
 {
     static int initialised = 0;
+    size_t i, k;
+    uint32_t c;
 
     if (pthread_mutex_lock(&_mutex) != 0)
         return (-1);
@@ -285,6 +780,35 @@ _init()
         av_register_all();
 #endif
         av_log_set_level(AV_LOG_ERROR);
+
+#ifdef USE_CRC32 // XXX WIP
+        for (i = 0; i < 256; i++) {
+            c = i;
+            for (k = 0; k < 8; k++)
+                c = c & 0x1 ? (c >> 1) ^ 0xedb88320 : c >> 1;
+            _crc32_table[0][i] = c;
+        }
+        for (i = 0; i < 256; i++) {
+            for (k = 1; k < 8; k++) {
+                c = _crc32_table[k - 1][i];
+                _crc32_table[k][i] =
+                    (c >> 8) ^ _crc32_table[0][c & 0xff];
+            }
+        }
+        for (i = 0; i < 32; i++)
+            _crc32_zeros[i] = crc32_combine(1UL << i, 0, 588 * 4);
+#endif
+
+#if FINGERSUM_SIMD_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            _moments = _moments_avx2;
+            _hi = _hi_avx2;
+        } else if (__builtin_cpu_supports("sse4.1")) {
+            _moments = _moments_sse41;
+            _hi = _hi_sse41;
+        }
+#endif
         initialised = 1;
     }
 
@@ -332,81 +856,461 @@ _seek(void *opaque, int64_t offset, int whence)
 }
 
 
-struct fingersum_context *
-fingersum_new(FILE *stream)
+/* The persistent cache
+ *
+ * A completely processed stream is summarised in a record on disk,
+ * one file per file system object, named after its device and inode
+ * numbers.  The record is keyed by the device, the inode, the size,
+ * and the modification time of the file, and optionally by the CRC32
+ * of its contents.  It holds everything fingersum_get_fingerprint()
+ * and fingersum_get_result_3() need, so that a stream that has not
+ * changed since it was last processed does not have to be decoded
+ * again.  Records are in native byte order, and are discarded if the
+ * byte order marker in the header does not match; the device and
+ * inode numbers they are named after mean nothing on another machine
+ * anyway.
+ *
+ * The directory is set once by fingersum_cache_init(), before any
+ * fingersum contexts are created.  Records are installed with
+ * store_commit(), so a process that is killed while it writes a
+ * record leaves the previous record, if any, in place.
+ */
+#define FINGERSUM_CACHE_MAGIC "sndchkfs"
+#define FINGERSUM_CACHE_VERSION 3
+
+static char *_cache_path = NULL;
+static int _cache_flags = 0;
+
+
+struct _cache_header
 {
-    AVCodec *decoder;
-    AVDictionary *options;
-    AVDictionaryEntry *option;
-    struct fingersum_context *ctx;
-    void *buffer;
-    int64_t channel_layout;
-    int stream_index;
+    char magic[8];
+    uint32_t version;
 
+    /* Always 0x01020304 in the byte order of the machine that wrote
+     * the record
+     */
+    uint32_t byte_order;
 
-    /* Initialise the module, allocate the fingersum context and
-     * initialise it such that fingersum_free() can be called at any
-     * time from now.
+    struct _cache_key key;
+
+    int64_t duration;
+    uint32_t len_fingerprint;
+    uint32_t nmemb;
+    uint32_t mid_sof;
+    uint32_t mid_sum;
+    uint32_t crc32[3];
+    uint32_t crc32_skip_zero;
+
+    /* The window of the offset-finding sums, and whether the sums and
+     * the CRC32 of the offset sectors follow in the record
      */
-    if (_init() != 0)
-        return (NULL);
+    uint32_t window;
+    uint32_t has_sof;
+    uint32_t has_crc32_off;
+};
 
-    ctx = malloc(sizeof(struct fingersum_context));
-    if (ctx == NULL)
-        return (NULL);
 
-    ctx->swr_ctx = NULL;
-    ctx->avcc = NULL;
-    ctx->ic = NULL;
-    ctx->cc = NULL;
-    ctx->frame = NULL;
-    ctx->fingerprint = NULL;
+int
+fingersum_cache_init(const char *path, int flags)
+{
+    char *p;
 
+    if (pthread_mutex_lock(&_mutex) != 0)
+        return (-1);
 
-    /* Open the data stream and return with EPROTONOSUPPORT in case of
-     * failure.  This function will fail if Libav has not been
-     * initialised properly.
-     *
-     * XXX Buffer should be blocksize if fixed by protocol.  Otherwise
-     * a cache page (e.g. 4 kB).  A future project may be to measure
-     * performance as a function of blocksize on different platforms.
-     * Free with av_freep(), or will it be released by the other
-     * functions--check with Valgrind?  What's the Libav default?
-     *
-     * XXX Is ctx->ic->pb also automagically released?  Check with
-     * Valgrind.
-     */
-    ctx->ic = avformat_alloc_context();
-    if (ctx->ic == NULL) {
-        fingersum_free(ctx);
-        errno = ENOMEM;
-        return (NULL);
+    p = NULL;
+    if (path != NULL) {
+        if (store_mkdir(path) != 0 || (p = strdup(path)) == NULL) {
+            pthread_mutex_unlock(&_mutex);
+            return (-1);
+        }
     }
-    buffer = av_malloc(4 * 1024);
+
+    if (_cache_path != NULL)
+        free(_cache_path);
+    _cache_path = p;
+    _cache_flags = flags;
+
+    if (pthread_mutex_unlock(&_mutex) != 0)
+        return (-1);
+    return (0);
+}
+
+
+/* The _cache_key() function fills in @p key with the identity of the
+ * file backing @p stream.  The key is only valid if the cache is
+ * enabled and @p stream refers to a regular file.
+ */
+static void
+_cache_key(FILE *stream, struct _cache_key *key)
+{
+    struct stat sb;
+    unsigned char buf[64 * 1024];
+    ssize_t n;
+    off_t pos;
+    uLong crc;
+
+    memset(key, 0, sizeof(struct _cache_key));
+    if (_cache_path == NULL)
+        return;
+    if (fstat(fileno(stream), &sb) != 0 || !S_ISREG(sb.st_mode))
+        return;
+
+    key->dev = sb.st_dev;
+    key->ino = sb.st_ino;
+    key->size = sb.st_size;
+#if defined(__APPLE__)
+    key->mtime_sec = sb.st_mtimespec.tv_sec;
+    key->mtime_nsec = sb.st_mtimespec.tv_nsec;
+#else
+    key->mtime_sec = sb.st_mtim.tv_sec;
+    key->mtime_nsec = sb.st_mtim.tv_nsec;
+#endif
+
+
+    /* Optionally, hash the contents of the file.  pread(2) leaves the
+     * file position of the stream alone.
+     */
+    if (_cache_flags & FINGERSUM_CACHE_HASH) {
+        crc = crc32(0, Z_NULL, 0);
+        for (pos = 0; ; pos += n) {
+            n = pread(fileno(stream), buf, sizeof(buf), pos);
+            if (n < 0)
+                return;
+            if (n == 0)
+                break;
+            crc = crc32(crc, buf, n);
+        }
+        key->hash = crc;
+        key->has_hash = 1;
+    }
+
+    key->valid = 1;
+}
+
+
+static char *
+_cache_record_path(const struct _cache_key *key)
+{
+    char *path;
+    size_t len;
+
+    len = strlen(_cache_path) + 1 + 2 * 16 + 1 + 1;
+    path = malloc(len);
+    if (path == NULL)
+        return (NULL);
+
+    snprintf(path, len, "%s/%016" PRIx64 "-%016" PRIx64,
+             _cache_path, key->dev, key->ino);
+    return (path);
+}
+
+
+static int
+_cache_read_u32(FILE *stream, uint32_t *buf, size_t nmemb)
+{
+    return (fread(buf, sizeof(uint32_t), nmemb, stream) == nmemb ? 0 : -1);
+}
+
+
+static int
+_cache_write_u32(FILE *stream, const uint32_t *buf, size_t nmemb)
+{
+    return (fwrite(buf, sizeof(uint32_t), nmemb, stream) == nmemb ? 0 : -1);
+}
+
+
+/* The _cache_load() function fills in the checksums, the fingerprint,
+ * and the retained samples of @p ctx from its record in the cache.
+ * The record must have been written with the current window of @p
+ * ctx.  On success, the stream is marked as completely processed.
+ * Offsets registered with @p ctx but missing from the record are kept
+ * as pending: their v1 checksums follow from the stored moments, and
+ * only their v2 checksums need the stream again; see
+ * _process_pending().  If there is no valid record, @p ctx is left
+ * untouched.
+ *
+ * @return 0 if successful, -1 otherwise
+ */
+static int
+_cache_load(struct fingersum_context *ctx)
+{
+    struct _cache_header header;
+    struct _fingersum_offset *offsets;
+    uint32_t *crc32_off, *samples, *samples_end, *sof, *sum;
+    FILE *stream;
+    char *fingerprint, *path;
+    size_t i, j, n;
+
+
+    path = _cache_record_path(&ctx->key);
+    if (path == NULL)
+        return (-1);
+    stream = fopen(path, "r");
+    free(path);
+    if (stream == NULL)
+        return (-1);
+
+    if (fread(&header, sizeof(header), 1, stream) != 1 ||
+        memcmp(header.magic, FINGERSUM_CACHE_MAGIC, 8) != 0 ||
+        header.version != FINGERSUM_CACHE_VERSION ||
+        header.byte_order != 0x01020304 ||
+        header.key.dev != ctx->key.dev ||
+        header.key.ino != ctx->key.ino ||
+        header.key.size != ctx->key.size ||
+        header.key.mtime_sec != ctx->key.mtime_sec ||
+        header.key.mtime_nsec != ctx->key.mtime_nsec ||
+        (ctx->key.has_hash != 0 && (header.key.has_hash == 0 ||
+                                    header.key.hash != ctx->key.hash)) ||
+        header.duration != ctx->duration ||
+        header.window != ctx->window) {
+        fclose(stream);
+        return (-1);
+    }
+
+
+    /* The tables that the record does not have are left unallocated,
+     * as they would be after processing the stream.
+     */
+    fingerprint = malloc(header.len_fingerprint + 1);
+    offsets = calloc(header.nmemb + ctx->nmemb,
+                     sizeof(struct _fingersum_offset));
+    samples = calloc(2 * 5 * 588 + 1, 2 * sizeof(int16_t));
+    samples_end = calloc(2 * 5 * 588 + 1, 2 * sizeof(int16_t));
+    sof = NULL;
+    sum = NULL;
+    if (header.has_sof != 0) {
+        sof = calloc(2 * ctx->window + 588 + 1, sizeof(uint32_t));
+        sum = calloc(2 * ctx->window + 588 + 1, sizeof(uint32_t));
+    }
+    crc32_off = NULL;
+    if (header.has_crc32_off != 0)
+        crc32_off = calloc(2 * 5 * 588 + 1, sizeof(uint32_t));
+    if (fingerprint == NULL ||
+        (offsets == NULL && header.nmemb + ctx->nmemb > 0) ||
+        samples == NULL ||
+        samples_end == NULL ||
+        (header.has_sof != 0 && (sof == NULL || sum == NULL)) ||
+        (header.has_crc32_off != 0 && crc32_off == NULL) ||
+        fread(fingerprint, 1, header.len_fingerprint, stream) !=
+        header.len_fingerprint ||
+        fread(offsets, sizeof(struct _fingersum_offset), header.nmemb,
+              stream) != header.nmemb ||
+        (sof != NULL &&
+         (_cache_read_u32(stream, sof, 2 * ctx->window + 588 + 1) != 0 ||
+          _cache_read_u32(stream, sum, 2 * ctx->window + 588 + 1) != 0)) ||
+        (crc32_off != NULL &&
+         _cache_read_u32(stream, crc32_off, 2 * 5 * 588 + 1) != 0) ||
+        _cache_read_u32(stream, samples, 2 * 5 * 588 + 1) != 0 ||
+        _cache_read_u32(stream, samples_end, 2 * 5 * 588 + 1) != 0) {
+        if (fingerprint != NULL)
+            free(fingerprint);
+        if (offsets != NULL)
+            free(offsets);
+        if (samples != NULL)
+            free(samples);
+        if (samples_end != NULL)
+            free(samples_end);
+        if (sof != NULL)
+            free(sof);
+        if (sum != NULL)
+            free(sum);
+        if (crc32_off != NULL)
+            free(crc32_off);
+        fclose(stream);
+        return (-1);
+    }
+    fclose(stream);
+    fingerprint[header.len_fingerprint] = '\0';
+
+
+    /* Commit the record to the context.
+     */
+    if (ctx->sof != NULL)
+        free(ctx->sof);
+    ctx->sof = sof;
+    if (ctx->sum != NULL)
+        free(ctx->sum);
+    ctx->sum = sum;
+    if (ctx->crc32_off != NULL)
+        free(ctx->crc32_off);
+    ctx->crc32_off = crc32_off;
+    for (i = 0; i < 3; i++)
+        ctx->crc32[i] = header.crc32[i];
+    ctx->crc32_skip_zero = header.crc32_skip_zero;
+    ctx->mid_sof = header.mid_sof;
+    ctx->mid_sum = header.mid_sum;
+
+    n = header.nmemb;
+    for (i = 0; i < ctx->nmemb; i++) {
+        for (j = 0; j < header.nmemb; j++) {
+            if (offsets[j].offset == ctx->offsets[i].offset)
+                break;
+        }
+        if (j == header.nmemb) {
+            offsets[n].offset = ctx->offsets[i].offset;
+            offsets[n].hi = 0;
+            offsets[n].pending = 1;
+            n++;
+        }
+    }
+    if (ctx->offsets != NULL)
+        free(ctx->offsets);
+    ctx->offsets = offsets;
+    ctx->nmemb = n;
+
+    if (ctx->samples != NULL)
+        free(ctx->samples);
+    ctx->samples = samples;
+    if (ctx->samples_end != NULL)
+        free(ctx->samples_end);
+    ctx->samples_end = samples_end;
+
+    if (ctx->fingerprint != NULL) {
+        if (ctx->cached != 0)
+            free(ctx->fingerprint);
+        else
+            chromaprint_dealloc(ctx->fingerprint);
+    }
+    ctx->fingerprint = fingerprint;
+    ctx->cached = 1;
+    ctx->remaining = 0;
+    ctx->samples_tot = 2 * ctx->duration;
+
+    return (0);
+}
+
+
+/* The _cache_store() function writes the record for the completely
+ * processed stream in @p ctx to the cache.  Failure to write the
+ * record is not an error for the caller.
+ *
+ * @return 0 if successful, -1 otherwise
+ */
+static int
+_cache_store(const struct fingersum_context *ctx)
+{
+    struct _cache_header header;
+    FILE *stream;
+    char *path, *tmp;
+    size_t i, len_sof;
+    int ret;
+
+
+    if (ctx->key.valid == 0 ||
+        ctx->fingerprint == NULL ||
+        ctx->samples == NULL ||
+        ctx->samples_end == NULL) {
+        return (-1);
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, FINGERSUM_CACHE_MAGIC, 8);
+    header.version = FINGERSUM_CACHE_VERSION;
+    header.byte_order = 0x01020304;
+    header.key = ctx->key;
+    header.duration = ctx->duration;
+    header.len_fingerprint = strlen(ctx->fingerprint);
+    header.nmemb = ctx->nmemb;
+    header.mid_sof = ctx->mid_sof;
+    header.mid_sum = ctx->mid_sum;
+    for (i = 0; i < 3; i++)
+        header.crc32[i] = ctx->crc32[i];
+    header.crc32_skip_zero = ctx->crc32_skip_zero;
+    header.window = ctx->window;
+    len_sof = 2 * ctx->window + 588 + 1;
+    header.has_sof = ctx->sof != NULL ? 1 : 0;
+    header.has_crc32_off = ctx->crc32_off != NULL ? 1 : 0;
+
+    path = _cache_record_path(&ctx->key);
+    if (path == NULL)
+        return (-1);
+    stream = store_create(path, &tmp);
+    if (stream == NULL) {
+        free(path);
+        return (-1);
+    }
+
+    ret = 0;
+    if (fwrite(&header, sizeof(header), 1, stream) != 1 ||
+        fwrite(ctx->fingerprint, 1, header.len_fingerprint, stream) !=
+        header.len_fingerprint ||
+        fwrite(ctx->offsets, sizeof(struct _fingersum_offset), ctx->nmemb,
+               stream) != ctx->nmemb ||
+        (ctx->sof != NULL &&
+         (_cache_write_u32(stream, ctx->sof, len_sof) != 0 ||
+          _cache_write_u32(stream, ctx->sum, len_sof) != 0)) ||
+        (ctx->crc32_off != NULL &&
+         _cache_write_u32(stream, ctx->crc32_off, 2 * 5 * 588 + 1) != 0) ||
+        _cache_write_u32(stream, ctx->samples, 2 * 5 * 588 + 1) != 0 ||
+        _cache_write_u32(stream, ctx->samples_end, 2 * 5 * 588 + 1) != 0) {
+        ret = -1;
+    }
+    ret = store_commit(stream, tmp, path, ret);
+    free(path);
+    return (ret);
+}
+
+
+/* The _open() function opens the input context and the decoder of
+ * @p ctx on the stream in ctx->file, from its current position.  On
+ * failure, the members that were set up must be released by the
+ * caller.
+ *
+ * @return 0 if successful, -1 otherwise.  If an error occurs, the
+ *         global variable @c errno is set to indicate the error.
+ */
+static int
+_open(struct fingersum_context *ctx)
+{
+    AVCodec *decoder;
+    AVDictionary *options;
+    AVDictionaryEntry *option;
+    void *buffer;
+    int64_t channel_layout;
+    int stream_index;
+
+
+    /* Open the data stream and return with EPROTONOSUPPORT in case of
+     * failure.  This function will fail if Libav has not been
+     * initialised properly.
+     *
+     * XXX Buffer should be blocksize if fixed by protocol.  Otherwise
+     * a cache page (e.g. 4 kB).  A future project may be to measure
+     * performance as a function of blocksize on different platforms.
+     * Free with av_freep(), or will it be released by the other
+     * functions--check with Valgrind?  What's the Libav default?
+     *
+     * XXX Is ctx->ic->pb also automagically released?  Check with
+     * Valgrind.
+     */
+    ctx->ic = avformat_alloc_context();
+    if (ctx->ic == NULL) {
+        errno = ENOMEM;
+        return (-1);
+    }
+    buffer = av_malloc(4 * 1024);
     if (buffer == NULL) {
-        fingersum_free(ctx);
         errno = ENOMEM;
-        return (NULL);
+        return (-1);
     }
     ctx->ic->pb = avio_alloc_context(
-        buffer, 4 * 1024, 0, stream, _read, NULL, _seek);
+        buffer, 4 * 1024, 0, ctx->file, _read, NULL, _seek);
     if (ctx->ic->pb == NULL) {
-        av_freep(buffer);
-        fingersum_free(ctx);
+        av_freep(&buffer);
         errno = ENOMEM;
-        return (NULL);
+        return (-1);
     }
 
     options = NULL;
     if (av_dict_set(&options, "export_all", "1", 0) < 0) {
-        fingersum_free(ctx);
         errno = EPROTONOSUPPORT;
-        return (NULL);
+        return (-1);
     }
     if (avformat_open_input(&ctx->ic, NULL, NULL, &options) != 0) {
-        fingersum_free(ctx);
         errno = EPROTONOSUPPORT;
-        return (NULL);
+        return (-1);
     }
     option = NULL;
     while (av_dict_get(options, "", option, AV_DICT_IGNORE_SUFFIX) != NULL) {
@@ -432,22 +1336,19 @@ fingersum_new(FILE *stream)
      * but that would lead to problems later on.
      */
     if (avformat_find_stream_info(ctx->ic, NULL) < 0) {
-        fingersum_free(ctx);
         errno = ENOMSG;
-        return (NULL);
+        return (-1);
     }
 
     stream_index = av_find_best_stream(
         ctx->ic, AVMEDIA_TYPE_AUDIO, -1, -1, &decoder, 0);
     if (stream_index < 0) {
-        fingersum_free(ctx);
         errno = ENOMSG;
-        return (NULL);
+        return (-1);
     }
     if (decoder == NULL) {
-        fingersum_free(ctx);
         errno = ENOTSUP;
-        return (NULL);
+        return (-1);
     }
     ctx->stream = ctx->ic->streams[stream_index];
 
@@ -455,9 +1356,8 @@ fingersum_new(FILE *stream)
         ctx->stream->duration <= 0 ||
         ctx->stream->time_base.den <= 0 ||
         ctx->stream->time_base.num <= 0) {
-        fingersum_free(ctx);
         errno = ENOMSG;
-        return (NULL);
+        return (-1);
     }
 
 
@@ -468,36 +1368,28 @@ fingersum_new(FILE *stream)
     ctx->avcc = avcodec_alloc_context3(decoder);
     if (ctx->avcc == NULL) {
         errno = ENOMEM;
-        return (NULL);
+        return (-1);
     }
     if (avcodec_parameters_to_context(ctx->avcc, ctx->stream->codecpar) != 0) {
         errno = EPROTO;
-        return (NULL);
+        return (-1);
     }
     ctx->avcc->request_sample_fmt = AV_SAMPLE_FMT_S16;
-    if (pthread_mutex_lock(&_mutex) != 0) {
-        fingersum_free(ctx);
-        return (NULL);
-    }
+    if (pthread_mutex_lock(&_mutex) != 0)
+        return (-1);
     if (avcodec_open2(ctx->avcc, decoder, NULL) < 0) {
-        fingersum_free(ctx);
         pthread_mutex_unlock(&_mutex);
         errno = EPROTO;
-        return (NULL);
-    }
-    if (pthread_mutex_unlock(&_mutex) != 0) {
-        fingersum_free(ctx);
-        return (NULL);
+        return (-1);
     }
+    if (pthread_mutex_unlock(&_mutex) != 0)
+        return (-1);
 
-    printf("Have %d channels at %d\n",
-           ctx->avcc->channels, ctx->avcc->sample_rate);
     if (ctx->avcc->channels < 1 ||
         ctx->avcc->channels > 2 ||
         ctx->avcc->sample_rate <= 0) {
-        fingersum_free(ctx);
         errno = EPROTO;
-        return (NULL);
+        return (-1);
     }
 
 
@@ -513,9 +1405,8 @@ fingersum_new(FILE *stream)
 
         ctx->swr_ctx = swr_alloc();
         if (ctx->swr_ctx == NULL) {
-            fingersum_free(ctx);
             errno = ENOMEM;
-            return (NULL);
+            return (-1);
         }
 
         av_opt_set_int(
@@ -533,9 +1424,8 @@ fingersum_new(FILE *stream)
             ctx->swr_ctx, "out_sample_rate", ctx->avcc->sample_rate, 0);
 
         if (swr_init(ctx->swr_ctx) < 0) {
-            fingersum_free(ctx);
             errno = EPROTONOSUPPORT;
-            return (NULL);
+            return (-1);
         }
     }
 
@@ -544,10 +1434,111 @@ fingersum_new(FILE *stream)
      */
     ctx->frame = av_frame_alloc(); // avcodec_alloc_frame();
     if (ctx->frame == NULL) {
-        fingersum_free(ctx);
         errno = ENOMEM;
+        return (-1);
+    }
+
+    return (0);
+}
+
+
+/* The _close() function releases the input context, the decoder, the
+ * resampler and the frame of @p ctx, but none of the results.  It is
+ * not used for the tracks of an image, which share the input context
+ * and the decoder of the image.
+ */
+static void
+_close(struct fingersum_context *ctx)
+{
+    AVIOContext *pb;
+
+
+    if (ctx->frame != NULL)
+        av_frame_free(&ctx->frame);
+
+    if (ctx->swr_ctx != NULL)
+        swr_free(&ctx->swr_ctx);
+
+    if (ctx->avcc != NULL)
+        avcodec_free_context(&ctx->avcc);
+
+
+    /* The I/O context was supplied by _open(), so it is not released
+     * along with the input context.
+     */
+    if (ctx->ic != NULL) {
+        pb = ctx->ic->pb;
+        avformat_close_input(&ctx->ic);
+        if (pb != NULL) {
+            av_freep(&pb->buffer);
+            av_freep(&pb);
+        }
+    }
+    ctx->stream = NULL;
+}
+
+
+/* The _new() function does the work of fingersum_new().  Unless @p
+ * cache is non-zero, the persistent cache is neither consulted nor
+ * updated for the new context.
+ */
+static struct fingersum_context *
+_new(FILE *stream, int cache)
+{
+    struct fingersum_context *ctx;
+    int ret;
+
+
+    /* Initialise the module, allocate the fingersum context and
+     * initialise it such that fingersum_free() can be called at any
+     * time from now.
+     */
+    if (_init() != 0)
+        return (NULL);
+
+    ctx = malloc(sizeof(struct fingersum_context));
+    if (ctx == NULL)
+        return (NULL);
+
+    ctx->swr_ctx = NULL;
+    ctx->avcc = NULL;
+    ctx->ic = NULL;
+    ctx->cc = NULL;
+    ctx->cc_started = NULL;
+    ctx->frame = NULL;
+    ctx->fingerprint = NULL;
+    ctx->cached = 0;
+    ctx->offsets = NULL;
+    ctx->samples = NULL;
+    ctx->samples_end = NULL;
+    ctx->sof = NULL;
+    ctx->sum = NULL;
+    ctx->crc32_off = NULL;
+    ctx->crc32_pre = NULL;
+    ctx->tail = 0;
+    ctx->image = NULL;
+    ctx->metadata = NULL;
+    ctx->path = NULL;
+
+
+    /* Open the stream and its decoder.  The duration and the time
+     * base are kept, because they outlive the input context if the
+     * context is parked.
+     */
+    ctx->file = stream;
+    if (_open(ctx) != 0) {
+        ret = errno;
+        _close(ctx);
+        fingersum_free(ctx);
+        errno = ret;
         return (NULL);
     }
+    ctx->duration = ctx->stream->duration;
+    ctx->time_base = ctx->stream->time_base;
+    ctx->channels = ctx->avcc->channels;
+    ctx->sample_rate = ctx->avcc->sample_rate;
+
+    printf("Have %d channels at %d\n", ctx->channels, ctx->sample_rate);
 
 
     /* Initialise the rest of the structure for bookkeeping.
@@ -558,8 +1549,7 @@ fingersum_new(FILE *stream)
 //    ctx->checksum_v2[0] = 0;
 //    ctx->checksum_v2[1] = 0;
 //    ctx->checksum_v2[2] = 0;
-    ctx->remaining =
-        CHROMAPRINT_LEN * ctx->avcc->channels * ctx->avcc->sample_rate;
+    ctx->remaining = CHROMAPRINT_LEN * ctx->channels * ctx->sample_rate;
     ctx->samples_tot = 0;
 
 
@@ -598,13 +1588,13 @@ fingersum_new(FILE *stream)
 //        ctx->prutt_3 = 0;
 //        ctx->prutt_4 = 0;
 
-        for (i = 0; i < 2 * MAX_OFFSET_2 + 588 + 1; i++) {
-            ctx->sof[i] = 0;
-            ctx->sum[i] = 0;
-        }
+        ctx->window = MAX_OFFSET_2;
 
-        for (i = 0; i < 2 * 5 * 588 + 1; i++)
-            ctx->crc32_off[i] = crc32(0, Z_NULL, 0);
+        ctx->mid_sof = 0;
+        ctx->mid_sum = 0;
+        for (i = 0; i < 3; i++)
+            ctx->crc32[i] = crc32(0, Z_NULL, 0);
+        ctx->crc32_skip_zero = crc32(0, Z_NULL, 0);
 
         ctx->offsets = NULL;
         ctx->nmemb = 0;
@@ -613,6 +1603,18 @@ fingersum_new(FILE *stream)
         ctx->max_offset = 0;
     }
 
+
+    /* If the stream has been processed before, and the file has not
+     * changed since, pick up the results from the cache.  A missing
+     * or stale record is not an error.
+     */
+    if (cache != 0)
+        _cache_key(stream, &ctx->key);
+    else
+        memset(&ctx->key, 0, sizeof(ctx->key));
+    if (ctx->key.valid != 0)
+        _cache_load(ctx);
+
 //    struct fp3_ar *foo;
 //    printf("sizeof() = %zd, sizeof() = %zd\n",
 //           sizeof(struct fingersum_checksum),
@@ -622,32 +1624,288 @@ fingersum_new(FILE *stream)
 }
 
 
-/* Ignore any pthread-related errors, because there is nothing that
- * can be done about them here.  Note that chromaprint_free() is not
- * thread-safe if Chromaprint was compiled with FFTW.
- */
-void
-fingersum_free(struct fingersum_context *ctx)
+struct fingersum_context *
+fingersum_new(FILE *stream)
 {
-    if (ctx == NULL)
-        return;
-
-    if (ctx->fingerprint != NULL)
-        chromaprint_dealloc(ctx->fingerprint);
+    return (_new(stream, 1));
+}
 
-    if (ctx->cc != NULL && pthread_mutex_lock(&_mutex) == 0) {
-        chromaprint_free(ctx->cc);
-        pthread_mutex_unlock(&_mutex);
-    }
 
-    if (ctx->frame != NULL)
+struct fingersum_context *
+fingersum_open(const char *path)
+{
+    struct fingersum_context *ctx;
+    FILE *stream;
+    int ret;
+
+
+    stream = fopen(path, "r");
+    if (stream == NULL)
+        return (NULL);
+
+    ctx = _new(stream, 1);
+    if (ctx == NULL) {
+        ret = errno;
+        fclose(stream);
+        errno = ret;
+        return (NULL);
+    }
+
+    ctx->path = strdup(path);
+    if (ctx->path == NULL) {
+        ret = errno;
+        fingersum_free(ctx);
+        fclose(stream);
+        errno = ret;
+        return (NULL);
+    }
+
+    return (ctx);
+}
+
+
+/* The _image_release() function detaches the track pointed to by @p
+ * ctx from its image, and releases the image if no other tracks
+ * remain.  The stream of the image is left open.
+ */
+static void
+_image_release(struct _image *image, struct fingersum_context *ctx)
+{
+    size_t i, refs;
+
+    pthread_mutex_lock(&image->mutex);
+    for (i = 0; i < image->nmemb; i++) {
+        if (image->tracks[i] == ctx)
+            image->tracks[i] = NULL;
+    }
+    refs = --image->refs;
+    pthread_mutex_unlock(&image->mutex);
+
+    if (refs > 0)
+        return;
+
+    fingersum_free(image->ctx);
+    pthread_mutex_destroy(&image->mutex);
+    free(image->tracks);
+    free(image->starts);
+    free(image);
+}
+
+
+/* The image is opened like any other stream, except that it is not
+ * cached: the records of the cache describe files rather than tracks.
+ * The tracks start out as copies of the pristine context of the
+ * image, less everything that is owned by it.  CUE sheets index the
+ * image in sectors of 1/75:th of a second.
+ */
+int
+fingersum_new_image(FILE *stream,
+                    const long int *offsets,
+                    size_t nmemb,
+                    struct fingersum_context **ctxs)
+{
+    char buf[32];
+    struct _image *image;
+    struct fingersum_context *ctx, *track;
+    size_t i;
+
+
+    if (nmemb == 0) {
+        errno = EINVAL;
+        return (-1);
+    }
+
+    ctx = _new(stream, 0);
+    if (ctx == NULL)
+        return (-1);
+    if (ctx->avcc->channels != 2) {
+        fingersum_free(ctx);
+        errno = ENOMSG;
+        return (-1);
+    }
+
+    image = malloc(sizeof(struct _image));
+    if (image == NULL) {
+        fingersum_free(ctx);
+        return (-1);
+    }
+    image->tracks = calloc(nmemb, sizeof(struct fingersum_context *));
+    image->starts = calloc(nmemb + 1, sizeof(int64_t));
+    if (image->tracks == NULL || image->starts == NULL) {
+        fingersum_free(ctx);
+        free(image->tracks);
+        free(image->starts);
+        free(image);
+        return (-1);
+    }
+
+
+    /* The tracks must start in order within the image, and none of
+     * them may be empty.
+     */
+    for (i = 0; i < nmemb; i++)
+        image->starts[i] = offsets[i] * ctx->avcc->sample_rate / 75;
+    image->starts[nmemb] = ctx->duration;
+    for (i = 0; i < nmemb; i++) {
+        if (image->starts[i] < 0 ||
+            image->starts[i] >= image->starts[i + 1]) {
+            fingersum_free(ctx);
+            free(image->tracks);
+            free(image->starts);
+            free(image);
+            errno = EINVAL;
+            return (-1);
+        }
+    }
+
+    if (pthread_mutex_init(&image->mutex, NULL) != 0) {
+        fingersum_free(ctx);
+        free(image->tracks);
+        free(image->starts);
+        free(image);
+        return (-1);
+    }
+    image->ctx = ctx;
+    image->nmemb = nmemb;
+    image->refs = 0;
+    image->pos = 0;
+    image->done = 0;
+
+
+    /* Each track inherits the metadata of the image, such as the
+     * album and the album artist, along with its position.  The
+     * caller may override the rest with fingersum_set_metadata().
+     */
+    for (i = 0; i < nmemb; i++) {
+        track = malloc(sizeof(struct fingersum_context));
+        if (track == NULL)
+            break;
+
+        memcpy(track, ctx, sizeof(struct fingersum_context));
+        track->swr_ctx = NULL;
+        track->frame = NULL;
+        track->cc = NULL;
+        track->cc_started = NULL;
+        track->offsets = NULL;
+        track->nmemb = 0;
+        track->samples = NULL;
+        track->samples_end = NULL;
+        track->sof = NULL;
+        track->sum = NULL;
+        track->crc32_off = NULL;
+        track->crc32_pre = NULL;
+        track->duration = image->starts[i + 1] - image->starts[i];
+        track->image = image;
+        track->metadata = NULL;
+
+        image->tracks[i] = track;
+        image->refs++;
+
+        snprintf(buf, sizeof(buf), "%zd", i + 1);
+        if (av_dict_copy(&track->metadata, ctx->ic->metadata, 0) < 0 ||
+            av_dict_set(&track->metadata, "track", buf, 0) < 0) {
+            errno = ENOMEM;
+            break;
+        }
+        ctxs[i] = track;
+    }
+
+    /* The image goes with the last of the tracks that were created.
+     */
+    if (i < nmemb) {
+        i = image->refs;
+        if (i == 0) {
+            fingersum_free(ctx);
+            pthread_mutex_destroy(&image->mutex);
+            free(image->tracks);
+            free(image->starts);
+            free(image);
+        }
+        while (i > 0)
+            fingersum_free(image->tracks[--i]);
+        return (-1);
+    }
+
+    return (0);
+}
+
+
+/* The _metadata() function returns the tags of @p ctx: the overridden
+ * ones if there are any, otherwise those of the stream.  A parked
+ * context without overrides had no tags to begin with.
+ */
+static AVDictionary *
+_metadata(const struct fingersum_context *ctx)
+{
+    if (ctx->metadata != NULL)
+        return (ctx->metadata);
+    if (ctx->ic != NULL)
+        return (ctx->ic->metadata);
+    return (NULL);
+}
+
+
+int
+fingersum_set_metadata(struct fingersum_context *ctx,
+                       const char *key,
+                       const char *value)
+{
+    if (ctx->metadata == NULL &&
+        av_dict_copy(&ctx->metadata, _metadata(ctx), 0) < 0) {
+        errno = ENOMEM;
+        return (-1);
+    }
+
+    if (av_dict_set(&ctx->metadata, key, value, 0) < 0) {
+        errno = ENOMEM;
+        return (-1);
+    }
+
+    return (0);
+}
+
+
+/* Ignore any pthread-related errors, because there is nothing that
+ * can be done about them here.  Note that chromaprint_free() is not
+ * thread-safe if Chromaprint was compiled with FFTW.
+ */
+void
+fingersum_free(struct fingersum_context *ctx)
+{
+    if (ctx == NULL)
+        return;
+
+    if (ctx->fingerprint != NULL) {
+        if (ctx->cached != 0)
+            free(ctx->fingerprint);
+        else
+            chromaprint_dealloc(ctx->fingerprint);
+    }
+
+    if (ctx->cc != NULL && pthread_mutex_lock(&_mutex) == 0) {
+        chromaprint_free(ctx->cc);
+        pthread_mutex_unlock(&_mutex);
+    }
+
+    if (ctx->frame != NULL)
         av_frame_free(&ctx->frame); // avcodec_free_frame(&ctx->frame);
 
     if (ctx->swr_ctx != NULL)
         swr_free(&ctx->swr_ctx);
 
-    if (ctx->ic != NULL)
-        avformat_close_input(&ctx->ic);
+    if (ctx->image != NULL)
+        _image_release(ctx->image, ctx);
+    else
+        _close(ctx);
+
+    if (ctx->metadata != NULL)
+        av_dict_free(&ctx->metadata);
+
+    if (ctx->path != NULL) {
+        if (ctx->file != NULL)
+            fclose(ctx->file);
+        free(ctx->path);
+    }
 
 
     /* XXX PLAYGROUND! */
@@ -660,20 +1918,104 @@ fingersum_free(struct fingersum_context *ctx)
 
         if (ctx->samples_end != NULL)
             free(ctx->samples_end);
+
+        if (ctx->sof != NULL)
+            free(ctx->sof);
+
+        if (ctx->sum != NULL)
+            free(ctx->sum);
+
+        if (ctx->crc32_off != NULL)
+            free(ctx->crc32_off);
+
+        if (ctx->crc32_pre != NULL)
+            free(ctx->crc32_pre);
     }
 
     free(ctx);
 }
 
 
-/* XXX PLAYGROUND! */
+/* The _rewind() function restarts the accumulation of the checksums
+ * for all offsets, not just the one that was added, once the stream
+ * has been rewound.  An unfinished fingerprint is restarted as well.
+ */
+static void
+_rewind(struct fingersum_context *ctx)
+{
+    size_t i;
+
+    if (ctx->fingerprint == NULL)
+        ctx->remaining = CHROMAPRINT_LEN * ctx->channels * ctx->sample_rate;
+
+    for (i = 0; i < ctx->nmemb; i++) {
+        ctx->offsets[i].hi = 0;
+        ctx->offsets[i].pending = 0;
+    }
+    ctx->mid_sof = 0;
+    ctx->mid_sum = 0;
+#ifdef USE_CRC32 // XXX WIP
+    for (i = 0; i < 3; i++)
+        ctx->crc32[i] = crc32(0, Z_NULL, 0);
+    ctx->crc32_skip_zero = crc32(0, Z_NULL, 0);
+#endif
+
+    ctx->samples_tot = 0;
+}
+
 
-/* This should probably rewind (reset the file position); whenever the
- * list of offsets changes, the checksums must be restarted.  Only add
- * the offset if it is not already in the list.
+/* The _restart() function rewinds the stream of @p ctx such that its
+ * checksums are accumulated anew the next time data is needed.  For a
+ * track of an image, the caller must hold the mutex of the image.
+ *
+ * @return 0 if successful, -1 otherwise
  */
-int
-fingersum_add_offset(struct fingersum_context *ctx, int32_t offset)
+static int
+_restart(struct fingersum_context *ctx)
+{
+    /* The image is shared with the other tracks, so a track of an
+     * image is not rewound here.  Instead, the image is decoded again
+     * for the tracks that are incomplete the next time data is
+     * needed.
+     */
+    if (ctx->image != NULL) {
+        _rewind(ctx);
+        ctx->image->done = 0;
+        return (0);
+    }
+
+
+    /* A parked stream is read from the start anyway once it is
+     * reopened.
+     */
+    if (ctx->ic == NULL) {
+        _rewind(ctx);
+        return (0);
+    }
+
+
+    /* XXX Check the documentation of this one!
+     */
+    if (av_seek_frame(ctx->ic, ctx->stream->index, 0, 0) < 0)
+        return (-1);
+    _rewind(ctx);
+
+    return (0);
+}
+
+
+/* The _add_offset() function registers @p offset for the v2
+ * checksum, unless it is already in the list.  The stream is not
+ * rewound: the v1 checksum is derived for any offset from the moments
+ * and the boundary samples, and only the high words of the v2
+ * products need the samples of the middle region at this offset.  If
+ * some of those have already been fed, the offset is marked pending,
+ * and fingersum_get_result_3() processes the stream again once, for
+ * all pending offsets together.  For a track of an image, the caller
+ * must hold the mutex of the image.
+ */
+static int
+_add_offset(struct fingersum_context *ctx, int32_t offset)
 {
     void *p;
     size_t i;
@@ -696,105 +2038,262 @@ fingersum_add_offset(struct fingersum_context *ctx, int32_t offset)
     ctx->offsets = p;
     ctx->offsets[ctx->nmemb].offset = offset;
 
-    ctx->offsets[ctx->nmemb].checksum_v1[0] = 0;
-    ctx->offsets[ctx->nmemb].checksum_v1[1] = 0;
-    ctx->offsets[ctx->nmemb].checksum_v1[2] = 0;
-
-    ctx->offsets[ctx->nmemb].checksum_v2[0] = 0;
-    ctx->offsets[ctx->nmemb].checksum_v2[1] = 0;
-    ctx->offsets[ctx->nmemb].checksum_v2[2] = 0;
-
-#ifdef USE_CRC32 // XXX WIP
-    ctx->offsets[ctx->nmemb].crc32[0] = crc32(0, Z_NULL, 0);
-    ctx->offsets[ctx->nmemb].crc32[1] = crc32(0, Z_NULL, 0);
-    ctx->offsets[ctx->nmemb].crc32[2] = crc32(0, Z_NULL, 0);
-
-    ctx->offsets[ctx->nmemb].crc32_skip_zero = crc32(0, Z_NULL, 0);
-#endif
+    ctx->offsets[ctx->nmemb].hi = 0;
+    ctx->offsets[ctx->nmemb].pending =
+        ctx->samples_tot / 2 > 2 * 5 * 588 + 1 ? 1 : 0;
 
     ctx->nmemb += 1;
 
 //    printf("post-add dump:\n");
 //    fingersum_dump(ctx);
 
+    return (0);
+}
+
 
-    /* XXX Check the documentation of this one!
-     */
-    if (av_seek_frame(ctx->ic, ctx->stream->index, 0, 0) < 0)
-        return (-1);
+/* The offsets of a track of an image must not change while the image
+ * is being decoded.
+ */
+int
+fingersum_add_offset(struct fingersum_context *ctx, int32_t offset)
+{
+    int ret;
 
-    ctx->samples_tot = 0;
+    if (ctx->image == NULL)
+        return (_add_offset(ctx, offset));
 
-    return (0);
+    if (pthread_mutex_lock(&ctx->image->mutex) != 0)
+        return (-1);
+    ret = _add_offset(ctx, offset);
+    pthread_mutex_unlock(&ctx->image->mutex);
+
+    return (ret);
 }
 
 
-/* The _decode_frame() function extracts the next frame from the
- * fingersum context pointed to by @p ctx and returns a pointer to the
- * decoded interleaved, signed 16-bit samples in @p *data.  If no
- * resampling is required @p *data will be freed if non-NULL on entry
- * and set to point to a buffer internal to Libav on return.  If
- * resampling is required, _decode_frame() must be called with @p
- * *data pointing to a buffer of size @p *size allocated by the
- * caller.  If @p *data is @c NULL or not big enough to accommodate
- * the decoded frame, it will be reallocated inside _decode_frame().
- *
- * @param data Double pointer to interleaved, signed 16-bit samples.
- *             If the buffer was allocated within _decode_frame() @p
- *             *data will be non-Null on successful return and must be
- *             freed with av_freep().  XXX IS THIS INPUT OR OUTPUT?
- * @param size Size of @p *data buffer or 0 if @p *data points to a
- *             buffer internal to Libav.  If the buffer was allocated
- *             within _decode_frame(), @p *size will be >0 on
- *             successful return, and @p *data may subsequently be
- *             used as an argument to the function av_freep().
- * @return     The total number of decoded samples, or 0 when the end
- *             of the stream has been reached.  The function returns
- *             -1 in case of failure and sets @c errno to @c ENOMEM
- *             and @c EPROTO in the case of memory exhaustion and
- *             audio decoding errors, respectively.  XXX CHANNEL BUSINESS HERE!  It returns the number of "mono samples", but it would probably be more convenient if it returned the number of samples without taking the number of channels into account.
+/* Ignore any pthread-related errors, as in fingersum_free().  The
+ * Chromaprint context goes too: an unfinished fingerprint is
+ * restarted from the beginning of the stream along with everything
+ * else.
  */
-static int
-_decode_frame(struct fingersum_context *ctx, uint8_t **data, int *size)
+int
+fingersum_park(struct fingersum_context *ctx)
 {
-    AVPacket packet;
-    int linesize;
+    if (ctx->image != NULL || ctx->ic == NULL)
+        return (0);
 
 
-    /* Get the next packet from the appropriate stream and decode it.
+    /* The tags of the stream are needed after the input context is
+     * gone.
      */
-gimme_another:
-//    printf("HATTNE entering _decode_frame() #0\n");
-    for ( ; ; ) {
-        if (av_read_frame(ctx->ic, &packet) < 0)
-            return (0);
-        if (packet.stream_index == ctx->stream->index) {
-            if (avcodec_send_packet(ctx->avcc, &packet) != 0) {
-                av_packet_unref(&packet);
-                errno = EPROTO;
-                return (-1);
-            }
-            av_packet_unref(&packet);
-            break;
-        }
-        av_packet_unref(&packet);
+    if (ctx->metadata == NULL &&
+        av_dict_copy(&ctx->metadata, ctx->ic->metadata, 0) < 0) {
+        errno = ENOMEM;
+        return (-1);
     }
 
-//    printf("HATTNE entering _decode_frame() #1\n");
-    int ret = avcodec_receive_frame(ctx->avcc, ctx->frame);
-    if (ret == AVERROR(EAGAIN))
-        goto gimme_another;
-    if (ret != 0) {
-        printf("avcodec_recieve_frame() said %d vs %d: '%s'\n", ret, AVERROR(EAGAIN), av_err2str(ret));
-        errno = EPROTO;
-        return (-1);
+    if (ctx->cc != NULL && pthread_mutex_lock(&_mutex) == 0) {
+        chromaprint_free(ctx->cc);
+        ctx->cc = NULL;
+        pthread_mutex_unlock(&_mutex);
     }
+    ctx->cc_started = NULL;
 
+    if (ctx->crc32_pre != NULL) {
+        free(ctx->crc32_pre);
+        ctx->crc32_pre = NULL;
+    }
 
-    /* If resampling is not required, release any externally allocated
-     * buffer and return a pointer to the frame's data.
+    _close(ctx);
+
+
+    /* A stream owned by the context does not hold on to a file
+     * descriptor while parked.
      */
-    if (ctx->swr_ctx == NULL) {
+    if (ctx->path != NULL) {
+        fclose(ctx->file);
+        ctx->file = NULL;
+    }
+
+    return (0);
+}
+
+
+/* The estimate covers the tables allocated in _start() for the
+ * duration and window of the stream, and a rough allowance for the
+ * demuxer, the decoder, the resampler, and the Chromaprint context.
+ */
+size_t
+fingersum_get_size(const struct fingersum_context *ctx)
+{
+    size_t size;
+
+    size = sizeof(struct fingersum_context) + FINGERSUM_DECODER_SIZE;
+    if (ctx->duration > 450 * 588 - (int64_t)ctx->window)
+        size += 2 * (2 * ctx->window + 588 + 1) * sizeof(uint32_t);
+#ifdef USE_CRC32 // XXX WIP
+    if (ctx->duration >= 501 * 588) {
+        size += (2 * 5 * 588 + 1) * sizeof(uint32_t);
+        size += (2 * 5 * 588 + 588 + 1) * sizeof(uint32_t);
+    }
+#endif
+    size += 2 * (2 * 5 * 588 + 1) * 2 * sizeof(int16_t);
+
+    return (size);
+}
+
+
+/* The _unpark() function reopens the input context and the decoder of
+ * @p ctx if it was parked.  The stream must be the one the context
+ * was created on, and it is opened again by path if the context owns
+ * it.  Since decoding resumes from the start of the stream, any
+ * partial results are restarted.
+ *
+ * @return 0 if successful, -1 otherwise.  If an error occurs, the
+ *         global variable @c errno is set to indicate the error.
+ */
+static int
+_unpark(struct fingersum_context *ctx)
+{
+    if (ctx->image != NULL || ctx->ic != NULL)
+        return (0);
+
+    if (ctx->file == NULL) {
+        ctx->file = fopen(ctx->path, "r");
+        if (ctx->file == NULL)
+            return (-1);
+    } else if (fseeko(ctx->file, 0, SEEK_SET) != 0) {
+        return (-1);
+    }
+    if (_open(ctx) != 0) {
+        _close(ctx);
+        return (-1);
+    }
+    if (ctx->stream->duration != ctx->duration ||
+        ctx->avcc->channels != ctx->channels ||
+        ctx->avcc->sample_rate != ctx->sample_rate) {
+        _close(ctx);
+        errno = ESTALE;
+        return (-1);
+    }
+
+    if (ctx->samples_tot > 0 && ctx->samples_tot < 2 * ctx->duration)
+        _rewind(ctx);
+
+    return (0);
+}
+
+
+/* The tables of the old window are discarded.  The cache is looked up
+ * again with the new window, because the record of the stream may
+ * have been written with it, and the stream is only decoded again if
+ * there is no such record and it has been processed already.
+ */
+int
+fingersum_set_offset_window(struct fingersum_context *ctx, size_t window)
+{
+    int ret;
+
+
+    if (window > MAX_WINDOW) {
+        errno = EINVAL;
+        return (-1);
+    }
+    if (window == ctx->window)
+        return (0);
+
+    if (ctx->image != NULL && pthread_mutex_lock(&ctx->image->mutex) != 0)
+        return (-1);
+
+    if (ctx->sof != NULL) {
+        free(ctx->sof);
+        ctx->sof = NULL;
+    }
+    if (ctx->sum != NULL) {
+        free(ctx->sum);
+        ctx->sum = NULL;
+    }
+    ctx->window = window;
+
+    ret = 0;
+    if ((ctx->key.valid == 0 || _cache_load(ctx) != 0) &&
+        ctx->samples_tot > 0) {
+        ret = _restart(ctx);
+    }
+
+    if (ctx->image != NULL)
+        pthread_mutex_unlock(&ctx->image->mutex);
+
+    return (ret);
+}
+
+
+/* The _decode_frame() function extracts the next frame from the
+ * fingersum context pointed to by @p ctx and returns a pointer to the
+ * decoded interleaved, signed 16-bit samples in @p *data.  If no
+ * resampling is required @p *data will be freed if non-NULL on entry
+ * and set to point to a buffer internal to Libav on return.  If
+ * resampling is required, _decode_frame() must be called with @p
+ * *data pointing to a buffer of size @p *size allocated by the
+ * caller.  If @p *data is @c NULL or not big enough to accommodate
+ * the decoded frame, it will be reallocated inside _decode_frame().
+ *
+ * @param data Double pointer to interleaved, signed 16-bit samples.
+ *             If the buffer was allocated within _decode_frame() @p
+ *             *data will be non-Null on successful return and must be
+ *             freed with av_freep().  XXX IS THIS INPUT OR OUTPUT?
+ * @param size Size of @p *data buffer or 0 if @p *data points to a
+ *             buffer internal to Libav.  If the buffer was allocated
+ *             within _decode_frame(), @p *size will be >0 on
+ *             successful return, and @p *data may subsequently be
+ *             used as an argument to the function av_freep().
+ * @return     The total number of decoded samples, or 0 when the end
+ *             of the stream has been reached.  The function returns
+ *             -1 in case of failure and sets @c errno to @c ENOMEM
+ *             and @c EPROTO in the case of memory exhaustion and
+ *             audio decoding errors, respectively.  XXX CHANNEL BUSINESS HERE!  It returns the number of "mono samples", but it would probably be more convenient if it returned the number of samples without taking the number of channels into account.
+ */
+static int
+_decode_frame(struct fingersum_context *ctx, uint8_t **data, int *size)
+{
+    AVPacket packet;
+    int linesize;
+
+
+    /* Get the next packet from the appropriate stream and decode it.
+     */
+gimme_another:
+//    printf("HATTNE entering _decode_frame() #0\n");
+    for ( ; ; ) {
+        if (av_read_frame(ctx->ic, &packet) < 0)
+            return (0);
+        if (packet.stream_index == ctx->stream->index) {
+            if (avcodec_send_packet(ctx->avcc, &packet) != 0) {
+                av_packet_unref(&packet);
+                errno = EPROTO;
+                return (-1);
+            }
+            av_packet_unref(&packet);
+            break;
+        }
+        av_packet_unref(&packet);
+    }
+
+//    printf("HATTNE entering _decode_frame() #1\n");
+    int ret = avcodec_receive_frame(ctx->avcc, ctx->frame);
+    if (ret == AVERROR(EAGAIN))
+        goto gimme_another;
+    if (ret != 0) {
+        printf("avcodec_recieve_frame() said %d vs %d: '%s'\n", ret, AVERROR(EAGAIN), av_err2str(ret));
+        errno = EPROTO;
+        return (-1);
+    }
+
+
+    /* If resampling is not required, release any externally allocated
+     * buffer and return a pointer to the frame's data.
+     */
+    if (ctx->swr_ctx == NULL) {
         /* XXX Note to self: flac files, both from morituri and XLD on
          * vindaloo, go here.
          */
@@ -836,6 +2335,37 @@ gimme_another:
 }
 
 
+/* The _feed_middle() function accumulates the contribution of @p n
+ * stereo samples from the middle region of the track to the
+ * AccurateRip checksums.  The offset-independent moments sum(v) and
+ * sum(j * v) suffice for the v1 checksum and for the low words of the
+ * v2 products, because sum((j - offset) * v) = sum(j * v) - offset *
+ * sum(v) modulo 2^32.  The high words of the v2 products, ((j -
+ * offset) * v) >> 32, do not decompose like that: whether the low
+ * word borrows from the high word depends on both the sample and the
+ * offset.  They are accumulated separately, but only for the offsets
+ * registered for the v2 checksum before the middle region was
+ * reached.  The work is done by the kernels selected in _init().
+ *
+ * @param ctx Pointer to an opaque fingersum context
+ * @param v   Pointer to @p n stereo samples
+ * @param j   One-based index of the first sample in @p v
+ * @param n   Number of stereo samples in @p v
+ */
+static void
+_feed_middle(
+    struct fingersum_context *ctx, const uint32_t *v, uint64_t j, size_t n)
+{
+    size_t m;
+
+    _moments(v, j, n, &ctx->mid_sof, &ctx->mid_sum);
+    for (m = 0; m < ctx->nmemb; m++) {
+        if (ctx->offsets[m].pending == 0)
+            ctx->offsets[m].hi += _hi(v, j - ctx->offsets[m].offset, n);
+    }
+}
+
+
 /* The _feed_checksum() function sends audio data to the AccurateRip
  * checksum calculator.  This function cannot fail.
  *
@@ -853,16 +2383,22 @@ gimme_another:
 static void
 _feed_checksum(struct fingersum_context *ctx, const void *data, int len)
 {
-    int i;
-    uint64_t j, p;
-    uint32_t s;
+    const uint32_t *frames;
+    int64_t f, first, i, i_mid, f_mid, n, w;
+    uint64_t k, u;
 
 
     /* Traverse the signed 16-bit data in 32-bit strides, i.e. one
-     * 2-channel stereo sample.  Accumulate separate sums for the
-     * first 5 sectors, the last five sectors, and everything in
-     * between.  Note that the last sample of the fifth sector is
-     * included in the last sum.
+     * 2-channel stereo sample.  The samples fall into three regions
+     * by their one-based index: the first (2 * 5 * 588 + 1) samples,
+     * the last (2 * 5 * 588 + 1) samples, and everything in between.
+     * The first and the last regions are retained verbatim in
+     * ctx->samples and ctx->samples_end by _process(), and their
+     * contributions to the checksums are calculated on demand for any
+     * offset in _ar_cksum_range().  Only the middle region is
+     * accumulated here, and apart from the high words of the v2
+     * products that accumulation does not depend on the number of
+     * offsets; see _feed_middle().
      *
      * XXX Will this still work on a big-endian machine?  May need to
      * extract the left and right channels separately.  And which one
@@ -870,12 +2406,10 @@ _feed_checksum(struct fingersum_context *ctx, const void *data, int len)
      * depends on the channel layout.  Will this break if the layout
      * is tweaked?
      *
-     * XXX Note that j is a one-based index here!
-     *
      * ctx->samples_tot is the number of mono samples seen so far (in
      * stereo, two for each time point), not counting the current
-     * block.  i loops over current block, j count total samples seen
-     * so far.
+     * block.  i indexes the current block, first is the one-based
+     * index of its first stereo sample in the track.
      *
      * For Pettson, XLD says:
      *
@@ -924,412 +2458,102 @@ _feed_checksum(struct fingersum_context *ctx, const void *data, int len)
      * Only seem to be getting one offset: for "Hedningarna", would
      * expect [-17, +664].
      *
-     * offset_array_1  data [MAX_OFFSET]
-     * offset_array_2  i * data [MAX_OFFSET]
-     *
-     * offset_test_1  sum(data)
-     * offset_test_2  sum(i * data)
-     *
-     * XXX Corner cases: what if track too short for there to be no
-     * mid section?  What if leader and trailer overlap?
-     *
-     * XXX What's the range for j in this loop?  I guess
-     * j=1..ctx->stream->duration?  That affects l in the inner loop
-     * (l=-ctx->offset[m].offset..ctx->stream->duration-ctx->offset[m].offset).
-     * 2018-12-10: confirm that l starts at 1.
+     * XXX Corner cases: what if leader and trailer overlap?
      */
-    for (i = 0, j = ctx->samples_tot / 2 + 1; i < len / 2; i++, j++) {
-        size_t m;
-        int64_t l;
-
-        for (m = 0; m < ctx->nmemb; m++) {
-            l = j - ctx->offsets[m].offset;
-//            p = j * ((uint32_t *)data)[i];
-            p = l * ((uint32_t *)data)[i];
-            s = ((p >> 32) + p); // & 0xffffffff;
+    frames = data;
+    n = len / 2;
+    first = ctx->samples_tot / 2 + 1;
 
-//            printf("ADDING TO OFFSET %ld\n", ctx->offsets[m].offset);
 
-/*
-            printf("while _feed_checksum %zd %lld %d 0x%08X 0x%08x\n", m, l, ctx->offsets[m].offset,
-                   p, // ctx->offsets[m].checksum_v1[2],
-                   s); // ctx->offsets[m].checksum_v2[2]);
-
-            printf("adding  _feed_checksum %zd %lld"
-                   "0x%08X 0x%08x "
-                   "0x%08X 0x%08x "
-                   "0x%08X 0x%08x\n", m, l,
-                   ctx->offsets[m].checksum_v1[0],
-                   ctx->offsets[m].checksum_v2[0],
-                   ctx->offsets[m].checksum_v1[1],
-                   ctx->offsets[m].checksum_v2[1],
-                   ctx->offsets[m].checksum_v1[2],
-                   ctx->offsets[m].checksum_v2[2]);
-*/
+    /* Determine the half-open range [i_mid, f_mid) of the middle
+     * region within the current block.  The middle region is empty
+     * for tracks shorter than 2 * (2 * 5 * 588 + 1) samples.
+     */
+    i_mid = (2 * 5 * 588 + 1) + 1 - first;
+    i_mid = i_mid < 0 ? 0 : (i_mid > n ? n : i_mid);
+    f_mid = ctx->duration - (2 * 5 * 588 + 1) + 1 - first;
+    f_mid = f_mid < i_mid ? i_mid : (f_mid > n ? n : f_mid);
 
 #ifdef USE_CRC32 // XXX WIP
-                /*
-  Computer says: skip first 2940 samples?
-
-  track 1/16 [offset 16]
-    n_block:      5
-      block 1/5
-        crc32:    2A6864B3
-        count:    9
-        date2:    00000343
-      block 2/5
-        crc32:    D85D1476
-        count:    1
-        date2:    00000023
-      block 3/5
-        crc32:    8E5D4AA2
-        count:    5
-        date2:    00000403
-      block 4/5
-        crc32:    F6740D65 <--- THIS IS WHAT WE WANT for offset 0
-        count:    15
-        date2:    000003E3
-      block 5/5
-        crc32:    95B6C69B
-        count:    3
-        date2:    000002E5
-
-  Computer says: skip last 2940 samples?
-
-  track 16/16 [offset 988]
-    n_block:      2
-      block 1/2
-        crc32:    66136869
-        count:    8
-        date2:    00000361
-      block 2/2
-        crc32:    C5A8BB58 <--- THIS IS WHAT WE WANT for offset 0
-        count:    24
-        date2:    00000421
-                */
-
-            /* XXX Looks like this is offset-independent: move it out
-             * of the offset loop!  And crc32 does the looping
-             * internally: move it out of the outer loop as well!
-             * That really affects a whole bunch of things!
-             *
-             * l starts at 1: this handles the 5 * 588 first samples
-             * and the 5 * 588 last samples separately.
-             */
-            if (j <= 2 * 5 * 588 + 1) { // was l, not j; no factor 2, no offset 1
-                ctx->offsets[m].crc32[0] =
-                    crc32(
-                        ctx->offsets[m].crc32[0],
-                        data + 2 * i * sizeof(int16_t),
-                        2 * sizeof(int16_t));
-
-            } else if (j + 2 * 5 * 588 + 1 > ctx->stream->duration) { // was l, not j; no factor 2, no offset 1
-                ctx->offsets[m].crc32[2] =
-                    crc32(
-                        ctx->offsets[m].crc32[2],
-                        data + 2 * i * sizeof(int16_t),
-                        2 * sizeof(int16_t));
-
-            } else {
-                ctx->offsets[m].crc32[1] =
-                    crc32(
-                        ctx->offsets[m].crc32[1],
-                        data + 2 * i * sizeof(int16_t),
-                        2 * sizeof(int16_t));
-            }
+    /* The CRC32 does not depend on the offset.  The first region goes
+     * into crc32[0], the middle into crc32[1], and the last into
+     * crc32[2].  The CRC32 that skips zero samples runs over the
+     * whole track in the same pass.
+     */
+    ctx->crc32[0] = _crc32_frames(
+        ctx->crc32[0], frames, i_mid, &ctx->crc32_skip_zero);
+    ctx->crc32[1] = _crc32_frames(
+        ctx->crc32[1], frames + i_mid, f_mid - i_mid, &ctx->crc32_skip_zero);
+    ctx->crc32[2] = _crc32_frames(
+        ctx->crc32[2], frames + f_mid, n - f_mid, &ctx->crc32_skip_zero);
 #endif
 
-            if (l < 5 * 588) {
-                ctx->offsets[m].checksum_v1[0] += p; // & 0xffffffff;
-                ctx->offsets[m].checksum_v2[0] += s;
+    if (f_mid > i_mid)
+        _feed_middle(ctx, frames + i_mid, first + i_mid, f_mid - i_mid);
 
-            } else if (l + 5 * 588 > ctx->stream->duration) {
-                ctx->offsets[m].checksum_v1[2] += p; // & 0xffffffff;
-                ctx->offsets[m].checksum_v2[2] += s;
-
-                // XXX This should probably not be necessary
-//                if (j + ctx->offsets[m].offset > ctx->stream->duration) {
-//                    ctx->offsets[m].checksum_v1[3] += p; // & 0xffffffff;
-//                    ctx->offsets[m].checksum_v2[3] += s;
-//                }
 
+    /* Offset-finding stuff: cumulative sums of v and k * v over the
+     * (2 * window + 588 + 1) samples starting at one-based index (450
+     * * 588 - window + 1), where k is the one-based index relative to
+     * the start of that range.  Only the part of the block that
+     * overlaps the range is visited.  The tables are not allocated
+     * for tracks that end before the range.
+     */
+    if (ctx->sof != NULL) {
+        w = ctx->window;
+        i = (450 * 588 - w + 1) - first;
+        f = i + (2 * w + 588 + 1);
+        for (i = i < 0 ? 0 : i; i < n && i < f; i++) {
+            k = first + i - (450 * 588 + 0 - w);
+            u = frames[i];
+            if (k == 1) {
+                ctx->sof[0] = (k + 0) * u;
+                ctx->sum[0] = u;
             } else {
-                ctx->offsets[m].checksum_v1[1] += p; // & 0xffffffff;
-                ctx->offsets[m].checksum_v2[1] += s;
+                ctx->sof[k - 1] = ctx->sof[k - 2] + (k + 0) * u;
+                ctx->sum[k - 1] = ctx->sum[k - 2] + u;
             }
         }
-
-
-        /* XXX PLAYGROUND START */
-
-        /* The leader: do the cumulative thing here, so nothing needs
-         * to be done to finalise, but subtraction needed in checksum
-         * comparator/offset finder instead.
-         *
-         * XXX Note that now, offset_array_{1,2} is kept base zero.
-         */
-        uint64_t t = ((uint32_t *)data)[i];
-        uint64_t u = t;
-//        u = ((u >> 32) + u);
-
-#if 0
-        if (j == 1) {
-            ctx->v1.offset_array_1[0] = t;
-            ctx->v1.offset_array_2[0] = j * t;
-
-            ctx->v2.offset_array_1[0] = u;
-            ctx->v2.offset_array_2[0] = (j * u) >> 32;
-
-        } else if (j < MAX_OFFSET) {
-            ctx->v1.offset_array_1[j - 1] =
-                ctx->v1.offset_array_1[j - 2] + t;
-            ctx->v1.offset_array_2[j - 1] =
-                ctx->v1.offset_array_2[j - 2] + j * t;
-
-            ctx->v2.offset_array_1[j - 1] =
-                ctx->v2.offset_array_1[j - 2] + u;
-            ctx->v2.offset_array_2[j - 1] =
-                ctx->v2.offset_array_2[j - 2] + ((j * u) >> 32);
-
-        } else {
-            /* The middle only sums the middle, because of the way the
-             * circular array for the trailer works.
-             */
-            ctx->v1.offset_test_1 +=
-                ctx->v1.offset_array_3[(j - 1) % MAX_OFFSET];
-            ctx->v1.offset_test_2 +=
-                ctx->v1.offset_array_4[(j - 1) % MAX_OFFSET];
-
-            ctx->v2.offset_test_1 +=
-                ctx->v2.offset_array_3[(j - 1) % MAX_OFFSET];
-            ctx->v2.offset_test_2 +=
-                ctx->v2.offset_array_4[(j - 1) % MAX_OFFSET];
-
-
-            /* The trailer, kept in circular array.  We may not want
-             * to rely on duration being reported correctly (e.g. the
-             * SLAYRadio stream).  But we probably have to, otherwise
-             * there is no way to get at the duration of the stream
-             * without first traversing it.
-             */
-            ctx->v1.offset_array_3[(j - 1) % MAX_OFFSET] = t;
-            ctx->v1.offset_array_4[(j - 1) % MAX_OFFSET] = j * t;
-
-            ctx->v2.offset_array_3[(j - 1) % MAX_OFFSET] = u;
-            ctx->v2.offset_array_4[(j - 1) % MAX_OFFSET] = (j * u) >> 32;
-        }
-
-
-//        int k = 0;
-
-        /* This is what we want.
-         */
-//        ctx->prutt_1 += (((j + k) * u) >> 32) + (j + k) * u;
-
-
-        /* What's this?
-         */
-//        ctx->prutt_2 += (j + k) * u;
-//        ctx->prutt_3 += ((j + k) * u) >> 32;
-
-
-        /* Works for k == 0
-         */
-//        ctx->prutt_1 += (((j + k) * u) >> 32) + (j + k) * u;
-//        ctx->prutt_2 += j * u;
-//        ctx->prutt_3 += u;
-//        ctx->prutt_4 += (j * u + k * u) & 0xffffffff;
-
-
-        /* Test Monday, OK for k == 0
-         */
-//        ctx->prutt_1 += ((j + k) * u) >> 32;
-//        ctx->prutt_2 += ((j + k) * u);
-//        ctx->prutt_3 += u & 0xffffffff;
-//        ctx->prutt_4 += ((j + k) * u) & 0xffffffff;
-
-
-        /* Playground Tuesday -- OK
-         *
-         * Hit the snag when replacing (j + k) in prutt_3 with + k *
-         * prutt_4 in final expression!
-         */
-//        ctx->prutt_1 += ((j + k) * u) >> 32;
-//        ctx->prutt_2 += ((j + k) * u);
-//        ctx->prutt_3 += ((j + k) * u) & 0xffffffff;
-
-//        ctx->prutt_1 += (((j + k) * u) >> 32) + (j + k) * u;
-//        ctx->prutt_2 += (j * u);
-//        ctx->prutt_3 += ((j + k) * u) % 0x100000000; // & 0xffffffff;
-//        ctx->prutt_4 += u;
-
-/*
-        if (j == 8122044 - 5 * 588) {
-            printf("  IN-FLIGHT 0x%016llx 0x%016llx\n",
-                   ctx->prutt, ctx->v2.offset_test_2);
-        }
-*/
-#endif
-
-
-        /* Offset-finding stuff.
-         */
-        size_t k = j - (450 * 588 + 0 - MAX_OFFSET_2);
-        if (k == 1) {
-            ctx->sof[0] = (k + 0) * u;
-            ctx->sum[0] = u;
-
-        } else if (k > 1 && k <= 2 * MAX_OFFSET_2 + 588 + 1) {
-//            printf("Writing at %zd\n", k);
-
-            ctx->sof[k - 1] = ctx->sof[k - 2] + (k + 0) * u;
-            ctx->sum[k - 1] = ctx->sum[k - 2] + u;
-        }
-        /* XXX PLAYGROUND STOP */
     }
 
 
-    /* Offset-finding for EAC
-     *
-     *   ctx->samples_tot Number of mono-samples seen so far
-     *   len              Number of mono samples in this call
+#ifdef USE_CRC32 // XXX WIP
+    /* Offset-finding for EAC: the CRC32 of the sector starting at
+     * zero-based index (450 * 588 + i) for each offset i in [-5 *
+     * 588, +5 * 588].  Rather than running the CRC over each of the
+     * (2 * 5 * 588 + 1) overlapping sectors, keep the CRC32 of every
+     * prefix of the region spanned by the sectors.  Once the region
+     * is complete, the CRC32 of each sector follows from two of the
+     * prefixes; see _crc32_sector().
      *
-     * There certainly is a cleverer way to do this.
+     * The prefixes are only allocated by _start() for tracks of at
+     * least (500 + 1) * 588 samples, and they are released once the
+     * sectors are done.
      *
-     * XXX We seem to get here a lot more often than we should.
+     * XXX Arbitrary limit; would have expected (450 + 1 + 5) * 588 to
+     * make more sense, but that does not work for the pause track on
+     * Duke.
      */
-#if 1
-//    int done = 0;
-    {
-//        uLong my_crc;
-//        goto skip_crc32;
-        if (ctx->crc32_off[2 * 588 + 1 - 1] != crc32(0, Z_NULL, 0)) {
-//            printf("  BEEN HERE, DONE THAT %p %lld %ld\n",
-//                   ctx, ctx->stream->duration, 450 * 588);
-            goto skip_crc32;
-        }
-
-
-        /* XXX Arbitrary limit; would have expected (450 + 1 + 5) *
-         * 588 to make more sense, but that does not work for the
-         * pause track on Duke.
-         */
-        if (ctx->stream->duration < (500 + 1) * 588) {
-            printf("Skipped track duration %" PRId64 "\n",
-                   ctx->stream->duration);
-            goto skip_crc32;
+    if (ctx->crc32_pre != NULL) {
+        i = (450 * 588 - 5 * 588) - (first - 1);
+        f = i + (2 * 5 * 588 + 588);
+        for (i = i < 0 ? 0 : i; i < n && i < f; i++) {
+            k = (first - 1) + i - (450 * 588 - 5 * 588);
+            ctx->crc32_pre[k + 1] = _crc32_frames(
+                ctx->crc32_pre[k], frames + i, 1, NULL);
         }
 
-//        printf("PRESSING AHEAD\n");
-//        goto skip_crc32;
-
-        for (int i = -5 * 588; i <= +5 * 588; i++) {
-            /* Map the range we got onto the range needed for the
-             * current index.
-             */
-//            int i_crc = ctx->samples_tot / 2 - (450 * 588 + i);
-//            int f_crc = (ctx->samaples_tot + n) / 2 - (450 * 588 + i);
-
-            /* Map the range for the current CRC onto the range we
-             * got.
-             */
-            int i_dat = (450 * 588 + i) - ctx->samples_tot / 2;
-            int f_dat = (451 * 588 + i) - ctx->samples_tot / 2;
-
-//            printf("Got i=%d f=%d\n", i_dat, f_dat);
-
-            if (i_dat >= 0 && i_dat < len / 2) {
-                /* This is the first data block for the CRC; only the
-                 * tail of the data block will be included in the CRC.
-                 */
-                int my_len = 588 < len / 2 - i_dat ? 588 : len / 2 - i_dat;
-
-//                printf("%03d FIRST:  samples=%llu len=%d i=%d f=%d l=%d\n",
-//                       i, ctx->samples_tot, len, i_dat, f_dat, my_len);
-//                if (my_len >= 588)
-//                    done = 1;
-
-//                printf("START i=%d i_dat=%d l=%d len=%d\n", i, i_dat, my_len, len);
-
-                ctx->crc32_off[i + 5 * 588] = crc32(
-                    crc32(0, Z_NULL, 0),
-                    data + i_dat * 2 * sizeof(int16_t),
-                    my_len * 2 * sizeof(int16_t)); // XXX for Duke: Instead of my_len: 587 is OK, 588 is not
-
-//                printf("STOP\n");
-
-            } else if (i_dat < 0 && f_dat >= len / 2) {
-                /* The entire data block is to be included in the CRC.
-                 *   i_dat >= 0     => f_dat > 0
-                 *   f_dat <  n / 2 => i_dat < n / 2
-                 *
-                 * Unlikely to ever see this case, because len > 588.
-                 */
-                int my_len = len / 2;
-
-//                printf("%03d MIDDLE: samples=%llu len=%d i=%d f=%d\n",
-//                       i, ctx->samples_tot, len, i_dat, f_dat);
-//                done = 0;
-
-                ctx->crc32_off[i + 5 * 588] = crc32(
-                    ctx->crc32_off[i + 5 * 588],
-                    data + i_dat * 2 * sizeof(int16_t),
-                    my_len * 2 * sizeof(int16_t));
-
-            } else if (f_dat > 0 && f_dat < len / 2) {
-                /* This is the last data block for the CRC; only the
-                 * head of the data block will be included in the CRC.
-                 */
-                int my_len = f_dat;
-
-//                printf("%03d END:    samples=%llu len=%d i=%d f=%d l=%d\n",
-//                       i, ctx->samples_tot, len, i_dat, f_dat, my_len);
-//                done = 1;
-
-                ctx->crc32_off[i + 5 * 588] = crc32(
-                    ctx->crc32_off[i + 5 * 588],
-                    data,
-                    my_len * 2 * sizeof(int16_t));
-            }
-
-#if 0
-            switch(ctx->crc32_off[i + 5 * 588]) {
-#if 1
-                // August
-            case 0x004CE982: // +6  [count 81]
-            case 0x733A7847:
-            case 0xD75B3115: // -62 [count 1]
-            case 0x0A99519A:
-            case 0xA8A50BDB:
-            case 0x2AC8B12F:
-            case 0xDE5AE38B:
-            case 0x7B87209D: //  0 [count 4]
-#else
-                // Duke
-            case 0x15FC2681:
-            case 0xC1FCB369: // -104 [count 1]
-            case 0xDB2008BE:
-            case 0x2A0D927E: //  0   [count 15]
-            case 0x0B6E43D4: // +338 [count 3]
-#endif
-                printf("#1 Offset %d: 0x%08lx\n", i, ctx->crc32_off[i + 5 * 588]);
-                //exit(0);
-                break;
-            default:
-                break;
+        if (f > 0 && i == f) {
+            for (k = 0; k < 2 * 5 * 588 + 1; k++) {
+                ctx->crc32_off[k] = _crc32_sector(
+                    ctx->crc32_pre[k], ctx->crc32_pre[k + 588]);
             }
-#endif
+            free(ctx->crc32_pre);
+            ctx->crc32_pre = NULL;
         }
-
-    skip_crc32:
-        ;
     }
-
 #endif
 
-//    if (done != 0)
-//        exit(0);
-
 #if 0
 /*
   From Duke: partial track 1
@@ -1754,8 +2978,18 @@ fingersum_diff(struct fingersum_context *ctx1, struct fingersum_context *ctx2)
     int m, mono1 = 1, mono2 = 1; // NEW, for mono check
 
 
-    /* Calculate the number of octets per sample.  There is no point
-     * in trying to diff if the number of bits per sample are not
+    /* The tracks of an image cannot be decoded on their own.
+     */
+    if (ctx1->image != NULL || ctx2->image != NULL) {
+        errno = ENOTSUP;
+        return (-1);
+    }
+    if (_unpark(ctx1) != 0 || _unpark(ctx2) != 0)
+        return (-1);
+
+
+    /* Calculate the number of octets per sample.  There is no point
+     * in trying to diff if the number of bits per sample are not
      * identical, or not a multiple of eight.
      */
     ops = ctx1->avcc->bits_per_raw_sample / 8;
@@ -1864,91 +3098,670 @@ fingersum_diff(struct fingersum_context *ctx1, struct fingersum_context *ctx2)
 }
 
 
-/* Allocate and initialise a Chromaprint context unless the fingersum
- * context already has one.  _process() will feed at least @ len
- * samples to the checksumming and fingerprinting algorithms before
- * returning.  The fingerprint calculation is not finalised here,
- * because it may not be required.
+/* The _start() function allocates and initialises a Chromaprint
+ * context unless the fingersum context already has one, and prepares
+ * the fingersum context pointed to by @p ctx for the data that
+ * follows.
+ *
+ * @param ctx Pointer to an opaque fingersum context
+ * @param cc  Pointer to the Chromaprint context.  If @p *cc is @c
+ *            NULL, it is set to a context local to @p ctx.
+ * @return    0 if successful, -1 otherwise.  If an error occurs
+ *            during the Chromaprint calculation, the global variable
+ *            @c errno is set to @c EPROTO.
+ */
+static int
+_start(struct fingersum_context *ctx, ChromaprintContext **cc)
+{
+
+    /* Create a new Chromaprint context if needed and store it in the
+     * fingersum context for later reference.  It is an error if this
+     * needs to be done after the first samples have been processed.
+     * Note that chromaprint_new() is not thread-safe if Chromaprint
+     * was compiled with FFTW.
+     *
+     * XXX Why do we need the Chromaprint context to be accessible
+     * from the outside again?
+     */
+    if (*cc == NULL) {
+        if (ctx->cc == NULL) {
+            if (ctx->samples_tot > 0) {
+                errno = EPROTO;
+                return (-1);
+            }
+
+            if (pthread_mutex_lock(&_mutex) != 0)
+                return (-1);
+            ctx->cc = chromaprint_new(CHROMAPRINT_ALGORITHM_DEFAULT);
+            if (ctx->cc == NULL) {
+                pthread_mutex_unlock(&_mutex);
+                errno = EPROTO;
+                return (-1);
+            }
+            if (pthread_mutex_unlock(&_mutex) != 0)
+                return (-1);
+        }
+
+        *cc = ctx->cc;
+    }
+
+
+    /* If this is the first data feed prepare the Chromaprint context
+     * for a new audio stream.
+     */
+    if (ctx->samples_tot == 0) {
+        if (chromaprint_start(
+                *cc, ctx->avcc->sample_rate, ctx->avcc->channels) != 1) {
+            errno = EPROTO;
+            return (-1);
+        }
+        ctx->cc_started = *cc;
+    }
+
+
+    /* XXX Determine the maximum offset; maybe better as its own
+     * function?
+     */
+    size_t i;
+    ctx->max_offset = 0;
+    for (i = 0; i < ctx->nmemb; i++) {
+        if (abs(ctx->offsets[i].offset) > ctx->max_offset)
+            ctx->max_offset = abs(ctx->offsets[i].offset);
+//        printf("HATTNE see offset %ld [%zd/%zd]\n",
+//               ctx->offsets[i].offset, i + 1, ctx->nmemb);
+    }
+    ctx->max_offset = 2 * 5 * 588 + 1; // XXX Ouch!
+
+    if (ctx->samples == NULL) {
+        ctx->samples = calloc(2 * 5 * 588 + 1, 2 * sizeof(int16_t));
+        if (ctx->samples == NULL)
+            return (-1);
+    }
+
+    if (ctx->samples_end == NULL) {
+        ctx->samples_end = calloc(2 * 5 * 588 + 1, 2 * sizeof(int16_t));
+        if (ctx->samples_end == NULL)
+            return (-1);
+    }
+
+
+    /* The offset-finding tables are only allocated for tracks that
+     * reach them; see _feed_checksum().  Entries that lie beyond the
+     * end of the track remain zero.
+     */
+    if (ctx->sof == NULL &&
+        ctx->duration > 450 * 588 - (int64_t)ctx->window) {
+        ctx->sof = calloc(2 * ctx->window + 588 + 1, sizeof(uint32_t));
+        if (ctx->sof == NULL)
+            return (-1);
+        ctx->sum = calloc(2 * ctx->window + 588 + 1, sizeof(uint32_t));
+        if (ctx->sum == NULL) {
+            free(ctx->sof);
+            ctx->sof = NULL;
+            return (-1);
+        }
+    }
+
+#ifdef USE_CRC32 // XXX WIP
+    if (ctx->samples_tot == 0 && ctx->duration >= (500 + 1) * 588) {
+        if (ctx->crc32_off == NULL) {
+            ctx->crc32_off = calloc(2 * 5 * 588 + 1, sizeof(uint32_t));
+            if (ctx->crc32_off == NULL)
+                return (-1);
+        }
+
+        if (ctx->crc32_pre == NULL) {
+            ctx->crc32_pre = malloc(
+                (2 * 5 * 588 + 588 + 1) * sizeof(uint32_t));
+            if (ctx->crc32_pre == NULL)
+                return (-1);
+        }
+        ctx->crc32_pre[0] = crc32(0, Z_NULL, 0);
+    }
+#endif
+
+    return (0);
+}
+
+
+/* The _feed() function sends the @p n 16-bit samples in @p data to
+ * the checksumming and fingerprinting algorithms, and retains the
+ * samples at either end of the track.  The fingerprint calculation is
+ * finalised if @p n is zero, or if the fingerprint does not require
+ * more samples.
+ *
+ * @param ctx  Pointer to an opaque fingersum context
+ * @param cc   The Chromaprint context
+ * @param data Pointer to raw audio data, an @p n-long array of 16-bit
+ *             signed integers in native byte order
+ * @param n    Length of data, in 16-bit samples
+ * @return     0 if successful, -1 otherwise.  If an error occurs, the
+ *             global variable @c errno is set to @c EPROTO.
+ */
+static int
+_feed(struct fingersum_context *ctx,
+      ChromaprintContext *cc,
+      uint8_t *data,
+      int n)
+{
+    _feed_checksum(ctx, data, n);
+    if (ctx->fingerprint == NULL) {
+        if (_feed_chromaprint(ctx, cc, data, n) != 0)
+            return (-1);
+    }
+
+#if 0 && defined(USE_CRC32) // XXX WIP
+    // XXX Apparently, the zero-skip CRC32 is reported by EAC.
+    if (n > 0) {
+        ctx->offsets[m].crc32 = crc32(ctx->offsets[m].crc32, data, 2 * n);
+
+        size_t k;
+        for (k = 0; k < n; k++) {
+            if (((uint16_t *)data)[k] != 0)
+                ctx->offsets[m].crc32_skip_zero = crc32(ctx->offsets[m].crc32_skip_zero, data + 2 * k, 2);
+        }
+    }
+#endif
+
+
+    /* Remember the first 2 * 5 * 588 + 1 samples.
+     */
+    if (ctx->samples_tot < (2 * 5 * 588 + 1) * 2) {
+        memcpy(ctx->samples + ctx->samples_tot / 2, // XXX Should ctx->samples and ctx->samples_end be void ptr?
+               data,
+               (ctx->samples_tot + n < (2 * 5 * 588 + 1) * 2 ?
+                n : (2 * 5 * 588 + 1) * 2 - ctx->samples_tot) * sizeof(int16_t));
+    }
+
+
+    /* Remember the last 2 * 5 * 588 + 1 samples as well.  Circular
+     * buffer, no let's not do that, because we need to rely on
+     * ctx->duration anyhow!
+     *
+     * This should really just be the above, but backwards!
+     *
+     * Alternatively: store all 2 * 5 * 588 + 1 16-bit stereo samples at
+     * beginning and end (about (2 * 5 * 588 + 1) / 44100 = 0.13 s).
+     *
+     *   2 * (2 * 5 * 588 + 1) * 2 * 2 = 46 k per track, probably acceptable
+     *
+     * And note that the ARv1 checksum can be precalculated
+     * and stored as two numbers and that the leading offset
+     * can be precalculated and stored as partial checksums.
+     *
+     * XXX This part may be buggered!  See Boney M.
+     *
+     * XXX Complex, see "Offset-finding for EAC" in this file.
+     */
+    if (n > 0 && ctx->samples_tot / 2 + n / 2 > ctx->duration - (2 * 5 * 588 + 1)) {
+
+//            printf("\n");
+//            printf("Checking %lld + %d = %lld, %lld - %lld = %lld\n",
+//                   ctx->samples_tot / 2, n / 2, ctx->samples_tot / 2 + n / 2,
+//                   ctx->duration, 2 * 5 * 588 + 1, ctx->duration - (2 * 5 * 588 + 1));
+
+        uint64_t dst, len, src;
+        uint64_t stm = ctx->samples_tot / 2 + (2 * 5 * 588 + 1);
+
+        src = ctx->samples_tot / 2 > ctx->duration - (2 * 5 * 588 + 1)
+            ? 0
+            : ctx->duration - (2 * 5 * 588 + 1) - ctx->samples_tot / 2;
+        dst = ctx->samples_tot / 2 > ctx->duration - (2 * 5 * 588 + 1)
+            ? ctx->samples_tot / 2 - (ctx->duration - (2 * 5 * 588 + 1))
+            : 0;
+        len = n / 2 < stm + n / 2 - ctx->duration
+            ? n / 2
+            : stm + n / 2 - ctx->duration;
+
+//            printf("Copying %lld samples from %lld to %lld\n",
+//                   len, src, dst);
+
+//            printf("  stm = %lld, duration = %lld, n = %d, n / 2 = %d, max_offset = %lld\n",
+//                   stm, ctx->duration, n, n / 2, (2 * 5 * 588 + 1));
+//            printf("\n");
+
+        memcpy(ctx->samples_end + dst,
+               (uint32_t *)data + src, // Because data is (uint8_t *)
+               len * sizeof(uint32_t));
+
+//            for (i = 0; i < 2 * 5 * 588 + 1; i++)
+//                printf("  SET DATA %zd: 0x%08x\n", i, ctx->samples_end[i]);
+    }
+
+    ctx->samples_tot += n;
+
+    return (0);
+}
+
+
+/* The _process() function will feed at least @ len samples to the
+ * checksumming and fingerprinting algorithms before returning.  The
+ * fingerprint calculation is not finalised here, because it may not
+ * be required.
+ *
+ * @param ctx Pointer to an opaque fingersum context
+ * @param cc  The Chromaprint context, or @c NULL to use a context
+ *            local to @p ctx
+ * @param len Samples to process, or negative to process the remainder
+ *            of the stream
+ * @return    0 if successful, -1 otherwise.  If an error occurs
+ *            during the Chromaprint calculation, the global variable
+ *            @c errno is set to @c EPROTO.
+ */
+static int
+_process(struct fingersum_context *ctx, ChromaprintContext *cc, int64_t len)
+{
+    uint8_t *data;
+    int n, ret, size;
+
+
+    if (_unpark(ctx) != 0 || _start(ctx, &cc) != 0)
+        return (-1);
+
+
+    /* Decode as many frames as requested and feed the checksumming
+     * and fingerprinting algorithms.
+     */
+    data = NULL;
+    n = 0;
+    ret = 0;
+    size = 0;
+    do {
+        n = _decode_frame(ctx, &data, &size);
+        if (n < 0 || _feed(ctx, cc, data, n) != 0) {
+            ret = -1;
+            break;
+        }
+    } while (n > 0 && (len < 0 || (len -= n) > 0));
+
+
+    /* If the end of the stream was reached, everything is known about
+     * it.  Failure to update the cache is ignored.
+     */
+    if (n == 0 && ret == 0 && ctx->samples_tot == 2 * ctx->duration)
+        _cache_store(ctx);
+
+
+    /* Free the mallocs!
+     */
+    if (data != NULL && size > 0)
+        av_freep(&data);
+    return (ret);
+}
+
+
+/* The _process_image() function decodes the image pointed to by @p
+ * image from the start, and dispatches the samples to the tracks that
+ * have not yet seen all of theirs.  Each sample is decoded once, no
+ * matter how many tracks need it, and the image is not decoded again
+ * unless the offsets of a track change.  Samples before the first
+ * track, such as a hidden track in the pregap, are skipped.  Calls
+ * for the other tracks of the image wait until the decoding is
+ * complete.
+ *
+ * @param image Pointer to the image
+ * @return      0 if successful, -1 otherwise.  If an error occurs,
+ *              the global variable @c errno is set to indicate the
+ *              error.
+ */
+static int
+_process_image(struct _image *image)
+{
+    struct fingersum_context *ctx, *track;
+    uint8_t *data;
+    uint64_t hi, lo;
+    size_t first, i, incomplete;
+    int n, ret, size;
+
+
+    if (pthread_mutex_lock(&image->mutex) != 0)
+        return (-1);
+    if (image->done != 0) {
+        pthread_mutex_unlock(&image->mutex);
+        return (0);
+    }
+
+
+    /* Restart any track that was left incomplete by a failed pass,
+     * and rewind the image unless nothing has been decoded yet.
+     */
+    ctx = image->ctx;
+    incomplete = 0;
+    for (i = 0; i < image->nmemb; i++) {
+        track = image->tracks[i];
+        if (track == NULL || track->samples_tot >= 2 * track->duration)
+            continue;
+        if (track->samples_tot > 0)
+            _rewind(track);
+        if (_start(track, &track->cc) != 0) {
+            pthread_mutex_unlock(&image->mutex);
+            return (-1);
+        }
+        incomplete++;
+    }
+
+    if (image->pos > 0) {
+        if (av_seek_frame(ctx->ic, ctx->stream->index, 0, 0) < 0) {
+            pthread_mutex_unlock(&image->mutex);
+            errno = EPROTO;
+            return (-1);
+        }
+        image->pos = 0;
+    }
+
+
+    /* Split each decoded block at the track boundaries, and feed the
+     * pieces to the tracks they belong to.  Once a track has seen all
+     * its samples, its fingerprint is finalised, because the
+     * remainder of the image belongs to other tracks.  Decoding stops
+     * as soon as all tracks are complete.
+     */
+    data = NULL;
+    first = 0;
+    ret = 0;
+    size = 0;
+    while (incomplete > 0) {
+        n = _decode_frame(ctx, &data, &size);
+        if (n <= 0) {
+            ret = n;
+            break;
+        }
+
+        for (i = first; i < image->nmemb; i++) {
+            lo = 2 * image->starts[i];
+            hi = 2 * image->starts[i + 1];
+            if (lo >= image->pos + n)
+                break;
+            if (hi <= image->pos) {
+                first = i + 1;
+                continue;
+            }
+
+            track = image->tracks[i];
+            if (track == NULL || track->samples_tot >= 2 * track->duration)
+                continue;
+
+            lo = lo > image->pos ? lo : image->pos;
+            hi = hi < image->pos + n ? hi : image->pos + n;
+            if (_feed(track,
+                      track->cc,
+                      data + (lo - image->pos) * sizeof(int16_t),
+                      hi - lo) != 0) {
+                ret = -1;
+                break;
+            }
+
+            if (track->samples_tot == 2 * track->duration) {
+                if (track->fingerprint == NULL &&
+                    _feed_chromaprint(track, track->cc, NULL, 0) != 0) {
+                    ret = -1;
+                    break;
+                }
+                incomplete--;
+            }
+        }
+        if (ret != 0)
+            break;
+
+        image->pos += n;
+    }
+
+
+    /* If the image ends before the last track does, the tracks that
+     * remain are as complete as they will ever be, just like a stream
+     * that is shorter than its duration.
+     */
+    if (ret == 0) {
+        for (i = 0; i < image->nmemb; i++) {
+            track = image->tracks[i];
+            if (track == NULL || track->samples_tot >= 2 * track->duration)
+                continue;
+            if (track->fingerprint == NULL &&
+                _feed_chromaprint(track, track->cc, NULL, 0) != 0) {
+                ret = -1;
+                break;
+            }
+        }
+    }
+    if (ret == 0)
+        image->done = 1;
+    pthread_mutex_unlock(&image->mutex);
+
+    if (data != NULL && size > 0)
+        av_freep(&data);
+    return (ret);
+}
+
+
+/* The _complete() function ensures that all the samples of the stream
+ * of the fingersum context pointed to by @p ctx have been processed.
+ * For a track of an image, the state of the track may only be
+ * inspected under the mutex of the image, which is taken whether or
+ * not any decoding remains.
+ *
+ * @param ctx Pointer to an opaque fingersum context
+ * @param cc  The Chromaprint context, or @c NULL to use a context
+ *            local to @p ctx
+ * @return    0 if successful, -1 otherwise.  If an error occurs, the
+ *            global variable @c errno is set to indicate the error.
+ */
+static int
+_complete(struct fingersum_context *ctx, ChromaprintContext *cc)
+{
+    if (ctx->image != NULL)
+        return (_process_image(ctx->image));
+    if (ctx->samples_tot < 2 * ctx->duration)
+        return (_process(ctx, cc, -1));
+    return (0);
+}
+
+
+/* The _process_pending() function processes the stream of the
+ * fingersum context pointed to by @p ctx again if any of its offsets
+ * are pending, such that the v2 checksums are available for all its
+ * offsets.  All pending offsets are caught up in a single pass, and
+ * an unfinished fingerprint is kept; see _rewind().  For a track of
+ * an image, every track of the image with pending offsets is rewound
+ * along with it, so that the image is decoded once for all of them.
+ *
+ * @param ctx Pointer to an opaque fingersum context
+ * @return    0 if successful, -1 otherwise.  If an error occurs, the
+ *            global variable @c errno is set to indicate the error.
+ */
+static int
+_has_pending(const struct fingersum_context *ctx)
+{
+    size_t i;
+
+    for (i = 0; i < ctx->nmemb; i++) {
+        if (ctx->offsets[i].pending != 0)
+            return (1);
+    }
+    return (0);
+}
+
+
+static int
+_process_pending(struct fingersum_context *ctx)
+{
+    struct fingersum_context *track;
+    size_t i;
+    int ret;
+
+
+    if (ctx->image == NULL) {
+        if (_has_pending(ctx) == 0)
+            return (0);
+        if (_restart(ctx) != 0)
+            return (-1);
+        return (_complete(ctx, ctx->cc));
+    }
+
+    if (pthread_mutex_lock(&ctx->image->mutex) != 0)
+        return (-1);
+    ret = _has_pending(ctx);
+    if (ret != 0) {
+        for (i = 0; i < ctx->image->nmemb; i++) {
+            track = ctx->image->tracks[i];
+            if (track != NULL && _has_pending(track) != 0)
+                _restart(track);
+        }
+    }
+    pthread_mutex_unlock(&ctx->image->mutex);
+
+    if (ret == 0)
+        return (0);
+    return (_complete(ctx, ctx->cc));
+}
+
+
+/* The _process_head() function ensures that the first (2 * 5 * 588 +
+ * 1) samples of the stream of the fingersum context pointed to by @p
+ * ctx have been retained in ctx->samples.  Only as much of the stream
+ * as that takes is decoded; the rest is left for later.
+ *
+ * @param ctx Pointer to an opaque fingersum context
+ * @return    0 if successful, -1 otherwise.  If an error occurs, the
+ *            global variable @c errno is set to indicate the error.
+ */
+static int
+_process_head(struct fingersum_context *ctx)
+{
+    if (ctx->image != NULL)
+        return (_process_image(ctx->image));
+    if (ctx->samples_tot < 2 * ctx->duration &&
+        ctx->samples_tot < (2 * 5 * 588 + 1) * 2) {
+        return (_process(
+                    ctx, ctx->cc, (2 * 5 * 588 + 1) * 2 - ctx->samples_tot));
+    }
+    return (0);
+}
+
+
+/* The _resume() function returns the decoder of @p ctx to the sample
+ * after the last one that was fed, once it has been used to read
+ * ahead.  It seeks to the frame that contains that sample, and feeds
+ * the part of the frame that has not been seen, such that the
+ * checksums and the moments accumulated so far remain valid.  An
+ * unfinished fingerprint is continued in the local Chromaprint
+ * context of @p ctx, which is where _process_head() and
+ * _process_tail() feed it.  Only if the stream was started in an
+ * external Chromaprint context, which may since have been reused, or
+ * if the sample cannot be located exactly, is the stream rewound to
+ * its start and all partial results restarted.
  *
  * @param ctx Pointer to an opaque fingersum context
- * @param cc  The Chromaprint context, or @c NULL to use a context
- *            local to @p ctx
- * @param len Samples to process, or negative to process the remainder
- *            of the stream
- * @return    The Chromaprint context if successful, @c NULL
- *            otherwise.  If an error occurs during the Chromaprint
- *            calculation, the global variable @c errno is set to @c
- *            EPROTO.
+ * @return    0 if successful, -1 otherwise.  If an error occurs, the
+ *            global variable @c errno is set to indicate the error.
  */
 static int
-_process(struct fingersum_context *ctx, ChromaprintContext *cc, int64_t len)
+_resume(struct fingersum_context *ctx)
 {
+    AVRational time_base;
     uint8_t *data;
+    int64_t pos, start, t;
     int n, ret, size;
 
 
-    /* Create a new Chromaprint context if needed and store it in the
-     * fingersum context for later reference.  It is an error if this
-     * needs to be done after the first samples have been processed.
-     * Note that chromaprint_new() is not thread-safe if Chromaprint
-     * was compiled with FFTW.
-     *
-     * XXX Why do we need the Chromaprint context to be accessible
-     * from the outside again?
-     */
-    if (cc == NULL) {
-        if (ctx->cc == NULL) {
-            if (ctx->samples_tot > 0) {
-                errno = EPROTO;
-                return (-1);
-            }
+    pos = ctx->samples_tot / 2;
+    ret = 1;
+    if (pos > 0 &&
+        (ctx->fingerprint != NULL ||
+         (ctx->cc != NULL && ctx->cc_started == ctx->cc))) {
+        time_base.num = 1;
+        time_base.den = ctx->sample_rate;
+        start = ctx->stream->start_time != AV_NOPTS_VALUE
+            ? ctx->stream->start_time : 0;
+        data = NULL;
+        size = 0;
+        if (av_seek_frame(
+                ctx->ic,
+                ctx->stream->index,
+                start + av_rescale_q(pos, time_base, ctx->stream->time_base),
+                AVSEEK_FLAG_BACKWARD) >= 0) {
+            avcodec_flush_buffers(ctx->avcc);
+
+            for ( ; ; ) {
+                n = _decode_frame(ctx, &data, &size);
+                if (n <= 0 ||
+                    ctx->frame->best_effort_timestamp == AV_NOPTS_VALUE) {
+                    break;
+                }
 
-            if (pthread_mutex_lock(&_mutex) != 0)
-                return (-1);
-            ctx->cc = chromaprint_new(CHROMAPRINT_ALGORITHM_DEFAULT);
-            if (ctx->cc == NULL) {
-                pthread_mutex_unlock(&_mutex);
-                errno = EPROTO;
-                return (-1);
+                t = av_rescale_q(ctx->frame->best_effort_timestamp - start,
+                                 ctx->stream->time_base, time_base);
+                if (t > pos)
+                    break;
+                if (t + n / 2 <= pos)
+                    continue;
+
+                ret = _feed(ctx,
+                            ctx->cc,
+                            data + (pos - t) * 2 * sizeof(int16_t),
+                            n - 2 * (pos - t));
+                break;
             }
-            if (pthread_mutex_unlock(&_mutex) != 0)
-                return (-1);
         }
-
-        cc = ctx->cc;
+        if (data != NULL && size > 0)
+            av_freep(&data);
+        if (ret <= 0)
+            return (ret);
     }
 
 
-    /* If this is the first data feed prepare the Chromaprint context
-     * for a new audio stream.
+    /* Rewind, and start over from the beginning of the stream.
      */
-    if (ctx->samples_tot == 0) {
-        if (chromaprint_start(
-                cc, ctx->avcc->sample_rate, ctx->avcc->channels) != 1) {
-            errno = EPROTO;
-            return (-1);
-        }
+    if (av_seek_frame(ctx->ic, ctx->stream->index, 0, 0) < 0) {
+        errno = EPROTO;
+        return (-1);
     }
+    avcodec_flush_buffers(ctx->avcc);
+    _rewind(ctx);
 
+    return (0);
+}
 
-    /* XXX Determine the maximum offset; maybe better as its own
-     * function?
-     */
-    size_t i;
-    ctx->max_offset = 0;
-    for (i = 0; i < ctx->nmemb; i++) {
-        if (abs(ctx->offsets[i].offset) > ctx->max_offset)
-            ctx->max_offset = abs(ctx->offsets[i].offset);
-//        printf("HATTNE see offset %ld [%zd/%zd]\n",
-//               ctx->offsets[i].offset, i + 1, ctx->nmemb);
-    }
-    ctx->max_offset = 2 * 5 * 588 + 1; // XXX Ouch!
 
-    if (ctx->samples == NULL) {
-        ctx->samples = calloc(2 * 5 * 588 + 1, 2 * sizeof(int16_t));
-        if (ctx->samples == NULL)
-            return (-1);
-    }
+/* The _process_tail() function ensures that the last (2 * 5 * 588 +
+ * 1) samples of the stream of the fingersum context pointed to by @p
+ * ctx have been retained in ctx->samples_end.  Rather than decoding
+ * the whole stream, it seeks to the tail, relying on the duration
+ * from the header, and decodes only the last few frames.  The
+ * position of each frame is taken from its timestamp relative to the
+ * start of the stream, because the seek may land anywhere before the
+ * tail.
+ *
+ * Sequential decoding then resumes where it left off; see _resume().
+ * If the tail cannot be located exactly, or the track is too short to
+ * have one, the stream is processed to the end instead.
+ *
+ * @param ctx Pointer to an opaque fingersum context
+ * @return    0 if successful, -1 otherwise.  If an error occurs, the
+ *            global variable @c errno is set to indicate the error.
+ */
+static int
+_process_tail(struct fingersum_context *ctx)
+{
+    AVRational time_base;
+    uint8_t *data;
+    int64_t first, next, start, t;
+    int n, size;
+
+
+    if (ctx->image != NULL)
+        return (_process_image(ctx->image));
+    if (ctx->tail != 0 || ctx->samples_tot >= 2 * ctx->duration)
+        return (0);
+    if (_unpark(ctx) != 0)
+        return (-1);
+
+
+    /* Without a middle region, or if the sequential decoding has
+     * (almost) reached the tail anyway, there is nothing to gain.
+     */
+    first = ctx->duration - (2 * 5 * 588 + 1);
+    if (first < (2 * 5 * 588 + 1) || (int64_t)ctx->samples_tot / 2 >= first)
+        return (_process(ctx, ctx->cc, -1));
 
     if (ctx->samples_end == NULL) {
         ctx->samples_end = calloc(2 * 5 * 588 + 1, 2 * sizeof(int16_t));
@@ -1957,115 +3770,54 @@ _process(struct fingersum_context *ctx, ChromaprintContext *cc, int64_t len)
     }
 
 
-    /* Decode as many frames as requested and feed the checksumming
-     * and fingerprinting algorithms.
+    /* Decode from the seek point, copying the samples that fall in
+     * the tail.  next is the index of the first sample of the tail
+     * that is still missing; a frame that starts beyond it, or that
+     * has no timestamp, means the tail cannot be trusted.
      */
+    time_base.num = 1;
+    time_base.den = ctx->sample_rate;
+    start = ctx->stream->start_time != AV_NOPTS_VALUE
+        ? ctx->stream->start_time : 0;
+    next = first;
     data = NULL;
-    n = 0;
-    ret = 0;
     size = 0;
-    do {
-        n = _decode_frame(ctx, &data, &size);
-        if (n < 0) {
-            ret = -1;
-            break;
-        }
-
-        _feed_checksum(ctx, data, n);
-        if (ctx->fingerprint == NULL) {
-            if (_feed_chromaprint(ctx, cc, data, n) != 0) {
-                ret = -1;
+    if (av_seek_frame(
+            ctx->ic,
+            ctx->stream->index,
+            start + av_rescale_q(first, time_base, ctx->stream->time_base),
+            AVSEEK_FLAG_BACKWARD) >= 0) {
+        avcodec_flush_buffers(ctx->avcc);
+
+        while (next < ctx->duration) {
+            n = _decode_frame(ctx, &data, &size);
+            if (n <= 0 || ctx->frame->best_effort_timestamp == AV_NOPTS_VALUE)
                 break;
-            }
-        }
-
-#if 0 && defined(USE_CRC32) // XXX WIP
-        // XXX Apparently, the zero-skip CRC32 is reported by EAC.
-        if (n > 0) {
-            ctx->offsets[m].crc32 = crc32(ctx->offsets[m].crc32, data, 2 * n);
-
-            size_t k;
-            for (k = 0; k < n; k++) {
-                if (((uint16_t *)data)[k] != 0)
-                    ctx->offsets[m].crc32_skip_zero = crc32(ctx->offsets[m].crc32_skip_zero, data + 2 * k, 2);
-            }
-        }
-#endif
-
-
-        /* Remember the first 2 * 5 * 588 + 1 samples.
-         */
-        if (ctx->samples_tot < (2 * 5 * 588 + 1) * 2) {
-            memcpy(ctx->samples + ctx->samples_tot / 2, // XXX Should ctx->samples and ctx->samples_end be void ptr?
-                   data,
-                   (ctx->samples_tot + n < (2 * 5 * 588 + 1) * 2 ?
-                    n : (2 * 5 * 588 + 1) * 2 - ctx->samples_tot) * sizeof(int16_t));
-        }
-
-
-        /* Remember the last 2 * 5 * 588 + 1 samples as well.  Circular
-         * buffer, no let's not do that, because we need to rely on
-         * ctx->stream->duration anyhow!
-         *
-         * This should really just be the above, but backwards!
-         *
-         * Alternatively: store all 2 * 5 * 588 + 1 16-bit stereo samples at
-         * beginning and end (about (2 * 5 * 588 + 1) / 44100 = 0.13 s).
-         *
-         *   2 * (2 * 5 * 588 + 1) * 2 * 2 = 46 k per track, probably acceptable
-         *
-         * And note that the ARv1 checksum can be precalculated
-         * and stored as two numbers and that the leading offset
-         * can be precalculated and stored as partial checksums.
-         *
-         * XXX This part may be buggered!  See Boney M.
-         *
-         * XXX Complex, see "Offset-finding for EAC" in this file.
-         */
-        if (n > 0 && ctx->samples_tot / 2 + n / 2 > ctx->stream->duration - (2 * 5 * 588 + 1)) {
-
-//            printf("\n");
-//            printf("Checking %lld + %d = %lld, %lld - %lld = %lld\n",
-//                   ctx->samples_tot / 2, n / 2, ctx->samples_tot / 2 + n / 2,
-//                   ctx->stream->duration, 2 * 5 * 588 + 1, ctx->stream->duration - (2 * 5 * 588 + 1));
-
-            uint64_t dst, len, src;
-            uint64_t stm = ctx->samples_tot / 2 + (2 * 5 * 588 + 1);
 
-            src = ctx->samples_tot / 2 > ctx->stream->duration - (2 * 5 * 588 + 1)
-                ? 0
-                : ctx->stream->duration - (2 * 5 * 588 + 1) - ctx->samples_tot / 2;
-            dst = ctx->samples_tot / 2 > ctx->stream->duration - (2 * 5 * 588 + 1)
-                ? ctx->samples_tot / 2 - (ctx->stream->duration - (2 * 5 * 588 + 1))
-                : 0;
-            len = n / 2 < stm + n / 2 - ctx->stream->duration
-                ? n / 2
-                : stm + n / 2 - ctx->stream->duration;
-
-//            printf("Copying %lld samples from %lld to %lld\n",
-//                   len, src, dst);
-
-//            printf("  stm = %lld, duration = %lld, n = %d, n / 2 = %d, max_offset = %lld\n",
-//                   stm, ctx->stream->duration, n, n / 2, (2 * 5 * 588 + 1));
-//            printf("\n");
-
-            memcpy(ctx->samples_end + dst,
-                   (uint32_t *)data + src, // Because data is (uint8_t *)
-                   len * sizeof(uint32_t));
+            t = av_rescale_q(ctx->frame->best_effort_timestamp - start,
+                             ctx->stream->time_base, time_base);
+            if (t > next)
+                break;
+            if (t + n / 2 <= next)
+                continue;
 
-//            for (i = 0; i < 2 * 5 * 588 + 1; i++)
-//                printf("  SET DATA %zd: 0x%08x\n", i, ctx->samples_end[i]);
+            n = t + n / 2 < ctx->duration ? n / 2 : ctx->duration - t;
+            memcpy(ctx->samples_end + (next - first),
+                   (uint32_t *)data + (next - t),
+                   (t + n - next) * sizeof(uint32_t));
+            next = t + n;
         }
-
-        ctx->samples_tot += n;
-    } while (n > 0 && (len < 0 || (len -= n) > 0));
-
-
-    /* Free the mallocs!
-     */
+    }
     if (data != NULL && size > 0)
         av_freep(&data);
-    return (ret);
+
+
+    if (_resume(ctx) != 0)
+        return (-1);
+    if (next < ctx->duration)
+        return (_process(ctx, ctx->cc, -1));
+    ctx->tail = 1;
+    return (0);
 }
 
 
@@ -2616,10 +4368,10 @@ fingersum_find_offset(const struct fingersum_context *ctx, uint32_t crc) //, ssi
     // Distinguish between failure (return NULL) and no results
     // (return empty list).
     offset_list = NULL;
-    if (crc == 0)
+    if (crc == 0 || ctx->sof == NULL)
         return (offset_list);
 
-    for (k = 0; k < 2 * MAX_OFFSET_2 + 1; k++) {
+    for (k = 0; k < 2 * ctx->window + 1; k++) {
         sof = ctx->sof[k + 588 - 1] - (k > 0 ? ctx->sof[k - 1] : 0);
         sum = ctx->sum[k + 588 - 1] - (k > 0 ? ctx->sum[k - 1] : 0);
 
@@ -2631,7 +4383,7 @@ fingersum_find_offset(const struct fingersum_context *ctx, uint32_t crc) //, ssi
             }
 
             if (fp3_offset_list_add_offset(
-                    offset_list, k - MAX_OFFSET_2) != 0) {
+                    offset_list, (ssize_t)k - (ssize_t)ctx->window) != 0) {
                 fp3_free_offset_list(offset_list);
                 return (NULL);
             }
@@ -2646,6 +4398,102 @@ fingersum_find_offset(const struct fingersum_context *ctx, uint32_t crc) //, ssi
 }
 
 
+/* The CRCs are kept in a small open-addressing hash set, sized to a
+ * power of two at least twice the number of CRCs, such that every
+ * lookup is expected to finish within a probe or two.  Zero marks an
+ * empty slot, which is fine because a CRC of zero is never looked
+ * up.  The candidate values for the whole window are computed first,
+ * in a loop without branches or dependencies between iterations that
+ * the compiler can vectorise, and then looked up one by one.
+ */
+ssize_t
+fingersum_find_offsets(const struct fingersum_context *ctx,
+                       const uint32_t *crcs,
+                       size_t nmemb,
+                       struct fingersum_match **matches)
+{
+    struct fingersum_match *m;
+    uint32_t *set, *values;
+    void *p;
+    size_t h, i, k, mask, n, size;
+
+
+    *matches = NULL;
+    if (ctx->sof == NULL)
+        return (0);
+
+    for (size = 16; size < 2 * nmemb; size *= 2)
+        ;
+    mask = size - 1;
+
+    set = calloc(size, sizeof(uint32_t));
+    if (set == NULL)
+        return (-1);
+
+    n = 0;
+    for (i = 0; i < nmemb; i++) {
+        if (crcs[i] == 0)
+            continue;
+        for (h = (crcs[i] * 0x9e3779b1U) & mask;
+             set[h] != 0 && set[h] != crcs[i];
+             h = (h + 1) & mask)
+            ;
+        if (set[h] == 0) {
+            set[h] = crcs[i];
+            n++;
+        }
+    }
+    if (n == 0) {
+        free(set);
+        return (0);
+    }
+
+
+    /* The candidate for offset (k - window) is sum(j * v) - k *
+     * sum(v) over the sector of 588 samples starting at k; see
+     * fingersum_find_offset().
+     */
+    values = malloc((2 * ctx->window + 1) * sizeof(uint32_t));
+    if (values == NULL) {
+        free(set);
+        return (-1);
+    }
+    values[0] = ctx->sof[588 - 1];
+    for (k = 1; k < 2 * ctx->window + 1; k++) {
+        values[k] = (ctx->sof[k + 588 - 1] - ctx->sof[k - 1]) -
+            k * (ctx->sum[k + 588 - 1] - ctx->sum[k - 1]);
+    }
+
+    n = 0;
+    for (k = 0; k < 2 * ctx->window + 1; k++) {
+        for (h = (values[k] * 0x9e3779b1U) & mask;
+             set[h] != 0 && set[h] != values[k];
+             h = (h + 1) & mask)
+            ;
+        if (set[h] == 0)
+            continue;
+
+        p = realloc(*matches, (n + 1) * sizeof(struct fingersum_match));
+        if (p == NULL) {
+            free(*matches);
+            *matches = NULL;
+            free(values);
+            free(set);
+            return (-1);
+        }
+        *matches = p;
+
+        m = *matches + n++;
+        m->crc = values[k];
+        m->offset = (int32_t)k - (int32_t)ctx->window;
+    }
+
+    free(values);
+    free(set);
+    return (n);
+}
+
+
 /* XXX Might want to keep two offset lists, one for AccurateRip and
  * one for EAC, because they often (how often?) have unique but
  * overlapping sets of offsets
@@ -2657,6 +4505,9 @@ fingersum_find_offset_eac(const struct fingersum_context *ctx, uint32_t crc32)
     size_t k;
 
     offset_list = NULL;
+    if (ctx->crc32_off == NULL)
+        return (offset_list);
+
     for (k = 0; k < 2 * 5 * 588 + 1; k++) {
         if (ctx->crc32_off[k] == crc32) {
             if (offset_list == NULL) {
@@ -2675,6 +4526,44 @@ fingersum_find_offset_eac(const struct fingersum_context *ctx, uint32_t crc32)
     return (offset_list);
 }
 
+#ifdef USE_CRC32 // XXX WIP
+int
+fingersum_get_crc32(struct fingersum_context *ctx,
+                    uint32_t *crc,
+                    uint32_t *crc_skip_zero)
+{
+    int64_t len_mid, len_end;
+
+
+    if (_complete(ctx, ctx->cc) != 0)
+        return (-1);
+
+
+    /* Stitch together the CRC32 of the three regions of the track
+     * without another pass over the data.
+     */
+    len_mid = ctx->duration - 2 * (2 * 5 * 588 + 1);
+    len_mid = len_mid > 0 ? len_mid : 0;
+    len_end = ctx->duration - (2 * 5 * 588 + 1) - len_mid;
+    len_end = len_end > 0 ? len_end : 0;
+
+    if (crc != NULL) {
+        *crc = crc32_combine(
+            crc32_combine(ctx->crc32[0],
+                          ctx->crc32[1],
+                          len_mid * 2 * sizeof(int16_t)),
+            ctx->crc32[2],
+            len_end * 2 * sizeof(int16_t));
+    }
+
+    if (crc_skip_zero != NULL)
+        *crc_skip_zero = ctx->crc32_skip_zero;
+
+    return (0);
+}
+#endif
+
+
 
 #if 0
 int
@@ -2689,7 +4578,7 @@ fingersum_get_checksum(struct fingersum_context *ctx,
      * samples_tot account for channels!  Or maybe better: check for
      * EOF instead of expected number of samples.
      */
-    if (ctx->samples_tot < 2 * ctx->stream->duration) {
+    if (ctx->samples_tot < 2 * ctx->duration) {
         if (_process(ctx, cc, -1) != 0)
             return (-1);
 
@@ -2784,10 +4673,8 @@ fingersum_get_checksum2(struct fingersum_context *ctx,
                         ChromaprintContext *cc,
                         uint32_t checksum[3])
 {
-    if (ctx->samples_tot < 2 * ctx->stream->duration) {
-        if (_process(ctx, cc, -1) != 0)
-            return (-1);
-    }
+    if (_complete(ctx, cc) != 0)
+        return (-1);
 
     if (checksum != NULL) {
         checksum[0] = ctx->checksum_v2[1] + ctx->checksum_v2[2];
@@ -2850,6 +4737,105 @@ _ar2_cksum(uint32_t cksum, int64_t offset, const void *buf, size_t len)
 }
 
 
+/* The _frame() function returns the stereo sample at the one-based
+ * index @p j.  The sample must be among the first or the last (2 * 5
+ * * 588 + 1) samples of the track, which are retained by _process().
+ */
+static uint32_t
+_frame(const struct fingersum_context *ctx, int64_t j)
+{
+    if (j <= 2 * 5 * 588 + 1)
+        return (ctx->samples[j - 1]);
+    return (ctx->samples_end[
+                j - (ctx->duration - (2 * 5 * 588 + 1) + 1)]);
+}
+
+
+/* The _ar_cksum_range() function adds the AccurateRip v1 and v2
+ * checksums of the stereo samples with one-based indices @p first
+ * through @p last, inclusive, at the offset @p offset to @p *v1 and
+ * @p *v2.  The index of the first sample in the track at the given
+ * offset is (1 + offset).  Indices outside the track are ignored.
+ *
+ * Samples from the first and the last (2 * 5 * 588 + 1) samples of
+ * the track are summed directly, the middle region is derived from
+ * the moments accumulated by _feed_middle().  The range must
+ * therefore either cover the middle region in its entirety or not
+ * intersect it at all.  The v1 checksum is derived for any offset
+ * in constant time, but the v2 checksum of the middle region requires
+ * that @p offset was registered with fingersum_add_offset() before
+ * the middle region was processed.  If @p v2 is @c NULL, only the v1
+ * checksum is calculated, and the offset need not be registered.
+ *
+ * @return 0 if successful, -1 otherwise.  If an error occurs, the
+ *         global variable @c errno is set to @c ERANGE if the range
+ *         partially overlaps the middle region or @c ENOENT if the v2
+ *         checksum was requested for an offset that was not
+ *         registered in time.
+ */
+static int
+_ar_cksum_range(const struct fingersum_context *ctx,
+                int64_t offset,
+                int64_t first,
+                int64_t last,
+                uint32_t *v1,
+                uint32_t *v2)
+{
+    int64_t f_mid, i_mid, j;
+    uint64_t p;
+    uint32_t s;
+    size_t m;
+
+
+    if (first < 1)
+        first = 1;
+    if (last > ctx->duration)
+        last = ctx->duration;
+
+    i_mid = (2 * 5 * 588 + 1) + 1;
+    f_mid = ctx->duration - (2 * 5 * 588 + 1);
+    if (i_mid <= f_mid && first <= f_mid && last >= i_mid) {
+        if (first > i_mid || last < f_mid) {
+            errno = ERANGE;
+            return (-1);
+        }
+
+        if (v2 != NULL) {
+            for (m = 0; m < ctx->nmemb; m++) {
+                if (ctx->offsets[m].offset == offset)
+                    break;
+            }
+            if (m == ctx->nmemb || ctx->offsets[m].pending != 0) {
+                errno = ENOENT;
+                return (-1);
+            }
+        }
+
+        s = ctx->mid_sof - (uint32_t)offset * ctx->mid_sum;
+        *v1 += s;
+        if (v2 != NULL)
+            *v2 += s + ctx->offsets[m].hi;
+
+        for (j = first; j < i_mid; j++) {
+            p = (j - offset) * (uint64_t)_frame(ctx, j);
+            *v1 += p;
+            if (v2 != NULL)
+                *v2 += (p >> 32) + p;
+        }
+        first = f_mid + 1;
+    }
+
+    for (j = first; j <= last; j++) {
+        p = (j - offset) * (uint64_t)_frame(ctx, j);
+        *v1 += p;
+        if (v2 != NULL)
+            *v2 += (p >> 32) + p;
+    }
+
+    return (0);
+}
+
+
 #if 0
 // XXX Giant wart; should go!
 static uint32_t
@@ -2902,30 +4888,32 @@ fingersum_get_result_3(struct fingersum_context *leader,
     struct fp3_ar *result;
     struct _fingersum_offset *offset_leader, *offset_trailer, *offset_center;
     void *p;
+    uint32_t checksum_v1[3], checksum_v2[3];
+    int64_t duration, k;
     size_t i, j;
 
 //    printf("fingersum_get_result_3() #0\n");
 
-    // Ensure all data has been processed for all streams.  XXX Are we
-    // sure the streams each have a Chromaprint context?
-    if (leader != NULL && leader->samples_tot < 2 * leader->stream->duration) {
-        if (_process(leader, leader->cc, -1) != 0)
-            return (NULL);
-    }
+    // Ensure all data has been processed for the center stream.  XXX
+    // Are we sure the streams each have a Chromaprint context?
+    //
+    // Across the track boundaries, only the last samples of the
+    // leader and the first samples of the trailer are needed, so the
+    // neighbours are not decoded in full.
+    if (leader != NULL && _process_tail(leader) != 0)
+        return (NULL);
 
 //    printf("fingersum_get_result_3() #1\n");
 
-    if (center != NULL && center->samples_tot < 2 * center->stream->duration) {
-        if (_process(center, center->cc, -1) != 0)
-            return (NULL);
+    if (center != NULL && (_complete(center, center->cc) != 0 ||
+                           _process_pending(center) != 0)) {
+        return (NULL);
     }
 
 //    printf("fingersum_get_result_3() #2\n");
 
-    if (trailer != NULL && trailer->samples_tot < 2 * trailer->stream->duration) {
-        if (_process(trailer, trailer->cc, -1) != 0)
-            return (NULL);
-    }
+    if (trailer != NULL && _process_head(trailer) != 0)
+        return (NULL);
 
 //    printf("fingersum_get_result_3() #3\n");
 
@@ -3002,6 +4990,34 @@ fingersum_get_result_3(struct fingersum_context *leader,
         result->checksums = p;
         result->checksums[result->nmemb].offset = offset_center->offset;
 
+
+        /* Derive the AccurateRip checksums of the center track at
+         * the current offset: 0 for the lead-in, 1 for the bulk, and
+         * 2 for the lead-out.  See _feed_middle() and
+         * _ar_cksum_range().
+         */
+        for (j = 0; j < 3; j++) {
+            checksum_v1[j] = 0;
+            checksum_v2[j] = 0;
+        }
+        duration = center->duration;
+        k = offset_center->offset;
+        if (_ar_cksum_range(center, k,
+                            1 + k,
+                            1 * 5 * 588 - 1 + k,
+                            checksum_v1 + 0, checksum_v2 + 0) != 0 ||
+            _ar_cksum_range(center, k,
+                            1 * 5 * 588 + k,
+                            duration - 1 * 5 * 588 + k,
+                            checksum_v1 + 1, checksum_v2 + 1) != 0 ||
+            _ar_cksum_range(center, k,
+                            duration - 1 * 5 * 588 + 1 + k,
+                            duration + k,
+                            checksum_v1 + 2, checksum_v2 + 2) != 0) {
+            fp3_ar_free(result);
+            return (NULL);
+        }
+
 //        printf("fingersum_get_result_3() #5.3\n");
 
 //        size_t i;
@@ -3034,9 +5050,9 @@ fingersum_get_result_3(struct fingersum_context *leader,
                 len = (2 * 5 * 588 + 1) * 2 * sizeof(int16_t);
 
                 result->checksums[result->nmemb].checksum_v1 +=
-                    offset_center->checksum_v1[0];
+                    checksum_v1[0];
                 result->checksums[result->nmemb].checksum_v2 +=
-                    offset_center->checksum_v2[0];
+                    checksum_v2[0];
                 result->checksums[result->nmemb].crc32_eac = crc32(
                     result->checksums[result->nmemb].crc32_eac, buf, len);
 
@@ -3057,13 +5073,13 @@ fingersum_get_result_3(struct fingersum_context *leader,
             }
 
             result->checksums[result->nmemb].checksum_v1 +=
-                offset_center->checksum_v1[1];
+                checksum_v1[1];
             result->checksums[result->nmemb].checksum_v2 +=
-                offset_center->checksum_v2[1];
+                checksum_v2[1];
             result->checksums[result->nmemb].crc32_eac = crc32_combine(
                 result->checksums[result->nmemb].crc32_eac,
-                offset_center->crc32[1],
-                (center->stream->duration - (2 * 5 * 588 + 1) - (2 * 5 * 588 + 1)) * 2 * sizeof(int16_t));
+                center->crc32[1],
+                (center->duration - (2 * 5 * 588 + 1) - (2 * 5 * 588 + 1)) * 2 * sizeof(int16_t));
 
             if (trailer != NULL) {
                 /* XXX This part appears to be buggered (for AR)!  See
@@ -3077,10 +5093,10 @@ fingersum_get_result_3(struct fingersum_context *leader,
 
                 result->checksums[result->nmemb].checksum_v1 = _ar1_cksum(
                     result->checksums[result->nmemb].checksum_v1,
-                    center->stream->duration - (1 * 5 * 588 + 0) + 1, buf, len);
+                    center->duration - (1 * 5 * 588 + 0) + 1, buf, len);
                 result->checksums[result->nmemb].checksum_v2 = _ar2_cksum(
                     result->checksums[result->nmemb].checksum_v2,
-                    center->stream->duration - (1 * 5 * 588 + 0) + 1, buf, len);
+                    center->duration - (1 * 5 * 588 + 0) + 1, buf, len);
 
                 buf = (void *)center->samples_end;
                 len = (2 * 5 * 588 + 1 + offset_center->offset) * 2 * sizeof(int16_t);
@@ -3109,9 +5125,9 @@ fingersum_get_result_3(struct fingersum_context *leader,
 
 #if 0
                 result->checksums[result->nmemb].checksum_v1 =
-                    offset_center->checksum_v1[0];
+                    checksum_v1[0];
                 result->checksums[result->nmemb].checksum_v2 =
-                    offset_center->checksum_v2[0];
+                    checksum_v2[0];
 
                 for (i = 0; i < offset_center->offset; i++) {
                     l = i + 1 - offset_center->offset;
@@ -3158,22 +5174,22 @@ fingersum_get_result_3(struct fingersum_context *leader,
             }
 
             result->checksums[result->nmemb].checksum_v1 +=
-                offset_center->checksum_v1[1];
+                checksum_v1[1];
             result->checksums[result->nmemb].checksum_v2 +=
-                offset_center->checksum_v2[1];
+                checksum_v2[1];
             result->checksums[result->nmemb].crc32_eac = crc32_combine(
                 result->checksums[result->nmemb].crc32_eac,
-                 offset_center->crc32[1],
-                (center->stream->duration - (2 * 5 * 588 + 1) - (2 * 5 * 588 + 1)) * 2 * sizeof(int16_t));
+                 center->crc32[1],
+                (center->duration - (2 * 5 * 588 + 1) - (2 * 5 * 588 + 1)) * 2 * sizeof(int16_t));
 
             if (trailer != NULL) {
                 result->checksums[result->nmemb].checksum_v1 +=
-                    offset_center->checksum_v1[2];
+                    checksum_v1[2];
                 result->checksums[result->nmemb].checksum_v2 +=
-                    offset_center->checksum_v2[2];
+                    checksum_v2[2];
                 result->checksums[result->nmemb].crc32_eac = crc32_combine(
                     result->checksums[result->nmemb].crc32_eac,
-                    offset_center->crc32[2],
+                    center->crc32[2],
                     (2 * 5 * 588 + 1) * 2 * sizeof(int16_t));
 
                 buf = (void *)(trailer->samples);
@@ -3217,15 +5233,15 @@ fingersum_get_result_3(struct fingersum_context *leader,
              * Coldplay's B-sides and rarities for an example.
              */
             result->checksums[result->nmemb].checksum_v1 =
-                offset_center->checksum_v1[1];
+                checksum_v1[1];
             result->checksums[result->nmemb].checksum_v2 =
-                offset_center->checksum_v2[1];
+                checksum_v2[1];
 
             if (leader != NULL) {
                 result->checksums[result->nmemb].checksum_v1 +=
-                    offset_center->checksum_v1[0];
+                    checksum_v1[0];
                 result->checksums[result->nmemb].checksum_v2 +=
-                    offset_center->checksum_v2[0];
+                    checksum_v2[0];
 
                 result->checksums[result->nmemb].crc32_eac = crc32(
                     crc32(0, Z_NULL, 0),
@@ -3240,14 +5256,14 @@ fingersum_get_result_3(struct fingersum_context *leader,
 
             result->checksums[result->nmemb].crc32_eac = crc32_combine(
                 result->checksums[result->nmemb].crc32_eac,
-                offset_center->crc32[1],
-                (center->stream->duration - (2 * 5 * 588 + 1) - (2 * 5 * 588 + 1)) * 2 * sizeof(int16_t));
+                center->crc32[1],
+                (center->duration - (2 * 5 * 588 + 1) - (2 * 5 * 588 + 1)) * 2 * sizeof(int16_t));
 
             if (trailer != NULL) {
                 result->checksums[result->nmemb].checksum_v1 +=
-                    offset_center->checksum_v1[2];
+                    checksum_v1[2];
                 result->checksums[result->nmemb].checksum_v2 +=
-                    offset_center->checksum_v2[2];
+                    checksum_v2[2];
 
                 result->checksums[result->nmemb].crc32_eac = crc32(
                     result->checksums[result->nmemb].crc32_eac,
@@ -3273,9 +5289,14 @@ fingersum_get_fingerprint(struct fingersum_context *ctx,
                           ChromaprintContext *cc,
                           char **fingerprint)
 {
-    /* Finalise the fingerprint calculation if necessary.
+    /* Finalise the fingerprint calculation if necessary.  The
+     * fingerprint of a track of an image is calculated along with
+     * everything else about the image.
      */
-    if (ctx->fingerprint == NULL) {
+    if (ctx->image != NULL) {
+        if (_process_image(ctx->image) != 0)
+            return (-1);
+    } else if (ctx->fingerprint == NULL) {
         if (_process(ctx, cc, ctx->remaining) != 0)
             return (-1);
     }
@@ -3304,8 +5325,7 @@ fingersum_get_duration(const struct fingersum_context *ctx)
 {
     uint64_t duration;
 
-    duration = ctx->stream->time_base.num * ctx->stream->duration /
-        ctx->stream->time_base.den;
+    duration = ctx->time_base.num * ctx->duration / ctx->time_base.den;
 
     return ((unsigned int)duration);
 }
@@ -3404,7 +5424,7 @@ fingersum_get_metadata(const struct fingersum_context *ctx)
 
     entry = NULL;
     while ((entry = av_dict_get(
-                ctx->ic->metadata, "", entry, AV_DICT_IGNORE_SUFFIX)) != NULL) {
+                _metadata(ctx), "", entry, AV_DICT_IGNORE_SUFFIX)) != NULL) {
         value = strdup(entry->value);
         if (value == NULL) {
             metadata_free(metadata);
@@ -3511,7 +5531,7 @@ fingersum_get_sectors(const struct fingersum_context *ctx)
 {
     uint64_t sectors;
 
-    if (ctx->stream->duration % 588 != 0) { // XXX Sanity check
+    if (ctx->duration % 588 != 0) { // XXX Sanity check
         /* This may not succeed for lossy rips.
          *
          * XXX Should probably result in an error then; there's a
@@ -3520,11 +5540,11 @@ fingersum_get_sectors(const struct fingersum_context *ctx)
          * This happens for initial rip of Renegades.
          */
         fprintf(stderr, "NOT INTEGER MULTIPLE OF FRAME SIZE %" PRId64 "d\n",
-                ctx->stream->duration);
+                ctx->duration);
         return (-1);
     }
 
-    sectors = (ctx->stream->duration + 588 - 1) / 588;
+    sectors = (ctx->duration + 588 - 1) / 588;
 
     return ((unsigned long int)sectors);
 }
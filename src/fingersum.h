@@ -117,6 +117,42 @@ FINGERSUM_BEGIN_C_DECLS
 #include "structures.h" // New addition, for multiple offsets [offset_list]
 
 
+/**
+ * @brief Also key cache records by the CRC32 of the file contents
+ *
+ * Without this flag, a record is considered valid as long as the
+ * device, inode, size, and modification time of the file match.
+ * Hashing the contents catches files that were modified in place
+ * with their modification time preserved, at the cost of reading
+ * every file once more.
+ */
+#define FINGERSUM_CACHE_HASH 0x1
+
+
+/**
+ * @brief Enable or disable the persistent result cache
+ *
+ * Once a stream has been completely processed, its fingerprint and
+ * everything needed to answer fingersum_get_result_3() is written to
+ * a record in the directory @p path.  Contexts subsequently created
+ * for the same, unchanged file are initialised from that record
+ * without decoding any audio.  The directory, and any missing
+ * parents, are created if necessary.  A @p path of @c NULL disables
+ * the cache, which is the default.
+ *
+ * This function should be called before any fingersum contexts are
+ * created.
+ *
+ * @param path  Path to the cache directory, or @c NULL
+ * @param flags Bitwise OR of zero or more @c FINGERSUM_CACHE_ flags
+ * @return      0 if successful, -1 otherwise.  If an error occurs,
+ *              the global variable @c errno is set to indicate the
+ *              error.
+ */
+int
+fingersum_cache_init(const char *path, int flags);
+
+
 /**
  * @brief Allocate and initialise a fingersum context
  *
@@ -151,6 +187,73 @@ struct fingersum_context *
 fingersum_new(FILE *stream);
 
 
+/**
+ * @brief Create a fingersum context for a file
+ *
+ * Like fingersum_new(), except that the context opens the file at @p
+ * path itself and owns the stream.  While the context is parked, the
+ * stream is closed, such that parked contexts do not hold on to file
+ * descriptors.  The file must remain unchanged until the context is
+ * freed.
+ *
+ * @param path Path to the file of encoded audio data
+ * @return     Pointer to an opaque fingersum context if successful,
+ *             @c NULL otherwise.  If an error occurs, the global
+ *             variable @c errno is set to indicate the error.
+ */
+struct fingersum_context *
+fingersum_open(const char *path);
+
+
+/**
+ * @brief Allocate and initialise fingersum contexts for the tracks of
+ *        a disc image
+ *
+ * fingersum_new_image() creates one context for each of the @p nmemb
+ * tracks of the disc image in @p stream, such as a FLAC or WAV file
+ * described by a CUE sheet.  Track @c i starts @p offsets[i] sectors
+ * of 1/75:th of a second into the image, as given by INDEX 01 of the
+ * CUE sheet, and ends where the next track starts.  The last track
+ * ends with the image.  The contexts are stored in @p ctxs, and can
+ * be used like any other.
+ *
+ * The image is decoded in a single pass the first time the data of
+ * any of its tracks is needed, and the checksums, the CRC32:s, and
+ * the fingerprints of all the tracks are calculated in that pass.
+ * The contexts share the image and must each be released with
+ * fingersum_free(); the image is released along with the last of
+ * them, and @p stream must remain open until then.  Tracks of an
+ * image are never cached, cannot be passed to fingersum_diff(), and
+ * always use their own Chromaprint contexts.
+ *
+ * In addition to the errors of fingersum_new(), fingersum_new_image()
+ * will fail if:
+ *
+ * <dl>
+ *
+ *   <dt>@c EINVAL</dt><dd>@p nmemb is zero, or the offsets are not
+ *   strictly increasing within the image</dd>
+ *
+ *   <dt>@c ENOMSG</dt><dd>The image is not in stereo</dd>
+ *
+ * </dl>
+ *
+ * @param stream  Pointer to the stream of encoded audio data
+ * @param offsets Offsets of the tracks, in sectors
+ * @param nmemb   Number of tracks
+ * @param ctxs    Array of @p nmemb pointers to opaque fingersum
+ *                contexts, one for each track
+ * @return        0 if successful, -1 otherwise.  If an error occurs,
+ *                the global variable @c errno is set to indicate the
+ *                error.
+ */
+int
+fingersum_new_image(FILE *stream,
+                    const long int *offsets,
+                    size_t nmemb,
+                    struct fingersum_context **ctxs);
+
+
 /**
  * @brief Free a fingersum context and all its contents
  *
@@ -163,6 +266,46 @@ void
 fingersum_free(struct fingersum_context *ctx);
 
 
+/**
+ * @brief Release the decoder of a fingersum context
+ *
+ * Closes the input context, the decoder, and the Chromaprint context
+ * of @p ctx, while keeping the results computed so far and the
+ * samples retained from either end of the stream.  A parked context
+ * can be used like any other: it is reopened on the same stream, from
+ * its start, as soon as decoding needs to resume.  Checksums and
+ * fingerprints that were not complete when the context was parked are
+ * then restarted.  A stream passed to fingersum_new() must therefore
+ * remain open and unchanged until the context is freed, while a
+ * stream opened by fingersum_open() is closed until it is needed
+ * again.
+ *
+ * The tracks of a disc image share the decoder of the image, and are
+ * not affected.
+ *
+ * @param ctx Pointer to an opaque fingersum context
+ * @return    0 if successful, -1 otherwise.  If an error occurs, the
+ *            global variable @c errno is set to indicate the error.
+ */
+int
+fingersum_park(struct fingersum_context *ctx);
+
+
+/**
+ * @brief Estimate the memory of a live fingersum context
+ *
+ * The estimate is meant for budgeting the number of contexts that are
+ * decoded at the same time.  It includes the tables for the offset
+ * window and the checksums, which depend on the duration of the
+ * stream, and a fixed allowance for the decoder.
+ *
+ * @param ctx Pointer to an opaque fingersum context
+ * @return    Estimated size of @p ctx while it is decoded, in bytes
+ */
+size_t
+fingersum_get_size(const struct fingersum_context *ctx);
+
+
 #if 0
 /**
  * @brief Calculate the AccurateRip checksums
@@ -275,6 +418,27 @@ struct metadata *
 fingersum_get_metadata(const struct fingersum_context *ctx);
 
 
+/**
+ * @brief Override the metadata of the audio stream
+ *
+ * Sets the tag @p key to @p value for the context, without modifying
+ * the stream itself.  Tags that are not overridden are taken from the
+ * stream.  This is used to attach the metadata from a CUE sheet to
+ * the tracks of a disc image.
+ *
+ * @param ctx   Pointer to an opaque fingersum context
+ * @param key   Name of the tag, as used by Libav, e.g. "title"
+ * @param value Value of the tag
+ * @return      0 if successful, -1 otherwise.  If an error occurs,
+ *              the global variable @c errno is set to indicate the
+ *              error.
+ */
+int
+fingersum_set_metadata(struct fingersum_context *ctx,
+                       const char *key,
+                       const char *value);
+
+
 /**
  * @brief Get the duration of the audio stream in sectors
  *
@@ -333,12 +497,108 @@ fingersum_check_checksum2(struct fingersum_context *leader,
                           uint32_t checksum);
 #endif
 
+/**
+ * @brief Set the window of offsets searched for the stream
+ *
+ * fingersum_find_offset() and fingersum_find_offsets() consider the
+ * offsets in [-@p window, +@p window] samples, 1024 by default.  The
+ * tables behind the search take (2 * @p window + 588 + 1) * 8 bytes,
+ * and they are only allocated for tracks that are long enough to be
+ * searched at all.  A narrow window saves memory when many contexts
+ * are open and only small offsets are of interest.
+ *
+ * The window should be set before the stream is processed.  The
+ * cache is consulted with the new window, so a stream whose record
+ * was written with the same window is not decoded.  Otherwise, if
+ * the stream has been processed already, it will be decoded again.
+ *
+ * @param ctx    Pointer to an opaque fingersum context
+ * @param window Largest offset to search, in samples.  It must not
+ *               exceed 5 * 588, the largest offset for which the
+ *               AccurateRip checksums can be computed.
+ * @return       0 if successful, -1 otherwise.  If an error occurs,
+ *               the global variable @c errno is set to indicate the
+ *               error.
+ */
+int
+fingersum_set_offset_window(struct fingersum_context *ctx, size_t window);
+
+
 struct fp3_offset_list *
 fingersum_find_offset(const struct fingersum_context *ctx, uint32_t crc);
 
 struct fp3_offset_list *
 fingersum_find_offset_eac(const struct fingersum_context *ctx, uint32_t crc32);
 
+
+/**
+ * @brief An offset-finding CRC and an offset at which it matches
+ */
+struct fingersum_match
+{
+    /* The offset-finding CRC, as given to fingersum_find_offsets()
+     */
+    uint32_t crc;
+
+    /* The offset at which the CRC matches the stream
+     */
+    int32_t offset;
+};
+
+
+/**
+ * @brief Find the offsets of many offset-finding CRCs at once
+ *
+ * fingersum_find_offsets() is equivalent to calling
+ * fingersum_find_offset() for each of the @p nmemb CRCs in @p crcs,
+ * but the offset-finding sums are evaluated once for every offset in
+ * the window, rather than once per CRC and offset.  Popular discs
+ * have dozens of pressings in an AccurateRip response, all of which
+ * are checked against the same stream.  As with
+ * fingersum_find_offset(), CRCs that are zero never match.
+ *
+ * Upon successful completion, @p *matches points to an array of the
+ * matching pairs, sorted by offset, which must be freed by the
+ * caller.  A CRC that is repeated in @p crcs is only reported once.
+ *
+ * @param ctx     Pointer to an opaque fingersum context
+ * @param crcs    Offset-finding CRCs from AccurateRip
+ * @param nmemb   Number of CRCs in @p crcs
+ * @param matches Pointer to the array of matches, or @c NULL if there
+ *                are none
+ * @return        The number of matches if successful, -1 otherwise.
+ *                If an error occurs, the global variable @c errno is
+ *                set to indicate the error.
+ */
+ssize_t
+fingersum_find_offsets(const struct fingersum_context *ctx,
+                       const uint32_t *crcs,
+                       size_t nmemb,
+                       struct fingersum_match **matches);
+
+#ifdef USE_CRC32
+/**
+ * @brief Get the CRC32 of the whole track
+ *
+ * The fingersum_get_crc32() function returns the CRC32 of the audio
+ * data, as calculated by EAC and XLD, and the CRC32 where 16-bit
+ * samples that are zero are skipped, as reported by XLD.  The stream
+ * is processed to the end if that has not already happened.
+ *
+ * @param ctx           Pointer to an opaque fingersum context
+ * @param crc           Pointer to the CRC32, or @c NULL
+ * @param crc_skip_zero Pointer to the CRC32 that skips zero samples,
+ *                      or @c NULL
+ * @return              0 if successful, -1 otherwise.  If an error
+ *                      occurs, the global variable @c errno is set to
+ *                      indicate the error.
+ */
+int
+fingersum_get_crc32(struct fingersum_context *ctx,
+                    uint32_t *crc,
+                    uint32_t *crc_skip_zero);
+#endif
+
 int
 fingersum_add_offset(struct fingersum_context *ctx, int32_t offset);
 
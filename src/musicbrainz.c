@@ -26,19 +26,31 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <ctype.h>
 #include <errno.h>
-#include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
-#include <semaphore.h>
+#include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <musicbrainz5/mb5_c.h>
+#include <neon/ne_request.h>
+#include <neon/ne_socket.h>
 #include <neon/ne_string.h>
 
+#include "cache.h"
 #include "musicbrainz.h"
 #include "ratelimit.h"
 #include "simpleq.h"
+#include "store.h"
 
 /* XXX This should be the MusicBrainz default.
  */
@@ -46,6 +58,28 @@
 #define MB_RETRIES 5
 #define MB_SLEEP 5
 
+/* Default number of worker threads.  Against musicbrainz.org, the
+ * workers are serialised by the rate limiter anyway, but a local
+ * mirror can serve them concurrently.
+ */
+#define MB_WORKERS 4
+
+/* Default memory budget of the query cache, and the estimated size of
+ * one parsed release, both in octets.  The releases are owned by the
+ * MusicBrainz library, so their actual size is not known.
+ */
+#define MB_CACHE_BUDGET (64 * 1024 * 1024)
+#define MB_RELEASE_SIZE (32 * 1024)
+
+
+/* The status of a query: _QUERY_PENDING until a worker has executed
+ * it, then _QUERY_DONE if it succeeded or _QUERY_FAILED if it did
+ * not.
+ */
+#define _QUERY_PENDING 0
+#define _QUERY_DONE    1
+#define _QUERY_FAILED  2
+
 
 /* A parameter, a name-value pair
  */
@@ -87,13 +121,43 @@ struct _query
      */
     size_t nmemb_releases;
 
-    /* XXX This is something to distinguish the status of the query
-     * (e.g. if it has been executed or not).
+    /* The responses that hold the releases, and their number
+     */
+    Mb5Metadata *metadata;
+    size_t nmemb_metadata;
+
+    /* The canonical form of the query, see _query_key()
+     */
+    char *key;
+
+    /* The entry of the query in the cache.  Each thread currently
+     * reading the releases holds a reference.
+     */
+    struct cache_entry entry;
+
+    /* Non-zero if any of the releases were handed out by
+     * musicbrainz_get_release().  Only accessed atomically.
+     */
+    int exported;
+
+    /* One of _QUERY_PENDING, _QUERY_DONE, or _QUERY_FAILED.  Only
+     * accessed atomically; changes are signalled on _cond_processed.
      *
      * See _pool_request structure in pool.c
      */
     int status;
 
+    /* Queries with higher priority are executed first, queries with
+     * equal priority in the order they were submitted
+     */
+    int priority;
+
+    /* Non-zero while the query is waiting for a worker in _queries.
+     * This and the priority are only accessed with _mutex_queries
+     * held.
+     */
+    int queued;
+
     /* Simple queue
      */
     SIMPLEQ_ENTRY(_query) queries;
@@ -105,64 +169,110 @@ struct _query
 struct musicbrainz_ctx
 {
     /* This is not really a query, but represents the connection to
-     * the remote MusicBrainz server?
+     * the remote MusicBrainz server?  Each worker has its own,
+     * because the last error is kept there.
      */
-    Mb5Query Query;
+    Mb5Query *Queries;
+
+    /* The worker threads.  These are opaque structures which must be
+     * initialised with pthread_create(3) before use.
+     */
+    pthread_t *threads;
+
+    /* Number of workers, and the number of those that were started
+     */
+    size_t nmemb;
+    size_t started;
+
+    /* Non-zero if requests must be rate limited, i.e. unless a
+     * server other than musicbrainz.org is used
+     */
+    int ratelimit;
+
+    /* Non-zero once the workers should exit.  Only accessed with
+     * _mutex_queries held.
+     */
+    int shutdown;
+
+    /* The server the proxy forwards requests to, see _proxy_start().
+     * The host is @c NULL for musicbrainz.org.
+     */
+    char *upstream_host;
+    unsigned int upstream_port;
+
+    /* The listening socket of the proxy, or -1 if the store is not
+     * used, its port, and the thread accepting connections
+     */
+    int proxy_fd;
+    unsigned int proxy_port;
+    pthread_t proxy_thread;
+
+    /* Number of connections being served, and non-zero once the proxy
+     * should exit.  Only accessed with _mutex_proxy held.
+     */
+    size_t proxy_conns;
+    int proxy_shutdown;
 };
 
 
-/* Define the structure for the head of the queries yet to be executed.
+/* Argument to _start(): the context and the index of the worker
  */
-SIMPLEQ_HEAD(_head, _query);
+struct _worker
+{
+    struct musicbrainz_ctx *ctx;
+    size_t index;
+};
 
-/* FIFO queue of queries to execute.
- */
-struct _head _queries = SIMPLEQ_HEAD_INITIALIZER(_queries);
 
-/* Mutex to ensure exclusive access to the result cache
+/* Define the structure for the head of the queries yet to be executed.
  */
-static pthread_mutex_t _mutex_cache = PTHREAD_MUTEX_INITIALIZER;
+SIMPLEQ_HEAD(_head, _query);
 
-/* Mutex to ensure exclusive access to the queue of unexecuted
- * queries.
+/* Queue of queries to execute, in order of decreasing priority.
  */
-static pthread_mutex_t _mutex_queries = PTHREAD_MUTEX_INITIALIZER;
+struct _head _queries = SIMPLEQ_HEAD_INITIALIZER(_queries);
 
-/* The single worker thread.  This is an opaque structure which must
- * be initialised with pthread_create(3) before use.
+/* Lock for the query cache.  Lookups only need the read lock.
+ * Where both locks are needed, _lock_cache must be taken before
+ * _mutex_queries.
  */
-static pthread_t _thread;
+static pthread_rwlock_t _lock_cache = PTHREAD_RWLOCK_INITIALIZER;
 
-/* Name of the named query semaphore
+/* Mutex and condition variable signalled whenever a query completes
  */
-static char *_name_queued = NULL;
+static pthread_mutex_t _mutex_processed = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _cond_processed = PTHREAD_COND_INITIALIZER;
 
-/* Name of the named query semaphore
+/* Mutex to ensure exclusive access to the queue of unexecuted
+ * queries, and the condition variable signalled whenever a query is
+ * queued.
  */
-static char *_name_processed = NULL;
+static pthread_mutex_t _mutex_queries = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _cond_queued = PTHREAD_COND_INITIALIZER;
 
-/* The named query semaphore
- *
- * XXX This is not unlinked!
- */
-static sem_t *_sem_queued = SEM_FAILED;
+static int
+_query_evictable(const struct cache_entry *entry);
 
-/* The named results semaphore.  XXX Should use a condition variable
- * instead
- * (https://en.wikipedia.org/wiki/Monitor_(synchronization)#Condition_variables)?
- */
-static sem_t *_sem_processed = SEM_FAILED;
+static void
+_query_evict(struct cache_entry *entry);
 
-/* Cache of completed queries
+/* Cache of submitted queries, completed or not
  *
- * This is not implemented as a queue because it is only appended to
- * and items are never removed.
+ * Queries are keyed on their canonical form, see cache.h.  Because
+ * pending queries are in the cache, too, identical queries are
+ * coalesced: a query that matches one in flight waits for that one
+ * instead of being queued again.  Lookups only need the read lock.
+ * Pending queries, and queries being read, are never evicted.
  */
-struct _query **_cache = NULL;
+static struct cache _cache =
+    CACHE_INITIALIZER(MB_CACHE_BUDGET, _query_evictable, _query_evict);
 
-/* Number of completed queries in the cache.
+/* Responses of evicted queries whose releases were handed out.  The
+ * caller may still use those, so they are kept until
+ * musicbrainz_free().
  */
-size_t _nmemb = 0;
+static Mb5Metadata *_retired = NULL;
+static size_t _nmemb_retired = 0;
 
 
 static struct _param *
@@ -222,7 +332,17 @@ _query_free(struct _query *query)
         free(query->params);
     }
 
-    // XXX Free the releases
+    if (query->releases != NULL)
+        free(query->releases);
+
+    if (query->metadata != NULL) {
+        for (i = 0; i < query->nmemb_metadata; i++)
+            mb5_metadata_delete(query->metadata[i]);
+        free(query->metadata);
+    }
+
+    if (query->key != NULL)
+        free(query->key);
 
     free(query);
 }
@@ -256,8 +376,13 @@ _query_add_param(struct _query *query,
 }
 
 
+/* The _query_new() function creates a query whose canonical form is
+ * @p key, as returned by _query_key().  The query takes ownership of
+ * @p key, also if it fails.
+ */
 static struct _query *
-_query_new(const char *entity,
+_query_new(char *key,
+           const char *entity,
            const char *id,
            const char *resource,
            size_t nmemb_params,
@@ -268,8 +393,10 @@ _query_new(const char *entity,
     size_t i;
 
     query = malloc(sizeof(struct _query));
-    if (query == NULL)
+    if (query == NULL) {
+        free(key);
         return (NULL);
+    }
 
     query->entity = NULL;
     query->id = NULL;
@@ -279,6 +406,16 @@ _query_new(const char *entity,
 
     query->releases = NULL;
     query->nmemb_releases = 0;
+    query->metadata = NULL;
+    query->nmemb_metadata = 0;
+
+    query->key = key;
+    cache_entry_init(&query->entry);
+    query->exported = 0;
+
+    query->status = _QUERY_PENDING;
+    query->priority = 0;
+    query->queued = 0;
 
     query->entity = strdup(entity);
     if (query->entity == NULL) {
@@ -343,8 +480,21 @@ _query_add_metadata(struct _query *query, Mb5Metadata Metadata)
 {
     Mb5Release Release;
     Mb5ReleaseList ReleaseList;
+    void *p;
     int i, size;
 
+
+    /* Keep the response, because it owns the releases.
+     */
+    p = realloc(query->metadata,
+                (query->nmemb_metadata + 1) * sizeof(Mb5Metadata));
+    if (p == NULL) {
+        mb5_metadata_delete(Metadata);
+        return (-1);
+    }
+    query->metadata = p;
+    query->metadata[query->nmemb_metadata++] = Metadata;
+
     ReleaseList = mb5_metadata_get_releaselist(Metadata);
     if (ReleaseList != NULL) {
         printf("GOT A %d-LONG RELEASELIST at %p\n",
@@ -375,151 +525,238 @@ _query_add_metadata(struct _query *query, Mb5Metadata Metadata)
 }
 
 
-/* Returns non-zero if @p query contains the parameter defined by @p
- * name and @p value.  The query may contain additional parameters.
+/* Order parameters by name, then by value
  */
-static struct _param *
-_query_has_param(struct _query *query,
-                 const char *name,
-                 const char *value)
+static int
+_param_cmp(const void *a, const void *b)
 {
-    size_t i;
+    const struct _param *pa, *pb;
+    int ret;
 
-    for (i = 0; i < query->nmemb_params; i++) {
-        if (strcmp(query->params[i]->name, name) == 0 &&
-            strcmp(query->params[i]->value, value) == 0) {
-            return (query->params[i]);
-        }
-    }
+    pa = (const struct _param *)a;
+    pb = (const struct _param *)b;
 
-    return (NULL);
+    ret = strcmp(pa->name, pb->name);
+    if (ret != 0)
+        return (ret);
+    return (strcmp(pa->value, pb->value));
 }
 
 
-/* Note that cache entries will never have the @c limit or @c offset
- * parameters.
+/* The _query_key() function returns the canonical form of a query:
+ * the entity, the id, the resource, and the parameters sorted by name
+ * and value, separated by ASCII unit separators.  The @c limit and @c
+ * offset parameters are not part of the key, because the cached
+ * query holds all pages.  The hash of the key is returned in @p hash.
+ * The key must be freed by the caller.
+ *
+ * @return The key, or @c NULL if an error occurs.  In that case, the
+ *         global variable @c errno is set to indicate the error.
  */
-static struct _query *
-_add_to_cache(struct musicbrainz_ctx *ctx, struct _query *query)
+static char *
+_query_key(const char *entity,
+           const char *id,
+           const char *resource,
+           size_t nmemb_params,
+           char **param_names,
+           char **param_values,
+           size_t *hash)
 {
-    void *p;
+    struct _param *params;
+    char *key, *p;
+    size_t i, len, n;
+
 
-    if (pthread_mutex_lock(&_mutex_cache) != 0)
+    params = calloc(nmemb_params > 0 ? nmemb_params : 1,
+                    sizeof(struct _param));
+    if (params == NULL)
         return (NULL);
 
-    p = realloc(_cache, (_nmemb + 1) * sizeof(struct _query *));
-    if (p == NULL) {
-        pthread_mutex_unlock(&_mutex_cache);
+    len = strlen(entity) + 1 + (id != NULL ? strlen(id) : 0) + 1 +
+        strlen(resource) + 1;
+    for (i = n = 0; i < nmemb_params; i++) {
+        if (strcmp(param_names[i], "limit") == 0)
+            continue;
+        if (strcmp(param_names[i], "offset") == 0)
+            continue;
+        params[n].name = param_names[i];
+        params[n].value = param_values[i];
+        len += strlen(param_names[i]) + 1 + strlen(param_values[i]) + 1;
+        n++;
+    }
+    qsort(params, n, sizeof(struct _param), _param_cmp);
+
+    key = malloc(len);
+    if (key == NULL) {
+        free(params);
         return (NULL);
     }
 
-    _cache = p;
-    _cache[_nmemb++] = query;
-    pthread_mutex_unlock(&_mutex_cache);
-    return (query);
+    p = key + sprintf(
+        key, "%s\037%s\037%s", entity, id != NULL ? id : "", resource);
+    for (i = 0; i < n; i++)
+        p += sprintf(p, "\037%s=%s", params[i].name, params[i].value);
+    free(params);
+
+
+    *hash = cache_hash(key);
+    return (key);
 }
 
 
-/* Note that cache entries will never have the @c limit or @c offset
- * parameters.
+/* The _query_size() function returns an estimate of the memory used
+ * by @p query and its releases, in octets.
  */
-static struct _query *
-_find_in_cache(struct musicbrainz_ctx *ctx,
-               const char *entity,
-               const char *id,
-               const char *resource,
-               size_t nmemb_params,
-               char **param_names,
-               char **param_values)
+static size_t
+_query_size(const struct _query *query)
 {
-    struct _query *query;
-    size_t i, j;
+    return (sizeof(struct _query) +
+            2 * (strlen(query->key) + 1) +
+            query->nmemb_params * sizeof(struct _param) +
+            query->nmemb_releases * (sizeof(Mb5Release) + MB_RELEASE_SIZE));
+}
 
-    if (pthread_mutex_lock(&_mutex_cache) != 0)
-        return (NULL);
 
-    for (i = 0; i < _nmemb; i++) {
-        query = _cache[i];
+/* The _retire() function releases the responses of @p query, which
+ * is about to be freed.  Responses whose releases were handed out
+ * are kept until musicbrainz_free(); the others are freed along with
+ * the query.  The caller must hold _lock_cache for writing.
+ */
+static void
+_retire(struct _query *query)
+{
+    void *p;
+    size_t i;
 
-        if (strcmp(query->entity, entity) != 0)
-            continue;
+    if (__atomic_load_n(&query->exported, __ATOMIC_ACQUIRE) == 0 ||
+        query->nmemb_metadata == 0) {
+        return;
+    }
 
-        if (query->id == NULL) {
-            if (id != NULL)
-                continue;
-        } else if (id == NULL || strcmp(query->id, id) != 0)
-            continue;
+    p = realloc(_retired,
+                (_nmemb_retired + query->nmemb_metadata) *
+                sizeof(Mb5Metadata));
+    if (p == NULL) {
+        /* Leak the responses rather than pulling them from under the
+         * caller.
+         */
+        free(query->metadata);
+    } else {
+        _retired = p;
+        for (i = 0; i < query->nmemb_metadata; i++)
+            _retired[_nmemb_retired++] = query->metadata[i];
+        free(query->metadata);
+    }
+    query->metadata = NULL;
+    query->nmemb_metadata = 0;
+}
 
-        if (strcmp(query->resource, resource) != 0)
-            continue;
 
-        for (j = 0; j < nmemb_params; j++) {
-            if (strcmp(param_names[j], "limit") == 0)
-                continue;
-            if (strcmp(param_names[j], "offset") == 0)
-                continue;
-            if (_query_has_param(
-                    query, param_names[j], param_values[j]) == NULL) {
-                break;
-            }
-        }
+/* The _query_evictable() function returns non-zero unless the query
+ * in @p entry is still pending.
+ */
+static int
+_query_evictable(const struct cache_entry *entry)
+{
+    const struct _query *query;
 
-        if (j == nmemb_params) {
-            pthread_mutex_unlock(&_mutex_cache);
-            return (query);
-        }
-    }
+    query = CACHE_CONTAINER(entry, const struct _query, entry);
+    return (__atomic_load_n(&query->status, __ATOMIC_ACQUIRE) !=
+            _QUERY_PENDING);
+}
 
-    pthread_mutex_unlock(&_mutex_cache);
-    return (NULL);
+
+/* The _query_evict() function frees the query in @p entry, which was
+ * evicted from the cache.  The caller must hold _lock_cache for
+ * writing.
+ */
+static void
+_query_evict(struct cache_entry *entry)
+{
+    struct _query *query;
+
+    query = CACHE_CONTAINER(entry, struct _query, entry);
+    _retire(query);
+    _query_free(query);
 }
 
 
-/* XXX Duplication w.r.t. pool.c
+/* The _query_reset() function discards whatever @p query gathered
+ * before it failed, so that it can be executed again.  The caller
+ * must hold _lock_cache for writing.
  */
-static int
-_sem_open(char **name, sem_t **sem)
+static void
+_query_reset(struct _query *query)
 {
-    char *n;
-    sem_t *s;
     size_t i;
-    int fd;
 
+    if (query->releases != NULL)
+        free(query->releases);
+    query->releases = NULL;
+    query->nmemb_releases = 0;
 
-    n = NULL;
-    s = SEM_FAILED;
-    for (i = 0; i < 256; i++) {
-        if (n != NULL)
-            free(n);
+    if (query->metadata != NULL) {
+        for (i = 0; i < query->nmemb_metadata; i++)
+            mb5_metadata_delete(query->metadata[i]);
+        free(query->metadata);
+    }
+    query->metadata = NULL;
+    query->nmemb_metadata = 0;
 
-        n = strdup("/tmp/sem_req.XXXXXX");
-        if (n == NULL)
-            break;
+    cache_resize(&_cache, &query->entry, _query_size(query));
+    __atomic_store_n(&query->status, _QUERY_PENDING, __ATOMIC_RELEASE);
+}
 
-        fd = mkstemp(n);
-        if (fd == -1)
-            break;
 
-        s = sem_open(n + 4, O_CREAT | O_EXCL, 0644,0);
-        if (close(fd) != 0 || unlink(n) != 0)
+/* The _enqueue() function inserts @p query into the queue of
+ * unexecuted queries, after all queries of the same or higher
+ * priority, and wakes up a worker.  The caller must hold
+ * _mutex_queries.
+ */
+static void
+_enqueue(struct _query *query)
+{
+    struct _query *prev, *q;
+
+    prev = NULL;
+    SIMPLEQ_FOREACH(q, &_queries, queries) {
+        if (q->priority < query->priority)
             break;
-        if (s != SEM_FAILED) {
-            *name = n;
-            *sem = s;
-            return (0);
-        } else if (errno == EPERM) {
-            errno = 0;
-        }
+        prev = q;
     }
 
-    if (i == 256)
-        errno = EBUSY;
+    if (prev == NULL)
+        SIMPLEQ_INSERT_HEAD(&_queries, query, queries);
+    else
+        SIMPLEQ_INSERT_AFTER(&_queries, prev, query, queries);
+    query->queued = 1;
 
-    if (s != SEM_FAILED)
-        sem_close(s);
-    if (n != NULL)
-        free(n);
-    return (-1);
+    pthread_cond_signal(&_cond_queued);
+}
+
+
+/* The _dequeue() function removes @p query from the queue of
+ * unexecuted queries.  The caller must hold _mutex_queries.
+ */
+static void
+_dequeue(struct _query *query)
+{
+    struct _query *prev, *q;
+
+    prev = NULL;
+    SIMPLEQ_FOREACH(q, &_queries, queries) {
+        if (q == query)
+            break;
+        prev = q;
+    }
+    if (q == NULL)
+        return;
+
+    if (prev == NULL)
+        SIMPLEQ_REMOVE_HEAD(&_queries, queries);
+    else
+        SIMPLEQ_REMOVE_AFTER(&_queries, prev, queries);
+    query->queued = 0;
 }
 
 
@@ -559,99 +796,1043 @@ _set_value(ne_buffer *buf, const char *format, ...)
 }
 
 
-/* Note somewhere else than here: offset is zero-based!
+/* The persistent response store
+ *
+ * The MusicBrainz library only hands out parsed responses, and it
+ * cannot parse a response it did not fetch itself.  Therefore, when
+ * the store is enabled, the workers send their requests to a small
+ * HTTP proxy on the loopback interface instead of the server.  The
+ * proxy saves the raw XML responses on disk, and serves them from
+ * there until they are older than the maximum age set by
+ * musicbrainz_store_init(), so the library parses them into Metadata
+ * as if they had come from the server.  Older records are
+ * revalidated with a conditional request, using the entity tag or
+ * the modification time of the stored response if the server
+ * provided either, and are served as they are if the server cannot
+ * be reached.
+ *
+ * Records are keyed on the canonical form of the request, see
+ * _store_key().  Unlike the key of the query cache, it includes the
+ * limit and offset parameters, because each record holds one page.
+ * The file name of a record is the 64-bit FNV-1a hash of its key, and
+ * the key is kept in the record to detect collisions.  Headers are in
+ * native byte order.
+ *
+ * A revalidated record is written out again with its new fetch time
+ * rather than patched in place, see store_commit(), so that the
+ * proxy threads never read a record that is half rewritten.
  */
-static int
-_process(struct _query *query, struct musicbrainz_ctx *ctx)
-{
-    Mb5Metadata Metadata;
-    tQueryResult result;
-    ne_buffer *msg, *val_limit, *val_offset;
-    char **names, **values;
-    size_t i, num_offset;
-    int http_code, size;
+#define MB_STORE_MAGIC "sndchkmb"
+#define MB_STORE_VERSION 1
 
+/* Maximum size of the headers of a request to the proxy, in octets
+ */
+#define MB_PROXY_REQUEST 16384
 
-    /* Construct a temporary set of name-value pairs for the
-     * parameters where the limit and offset values have been
-     * appended.  The offset item is guaranteed to be the last item in
-     * the arrays.
-     */
-    names = calloc(query->nmemb_params + 2, sizeof(char *));
-    if (names == NULL)
-        return (-1);
-    values = calloc(query->nmemb_params + 2, sizeof(char *));
-    if (values == NULL) {
-        free(names);
-        return (-1);
-    }
+static char *_store_path = NULL;
+static time_t _store_max_age = 0;
+static pthread_mutex_t _store_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-    for (i = 0; i < query->nmemb_params; i++) {
-        names[i] = query->params[i]->name;
-        values[i] = query->params[i]->value;
-    }
+/* Mutex and condition variable signalled whenever the proxy is done
+ * with a connection
+ */
+static pthread_mutex_t _mutex_proxy = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _cond_proxy = PTHREAD_COND_INITIALIZER;
 
-    msg = ne_buffer_create();
-    val_limit = ne_buffer_create();
-    val_offset = ne_buffer_create();
 
-    _set_value(val_limit, "%zd", MB_LIMIT);
-    names[query->nmemb_params + 0] = "limit";
-    values[query->nmemb_params + 0] = val_limit->data;
+struct _store_header
+{
+    char magic[8];
+    uint32_t version;
 
-//    _set_value(val_offset, "%zd", num_offset);
-    names[query->nmemb_params + 1] = "offset";
-//    values[query->nmemb_params + 1] = val_offset->data;
+    /* Length of the key that follows the header, in octets
+     */
+    uint32_t len_key;
 
+    /* Time the response was fetched or last revalidated, in seconds
+     * since the Epoch
+     */
+    int64_t fetched;
 
-    /* XXX Will fail here for Sid Vicious and UB40 on the old
-     * database.
-     *
-     * Outer loop [over i or offset] for paging, inner loop [over j]
-     * for retries
+    /* Lengths of the entity tag and the modification time, which
+     * follow the key, and of the response, which comes last, in
+     * octets.  The tag and the time are empty if the server did not
+     * provide them.
      */
-    num_offset = 0;
-    size = 0;
-    do {
-        _set_value(val_offset, "%zd", num_offset += size /* size + 0 */);
-        values[query->nmemb_params + 1] = val_offset->data;
-//        printf("INCREASING offset by %d to %s\n", size, val_offset->data);
+    uint32_t len_etag;
+    uint32_t len_modified;
+    uint64_t len_body;
+};
 
-        for (i = 0; ; i++) {
-            /* Ensure no more requests per unit time than are allowed.
-             * Rate limiting: no more than 1 request per second
-             * [http://musicbrainz.org/doc/Development/XML_Web_Service/Version_2]
-             *
-             * Note somewhere (maybe not here): we are assuming
-             * "browse" requests.  These should have query->id == NULL
-             * now...
-             */
-            if (ratelimit_musicbrainz() != 0) {
-                ne_buffer_destroy(val_offset);
-                ne_buffer_destroy(val_limit);
-                ne_buffer_destroy(msg);
-                free(values);
-                free(names);
-                return (-1);
-            }
 
-//            for (size_t j = 0; j < query->nmemb_params + 2; j++) {
-//                printf("PARAMETER %s=%s\n", names[j], values[j]);
-//            }
+/* A record in the store.  The strings are always NUL-terminated.
+ */
+struct _store_record
+{
+    time_t fetched;
+    char *etag;
+    char *modified;
+    char *body;
+    size_t len_body;
+};
 
-            Metadata = mb5_query_query(ctx->Query,
-                                       query->entity,
-                                       query->id != NULL ? query->id : "", // XXX Necessary?  Does mb5_query_query() handle NULL?
-                                       query->resource,
-                                       query->nmemb_params + 2,
-                                       names,
-                                       values);
-            if (Metadata != NULL)
-                break;
 
+/* Argument to _proxy_serve(): the context and the connected socket
+ */
+struct _connection
+{
+    struct musicbrainz_ctx *ctx;
+    int fd;
+};
 
-            /* 2014-11-17:
-             *
+
+int
+musicbrainz_store_init(const char *path, time_t max_age)
+{
+    char *p;
+
+    if (pthread_mutex_lock(&_store_mutex) != 0)
+        return (-1);
+
+    p = NULL;
+    if (path != NULL) {
+        if (store_mkdir(path) != 0 || (p = strdup(path)) == NULL) {
+            pthread_mutex_unlock(&_store_mutex);
+            return (-1);
+        }
+    }
+
+    if (_store_path != NULL)
+        free(_store_path);
+    _store_path = p;
+    _store_max_age = max_age;
+
+    if (pthread_mutex_unlock(&_store_mutex) != 0)
+        return (-1);
+    return (0);
+}
+
+
+static void
+_record_free(struct _store_record *rec)
+{
+    if (rec->etag != NULL)
+        free(rec->etag);
+    if (rec->modified != NULL)
+        free(rec->modified);
+    if (rec->body != NULL)
+        free(rec->body);
+    memset(rec, 0, sizeof(struct _store_record));
+}
+
+
+/* The _request_path() function returns the path the MusicBrainz
+ * library requests for @p entity, @p id, and @p resource.  Like the
+ * library, the resource is only used if there is an id.  The path
+ * must be freed by the caller.
+ */
+static char *
+_request_path(const char *entity, const char *id, const char *resource)
+{
+    char *path;
+    size_t len;
+
+    if (id == NULL)
+        id = "";
+    len = strlen("/ws/2/") + strlen(entity) + 1 + strlen(id) + 1 +
+        strlen(resource) + 1;
+    path = malloc(len);
+    if (path == NULL)
+        return (NULL);
+
+    if (id[0] == '\0')
+        snprintf(path, len, "/ws/2/%s", entity);
+    else if (resource[0] == '\0')
+        snprintf(path, len, "/ws/2/%s/%s", entity, id);
+    else
+        snprintf(path, len, "/ws/2/%s/%s/%s", entity, id, resource);
+    return (path);
+}
+
+
+/* The _store_key() function returns the canonical form of the
+ * request for @p path with the parameters @p param_names and @p
+ * param_values: the path followed by the parameters sorted by name
+ * and value, as in a URL but without encoding.  The key must be freed
+ * by the caller.
+ *
+ * @return The key, or @c NULL if an error occurs.  In that case, the
+ *         global variable @c errno is set to indicate the error.
+ */
+static char *
+_store_key(const char *path,
+           size_t nmemb_params,
+           char **param_names,
+           char **param_values)
+{
+    struct _param *params;
+    char *key, *p;
+    size_t i, len;
+
+
+    params = calloc(nmemb_params > 0 ? nmemb_params : 1,
+                    sizeof(struct _param));
+    if (params == NULL)
+        return (NULL);
+
+    len = strlen(path) + 1;
+    for (i = 0; i < nmemb_params; i++) {
+        params[i].name = param_names[i];
+        params[i].value = param_values[i];
+        len += 1 + strlen(param_names[i]) + 1 + strlen(param_values[i]);
+    }
+    qsort(params, nmemb_params, sizeof(struct _param), _param_cmp);
+
+    key = malloc(len);
+    if (key == NULL) {
+        free(params);
+        return (NULL);
+    }
+
+    p = key + sprintf(key, "%s", path);
+    for (i = 0; i < nmemb_params; i++) {
+        p += sprintf(p, "%c%s=%s",
+                     i == 0 ? '?' : '&', params[i].name, params[i].value);
+    }
+    free(params);
+
+    return (key);
+}
+
+
+/* The _url_decode() function decodes the URL-encoded string @p s in
+ * place.
+ */
+static void
+_url_decode(char *s)
+{
+    char *d;
+    unsigned int c;
+
+    for (d = s; *s != '\0'; d++, s++) {
+        if (*s == '+') {
+            *d = ' ';
+        } else if (*s == '%' &&
+                   isxdigit((unsigned char)s[1]) &&
+                   isxdigit((unsigned char)s[2])) {
+            sscanf(s + 1, "%2x", &c);
+            *d = (char)c;
+            s += 2;
+        } else {
+            *d = *s;
+        }
+    }
+    *d = '\0';
+}
+
+
+/* The _target_key() function returns the canonical form of the
+ * request for the URL-encoded @p target, such that it matches the
+ * key _store_key() computes for the path and the parameters the
+ * target was encoded from.  The key must be freed by the caller.
+ */
+static char *
+_target_key(const char *target)
+{
+    char **names, **values;
+    char *key, *p, *path, *q;
+    size_t n;
+
+
+    path = strdup(target);
+    if (path == NULL)
+        return (NULL);
+
+    for (n = 1, p = path; *p != '\0'; p++) {
+        if (*p == '&')
+            n += 1;
+    }
+    names = calloc(n, sizeof(char *));
+    values = calloc(n, sizeof(char *));
+    if (names == NULL || values == NULL) {
+        if (names != NULL)
+            free(names);
+        if (values != NULL)
+            free(values);
+        free(path);
+        return (NULL);
+    }
+
+
+    /* Split the query at the ampersands, and each parameter at the
+     * first equals sign.  A parameter without a value has an empty
+     * one.
+     */
+    n = 0;
+    p = strchr(path, '?');
+    if (p != NULL) {
+        *p++ = '\0';
+        for ( ; p != NULL; p = q) {
+            q = strchr(p, '&');
+            if (q != NULL)
+                *q++ = '\0';
+            if (*p == '\0')
+                continue;
+
+            names[n] = p;
+            p = strchr(p, '=');
+            if (p != NULL) {
+                *p++ = '\0';
+                values[n] = p;
+            } else {
+                values[n] = "";
+            }
+            _url_decode(names[n]);
+            _url_decode(values[n]);
+            n += 1;
+        }
+    }
+    _url_decode(path);
+
+    key = _store_key(path, n, names, values);
+    free(values);
+    free(names);
+    free(path);
+
+    return (key);
+}
+
+
+/* The _store_file() function returns the path to the record for @p
+ * key in the store, which must be freed by the caller.
+ */
+static char *
+_store_file(const char *key)
+{
+    char *file;
+    const char *p;
+    uint64_t hash;
+    size_t len;
+
+
+    /* 64-bit FNV-1a
+     */
+    hash = 14695981039346656037ULL;
+    for (p = key; *p != '\0'; p++)
+        hash = (hash ^ (unsigned char)*p) * 1099511628211ULL;
+
+    len = strlen(_store_path) + 1 + 2 + 1 + 16 + 1;
+    file = malloc(len);
+    if (file == NULL)
+        return (NULL);
+    snprintf(file, len, "%s/%02x/%016llx",
+             _store_path,
+             (unsigned int)(hash >> 56),
+             (unsigned long long)hash);
+
+    return (file);
+}
+
+
+/* The _read_string() function reads @p len octets from @p stream,
+ * and returns them as a NUL-terminated string which must be freed by
+ * the caller.
+ */
+static char *
+_read_string(FILE *stream, uint64_t len)
+{
+    char *s;
+
+    if (len >= SIZE_MAX)
+        return (NULL);
+    s = malloc(len + 1);
+    if (s == NULL)
+        return (NULL);
+    if (fread(s, 1, len, stream) != len) {
+        free(s);
+        return (NULL);
+    }
+    s[len] = '\0';
+    return (s);
+}
+
+
+/* The _store_load() function reads the record for @p key from the
+ * store into @p rec.  The response itself is only read if @p body is
+ * non-zero.  @p rec is always initialised, and must be released with
+ * _record_free().
+ *
+ * @return 0 if there is a valid record, -1 otherwise
+ */
+static int
+_store_load(const char *key, struct _store_record *rec, int body)
+{
+    struct _store_header header;
+    FILE *stream;
+    char *file, *k;
+    int ret;
+
+
+    memset(rec, 0, sizeof(struct _store_record));
+    if (_store_path == NULL)
+        return (-1);
+
+    file = _store_file(key);
+    if (file == NULL)
+        return (-1);
+    stream = fopen(file, "r");
+    free(file);
+    if (stream == NULL)
+        return (-1);
+
+    if (fread(&header, sizeof(header), 1, stream) != 1 ||
+        memcmp(header.magic, MB_STORE_MAGIC, 8) != 0 ||
+        header.version != MB_STORE_VERSION ||
+        header.len_key != strlen(key)) {
+        fclose(stream);
+        return (-1);
+    }
+
+    k = _read_string(stream, header.len_key);
+    if (k == NULL || strcmp(k, key) != 0) {
+        if (k != NULL)
+            free(k);
+        fclose(stream);
+        return (-1);
+    }
+    free(k);
+
+    ret = 0;
+    rec->fetched = header.fetched;
+    rec->etag = _read_string(stream, header.len_etag);
+    rec->modified = _read_string(stream, header.len_modified);
+    if (rec->etag == NULL || rec->modified == NULL)
+        ret = -1;
+    if (ret == 0 && body != 0) {
+        rec->body = _read_string(stream, header.len_body);
+        rec->len_body = header.len_body;
+        if (rec->body == NULL || fgetc(stream) != EOF)
+            ret = -1;
+    }
+    fclose(stream);
+
+    if (ret != 0)
+        _record_free(rec);
+    return (ret);
+}
+
+
+/* The _store_save() function writes @p rec as the record for @p key
+ * to the store.  Failure to write the record is not an error for the
+ * caller.
+ *
+ * @return 0 if successful, -1 otherwise
+ */
+static int
+_store_save(const char *key, const struct _store_record *rec)
+{
+    struct _store_header header;
+    FILE *stream;
+    char *file, *tmp;
+    int ret;
+
+
+    if (_store_path == NULL)
+        return (-1);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MB_STORE_MAGIC, 8);
+    header.version = MB_STORE_VERSION;
+    header.len_key = strlen(key);
+    header.fetched = rec->fetched;
+    header.len_etag = strlen(rec->etag);
+    header.len_modified = strlen(rec->modified);
+    header.len_body = rec->len_body;
+
+    file = _store_file(key);
+    if (file == NULL)
+        return (-1);
+    stream = store_create(file, &tmp);
+    if (stream == NULL) {
+        free(file);
+        return (-1);
+    }
+
+    ret = 0;
+    if (fwrite(&header, sizeof(header), 1, stream) != 1 ||
+        fwrite(key, 1, header.len_key, stream) != header.len_key ||
+        fwrite(rec->etag, 1, header.len_etag, stream) != header.len_etag ||
+        fwrite(rec->modified, 1, header.len_modified, stream) !=
+        header.len_modified ||
+        (header.len_body > 0 &&
+         fwrite(rec->body, 1, header.len_body, stream) != header.len_body)) {
+        ret = -1;
+    }
+    ret = store_commit(stream, tmp, file, ret);
+
+    free(file);
+    return (ret);
+}
+
+
+/* The _store_fresh() function returns non-zero if the proxy of @p
+ * ctx will serve the request for @p path with the given parameters
+ * from the store without contacting the server.
+ */
+static int
+_store_fresh(const struct musicbrainz_ctx *ctx,
+             const char *path,
+             size_t nmemb_params,
+             char **param_names,
+             char **param_values)
+{
+    struct _store_record rec;
+    char *key;
+    int ret;
+
+    if (ctx->proxy_fd == -1 || path == NULL)
+        return (0);
+    key = _store_key(path, nmemb_params, param_names, param_values);
+    if (key == NULL)
+        return (0);
+
+    ret = 0;
+    if (_store_load(key, &rec, 0) == 0) {
+        ret = time(NULL) - rec.fetched < _store_max_age;
+        _record_free(&rec);
+    }
+    free(key);
+
+    return (ret);
+}
+
+
+/* The _proxy_reader() function appends a block of the response to the
+ * buffer @p userdata.
+ */
+static int
+_proxy_reader(void *userdata, const char *buf, size_t len)
+{
+    if (len > 0)
+        ne_buffer_append((ne_buffer *)userdata, buf, len);
+    return (0);
+}
+
+
+/* The _proxy_fetch() function returns the response to the request for
+ * @p target, whose canonical form is @p key, in @p rec.  A fresh
+ * record from the store is used as it is.  Otherwise, the request is
+ * forwarded to the server over @p session; conditionally if there is
+ * a stale record, which is then used if it was not modified or if the
+ * server could not provide a response.  Successful responses from the
+ * server are saved to the store.
+ *
+ * @return 0 if @p rec holds the response, -1 otherwise.  In that
+ *         case, @p code is set to the HTTP status code to return.
+ */
+static int
+_proxy_fetch(ne_session *session,
+             const char *target,
+             const char *key,
+             struct _store_record *rec,
+             int *code)
+{
+    ne_buffer *body;
+    ne_request *request;
+    const char *etag, *modified;
+    int ret, stored;
+
+
+    stored = _store_load(key, rec, 1) == 0;
+    if (stored != 0 && time(NULL) - rec->fetched < _store_max_age)
+        return (0);
+
+    body = ne_buffer_create();
+    request = ne_request_create(session, "GET", target);
+    if (stored != 0 && rec->etag[0] != '\0')
+        ne_add_request_header(request, "If-None-Match", rec->etag);
+    if (stored != 0 && rec->modified[0] != '\0')
+        ne_add_request_header(request, "If-Modified-Since", rec->modified);
+    ne_add_response_body_reader(
+        request, ne_accept_2xx, _proxy_reader, body);
+
+    ret = ne_request_dispatch(request);
+    *code = ret == NE_OK ? ne_get_status(request)->code : 502;
+
+    if (*code == 200) {
+        _record_free(rec);
+        etag = ne_get_response_header(request, "ETag");
+        modified = ne_get_response_header(request, "Last-Modified");
+        rec->fetched = time(NULL);
+        rec->etag = strdup(etag != NULL ? etag : "");
+        rec->modified = strdup(modified != NULL ? modified : "");
+        rec->len_body = ne_buffer_size(body);
+        rec->body = ne_buffer_finish(body);
+        body = NULL;
+
+        if (rec->etag == NULL || rec->modified == NULL) {
+            _record_free(rec);
+            *code = 500;
+            ret = -1;
+        } else {
+            _store_save(key, rec);
+            ret = 0;
+        }
+
+    } else if (stored != 0 && (*code == 304 || *code / 100 == 5)) {
+        /* Not modified, or the server failed: keep the stale record,
+         * and only restart its clock if it was revalidated.
+         */
+        if (*code == 304) {
+            rec->fetched = time(NULL);
+            _store_save(key, rec);
+        }
+        ret = 0;
+
+    } else {
+        _record_free(rec);
+        ret = -1;
+    }
+
+    if (body != NULL)
+        ne_buffer_destroy(body);
+    ne_request_destroy(request);
+
+    return (ret);
+}
+
+
+/* The _proxy_respond() function sends a response with status @p code
+ * and the @p len octets at @p body to the client on @p fd.
+ */
+static int
+_proxy_respond(int fd, int code, const char *body, size_t len)
+{
+    char head[128];
+    const char *p;
+    ssize_t n;
+    size_t i, m;
+    int flags;
+
+
+#ifdef MSG_NOSIGNAL
+    flags = MSG_NOSIGNAL;
+#else
+    flags = 0;
+#endif
+
+    m = snprintf(head, sizeof(head),
+                 "HTTP/1.1 %d %s\r\n"
+                 "Content-Type: application/xml; charset=UTF-8\r\n"
+                 "Content-Length: %zu\r\n"
+                 "\r\n",
+                 code, code == 200 ? "OK" : "Error", len);
+
+    for (i = 0, p = head; i < 2; i++, p = body, m = len) {
+        while (m > 0) {
+            n = send(fd, p, m, flags);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return (-1);
+            p += n;
+            m -= n;
+        }
+    }
+
+    return (0);
+}
+
+
+/* The _proxy_allowed() function returns non-zero if @p target is a
+ * request for the MusicBrainz web service.  The proxy listens on the
+ * loopback interface, but any local process can connect to it, so it
+ * must not relay requests for anything else on the server, nor
+ * requests that climb out of the web service with dot segments.
+ */
+static int
+_proxy_allowed(const char *target)
+{
+    const char *p;
+    size_t len;
+
+
+    if (strncmp(target, "/ws/2/", 6) != 0)
+        return (0);
+
+    for (p = target + 6; *p != '\0' && *p != '?'; p += len) {
+        len = strcspn(p, "/?");
+        if (len == 0 ||
+            (len == 1 && p[0] == '.') ||
+            (len == 2 && p[0] == '.' && p[1] == '.') ||
+            memchr(p, '%', len) != NULL) {
+            return (0);
+        }
+        if (p[len] == '/')
+            len++;
+    }
+
+    return (1);
+}
+
+
+/* The _proxy_serve() function serves the requests on one connection
+ * until the client closes it.  The MusicBrainz library only sends GET
+ * requests, which have no body, so a request ends with its headers.
+ */
+static void *
+_proxy_serve(void *arg)
+{
+    struct _store_record rec;
+    struct musicbrainz_ctx *ctx;
+    ne_session *session;
+    char *buf, *end, *key, *target, *p;
+    size_t len;
+    ssize_t n;
+    int code, fd, ret;
+
+
+    ctx = ((struct _connection *)arg)->ctx;
+    fd = ((struct _connection *)arg)->fd;
+    free(arg);
+
+    session = ne_session_create(
+        "http",
+        ctx->upstream_host != NULL ? ctx->upstream_host : "musicbrainz.org",
+        ctx->upstream_port);
+    ne_set_useragent(session, PACKAGE_NAME "/" PACKAGE_VERSION);
+
+    buf = malloc(MB_PROXY_REQUEST + 1);
+    len = 0;
+    while (buf != NULL) {
+        buf[len] = '\0';
+        end = strstr(buf, "\r\n\r\n");
+        if (end == NULL) {
+            if (len == MB_PROXY_REQUEST)
+                break;
+            n = recv(fd, buf + len, MB_PROXY_REQUEST - len, 0);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            len += n;
+            continue;
+        }
+        *end = '\0';
+
+
+        /* The request line is the method, the target, and the
+         * version, separated by single spaces.
+         */
+        target = NULL;
+        if (strncmp(buf, "GET ", 4) == 0) {
+            target = buf + 4;
+            p = strpbrk(target, " \r");
+            if (p != NULL)
+                *p = '\0';
+        }
+
+        key = NULL;
+        if (target == NULL) {
+            ret = _proxy_respond(fd, 405, NULL, 0);
+        } else if (_proxy_allowed(target) == 0) {
+            ret = _proxy_respond(fd, 403, NULL, 0);
+        } else if ((key = _target_key(target)) == NULL) {
+            ret = _proxy_respond(fd, 500, NULL, 0);
+        } else if (_proxy_fetch(session, target, key, &rec, &code) == 0) {
+            ret = _proxy_respond(fd, 200, rec.body, rec.len_body);
+            _record_free(&rec);
+        } else {
+            ret = _proxy_respond(fd, code, NULL, 0);
+        }
+        if (key != NULL)
+            free(key);
+        if (ret != 0 || target == NULL)
+            break;
+
+        /* Keep whatever follows the request for the next one.
+         */
+        end += 4;
+        len -= end - buf;
+        memmove(buf, end, len);
+    }
+
+    if (buf != NULL)
+        free(buf);
+    ne_session_destroy(session);
+    close(fd);
+
+    if (pthread_mutex_lock(&_mutex_proxy) == 0) {
+        ctx->proxy_conns -= 1;
+        pthread_cond_broadcast(&_cond_proxy);
+        pthread_mutex_unlock(&_mutex_proxy);
+    }
+
+    return (NULL);
+}
+
+
+/* The _proxy_accept() function accepts connections to the proxy, and
+ * serves each in a detached thread of its own, until the proxy is
+ * shut down.  The listening socket is closed when the function
+ * returns, such that no connection is left waiting for an accept()
+ * that will not come.
+ */
+static void *
+_proxy_accept(void *arg)
+{
+    struct musicbrainz_ctx *ctx;
+    struct _connection *conn;
+    pthread_t thread;
+    int fd;
+
+    ctx = (struct musicbrainz_ctx *)arg;
+    for ( ; ; ) {
+        fd = accept(ctx->proxy_fd, NULL, NULL);
+
+        if (pthread_mutex_lock(&_mutex_proxy) != 0) {
+            if (fd != -1)
+                close(fd);
+            break;
+        }
+        if (ctx->proxy_shutdown != 0) {
+            pthread_mutex_unlock(&_mutex_proxy);
+            if (fd != -1)
+                close(fd);
+            break;
+        }
+        if (fd == -1) {
+            pthread_mutex_unlock(&_mutex_proxy);
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+
+        conn = malloc(sizeof(struct _connection));
+        if (conn != NULL) {
+            conn->ctx = ctx;
+            conn->fd = fd;
+            if (pthread_create(&thread, NULL, _proxy_serve, conn) == 0) {
+                pthread_detach(thread);
+                ctx->proxy_conns += 1;
+            } else {
+                free(conn);
+                close(fd);
+            }
+        } else {
+            close(fd);
+        }
+        pthread_mutex_unlock(&_mutex_proxy);
+    }
+
+    close(ctx->proxy_fd);
+    return (NULL);
+}
+
+
+/* The _proxy_start() function starts the proxy on an ephemeral port
+ * on the loopback interface.
+ *
+ * @return 0 if successful, -1 otherwise
+ */
+static int
+_proxy_start(struct musicbrainz_ctx *ctx)
+{
+    struct sockaddr_in addr;
+    socklen_t len;
+    int fd;
+
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1)
+        return (-1);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    len = sizeof(addr);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(fd, 16) != 0 ||
+        getsockname(fd, (struct sockaddr *)&addr, &len) != 0) {
+        close(fd);
+        return (-1);
+    }
+
+    if (ne_sock_init() != 0) {
+        close(fd);
+        return (-1);
+    }
+
+    ctx->proxy_fd = fd;
+    ctx->proxy_port = ntohs(addr.sin_port);
+    ctx->proxy_conns = 0;
+    ctx->proxy_shutdown = 0;
+    if (pthread_create(&ctx->proxy_thread, NULL, _proxy_accept, ctx) != 0) {
+        ne_sock_exit();
+        close(fd);
+        ctx->proxy_fd = -1;
+        return (-1);
+    }
+
+    return (0);
+}
+
+
+/* The _proxy_stop() function stops accepting connections, and waits
+ * for the connections being served to finish.  The accepting thread
+ * is woken up from accept() by a connection of its own to the
+ * listening socket, which _proxy_accept() closes as it returns.
+ */
+static void
+_proxy_stop(struct musicbrainz_ctx *ctx)
+{
+    struct sockaddr_in addr;
+    int fd;
+
+
+    if (ctx->proxy_fd == -1)
+        return;
+
+    if (pthread_mutex_lock(&_mutex_proxy) != 0)
+        return;
+    ctx->proxy_shutdown = 1;
+    pthread_mutex_unlock(&_mutex_proxy);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(ctx->proxy_port);
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd != -1) {
+        connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+        close(fd);
+    }
+    pthread_join(ctx->proxy_thread, NULL);
+    ctx->proxy_fd = -1;
+
+    if (pthread_mutex_lock(&_mutex_proxy) == 0) {
+        while (ctx->proxy_conns > 0)
+            pthread_cond_wait(&_cond_proxy, &_mutex_proxy);
+        pthread_mutex_unlock(&_mutex_proxy);
+    }
+    ne_sock_exit();
+}
+
+
+/* Note somewhere else than here: offset is zero-based!
+ *
+ * The query is executed using @p Query, which must not be used by
+ * any other thread at the same time.  The caller records the outcome
+ * in the cache.
+ */
+static int
+_process(struct _query *query, struct musicbrainz_ctx *ctx, Mb5Query Query)
+{
+    Mb5Metadata Metadata;
+    tQueryResult result;
+    ne_buffer *msg, *val_limit, *val_offset;
+    char **names, **values, *path;
+    size_t i, num_offset;
+    int http_code, size;
+
+
+    /* Construct a temporary set of name-value pairs for the
+     * parameters where the limit and offset values have been
+     * appended.  The offset item is guaranteed to be the last item in
+     * the arrays.
+     */
+    names = calloc(query->nmemb_params + 2, sizeof(char *));
+    if (names == NULL)
+        return (-1);
+    values = calloc(query->nmemb_params + 2, sizeof(char *));
+    if (values == NULL) {
+        free(names);
+        return (-1);
+    }
+
+    for (i = 0; i < query->nmemb_params; i++) {
+        names[i] = query->params[i]->name;
+        values[i] = query->params[i]->value;
+    }
+
+
+    /* The path is only needed to look for the pages in the store.  If
+     * it cannot be constructed, the requests are rate limited as
+     * usual.
+     */
+    path = ctx->proxy_fd != -1
+        ? _request_path(query->entity, query->id, query->resource) : NULL;
+
+    msg = ne_buffer_create();
+    val_limit = ne_buffer_create();
+    val_offset = ne_buffer_create();
+
+    _set_value(val_limit, "%zd", MB_LIMIT);
+    names[query->nmemb_params + 0] = "limit";
+    values[query->nmemb_params + 0] = val_limit->data;
+
+//    _set_value(val_offset, "%zd", num_offset);
+    names[query->nmemb_params + 1] = "offset";
+//    values[query->nmemb_params + 1] = val_offset->data;
+
+
+    /* XXX Will fail here for Sid Vicious and UB40 on the old
+     * database.
+     *
+     * Outer loop [over i or offset] for paging, inner loop [over j]
+     * for retries
+     */
+    num_offset = 0;
+    size = 0;
+    do {
+        _set_value(val_offset, "%zd", num_offset += size /* size + 0 */);
+        values[query->nmemb_params + 1] = val_offset->data;
+//        printf("INCREASING offset by %d to %s\n", size, val_offset->data);
+
+        for (i = 0; ; i++) {
+            /* Ensure no more requests per unit time than are allowed.
+             * Rate limiting: no more than 1 request per second
+             * [http://musicbrainz.org/doc/Development/XML_Web_Service/Version_2]
+             *
+             * Note somewhere (maybe not here): we are assuming
+             * "browse" requests.  These should have query->id == NULL
+             * now...
+             *
+             * A page the proxy serves from the store does not reach
+             * the server, and need not wait.
+             */
+            if (ctx->ratelimit != 0 &&
+                _store_fresh(ctx, path, query->nmemb_params + 2,
+                             names, values) == 0 &&
+                ratelimit_musicbrainz() != 0) {
+                if (path != NULL)
+                    free(path);
+                ne_buffer_destroy(val_offset);
+                ne_buffer_destroy(val_limit);
+                ne_buffer_destroy(msg);
+                free(values);
+                free(names);
+                return (-1);
+            }
+
+//            for (size_t j = 0; j < query->nmemb_params + 2; j++) {
+//                printf("PARAMETER %s=%s\n", names[j], values[j]);
+//            }
+
+            Metadata = mb5_query_query(Query,
+                                       query->entity,
+                                       query->id != NULL ? query->id : "", // XXX Necessary?  Does mb5_query_query() handle NULL?
+                                       query->resource,
+                                       query->nmemb_params + 2,
+                                       names,
+                                       values);
+            if (Metadata != NULL)
+                break;
+
+
+            /* 2014-11-17:
+             *
              * Result: 4 [see tQueryResult enumeration]
              * HTTPCode: 503
              * ErrorMessage: '503 Service Temporarily Unavailable'
@@ -666,12 +1847,12 @@ _process(struct _query *query, struct musicbrainz_ctx *ctx)
              * but should propagate the error message to the caller.
              */
             ne_buffer_grow(
-                msg, mb5_query_get_lasterrormessage(ctx->Query, NULL, 0) + 1);
-            mb5_query_get_lasterrormessage(ctx->Query, msg->data, msg->length);
+                msg, mb5_query_get_lasterrormessage(Query, NULL, 0) + 1);
+            mb5_query_get_lasterrormessage(Query, msg->data, msg->length);
             ne_buffer_altered(msg);
 
-            result = mb5_query_get_lastresult(ctx->Query);
-            http_code = mb5_query_get_lasthttpcode(ctx->Query);
+            result = mb5_query_get_lastresult(Query);
+            http_code = mb5_query_get_lasthttpcode(Query);
 
             fprintf(stderr,
                     "Result: %d\n"
@@ -684,6 +1865,8 @@ _process(struct _query *query, struct musicbrainz_ctx *ctx)
              * https://en.wikipedia.org/wiki/List_of_HTTP_status_codes
              */
             if (http_code / 100 != 5 || i + 1 == MB_RETRIES) {
+                if (path != NULL)
+                    free(path);
                 ne_buffer_destroy(val_offset);
                 ne_buffer_destroy(val_limit);
                 ne_buffer_destroy(msg);
@@ -696,6 +1879,8 @@ _process(struct _query *query, struct musicbrainz_ctx *ctx)
 
         size = _query_add_metadata(query, Metadata);
         if (size < 0) {
+            if (path != NULL)
+                free(path);
             ne_buffer_destroy(val_offset);
             ne_buffer_destroy(val_limit);
             ne_buffer_destroy(msg);
@@ -726,17 +1911,8 @@ _process(struct _query *query, struct musicbrainz_ctx *ctx)
     } while (query->id == NULL && size > 0 /* size >= MB_LIMIT */); // XXX Only check greater than zero for browse requests...
 
 
-    /* Add the query to cache after successful completion, post the
-     * semaphore.
-     */
-    if (_add_to_cache(ctx, query) == NULL) {
-        _query_free(query);
-        return (-1);
-    }
-
-    if (sem_post(_sem_processed) != 0)
-        return (-1);
-
+    if (path != NULL)
+        free(path);
     ne_buffer_destroy(val_offset);
     ne_buffer_destroy(val_limit);
     ne_buffer_destroy(msg);
@@ -748,45 +1924,70 @@ _process(struct _query *query, struct musicbrainz_ctx *ctx)
 
 
 /* See _start() in pool.c
+ *
+ * Each worker takes the query with the highest priority from the
+ * queue, executes it, and wakes up everybody waiting for a query to
+ * complete.  A query that fails is marked as such for the threads
+ * waiting for it, and dropped from the cache if there are none, such
+ * that it is executed anew the next time it is submitted; the worker
+ * carries on with the next one.
  */
 static void *
 _start(void *arg)
 {
+    struct musicbrainz_ctx *ctx;
     struct _query *query;
-    int oldstate;
+    Mb5Query Query;
+    int status;
 
-    for ( ; ; ) {
-        if (sem_wait(_sem_queued) != 0) {
-            if (errno == EINTR) {
-                errno = 0;
-                continue;
-            }
-            return (NULL);
-        }
+    ctx = ((struct _worker *)arg)->ctx;
+    Query = ctx->Queries[((struct _worker *)arg)->index];
+    free(arg);
 
-        if (pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate) != 0)
-            return (NULL);
+    for ( ; ; ) {
         if (pthread_mutex_lock(&_mutex_queries) != 0)
             return (NULL);
-
-        if (SIMPLEQ_EMPTY(&_queries)) {
-            if (pthread_mutex_unlock(&_mutex_queries) != 0)
-                return (NULL);
-            if (pthread_setcancelstate(oldstate, NULL) != 0)
+        while (SIMPLEQ_EMPTY(&_queries) && ctx->shutdown == 0) {
+            if (pthread_cond_wait(&_cond_queued, &_mutex_queries) != 0) {
+                pthread_mutex_unlock(&_mutex_queries);
                 return (NULL);
-            continue;
+            }
+        }
+        if (ctx->shutdown != 0) {
+            pthread_mutex_unlock(&_mutex_queries);
+            return (NULL);
         }
 
         query = SIMPLEQ_FIRST(&_queries);
-        if (query == NULL)
-            printf("*** SIMPLEQ BOGUS #1 ***\n");
         SIMPLEQ_REMOVE_HEAD(&_queries, queries);
+        query->queued = 0;
 
         if (pthread_mutex_unlock(&_mutex_queries) != 0)
             return (NULL);
-        if (_process(query, (struct musicbrainz_ctx *)arg) != 0)
+
+        status = _process(query, ctx, Query) == 0
+            ? _QUERY_DONE : _QUERY_FAILED;
+
+
+        /* Account for the releases before the query can be evicted,
+         * then publish the outcome.
+         */
+        if (pthread_rwlock_wrlock(&_lock_cache) != 0)
+            return (NULL);
+        cache_resize(&_cache, &query->entry, _query_size(query));
+        __atomic_store_n(&query->status, status, __ATOMIC_RELEASE);
+        if (status == _QUERY_FAILED && cache_refs(&query->entry) == 0) {
+            cache_remove(&_cache, &query->entry);
+            _query_free(query);
+        }
+        cache_evict(&_cache);
+        if (pthread_rwlock_unlock(&_lock_cache) != 0)
+            return (NULL);
+
+        if (pthread_mutex_lock(&_mutex_processed) != 0)
             return (NULL);
-        if (pthread_setcancelstate(oldstate, NULL) != 0)
+        pthread_cond_broadcast(&_cond_processed);
+        if (pthread_mutex_unlock(&_mutex_processed) != 0)
             return (NULL);
     }
 
@@ -794,72 +1995,333 @@ _start(void *arg)
 }
 
 
+/* The number of workers is taken from the SNDCHK_MB_WORKERS
+ * environment variable, if set.  If SNDCHK_MB_SERVER is set to
+ * host[:port], that server is queried instead of musicbrainz.org,
+ * and requests are not rate limited.  If the store is enabled, the
+ * workers query the server through the proxy; if the proxy cannot be
+ * started, they query the server directly.
+ */
 struct musicbrainz_ctx *
 musicbrainz_new()
 {
     struct musicbrainz_ctx *ctx;
+    struct _worker *worker;
+    char *end, *port;
+    const char *env, *server;
+    size_t i;
+    long l;
+    int port_number;
 
     ctx = malloc(sizeof(struct musicbrainz_ctx));
     if (ctx == NULL)
         return (NULL);
 
+    ctx->Queries = NULL;
+    ctx->threads = NULL;
+    ctx->nmemb = MB_WORKERS;
+    ctx->started = 0;
+    ctx->ratelimit = 1;
+    ctx->shutdown = 0;
+    ctx->upstream_host = NULL;
+    ctx->upstream_port = 80;
+    ctx->proxy_fd = -1;
+
+    env = getenv("SNDCHK_MB_WORKERS");
+    if (env != NULL && env[0] != '\0') {
+        l = strtol(env, &end, 10);
+        if (*end == '\0' && l > 0)
+            ctx->nmemb = l;
+    }
 
-    /* Note that the product string passed here does not conform to
-     * RFC2616's product token grammar.  XXX If the string is passed
-     * unchanged to neon's ne_session_create(), it probably should!
-     */
-    ctx->Query = mb5_query_new(PACKAGE_NAME "-" PACKAGE_VERSION, NULL, 0);
-    if (ctx->Query == NULL) {
+    env = getenv("SNDCHK_MB_SERVER");
+    if (env != NULL && env[0] != '\0') {
+        ctx->upstream_host = strdup(env);
+        if (ctx->upstream_host == NULL) {
+            musicbrainz_free(ctx);
+            return (NULL);
+        }
+        port = strrchr(ctx->upstream_host, ':');
+        if (port != NULL) {
+            *port++ = '\0';
+            ctx->upstream_port = atoi(port);
+        }
+        ctx->ratelimit = 0;
+    }
+
+    ctx->Queries = calloc(ctx->nmemb, sizeof(Mb5Query));
+    ctx->threads = calloc(ctx->nmemb, sizeof(pthread_t));
+    if (ctx->Queries == NULL || ctx->threads == NULL) {
         musicbrainz_free(ctx);
         return (NULL);
     }
 
-    if (_name_queued == NULL && _sem_queued == SEM_FAILED) {
-        if (_sem_open(&_name_queued, &_sem_queued) != 0) {
+    if (_store_path != NULL)
+        _proxy_start(ctx);
+    if (ctx->proxy_fd != -1) {
+        server = "127.0.0.1";
+        port_number = ctx->proxy_port;
+    } else {
+        server = ctx->upstream_host;
+        port_number = ctx->upstream_host != NULL ? ctx->upstream_port : 0;
+    }
+
+
+    /* Note that the product string passed here does not conform to
+     * RFC2616's product token grammar.  XXX If the string is passed
+     * unchanged to neon's ne_session_create(), it probably should!
+     */
+    for (i = 0; i < ctx->nmemb; i++) {
+        ctx->Queries[i] = mb5_query_new(PACKAGE_NAME "-" PACKAGE_VERSION,
+                                        server,
+                                        port_number);
+        if (ctx->Queries[i] == NULL) {
             musicbrainz_free(ctx);
             return (NULL);
         }
     }
 
-    if (_name_processed == NULL && _sem_processed == SEM_FAILED) {
-        if (_sem_open(&_name_processed, &_sem_processed) != 0) {
+    for (i = 0; i < ctx->nmemb; i++) {
+        worker = malloc(sizeof(struct _worker));
+        if (worker == NULL) {
             musicbrainz_free(ctx);
             return (NULL);
         }
-    }
+        worker->ctx = ctx;
+        worker->index = i;
 
-    if (pthread_create(&_thread, NULL, _start, ctx) != 0) {
-        musicbrainz_free(ctx);
-        return (NULL);
+        if (pthread_create(&ctx->threads[i], NULL, _start, worker) != 0) {
+            free(worker);
+            musicbrainz_free(ctx);
+            return (NULL);
+        }
+        ctx->started += 1;
     }
 
     return (ctx);
 }
 
 
+/* Workers finish the query they are executing before they exit.
+ * Queries still in the queue are not executed, but fail, so that
+ * threads waiting for them in musicbrainz_get_release() return.  The
+ * cache is only freed once those threads have let go of their
+ * queries.
+ */
 void
 musicbrainz_free(struct musicbrainz_ctx *ctx)
 {
-    if (pthread_cancel(_thread) == 0)
-        pthread_join(_thread, NULL);
+    struct cache_entry *entry;
+    struct _query *query;
+    size_t i;
+
+    if (pthread_mutex_lock(&_mutex_queries) == 0) {
+        ctx->shutdown = 1;
+        pthread_cond_broadcast(&_cond_queued);
+        pthread_mutex_unlock(&_mutex_queries);
+    }
+    for (i = 0; i < ctx->started; i++)
+        pthread_join(ctx->threads[i], NULL);
+
+    /* Fail the queries that were never executed, and wait for the
+     * threads that are waiting for them.
+     */
+    if (pthread_mutex_lock(&_mutex_queries) == 0) {
+        SIMPLEQ_INIT(&_queries);
+        for (entry = _cache.head; entry != NULL; entry = entry->next) {
+            query = CACHE_CONTAINER(entry, struct _query, entry);
+            query->queued = 0;
+            if (__atomic_load_n(&query->status, __ATOMIC_ACQUIRE) ==
+                _QUERY_PENDING) {
+                __atomic_store_n(
+                    &query->status, _QUERY_FAILED, __ATOMIC_RELEASE);
+            }
+        }
+        pthread_mutex_unlock(&_mutex_queries);
+    }
+
+    if (pthread_mutex_lock(&_mutex_processed) == 0) {
+        pthread_cond_broadcast(&_cond_processed);
+        entry = _cache.head;
+        while (entry != NULL) {
+            if (cache_refs(entry) == 0) {
+                entry = entry->next;
+                continue;
+            }
+            if (pthread_cond_wait(&_cond_processed, &_mutex_processed) != 0)
+                break;
+            entry = _cache.head;
+        }
+        pthread_mutex_unlock(&_mutex_processed);
+    }
+
 
-    if (pthread_mutex_lock(&_mutex_cache) == 0) {
-        // XXX Free the cache.
-        pthread_mutex_unlock(&_mutex_cache);
+    /* Free the cache, including the queries that were never executed
+     * and the responses of evicted queries.
+     */
+
+    if (pthread_rwlock_wrlock(&_lock_cache) == 0) {
+        cache_clear(&_cache);
+
+        for (i = 0; i < _nmemb_retired; i++)
+            mb5_metadata_delete(_retired[i]);
+        if (_retired != NULL)
+            free(_retired);
+        _retired = NULL;
+        _nmemb_retired = 0;
+
+        pthread_rwlock_unlock(&_lock_cache);
     }
 
-    if (ctx->Query != NULL)
-        mb5_query_delete(ctx->Query);
+    if (ctx->Queries != NULL) {
+        for (i = 0; i < ctx->nmemb; i++) {
+            if (ctx->Queries[i] != NULL)
+                mb5_query_delete(ctx->Queries[i]);
+        }
+        free(ctx->Queries);
+    }
+    _proxy_stop(ctx);
 
-    // XXX Free the semaphore stuff!
+    if (ctx->threads != NULL)
+        free(ctx->threads);
+    if (ctx->upstream_host != NULL)
+        free(ctx->upstream_host);
 
     free(ctx);
 }
 
 
-// XXX Always called with entity = "Release"
-// XXX id == NULL <=> "browse request" or "search request"?  See https://wiki.musicbrainz.org/Development/XML_Web_Service/Version_2
-// XXX resource always empty string?  Zap it?
+/* The _unref() function drops a reference to @p query taken by
+ * _submit(), and lets musicbrainz_free() know once the last one is
+ * gone.
+ */
+static void
+_unref(struct _query *query)
+{
+    if (pthread_mutex_lock(&_mutex_processed) != 0) {
+        cache_unref(&query->entry);
+        return;
+    }
+    if (cache_unref(&query->entry) == 0)
+        pthread_cond_broadcast(&_cond_processed);
+    pthread_mutex_unlock(&_mutex_processed);
+}
+
+
+/* The _submit() function returns the query with the canonical form @p
+ * key from the cache, creating and queueing it if necessary, and
+ * moving it up if it is still queued with a lower priority.  The
+ * query is returned with a reference held if @p ref is non-zero.  The
+ * function takes ownership of @p key.
+ *
+ * Check the cache for a matching entry under the read lock first,
+ * because that is by far the most common case.  Otherwise, take the
+ * write lock, and check again before creating a new entry.
+ */
+static struct _query *
+_submit(char *key,
+            size_t hash,
+            int priority,
+            int ref,
+            const char *entity,
+            const char *id,
+            const char *resource,
+            size_t num_params,
+            char **param_names,
+            char **param_values)
+{
+    struct cache_entry *entry;
+    struct _query *query;
+    int write;
+
+    for (write = 0; write < 2; write++) {
+        if ((write == 0 ? pthread_rwlock_rdlock(&_lock_cache)
+             : pthread_rwlock_wrlock(&_lock_cache)) != 0) {
+            free(key);
+            return (NULL);
+        }
+
+        entry = cache_find(&_cache, key, hash);
+        query = entry != NULL
+            ? CACHE_CONTAINER(entry, struct _query, entry) : NULL;
+        if (query != NULL &&
+            (write != 0 || __atomic_load_n(&query->status, __ATOMIC_ACQUIRE)
+             != _QUERY_FAILED)) {
+            break;
+        }
+        if (write == 0)
+            pthread_rwlock_unlock(&_lock_cache);
+    }
+
+
+    /* A query that failed, and is still held by the threads that
+     * waited for it, is executed again rather than failing anew.
+     */
+    if (query != NULL &&
+        __atomic_load_n(&query->status, __ATOMIC_ACQUIRE) == _QUERY_FAILED) {
+        free(key);
+        if (pthread_mutex_lock(&_mutex_queries) != 0) {
+            pthread_rwlock_unlock(&_lock_cache);
+            return (NULL);
+        }
+        _query_reset(query);
+        query->priority = priority;
+        _enqueue(query);
+        pthread_mutex_unlock(&_mutex_queries);
+    } else if (query != NULL) {
+        free(key);
+        cache_hit(&query->entry);
+        if (__atomic_load_n(&query->status, __ATOMIC_ACQUIRE) ==
+            _QUERY_PENDING &&
+            pthread_mutex_lock(&_mutex_queries) == 0) {
+            if (query->queued != 0 && query->priority < priority) {
+                _dequeue(query);
+                query->priority = priority;
+                _enqueue(query);
+            }
+            pthread_mutex_unlock(&_mutex_queries);
+        }
+    } else {
+        query = _query_new(key,
+                           entity,
+                           id,
+                           resource,
+                           num_params,
+                           param_names,
+                           param_values);
+        if (query == NULL) {
+            pthread_rwlock_unlock(&_lock_cache);
+            return (NULL);
+        }
+
+        if (pthread_mutex_lock(&_mutex_queries) != 0) {
+            _query_free(query);
+            pthread_rwlock_unlock(&_lock_cache);
+            return (NULL);
+        }
+        if (cache_insert(&_cache,
+                         &query->entry,
+                         query->key,
+                         hash,
+                         _query_size(query)) != 0) {
+            pthread_mutex_unlock(&_mutex_queries);
+            _query_free(query);
+            pthread_rwlock_unlock(&_lock_cache);
+            return (NULL);
+        }
+        query->priority = priority;
+        _enqueue(query);
+        pthread_mutex_unlock(&_mutex_queries);
+    }
+
+    if (ref != 0)
+        cache_ref(&query->entry);
+    pthread_rwlock_unlock(&_lock_cache);
+
+    return (query);
+}
+
+
 int
 musicbrainz_query(struct musicbrainz_ctx *ctx,
                   const char *entity,
@@ -869,32 +2331,57 @@ musicbrainz_query(struct musicbrainz_ctx *ctx,
                   char **param_names,
                   char **param_values)
 {
-    struct _query *query;
-
+    return (musicbrainz_query_priority(ctx,
+                                       0,
+                                       entity,
+                                       id,
+                                       resource,
+                                       num_params,
+                                       param_names,
+                                       param_values));
+}
 
-    /* Check the cache for a matching entry, and return immediately if
-     * a matching entry exists.  Otherwise, create a new cache entry.
-     *
-     * XXX Where is the query freed?
-     */
-    query = _find_in_cache(
-        ctx, entity, id, resource, num_params, param_names, param_values);
-    if (query != NULL)
-        return (0);
 
-    query = _query_new(
-        entity, id, resource, num_params, param_names, param_values);
-    if (query == NULL)
+// XXX Always called with entity = "Release"
+// XXX id == NULL <=> "browse request" or "search request"?  See https://wiki.musicbrainz.org/Development/XML_Web_Service/Version_2
+// XXX resource always empty string?  Zap it?
+int
+musicbrainz_query_priority(struct musicbrainz_ctx *ctx,
+                           int priority,
+                           const char *entity,
+                           const char *id,
+                           const char *resource,
+                           size_t num_params,
+                           char **param_names,
+                           char **param_values)
+{
+    char *key;
+    size_t hash;
+    int ret;
+
+
+    key = _query_key(entity,
+                     id,
+                     resource,
+                     num_params,
+                     param_names,
+                     param_values,
+                     &hash);
+    if (key == NULL)
         return (-1);
+    ret = _submit(key, hash, priority, 0, entity, id, resource,
+                  num_params, param_names, param_values) != NULL ? 0 : -1;
+    return (ret);
+}
 
-    if (pthread_mutex_lock(&_mutex_queries) == 0) {
-        SIMPLEQ_INSERT_TAIL(&_queries, query, queries);
-        pthread_mutex_unlock(&_mutex_queries);
-        if (sem_post(_sem_queued) != 0)
-            return (-1);
-    }
 
-    return (0);
+void
+musicbrainz_set_cache_budget(struct musicbrainz_ctx *ctx, size_t budget)
+{
+    if (pthread_rwlock_wrlock(&_lock_cache) != 0)
+        return;
+    cache_set_budget(&_cache, budget);
+    pthread_rwlock_unlock(&_lock_cache);
 }
 
 
@@ -912,42 +2399,47 @@ musicbrainz_get_release(struct musicbrainz_ctx *ctx,
     ne_buffer *ID;
 
     struct _query *query;
-    size_t i;
+    char *key;
+    size_t hash, i;
+    int status;
 
 
-    /* If there is no entry in the cache, there was probably no
-     * matching call to musicbrainz_query(); protocol error?
-     *
-     * We will hang indefinitely on protocol error now.  XXX Should
-     * probably use sem_timedwait() but Mac OS X does not seem to
-     * implement it (no man page).
+    /* Find the matching query and wait for it to complete.  If there
+     * is no entry in the cache, there was no matching call to
+     * musicbrainz_query(), or the query was evicted since.  Submit it
+     * again, ahead of everything else, because it is needed now.  The
+     * reference keeps the query from being evicted while its releases
+     * are read.
      */
-    query = _find_in_cache(ctx,
-                           entity,
-                           id,
-                           resource,
-                           num_params,
-                           param_names,
-                           param_values);
-    while (query == NULL) {
-        //printf("PROTOCOL ERROR\n");
-        if (sem_wait(_sem_processed) != 0) {
-            if (errno == EINTR) {
-                errno = 0;
-                continue;
-            }
-            return (NULL);
-        }
+    key = _query_key(entity,
+                     id,
+                     resource,
+                     num_params,
+                     param_names,
+                     param_values,
+                     &hash);
+    if (key == NULL)
+        return (NULL);
+    query = _submit(key, hash, INT_MAX, 1, entity, id, resource,
+                    num_params, param_names, param_values);
+    if (query == NULL)
+        return (NULL);
+
+    if (pthread_mutex_lock(&_mutex_processed) != 0) {
+        _unref(query);
+        return (NULL);
+    }
+    while ((status = __atomic_load_n(&query->status, __ATOMIC_ACQUIRE)) ==
+           _QUERY_PENDING) {
+        if (pthread_cond_wait(&_cond_processed, &_mutex_processed) != 0)
+            break;
+    }
+    pthread_mutex_unlock(&_mutex_processed);
+    printf("  GOT THE QUERY: %p\n", query);
 
-        printf("  GOT THE SEMAPHORE\n");
-        query = _find_in_cache(ctx,
-                               entity,
-                               id,
-                               resource,
-                               num_params,
-                               param_names,
-                               param_values);
-        printf("  GOT THE QUERY: %p\n", query);
+    if (status != _QUERY_DONE) {
+        _unref(query);
+        return (NULL);
     }
 
 
@@ -967,11 +2459,17 @@ musicbrainz_get_release(struct musicbrainz_ctx *ctx,
                i + 1, query->nmemb_releases, ID->data);
 
         if (strcmp(ID->data, release_id) == 0) {
+            /* The release remains valid until musicbrainz_free(),
+             * even if the query is evicted.
+             */
+            __atomic_store_n(&query->exported, 1, __ATOMIC_RELEASE);
+            _unref(query);
             ne_buffer_destroy(ID);
             return (Release);
         }
     }
 
+    _unref(query);
     ne_buffer_destroy(ID);
 
     return (NULL);
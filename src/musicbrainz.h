@@ -31,6 +31,8 @@
 #  define MUSICBRAINZ_END_C_DECLS
 #endif
 
+#include <time.h>
+
 MUSICBRAINZ_BEGIN_C_DECLS
 
 /**
@@ -67,8 +69,10 @@ musicbrainz_free(struct musicbrainz_ctx *ctx);
 
 
 /* Asynchronous and cached.  The musicbrainz_query() function returns
- * immediately; queries will be executed asynchronously in the order
- * they are submitted, subject to rate limiting constraints.
+ * immediately; queries will be executed asynchronously by a set of
+ * worker threads in the order they are submitted, subject to rate
+ * limiting constraints.  A query identical to one that was submitted
+ * before is not executed again.
  */
 int
 musicbrainz_query(struct musicbrainz_ctx *ctx,
@@ -80,6 +84,61 @@ musicbrainz_query(struct musicbrainz_ctx *ctx,
                   char **param_values);
 
 
+/* Like musicbrainz_query(), but queries with higher @p priority are
+ * executed before queries with lower priority.  musicbrainz_query()
+ * uses priority 0.  If an identical query is still waiting to be
+ * executed, it is moved up to @p priority if that is higher.
+ */
+int
+musicbrainz_query_priority(struct musicbrainz_ctx *ctx,
+                           int priority,
+                           const char *entity,
+                           const char *id,
+                           const char *resource,
+                           size_t num_params,
+                           char **param_names,
+                           char **param_values);
+
+
+/* Limit the memory used by the cache of completed queries.  Least
+ * recently used queries are evicted until the estimated size of the
+ * cache is within @p budget octets.  The default budget is 64 MiB.
+ * Releases returned by musicbrainz_get_release() remain valid until
+ * musicbrainz_free() regardless.
+ *
+ * @param ctx    MusicBrainz context
+ * @param budget Maximum size of the cache, in octets
+ */
+void
+musicbrainz_set_cache_budget(struct musicbrainz_ctx *ctx, size_t budget);
+
+
+/* Default maximum age of stored responses, in seconds.  Older
+ * responses are revalidated with the server before they are used.
+ */
+#define MUSICBRAINZ_STORE_MAX_AGE (7 * 24 * 60 * 60)
+
+
+/* Enable or disable the persistent response store.  Raw responses
+ * from MusicBrainz are saved below the directory @p path, keyed on
+ * the canonical form of the request, and used instead of the network
+ * until they are older than @p max_age seconds.  Requests answered
+ * from the store are not rate limited.  The directory, and any
+ * missing parents, are created if necessary.  A @p path of @c NULL
+ * disables the store, which is the default.
+ *
+ * This function should be called before musicbrainz_new().
+ *
+ * @param path    Path to the store directory, or @c NULL
+ * @param max_age Maximum age of stored responses, in seconds
+ * @return        0 if successful, -1 otherwise.  If an error occurs,
+ *                the global variable @c errno is set to indicate the
+ *                error.
+ */
+int
+musicbrainz_store_init(const char *path, time_t max_age);
+
+
 /**
  * The _releasegroup_get_release() function returns the release within
  * a releasegroup @p ReleaseList with identifier @p id.
@@ -18,14 +18,22 @@
  * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+/* sched_getaffinity(2) and CPU_COUNT(3) are GNU extensions.
+ */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#  define _GNU_SOURCE 1
+#endif
+
+#include <sys/time.h>
+
 #include <stdio.h>
 #include <stdlib.h>
 
 #include <errno.h>
-#include <fcntl.h>
 #include <pthread.h>
-#include <semaphore.h>
+#include <sched.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "fingersum.h"
@@ -33,6 +41,11 @@
 #include "simpleq.h"
 
 
+/* Number of seconds a surplus worker may be idle before it exits
+ */
+#define POOL_IDLE_TIMEOUT 30
+
+
 /* The internal request structure.  Identical to result structure?  So
  * maybe this is a job, or a task?  XXX If so, rename it to _job
  */
@@ -57,6 +70,36 @@ struct _pool_request
      */
     int flags;
 
+    /* Function to call for jobs submitted with pool_submit(), or @c
+     * NULL.  Continuations added with pool_then() call cont instead,
+     * passing the value of the job they follow as well.  Neither is
+     * set for jobs submitted with add_request().
+     */
+    void *(*fn)(void *arg);
+    void *(*cont)(void *arg, void *value);
+
+    /* Value returned by fn or cont once the job has completed.  For a
+     * continuation, this holds the value of the preceding job until
+     * it starts.
+     */
+    void *value;
+
+    /* Continuation to schedule when this job completes, or @c NULL.
+     * A job with a continuation is never pushed onto the results
+     * queue.
+     */
+    struct _pool_request *then;
+
+    /* Job this continuation follows, or @c NULL.  The preceding job
+     * is kept until the continuation is released, so that its handle
+     * remains valid (if useless) in the meantime.
+     */
+    struct _pool_request *prev;
+
+    /* Non-zero once the job is on the results queue
+     */
+    int done;
+
     /* 0 if successful, -1 otherwise.  This member is only valid after
      * the action has been carried out.
      *
@@ -64,15 +107,18 @@ struct _pool_request
      */
     int status;
 
+    /* Next job in the inbox of a worker; see _pool_worker below
+     */
+    struct _pool_request *next;
+
     /* Simple queue
      */
     SIMPLEQ_ENTRY(_pool_request) requests;
 };
 
 
-/* XXX Define the _pool_head structure, required for the global
- * _pool_requests variable and the pool_context structure defined
- * below.
+/* XXX Define the _pool_head structure, required for the pool_context
+ * structure defined below.
  *
  * XXX A SIMPLEQ might have been sufficient (we need to add at end of
  * list, and remove arbitrary elements--check that no simpler queue
@@ -91,24 +137,22 @@ struct pool_context
      */
     pthread_mutex_t mutex;
 
-    /* Named semaphore for results, counts the number of jobs in this
-     * context's results queue.
-     */
-    char *name;
-
-    /* XXX See above
+    /* Condition variable, broadcast whenever a job is pushed onto
+     * the results queue.  This replaces the named semaphore, which
+     * had to be created in the file system for every context.
      */
-    sem_t *sem;
+    pthread_cond_t cond;
 
-    /* Number of jobs in _pool_requests that belong to this context.
-     * This is increased by add_request() and decreased by
-     * get_result().  Could probably have been a semaphore, but
-     * sem_getvalue() is not implemented in Mac OS X.
+    /* Number of jobs submitted to this context whose results have not
+     * yet been retrieved.  This is increased by add_request() and
+     * decreased by get_result().
      */
     size_t inprogress;
 
     /* Non-zero if the context is active and accepts new submissions,
-     * zero if the context is being destructed.
+     * zero if the context is being destructed.  Jobs of an inactive
+     * context are not processed, but their results are still pushed
+     * onto the results queue.
      */
     int active;
 
@@ -118,36 +162,129 @@ struct pool_context
 };
 
 
+/* A worker thread and its jobs
+ *
+ * Jobs are submitted to the inbox of a worker, which is a lock-free
+ * LIFO stack, linked through the next member of the request.  The
+ * inbox is emptied in a single atomic exchange, and its jobs are
+ * appended in submission order to the deque of the thread that
+ * emptied it.  The owner of the deque takes jobs from the front;
+ * other workers steal from the back when they run out of jobs of
+ * their own.  The deque is a ring buffer, protected by its own
+ * mutex.  Since thieves only touch the deque of their victim,
+ * contention is limited to pairs of threads.
+ */
+struct _pool_worker
+{
+    /* Mutex to ensure exclusive access to the deque
+     */
+    pthread_mutex_t mutex;
+
+    /* Ring buffer of size jobs, holding nmemb jobs starting at head
+     */
+    struct _pool_request **deque;
+    size_t head;
+    size_t nmemb;
+    size_t size;
+
+    /* Top of the stack of submitted jobs that have not yet been moved
+     * to a deque.  Only accessed atomically.
+     */
+    struct _pool_request *inbox;
+
+    /* Index of the worker in _pool_workers
+     */
+    size_t index;
+
+    /* The thread itself, and its state: _WORKER_EMPTY if there is no
+     * thread, _WORKER_RUNNING while it runs, and _WORKER_EXITED once
+     * it has decided to exit and must be joined.  The state is
+     * protected by _mutex_resize.
+     */
+    pthread_t thread;
+    int state;
+};
+
+#define _WORKER_EMPTY   0
+#define _WORKER_RUNNING 1
+#define _WORKER_EXITED  2
+
+
 /* The initialisation of the global variables below ensures that the
  * module is functional even if _pool_init() has not been invoked.  It
  * will function as pool with no threads.  _pool_free() should be able
  * to run at all times.
  */
 
-/* Head of linked lists (naw, it's a FIFO queue) of requests
- */
-struct _pool_head _pool_requests = SIMPLEQ_HEAD_INITIALIZER(_pool_requests);   // XXX -> _jobs?
-
 /* Mutex to ensure exclusive access to the global variables in this
  * module
  */
 static pthread_mutex_t _mutex = PTHREAD_MUTEX_INITIALIZER;
 
-/* Global array of worker threads
+/* Mutex to serialise changes to the size of the pool.  It must not
+ * be locked while _mutex is held, because exiting workers lock _mutex
+ * to release their Chromaprint contexts.
  */
-static pthread_t *_pool_threads = NULL; // XXX -> _threads?
+static pthread_mutex_t _mutex_resize = PTHREAD_MUTEX_INITIALIZER;
+
+/* Global array of workers.  The array is replaced, never resized in
+ * place, when the pool grows, because other threads may be looking at
+ * it without holding the mutex.  Replaced arrays are kept in
+ * _pool_retired until _pool_free().  Workers are never removed from
+ * the array; a worker whose thread has exited stays behind, and any
+ * jobs left with it are stolen by the others.  _pool_workers,
+ * _pool_nmemb, and _pool_live are only accessed atomically.
+ */
+static struct _pool_worker **_pool_workers = NULL; // XXX -> _workers?
 
-/* Name of the named request semaphore
+/* Number of workers in _pool_workers
  */
-static char *_pool_requests_name = NULL; // XXX -> _name?
+static size_t _pool_nmemb = 0; // XXX -> _nmemb?
 
-/* The named request semaphore
+/* Number of workers with running threads.  These are always the
+ * first _pool_live workers in _pool_workers; a thread whose worker
+ * index is not less than _pool_live exits as soon as it is done with
+ * its current job.
  */
-static sem_t *_pool_requests_sem = SEM_FAILED; // XXX -> _sem or _semaphore?
+static size_t _pool_live = 0;
 
-/* Number of worker threads in _pool_threads
+/* Number of threads the pool should have when it is busy.  Surplus
+ * threads are not started until jobs are waiting for them, and they
+ * exit again after POOL_IDLE_TIMEOUT seconds without work.
  */
-static size_t _pool_nmemb = 0; // XXX -> _nmemb?
+static size_t _pool_target = 0;
+
+/* Worker arrays that have been replaced by larger ones
+ */
+static struct _pool_worker ***_pool_retired = NULL;
+static size_t _pool_nretired = 0;
+
+/* Counter used to distribute submitted jobs over the workers in a
+ * round-robin fashion
+ */
+static size_t _pool_next = 0;
+
+/* Number of submitted jobs that have not yet been picked up by a
+ * worker, and number of workers waiting for new jobs.  Only accessed
+ * atomically.
+ */
+static size_t _pool_pending = 0;
+static size_t _pool_idle = 0;
+
+/* Non-zero if the workers should exit
+ */
+static int _pool_shutdown = 0;
+
+/* The worker running on the current thread, or @c NULL if the thread
+ * is not part of the pool
+ */
+static __thread struct _pool_worker *_self = NULL;
+
+/* Mutex and condition variable for idle workers.  The mutex only
+ * protects the wait itself; see _start() and _submit().
+ */
+static pthread_mutex_t _mutex_idle = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _cond_idle = PTHREAD_COND_INITIALIZER;
 
 /* Number of successful invocations of _pool_init().  If the module
  * has not been initialised _init_state is zero.  If it is less than
@@ -170,152 +307,360 @@ _cleanup(void *arg)
 }
 
 
-/* If the thread was cancelled _join() will always attempt to join it,
- * even if the pool mutex could not be unlocked.  This ensures the
- * consistency of the thread pool.  _join() returns 0 if successful,
- * -1 otherwise.  If an error occurs, the global variable @c errno is
- * set to indicate the error.
- *
- * XXX All threads should exit with CANCEL-something.  Note here, and
- * check in caller?  It should be safe to call this from several
- * places simultaneously.
+static int
+_schedule(struct _pool_request *r);
+
+
+/* The _process() function processes a job.  It either calls the
+ * function of the job, or calculates the AccurateRip checksum and/or
+ * the Chromaprint fingerprint as requested and sets the status flag
+ * accordingly.  If the job has a continuation, the continuation is
+ * scheduled in its place.  Otherwise, the completed job (whether it
+ * succeeded or not) is pushed to the results queue of the submitting
+ * context and its condition variable is broadcast.  Jobs of contexts
+ * that are being destructed are not processed, and complete with a
+ * zero status and a @c NULL value.  The _process() function returns
+ * 0 if successful, -1 otherwise.  If an error occurs, the global
+ * variable @c errno is set to indicate the error.
  */
 static int
-_join(pthread_t thread, void **value_ptr)
+_process(struct _pool_request *r, ChromaprintContext *cc)
 {
-    int ret;
+    struct _pool_request *then;
+    int active;
 
-    printf("  _join() is calling pthread_cancel...\n");
-    ret = pthread_cancel(thread);
-    if (ret != 0) {
-        errno = ret;
-        return (-1);
-    }
 
-    // XXX 2018-11-02: this is where stuff hangs!
-    printf("  _join() is calling pthread_join()...\n");
-    ret = pthread_join(thread, value_ptr);
-    if (ret != 0) {
-        errno = ret;
+    if (pthread_mutex_lock(&r->result->mutex) != 0)
+        return (-1);
+    active = r->result->active;
+    if (pthread_mutex_unlock(&r->result->mutex) != 0)
         return (-1);
-    }
-
-    printf("  Leaving _join()...\n");
-    return (0);
-}
-
-
-/* The _process() function processes a job.  It calculates the
- * AccurateRip checksum and/or the Chromaprint fingerprint as
- * requested and sets the status flag accordingly.  It then pushes the
- * completed job (whether it succeeded or not) to the results queue of
- * the submitting context and posts its semaphore.  The _process()
- * function returns 0 if successful, -1 otherwise.  If an error
- * occurs, the global variable @c errno is set to indicate the error.
- */
-static int
-_process(struct _pool_request *r, ChromaprintContext *cc)
-{
-    //printf("    Processing job %zd, posting to %p\n",
-    //        (size_t)(r->arg), r->result->sem);
 
     r->status = 0;
-    if (r->flags & POOL_ACTION_ACCURATERIP) {
+    if (r->fn != NULL) {
+        r->value = active ? r->fn(r->arg) : NULL;
+    } else if (r->cont != NULL) {
+        r->value = active ? r->cont(r->arg, r->value) : NULL;
+    }
+
+    if (active && (r->flags & POOL_ACTION_ACCURATERIP)) {
 //        if (fingersum_get_checksum(r->ctx, cc, NULL) == 0)
 //            r->status |= POOL_ACTION_ACCURATERIP;
         if (fingersum_get_result_3(NULL, r->ctx, NULL) != NULL)
             r->status |= POOL_ACTION_ACCURATERIP;
     }
-    if (r->flags & POOL_ACTION_CHROMAPRINT) {
+    if (active && (r->flags & POOL_ACTION_CHROMAPRINT)) {
         if (fingersum_get_fingerprint(r->ctx, cc, NULL) == 0)
             r->status |= POOL_ACTION_CHROMAPRINT;
     }
 
+    /* The continuation replaces the job in the context, so there is
+     * no change to the number of jobs in progress.
+     */
     if (pthread_mutex_lock(&r->result->mutex) != 0)
         return (-1);
-    SIMPLEQ_INSERT_TAIL(&r->result->results, r, requests);
+    then = r->then;
+    if (then == NULL) {
+        r->done = 1;
+        SIMPLEQ_INSERT_TAIL(&r->result->results, r, requests);
+        if (pthread_cond_broadcast(&r->result->cond) != 0) {
+            pthread_mutex_unlock(&r->result->mutex);
+            return (-1);
+        }
+    }
     if (pthread_mutex_unlock(&r->result->mutex) != 0)
         return (-1);
-    if (sem_post(r->result->sem) != 0)
+
+    if (then != NULL) {
+        then->value = r->value;
+        then->prev = r;
+        return (_schedule(then));
+    }
+
+    return (0);
+}
+
+
+/* The _inbox_push() function atomically pushes the chain of jobs
+ * from @p first to @p last onto the inbox of the worker @p w.
+ */
+static void
+_inbox_push(struct _pool_worker *w,
+            struct _pool_request *first,
+            struct _pool_request *last)
+{
+    struct _pool_request *top;
+
+    top = __atomic_load_n(&w->inbox, __ATOMIC_RELAXED);
+    do {
+        last->next = top;
+    } while (!__atomic_compare_exchange_n(
+                 &w->inbox, &top, first, 1,
+                 __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+
+/* The _deque_grow() function doubles the capacity of the deque of @p
+ * w, which must be locked by the caller.  The jobs are unwrapped such
+ * that they start at the beginning of the new buffer.
+ */
+static int
+_deque_grow(struct _pool_worker *w)
+{
+    struct _pool_request **p;
+    size_t i, size;
+
+    size = w->size > 0 ? 2 * w->size : 16;
+    p = malloc(size * sizeof(struct _pool_request *));
+    if (p == NULL)
         return (-1);
 
+    for (i = 0; i < w->nmemb; i++)
+        p[i] = w->deque[(w->head + i) % w->size];
+    if (w->deque != NULL)
+        free(w->deque);
+
+    w->deque = p;
+    w->head = 0;
+    w->size = size;
     return (0);
 }
 
 
-/* The _sem_open() function opens a named semaphore, and initialises
- * its value to zero.  The name and the semaphore are stored in the
- * addresses pointed to by @p name and @p sem, respectively.  If
- * sem_open(3) fails because the semaphore is already in use, possibly
- * by a different user, try again.
- *
- * This module uses named semaphores, because unnamed semaphores as
- * constructed by sem_init(3) are not implemented in Mac OS X.  These
- * semaphores must be removed on exit.
+/* The _inbox_drain() function moves all jobs in the inbox of the
+ * worker @p from to the back of the deque of the worker @p to, in
+ * the order they were submitted.  Should the deque fail to grow,
+ * the jobs that could not be moved are pushed back onto the inbox
+ * they came from, and the function returns -1.
  */
 static int
-_sem_open(char **name, sem_t **sem)
+_inbox_drain(struct _pool_worker *from, struct _pool_worker *to)
 {
-    char *n;
-    sem_t *s;
-    size_t i;
-    int fd;
+    struct _pool_request *prev, *r, *next;
 
 
-    n = NULL;
-    s = SEM_FAILED;
-    for (i = 0; i < 256; i++) { // XXX HARDCODED LIMIT!  See below as well.
-        if (n != NULL)
-            free(n);
+    r = __atomic_exchange_n(&from->inbox, NULL, __ATOMIC_ACQUIRE);
+    if (r == NULL)
+        return (0);
 
-        n = strdup("/tmp/sem_req.XXXXXX");
-        if (n == NULL)
-            break;
 
-        fd = mkstemp(n);
-        if (fd == -1)
-            break;
+    /* The inbox is a stack: reverse it to restore submission order.
+     */
+    for (prev = NULL; r != NULL; r = next) {
+        next = r->next;
+        r->next = prev;
+        prev = r;
+    }
 
-        s = sem_open(n + 4, O_CREAT | O_EXCL, 0644,0);
-        if (close(fd) != 0 || unlink(n) != 0)
-            break;
-        if (s != SEM_FAILED) {
-            //printf("Opened semaphore %s at %p\n", n, s);
-            *name = n;
-            *sem = s;
-            return (0);
-        } else if (errno == EPERM) {
-            errno = 0;
+    if (pthread_mutex_lock(&to->mutex) != 0) {
+        for (r = prev; r->next != NULL; r = r->next)
+            ;
+        _inbox_push(from, prev, r);
+        return (-1);
+    }
+    for (r = prev; r != NULL; r = next) {
+        next = r->next;
+        if (to->nmemb == to->size && _deque_grow(to) != 0) {
+            pthread_mutex_unlock(&to->mutex);
+            for (prev = r; prev->next != NULL; prev = prev->next)
+                ;
+            _inbox_push(from, r, prev);
+            errno = ENOMEM;
+            return (-1);
+        }
+        to->deque[(to->head + to->nmemb++) % to->size] = r;
+    }
+    if (pthread_mutex_unlock(&to->mutex) != 0)
+        return (-1);
+
+    return (0);
+}
+
+
+/* The _deque_pop() function removes a job from the deque of @p w,
+ * from the front if @p front is non-zero, from the back otherwise.
+ * It returns @c NULL if the deque is empty.
+ */
+static struct _pool_request *
+_deque_pop(struct _pool_worker *w, int front)
+{
+    struct _pool_request *r;
+
+    if (pthread_mutex_lock(&w->mutex) != 0)
+        return (NULL);
+
+    r = NULL;
+    if (w->nmemb > 0) {
+        if (front) {
+            r = w->deque[w->head];
+            w->head = (w->head + 1) % w->size;
+        } else {
+            r = w->deque[(w->head + w->nmemb - 1) % w->size];
+        }
+        w->nmemb -= 1;
+    }
+
+    pthread_mutex_unlock(&w->mutex);
+    return (r);
+}
+
+
+/* The _next() function returns the next job for the worker @p w.  It
+ * first looks in the inbox and the deque of @p w itself, and then
+ * attempts to steal a job from the other workers, starting with the
+ * one after @p w.  Stealing takes jobs from the back of a victim's
+ * deque, or everything in its inbox.  If a job is returned, the
+ * number of pending jobs has been decreased accordingly.  _next()
+ * returns @c NULL if no job could be found.
+ */
+static struct _pool_request *
+_next(struct _pool_worker *w)
+{
+    struct _pool_worker **workers, *v;
+    struct _pool_request *r;
+    size_t i, nmemb;
+
+
+    _inbox_drain(w, w);
+    r = _deque_pop(w, 1);
+
+    if (r == NULL) {
+        nmemb = __atomic_load_n(&_pool_nmemb, __ATOMIC_ACQUIRE);
+        workers = __atomic_load_n(&_pool_workers, __ATOMIC_ACQUIRE);
+        for (i = 1; i < nmemb && r == NULL; i++) {
+            v = workers[(w->index + i) % nmemb];
+            r = _deque_pop(v, 0);
+            if (r == NULL && _inbox_drain(v, w) == 0)
+                r = _deque_pop(w, 1);
+        }
+    }
+
+    if (r != NULL)
+        __atomic_sub_fetch(&_pool_pending, 1, __ATOMIC_SEQ_CST);
+    return (r);
+}
+
+
+static int
+_pool_spawn(void);
+
+
+/* The _submit() function queues the job @p r for processing by the
+ * pool.  The job goes to the inbox of the next worker in turn, which
+ * does not take any locks.  A waiting worker is only woken up if
+ * there is one.
+ *
+ * The pending counter is increased before the number of idle workers
+ * is checked, while a worker about to wait increases the idle counter
+ * before it checks the pending counter.  Because all four accesses
+ * are sequentially consistent, at least one side sees the other, and
+ * a wake-up cannot be lost.
+ */
+static int
+_submit(struct _pool_request *r)
+{
+    struct _pool_worker **workers, *w;
+    size_t nmemb;
+
+
+    nmemb = __atomic_load_n(&_pool_live, __ATOMIC_ACQUIRE);
+    if (nmemb == 0)
+        nmemb = __atomic_load_n(&_pool_nmemb, __ATOMIC_ACQUIRE);
+    workers = __atomic_load_n(&_pool_workers, __ATOMIC_ACQUIRE);
+    w = workers[__atomic_fetch_add(&_pool_next, 1, __ATOMIC_RELAXED) % nmemb];
+
+    _inbox_push(w, r, r);
+    __atomic_add_fetch(&_pool_pending, 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&_pool_idle, __ATOMIC_SEQ_CST) > 0) {
+        if (pthread_mutex_lock(&_mutex_idle) != 0)
+            return (-1);
+        if (pthread_cond_signal(&_cond_idle) != 0) {
+            pthread_mutex_unlock(&_mutex_idle);
+            return (-1);
         }
+        if (pthread_mutex_unlock(&_mutex_idle) != 0)
+            return (-1);
+    } else if (__atomic_load_n(&_pool_live, __ATOMIC_ACQUIRE) <
+               __atomic_load_n(&_pool_target, __ATOMIC_ACQUIRE)) {
+        /* Every thread is busy, but the pool may grow: start another
+         * one.  The job is already queued, so failure to start the
+         * thread only delays it.
+         */
+        _pool_spawn();
+    }
+
+    return (0);
+}
+
+
+/* The _schedule() function queues the job @p r for processing.  A
+ * job scheduled from a worker, i.e. a continuation, is pushed onto
+ * the front of the worker's own deque, such that it runs next on the
+ * same thread while its input is still hot in the cache; idle workers
+ * may still steal it.  Jobs scheduled from outside the pool are
+ * submitted as usual, and processed immediately if the pool has no
+ * threads.
+ */
+static int
+_schedule(struct _pool_request *r)
+{
+    struct _pool_worker *w;
+
+
+    if (__atomic_load_n(&_pool_nmemb, __ATOMIC_ACQUIRE) == 0)
+        return (_process(r, NULL));
+
+    w = _self;
+    if (w == NULL)
+        return (_submit(r));
+
+    if (pthread_mutex_lock(&w->mutex) != 0)
+        return (-1);
+    if (w->nmemb == w->size && _deque_grow(w) != 0) {
+        pthread_mutex_unlock(&w->mutex);
+        return (_submit(r));
     }
+    w->head = (w->head + w->size - 1) % w->size;
+    w->deque[w->head] = r;
+    w->nmemb += 1;
+    if (pthread_mutex_unlock(&w->mutex) != 0)
+        return (-1);
 
-    if (i == 256)
-        errno = EBUSY; // XXX Is this a sensible message?
+    __atomic_add_fetch(&_pool_pending, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&_pool_idle, __ATOMIC_SEQ_CST) > 0) {
+        if (pthread_mutex_lock(&_mutex_idle) != 0)
+            return (-1);
+        pthread_cond_signal(&_cond_idle);
+        if (pthread_mutex_unlock(&_mutex_idle) != 0)
+            return (-1);
+    }
 
-    if (s != SEM_FAILED)
-        sem_close(s);
-    if (n != NULL)
-        free(n);
-    return (-1);
+    return (0);
 }
 
 
 /* Start routine for the checksumming and fingerprinting threads.
- * Extract queued jobs from _pool_requests as they are submitted and
- * process them according to the value of their flags.  Processed
- * fingersum contexts are pushed into the result queues of their
- * respective pool contexts.  This function does not exit, but is
- * stopped by pthread_cancel(3).  It also does not do any memory
- * management; jobs are simply moved from one queue to another.
+ * Take submitted jobs from the worker's own inbox and deque, or steal
+ * them from the other workers, and process them according to the
+ * value of their flags.  Processed fingersum contexts are pushed into
+ * the result queues of their respective pool contexts.  The function
+ * returns when _pool_free() sets _pool_shutdown.  It does not do any
+ * memory management; jobs are simply moved from one queue to another.
  */
 static void *
 _start(void *arg)
 {
     ChromaprintContext *cc;
     struct _pool_request *r;
-    int oldstate;
+    struct _pool_worker *w;
+    struct timespec ts;
+    struct timeval tv;
+    int shutdown, timedout;
+
+    w = arg;
+    _self = w;
 
-    //printf("    Thread started\n");
 
     /* Construct a thread-local Chromaprint context.  Note that
      * chromaprint_new() is not thread-safe if Chromaprint was
@@ -334,91 +679,129 @@ _start(void *arg)
 
 
     for ( ; ; ) {
-        /* Block unless a request is pending, and retry if
-         * interrupted.  This introduces a cancellation point:
-         * sem_wait(3) will not return if the thread is cancelled.
-         *
-         * There is no guarantee that the request at the top of the
-         * queue at the time sem_wait(3) returns is the same request
-         * returned by SIMPLEQ_FIRST(3).  Because this does not really
-         * matter, it is a benign race condition.
+        if (__atomic_load_n(&_pool_shutdown, __ATOMIC_ACQUIRE))
+            break;
+
+
+        /* Exit if the pool has shrunk below this worker.  The
+         * decision is made while holding _mutex_resize, such that a
+         * concurrent _pool_resize() either keeps the thread or knows
+         * it must be joined.
          */
-//        printf("    Waiting for data on %p\n", _pool_requests_sem);
-        if (sem_wait(_pool_requests_sem) != 0) {
-            if (errno == EINTR) {
-                errno = 0;
-                continue;
+        if (w->index >= __atomic_load_n(&_pool_live, __ATOMIC_ACQUIRE)) {
+            if (pthread_mutex_lock(&_mutex_resize) != 0)
+                break;
+            if (w->index >= _pool_live) {
+                w->state = _WORKER_EXITED;
+                pthread_mutex_unlock(&_mutex_resize);
+                break;
             }
-            return (NULL);
+            if (pthread_mutex_unlock(&_mutex_resize) != 0)
+                break;
         }
-//        printf("    Got the semaphore\n");
-
-
-        /* Disable cancellation to ensure atomicity: a job must be
-         * either processed in full or not at all.  Lock the mutex to
-         * ensure exclusive access the request queue and pop the
-         * pending request.  Unlock the mutex to allow new jobs to be
-         * queued while the job is processed.
-         *
-         * When a pool_context is destroyed and pulls its unstarted
-         * jobs from the _pool_requests queue, the queue may be empty
-         * even though the semaphore is signalled.
-         *
-         * 2018-11-02: race condition? It would seem that cancel
-         * requests are not properly queued.  If a pthread_cancel is
-         * called while PTHREAD_CANCEL_DISABLE, this code may hang
-         * indefinitely.  Really, there's no need to restore the
-         * cancel state, since the process will finish, but what about
-         * the cleanup function?
-         */
-        if (pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate) != 0)
-            return (NULL);
-//        printf("    set the state\n");
-        if (pthread_mutex_lock(&_mutex) != 0) {
-            pthread_setcancelstate(oldstate, NULL);
-            return (NULL);
+
+        r = _next(w);
+        if (r != NULL) {
+            if (_process(r, cc) != 0)
+                break;
+            continue;
         }
-//        printf("    locked the mutex\n");
 
-        if (SIMPLEQ_EMPTY(&_pool_requests)) {
-            if (pthread_mutex_unlock(&_mutex) != 0) {
-                pthread_setcancelstate(oldstate, NULL);
-                return (NULL);
-            }
-            if (pthread_setcancelstate(oldstate, NULL) != 0)
-                return (NULL);
+
+        /* Nothing to do.  If jobs are pending, they are in transit
+         * between an inbox and a deque; try again.  Otherwise wait
+         * until a job is submitted or the pool is shut down.
+         */
+        if (__atomic_load_n(&_pool_pending, __ATOMIC_SEQ_CST) > 0) {
+            sched_yield();
             continue;
         }
 
-        r = SIMPLEQ_FIRST(&_pool_requests);
-        SIMPLEQ_REMOVE_HEAD(&_pool_requests, requests);
-        if (r == NULL)
-            printf("*** SIMPLEQ BOGUS #1 ***\n");
+        if (gettimeofday(&tv, NULL) != 0)
+            break;
+        ts.tv_sec = tv.tv_sec + POOL_IDLE_TIMEOUT;
+        ts.tv_nsec = tv.tv_usec * 1000;
 
-        if (pthread_mutex_unlock(&_mutex) != 0) {
-            pthread_setcancelstate(oldstate, NULL);
-            return (NULL);
+        if (pthread_mutex_lock(&_mutex_idle) != 0)
+            break;
+        __atomic_add_fetch(&_pool_idle, 1, __ATOMIC_SEQ_CST);
+        timedout = 0;
+        while (__atomic_load_n(&_pool_pending, __ATOMIC_SEQ_CST) == 0 &&
+               !__atomic_load_n(&_pool_shutdown, __ATOMIC_ACQUIRE) &&
+               w->index < __atomic_load_n(&_pool_live, __ATOMIC_ACQUIRE) &&
+               !timedout) {
+            if (pthread_cond_timedwait(
+                    &_cond_idle, &_mutex_idle, &ts) == ETIMEDOUT) {
+                timedout = 1;
+            }
         }
-        printf("    unlocked the mutex\n");
-        if (_process(r, cc) != 0) {
-            pthread_setcancelstate(oldstate, NULL);
-            return (NULL);
+        __atomic_sub_fetch(&_pool_idle, 1, __ATOMIC_SEQ_CST);
+        shutdown = __atomic_load_n(&_pool_shutdown, __ATOMIC_ACQUIRE);
+        if (pthread_mutex_unlock(&_mutex_idle) != 0 || shutdown)
+            break;
+
+
+        /* Reap idle threads from the top of the pool, but keep at
+         * least one.  The thread notices that it should exit at the
+         * top of the loop.
+         */
+        if (timedout) {
+            if (pthread_mutex_lock(&_mutex_resize) != 0)
+                break;
+            if (w->index + 1 == _pool_live && _pool_live > 1)
+                __atomic_store_n(&_pool_live, w->index, __ATOMIC_RELEASE);
+            if (pthread_mutex_unlock(&_mutex_resize) != 0)
+                break;
         }
-        printf("    processed request\n");
-        if (pthread_setcancelstate(oldstate, NULL) != 0)
-            return (NULL);
-        printf("    reverted state\n");
-        pthread_testcancel(); // XXX 2018-11-02: force a cancellation point
     }
 
-
-    /* NOTREACHED
-     */
     pthread_cleanup_pop(1);
     return (NULL);
 }
 
 
+/* The _request_free() function releases the job @p r together with
+ * the chain of jobs it is a continuation of.
+ */
+static void
+_request_free(struct _pool_request *r)
+{
+    struct _pool_request *prev;
+
+    while (r != NULL) {
+        prev = r->prev;
+        free(r);
+        r = prev;
+    }
+}
+
+
+/* The _worker_free() function releases the worker @p w, which must
+ * not be running.  Any jobs left in its inbox or deque are discarded.
+ */
+static void
+_worker_free(struct _pool_worker *w)
+{
+    struct _pool_request *r;
+
+    while ((r = w->inbox) != NULL) {
+        w->inbox = r->next;
+        _request_free(r);
+    }
+
+    while (w->nmemb > 0) {
+        _request_free(w->deque[w->head]);
+        w->head = (w->head + 1) % w->size;
+        w->nmemb -= 1;
+    }
+
+    if (w->deque != NULL)
+        free(w->deque);
+    pthread_mutex_destroy(&w->mutex);
+    free(w);
+}
+
+
 /* The _pool_free() function releases the global pool of worker
  * threads.  The function must be called once all use of this module
  * is complete.  Any submitted jobs that have not yet been started are
@@ -439,7 +822,6 @@ _start(void *arg)
 static void
 _pool_free()
 {
-    struct _pool_request *r;
     size_t i;
 
 
@@ -453,187 +835,246 @@ _pool_free()
         return;
     }
     pthread_mutex_unlock(&_mutex);
-    printf("    adjusted state\n");
-//    printf("ACTUALLY CLOSING DOWN\n");
 
 
-    /* Cancel and join all the threads in the pool, then free the
-     * pool.  This guarantees that the requests semaphore can be
-     * closed, because there will be no threads left to wait for it.
+    /* Tell the workers to exit, wake up the idle ones, and join them
+     * all.  A worker finishes the job it is processing before it
+     * notices.
      */
-    for (i = 0; i < _pool_nmemb; i++) {// XXX Hang here 2016-10-14, 2016-10-16, 2016-11-28, 2018-09-13
-        printf("Joining thread %zd/%zd...\n", i, _pool_nmemb);
-        _join(_pool_threads[i], NULL);
-        printf("... joined!\n");
-    }
-    printf("    joined threads\n");
-
-    pthread_mutex_lock(&_mutex);
-    if (_pool_threads != NULL) {
-        free(_pool_threads);
-        _pool_threads = NULL;
-    }
-    printf("    freed pool\n");
+    pthread_mutex_lock(&_mutex_resize);
+    pthread_mutex_lock(&_mutex_idle);
+    __atomic_store_n(&_pool_shutdown, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&_cond_idle);
+    pthread_mutex_unlock(&_mutex_idle);
+    pthread_mutex_unlock(&_mutex_resize);
 
-    if (_pool_requests_sem != NULL) {
-        sem_close(_pool_requests_sem);
-        sem_unlink(_pool_requests_name + 4);
-        _pool_requests_sem = SEM_FAILED;
-    }
-    printf("    freed semaphore\n");
 
-    if (_pool_requests_name != NULL) {
-        free(_pool_requests_name);
-        _pool_requests_name = NULL;
+    /* No threads are started once _pool_shutdown is set.  The threads
+     * may need _mutex_resize on their way out, so it cannot be held
+     * while they are joined.
+     */
+    for (i = 0; i < _pool_nmemb; i++) {
+        if (_pool_workers[i]->state != _WORKER_EMPTY)
+            pthread_join(_pool_workers[i]->thread, NULL);
     }
-    printf("    freed name\n");
 
 
-    /* Discard any queued requests.
+    /* Discard any queued requests along with the workers, and reset
+     * the module.
      */
-    while (!SIMPLEQ_EMPTY(&_pool_requests)) {
-        r = SIMPLEQ_FIRST(&_pool_requests);
-        if (r == NULL)
-            printf("*** SIMPLEQ BOGUS #2 ***\n");
-        SIMPLEQ_REMOVE_HEAD(&_pool_requests, requests);
-        free(r);
+    pthread_mutex_lock(&_mutex_resize);
+    for (i = 0; i < _pool_nmemb; i++)
+        _worker_free(_pool_workers[i]);
+    if (_pool_workers != NULL) {
+        free(_pool_workers);
+        _pool_workers = NULL;
     }
-    printf("    discarded requests\n");
-
-    pthread_mutex_unlock(&_mutex);
+    for (i = 0; i < _pool_nretired; i++)
+        free(_pool_retired[i]);
+    if (_pool_retired != NULL) {
+        free(_pool_retired);
+        _pool_retired = NULL;
+    }
+    _pool_nretired = 0;
+    _pool_nmemb = 0;
+    _pool_live = 0;
+    _pool_target = 0;
+    _pool_pending = 0;
+    _pool_shutdown = 0;
+    pthread_mutex_unlock(&_mutex_resize);
 }
 
 
-/* The _pool_init() function performs one-time initialisation of the
- * pool module.  It adjusts the size of the global pool of worker
- * threads to @p nmemb members.  It must be called before any other
- * functions from the pool module.  It is thread-safe and can be
- * called multiple times.
- *
- * @param nmemb Number of threads to use for fingersum jobs (as least
- *              as many as @p nmemb XXX see pool_new_pc() in pool.h)
- * @return      0 if successful, -1 otherwise.  If an error occurs,
- *              the global variable @c errno is set to indicate the
- *              error.
+/* The _pool_grow() function adds workers to the pool until it has @p
+ * nmemb members, without starting their threads.  The new worker
+ * array is published before the number of workers, such that any
+ * thread that sees the new count also sees an array at least that
+ * long.  The caller must hold _mutex_resize.
  */
 static int
-_pool_init(size_t nmemb)
+_pool_grow(size_t nmemb)
 {
+    struct _pool_worker **workers, *w;
     void *p;
+    size_t i;
 
 
-    /* To allow proper cleanup in _pool_free(), the module must be in
-     * an initialised state as soon as _pool_init() is called.  Create
-     * a named requests semaphore.  This must be done before the
-     * threads are started, because the _start() routine will wait for
-     * it.
-     */
-    if (pthread_mutex_lock(&_mutex) != 0)
+    p = realloc(_pool_retired,
+                (_pool_nretired + 1) * sizeof(struct _pool_worker **));
+    if (p == NULL)
         return (-1);
+    _pool_retired = p;
 
-    if (_init_state++ < 0) {
-        pthread_mutex_unlock(&_mutex);
-        _pool_free();
-        return (_init_state = -1);
-    }
+    workers = calloc(nmemb, sizeof(struct _pool_worker *));
+    if (workers == NULL)
+        return (-1);
+    for (i = 0; i < _pool_nmemb; i++)
+        workers[i] = _pool_workers[i];
 
-    if (_pool_requests_name == NULL && _pool_requests_sem == SEM_FAILED) {
-        if (_sem_open(&_pool_requests_name, &_pool_requests_sem) != 0) {
-            pthread_mutex_unlock(&_mutex);
-            _pool_free();
-            return (_init_state = -1);
+    for (i = _pool_nmemb; i < nmemb; i++) {
+        w = malloc(sizeof(struct _pool_worker));
+        if (w == NULL)
+            break;
+        if (pthread_mutex_init(&w->mutex, NULL) != 0) {
+            free(w);
+            break;
         }
+        w->deque = NULL;
+        w->head = 0;
+        w->nmemb = 0;
+        w->size = 0;
+        w->inbox = NULL;
+        w->index = i;
+        w->state = _WORKER_EMPTY;
+        workers[i] = w;
     }
-    if (pthread_mutex_unlock(&_mutex) != 0) {
-        _pool_free();
-        return (_init_state = -1);
+    if (i < nmemb) {
+        while (i-- > _pool_nmemb)
+            _worker_free(workers[i]);
+        free(workers);
+        return (-1);
     }
 
+    if (_pool_workers != NULL)
+        _pool_retired[_pool_nretired++] = _pool_workers;
+    __atomic_store_n(&_pool_workers, workers, __ATOMIC_RELEASE);
+    __atomic_store_n(&_pool_nmemb, nmemb, __ATOMIC_RELEASE);
 
-    /* Allocate and create a pool of nmemb worker threads, all running
-     * the _start() function.  _mutex must not be locked when entering
-     * the if- and else-clauses, but will be locked on exit.
-     */
-    if (_pool_nmemb < nmemb) {
-        /* Grow the thread pool.  Lengthen the array of threads, then
-         * create new threads.  The pool mutex must be held while the
-         * pool array is adjusted.
-         */
-        if (pthread_mutex_lock(&_mutex) != 0) {
-            _pool_free();
-            return (_init_state = -1);
-        }
-        p = realloc(_pool_threads, nmemb * sizeof(pthread_t));
-        if (pthread_mutex_unlock(&_mutex) != 0) {
-            _pool_free();
-            return (_init_state = -1);
-        }
-        if (p == NULL) {
-            _pool_free();
-            return (_init_state = -1);
-        }
-        _pool_threads = p;
+    return (0);
+}
 
-        while (_pool_nmemb < nmemb) {
-            if (pthread_create(
-                    &_pool_threads[_pool_nmemb++], NULL, _start, NULL) != 0) {
-                _pool_free();
-                return (_init_state = -1);
-            }
-        }
 
-        if (pthread_mutex_lock(&_mutex) != 0) {
-            _pool_free();
-            return (_init_state = -1);
-        }
+/* The _pool_start() function brings the number of running threads up
+ * to @p nmemb, growing the worker array as necessary.  A thread that
+ * has decided to exit is joined before its worker is given a new
+ * one; a thread that has not yet noticed that it was to exit simply
+ * keeps running.  The caller must hold _mutex_resize.
+ */
+static int
+_pool_start(size_t nmemb)
+{
+    struct _pool_worker *w;
+    size_t i;
 
 
-    } else if (_pool_nmemb > nmemb) {
-#if 0 // XXX Zap this!
-        /* Shrink the thread pool.  Join superfluous threads, then
-         * shorten the array of threads.  The pool mutex cannot be
-         * held while joining the threads.
-         *
-         * XXX Would be nice (elegant) if this were to join just the
-         * next threads as they finish, which would allow the pool
-         * size to be shrunken, without discarding any jobs.
-         */
-        while (_pool_nmemb > nmemb) {
-            if (_join(_pool_threads[_pool_nmemb - 1], NULL) != 0) {
-                _pool_free();
-                return (_init_state = -1);
-            }
-            if (pthread_mutex_lock(&_mutex) != 0) {
-                _pool_free();
-                return (_init_state = -1);
-            }
-            _pool_nmemb -= 1;
-            if (pthread_mutex_unlock(&_mutex) != 0) {
-                _pool_free();
-                return (_init_state = -1);
-            }
-        }
+    if (_pool_nmemb < nmemb && _pool_grow(nmemb) != 0)
+        return (-1);
 
-        if (pthread_mutex_lock(&_mutex) != 0) {
-            _pool_free();
-            return (_init_state = -1);
+    for (i = _pool_live; i < nmemb; i++) {
+        w = _pool_workers[i];
+        if (w->state == _WORKER_EXITED) {
+            if (pthread_join(w->thread, NULL) != 0)
+                break;
+            w->state = _WORKER_EMPTY;
         }
-        p = realloc(_pool_threads, nmemb * sizeof(pthread_t));
-        if (p == NULL) {
-            _pool_free();
-            return (_init_state = -1);
+        if (w->state == _WORKER_EMPTY) {
+            if (pthread_create(&w->thread, NULL, _start, w) != 0)
+                break;
+            w->state = _WORKER_RUNNING;
         }
-        _pool_threads = p;
-#endif
-    } else if (_pool_nmemb == nmemb) {
+    }
+    __atomic_store_n(&_pool_live, i, __ATOMIC_RELEASE);
+
+    return (i < nmemb ? -1 : 0);
+}
+
+
+/* The _pool_spawn() function starts one more thread, unless the pool
+ * already has as many threads as it should have.  It is called when a
+ * job is submitted while all threads are busy.
+ */
+static int
+_pool_spawn(void)
+{
+    int ret;
+
+    if (pthread_mutex_lock(&_mutex_resize) != 0)
+        return (-1);
+    ret = 0;
+    if (_pool_live < _pool_target && !_pool_shutdown)
+        ret = _pool_start(_pool_live + 1);
+    if (pthread_mutex_unlock(&_mutex_resize) != 0)
+        return (-1);
+    return (ret);
+}
+
+
+/* The _pool_resize() function sets the number of threads in the pool
+ * to @p nmemb.  If @p grow is non-zero, the pool is only allowed to
+ * grow.  Growing starts the threads immediately.  When the pool
+ * shrinks, surplus threads finish their current jobs before they
+ * exit, and their queued jobs are stolen by the remaining threads.
+ * Idle threads are woken up so that they notice.
+ */
+static int
+_pool_resize(size_t nmemb, int grow)
+{
+    int ret;
+
+
+    if (pthread_mutex_lock(&_mutex_resize) != 0)
+        return (-1);
+    if (grow && nmemb <= _pool_target) {
+        if (pthread_mutex_unlock(&_mutex_resize) != 0)
+            return (-1);
         return (0);
     }
 
+    __atomic_store_n(&_pool_target, nmemb, __ATOMIC_RELEASE);
+    ret = 0;
+    if (_pool_live < nmemb) {
+        ret = _pool_start(nmemb);
+    } else if (_pool_live > nmemb) {
+        __atomic_store_n(&_pool_live, nmemb, __ATOMIC_RELEASE);
+        if (pthread_mutex_lock(&_mutex_idle) == 0) {
+            pthread_cond_broadcast(&_cond_idle);
+            pthread_mutex_unlock(&_mutex_idle);
+        }
+    }
+
+    if (pthread_mutex_unlock(&_mutex_resize) != 0)
+        return (-1);
+    return (ret);
+}
+
+
+/* The _pool_init() function performs one-time initialisation of the
+ * pool module.  It grows the global pool of worker threads to at
+ * least @p nmemb members.  It must be called before any other
+ * functions from the pool module.  It is thread-safe and can be
+ * called multiple times.
+ *
+ * @param nmemb Number of threads to use for fingersum jobs (as least
+ *              as many as @p nmemb XXX see pool_new_pc() in pool.h)
+ * @return      0 if successful, -1 otherwise.  If an error occurs,
+ *              the global variable @c errno is set to indicate the
+ *              error.
+ */
+static int
+_pool_init(size_t nmemb)
+{
+    /* To allow proper cleanup in _pool_free(), the module must be in
+     * an initialised state as soon as _pool_init() is called.
+     */
+    if (pthread_mutex_lock(&_mutex) != 0)
+        return (-1);
+
+    if (_init_state++ < 0) {
+        pthread_mutex_unlock(&_mutex);
+        _pool_free();
+        return (_init_state = -1);
+    }
+
     if (pthread_mutex_unlock(&_mutex) != 0) {
         _pool_free();
         return (_init_state = -1);
     }
 
+    if (_pool_resize(nmemb, 1) != 0) {
+        _pool_free();
+        return (_init_state = -1);
+    }
+
     return (0);
 }
 
@@ -641,70 +1082,22 @@ _pool_init(size_t nmemb)
 void
 pool_free_pc(struct pool_context *pc)
 {
-    struct _pool_request *r, *s;
+    struct _pool_request *r;
 
 
-    /* Inactivate the context to prevent new submissions.
+    /* Inactivate the context to prevent new submissions.  Queued jobs
+     * of the context will be passed straight to the results queue
+     * by the workers, without being processed.
      */
-    //printf("  locking\n");
     if (pthread_mutex_lock(&pc->mutex) != 0)
         return;
     pc->active = 0;
-    //printf("  unlocking\n");
     if (pthread_mutex_unlock(&pc->mutex) != 0)
         return;
 
 
-    /* Discard any queued jobs of the pool context.  This will cause
-     * the queue and the semaphore to loose synchronisation.
-     *
-     * XXX Maybe want a separate function for removing a job from the
-     * pool context?  Or subtracting the inprogress counter?
-     */
-//    printf("  deactivated\n");
-    if (pthread_mutex_lock(&_mutex) == 0) {
-        printf("    locked again\n");
-        while (!SIMPLEQ_EMPTY(&_pool_requests)) {
-//            printf("    loop #1\n");
-            r = SIMPLEQ_FIRST(&_pool_requests);
-            if (r->result != pc)
-                break;
-
-            if (pthread_mutex_lock(&pc->mutex) != 0)
-                return;
-            SIMPLEQ_REMOVE_HEAD(&_pool_requests, requests);
-            pc->inprogress -= 1;
-            if (pthread_mutex_unlock(&pc->mutex) != 0)
-                return;
-        }
-
-        if (!SIMPLEQ_EMPTY(&_pool_requests)) {
-            for (r = SIMPLEQ_FIRST(&_pool_requests); ; ) {
-//                printf("    loop #2\n");
-                s = SIMPLEQ_NEXT(r, requests);
-                if (s == NULL)
-                    break;
-                if (s->result == pc) {
-                    if (pthread_mutex_lock(&pc->mutex) != 0)
-                        return;
-                    SIMPLEQ_REMOVE_AFTER(&_pool_requests, r, requests);
-                    pc->inprogress -= 1;
-                    if (pthread_mutex_unlock(&pc->mutex) != 0)
-                        return;
-                } else {
-                    r = s;
-                }
-            }
-        }
-
-        printf("  unlocking\n");
-        pthread_mutex_unlock(&_mutex);
-    }
-
-
     /* Wait for any running jobs to finish.
      */
-    printf("  waiting\n");
     while (get_result(pc, NULL, NULL, NULL) == 0)
         ;
     if (errno != ENOMSG)
@@ -712,39 +1105,19 @@ pool_free_pc(struct pool_context *pc)
     errno = 0;
 
 
-    /* Close and remove the semaphore, discard any queue results
+    /* Discard any queued results.
      */
-    printf("  discarding\n");
     if (pthread_mutex_lock(&pc->mutex) == 0) {
-        printf("  locked\n");
-        if (pc->sem != NULL) {
-            sem_close(pc->sem);
-            sem_unlink(pc->name + 4);
-        }
-        printf("  removed\n");
-        if (pc->name != NULL)
-            free(pc->name);
-
-
-        /* This while loops appears to hang every once in a while
-         * 2016-10-03.
-         */
         while (!SIMPLEQ_EMPTY(&pc->results)) {
-            printf("    queue not empty\n");
             r = SIMPLEQ_FIRST(&pc->results);
-            if (r == NULL)
-                printf("*** SIMPLEQ BOGUS #3 ***\n");
-            printf("    got head\n");
             SIMPLEQ_REMOVE_HEAD(&pc->results, requests);
-            printf("    removed head\n");
-            free(r);
-            printf("    freed head\n");
+            _request_free(r);
         }
-        printf("  discarded\n");
         pthread_mutex_unlock(&pc->mutex);
     }
 
-    printf("  unlocked\n");
+    pthread_cond_destroy(&pc->cond);
+    pthread_mutex_destroy(&pc->mutex);
     free(pc);
 
 
@@ -752,9 +1125,7 @@ pool_free_pc(struct pool_context *pc)
      * However, most of them are related to mutex-locking, which
      * should never fail!
      */
-    printf("  freed\n"); // Hang here 2016-10-10
     _pool_free();
-    printf("  _pool_free() done\n");
 }
 
 
@@ -770,21 +1141,24 @@ pool_new_pc(size_t nmemb)
         return (NULL);
 
     pc = malloc(sizeof(struct pool_context));
-    if (pc == NULL)
+    if (pc == NULL) {
+        _pool_free();
         return (NULL);
+    }
     SIMPLEQ_INIT(&pc->results);
-    pc->name = NULL;
-    pc->sem = NULL;
     pc->inprogress = 0;
     pc->active = 1;
 
     if (pthread_mutex_init(&pc->mutex, NULL) != 0) {
-        pool_free_pc(pc);
+        free(pc);
+        _pool_free();
         return (NULL);
     }
 
-    if (_sem_open(&pc->name, &pc->sem) != 0) {
-        pool_free_pc(pc);
+    if (pthread_cond_init(&pc->cond, NULL) != 0) {
+        pthread_mutex_destroy(&pc->mutex);
+        free(pc);
+        _pool_free();
         return (NULL);
     }
 
@@ -793,82 +1167,279 @@ pool_new_pc(size_t nmemb)
 
 
 int
-add_request(struct pool_context *pc,
-            struct fingersum_context *ctx,
-            void *arg,
-            int flags)
+pool_resize(size_t nmemb)
 {
-    struct _pool_request *r;
-    int ret;
+    ssize_t state;
 
 
-    /* Allocate and initialise the job.
+    if (nmemb == 0) {
+        errno = EINVAL;
+        return (-1);
+    }
+
+
+    /* Resizing a pool that does not exist would start threads that
+     * _pool_free() never joins.
+     */
+    if (pthread_mutex_lock(&_mutex) != 0)
+        return (-1);
+    state = _init_state;
+    if (pthread_mutex_unlock(&_mutex) != 0)
+        return (-1);
+    if (state <= 0) {
+        errno = ENXIO;
+        return (-1);
+    }
+
+    return (_pool_resize(nmemb, 0));
+}
+
+
+#if defined(__linux__)
+/* The _cgroup_cpus() function returns the number of CPUs the process
+ * may use according to the cgroup v2 CPU bandwidth limit, cpu.max, of
+ * its cgroup, rounded up.  It returns zero if there is no limit or if
+ * it cannot be determined.
+ */
+static size_t
+_cgroup_cpus(void)
+{
+    char line[1024], path[1024 + 32], quota[32];
+    FILE *stream;
+    unsigned long period;
+    unsigned long long q;
+    size_t len;
+
+
+    /* The unified hierarchy is listed as "0::/path".
      */
+    stream = fopen("/proc/self/cgroup", "r");
+    if (stream == NULL)
+        return (0);
+    path[0] = '\0';
+    while (fgets(line, sizeof(line), stream) != NULL) {
+        if (strncmp(line, "0::", 3) == 0) {
+            len = strcspn(line + 3, "\n");
+            line[3 + len] = '\0';
+            snprintf(path, sizeof(path),
+                     "/sys/fs/cgroup%s/cpu.max", line + 3);
+            break;
+        }
+    }
+    fclose(stream);
+    if (path[0] == '\0')
+        return (0);
+
+    stream = fopen(path, "r");
+    if (stream == NULL)
+        return (0);
+    if (fscanf(stream, "%31s %lu", quota, &period) != 2 ||
+        strcmp(quota, "max") == 0 ||
+        period == 0) {
+        fclose(stream);
+        return (0);
+    }
+    fclose(stream);
+
+    q = strtoull(quota, NULL, 10);
+    if (q == 0)
+        return (0);
+    return ((q + period - 1) / period);
+}
+#endif
+
+
+size_t
+pool_nmemb_auto(void)
+{
+    const char *env;
+    char *ep;
+    long n;
+#if defined(__linux__)
+    cpu_set_t set;
+    size_t m;
+#endif
+
+
+    /* An explicit setting in the environment always wins.
+     */
+    env = getenv("SNDCHK_THREADS");
+    if (env != NULL && env[0] != '\0') {
+        errno = 0;
+        n = strtol(env, &ep, 10);
+        if (*ep == '\0' && errno == 0 && n >= 0)
+            return (n);
+    }
+
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+
+#if defined(__linux__)
+    if (sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) > 0)
+        n = CPU_COUNT(&set);
+
+    m = _cgroup_cpus();
+    if (m > 0 && (n <= 0 || m < (size_t)n))
+        n = m;
+#endif
+
+    errno = 0;
+    return (n > 0 ? n : 1);
+}
+
+
+/* The _request_new() function allocates a job for the pool context
+ * @p pc, with every member cleared except the context and @p arg.
+ */
+static struct _pool_request *
+_request_new(struct pool_context *pc, void *arg)
+{
+    struct _pool_request *r;
+
     r = malloc(sizeof(struct _pool_request));
     if (r == NULL)
-        return (-1);
-    r->ctx = ctx;
+        return (NULL);
     r->arg = arg;
+    r->ctx = NULL;
     r->result = pc;
-    r->flags = flags;
+    r->flags = 0;
+    r->status = 0;
+    r->fn = NULL;
+    r->cont = NULL;
+    r->value = NULL;
+    r->then = NULL;
+    r->prev = NULL;
+    r->done = 0;
+    r->next = NULL;
+    return (r);
+}
 
 
-    /* Do not allow new jobs to be enqueued if the context is
-     * inactive.
-     */
-    if (pthread_mutex_lock(&pc->mutex) != 0) {
-        free(r);
+/* The _enqueue() function schedules the job @p r, which belongs to
+ * the pool context @p pc.  New jobs are not accepted if the context
+ * is inactive.  Otherwise, the inprogress counter is increased to
+ * notify get_result() that a result is pending.  If the job cannot
+ * be enqueued, the caller retains ownership of @p r.
+ */
+static int
+_enqueue(struct pool_context *pc, struct _pool_request *r)
+{
+    if (pthread_mutex_lock(&pc->mutex) != 0)
         return (-1);
-    }
     if (!pc->active) {
         pthread_mutex_unlock(&pc->mutex);
-        free(r);
         errno = ECANCELED;
         return (-1);
     }
+    pc->inprogress += 1;
+    if (pthread_mutex_unlock(&pc->mutex) != 0)
+        return (-1);
 
 
-    /* Special case for serial processing.  Increase the inprogress
-     * counter to notify get_result() that a result is pending.
+    /* Once the job is in an inbox it belongs to the pool, even if
+     * waking up a worker fails.  In the serial case, the job has been
+     * processed by the time _schedule() returns.
      */
-    if (_pool_nmemb <= 0) {
-        pc->inprogress += 1;
-        if (pthread_mutex_unlock(&pc->mutex) != 0) {
-            free(r);
-            return (-1);
-        }
+    return (_schedule(r));
+}
 
-        if (_process(r, NULL) != 0) {
-            free(r);
-            return (-1);
-        }
 
-        return (0);
+/* The _unlink() function removes the completed job @p r from the
+ * results queue of @p pc.  The caller must hold the mutex of @p pc.
+ */
+static void
+_unlink(struct pool_context *pc, struct _pool_request *r)
+{
+    struct _pool_request *s;
+
+    if (SIMPLEQ_FIRST(&pc->results) == r) {
+        SIMPLEQ_REMOVE_HEAD(&pc->results, requests);
+        return;
     }
 
+    SIMPLEQ_FOREACH(s, &pc->results, requests) {
+        if (SIMPLEQ_NEXT(s, requests) == r) {
+            SIMPLEQ_REMOVE_AFTER(&pc->results, s, requests);
+            return;
+        }
+    }
+}
+
 
-    /* Parallel processing: push the job onto the global queue.
-     * Increase the inprogress counter and post the semaphore to less
-     * the worker processes know a job is pending.  If the mutexes
-     * cannot be unlocked or the semaphore cannot be posted, the job
-     * queue will be inconsistent!  At least attempt them both.
+/* The _wait() function waits for the job @p r of the pool context @p
+ * pc to complete and removes it from the results queue.  If @p r is
+ * @c NULL, it waits for any job, and returns the first completed one.
+ * The returned job is owned by the caller.
+ */
+static struct _pool_request *
+_wait(struct pool_context *pc, struct _pool_request *r)
+{
+    /* Unless no results are expected, wait for a result to become
+     * available.  pthread_cond_wait() releases the context's mutex
+     * while waiting.
      */
-    if (pthread_mutex_lock(&_mutex) != 0) {
+    if (pthread_mutex_lock(&pc->mutex) != 0)
+        return (NULL);
+    if (pc->inprogress == 0) {
         pthread_mutex_unlock(&pc->mutex);
-        free(r);
-        return (-1);
+        errno = ENOMSG;
+        return (NULL);
+    }
+    if (r != NULL && r->then != NULL) {
+        pthread_mutex_unlock(&pc->mutex);
+        errno = EINVAL;
+        return (NULL);
+    }
+
+    while (r == NULL ? SIMPLEQ_EMPTY(&pc->results) : !r->done) {
+        if (pthread_cond_wait(&pc->cond, &pc->mutex) != 0) {
+            pthread_mutex_unlock(&pc->mutex);
+            return (NULL);
+        }
     }
 
-    SIMPLEQ_INSERT_TAIL(&_pool_requests, r, requests);
-    pc->inprogress += 1;
 
-    ret = pthread_mutex_unlock(&pc->mutex);
-    ret |= pthread_mutex_unlock(&_mutex);
+    /* Extract the result from the queue.
+     */
+    if (r == NULL) {
+        r = SIMPLEQ_FIRST(&pc->results);
+        SIMPLEQ_REMOVE_HEAD(&pc->results, requests);
+    } else {
+        _unlink(pc, r);
+    }
 
-    //printf("      posting to %p\n", _pool_requests_sem);
-    ret |= sem_post(_pool_requests_sem);
+    pc->inprogress -= 1;
+    if (pthread_mutex_unlock(&pc->mutex) != 0) {
+        _request_free(r);
+        return (NULL);
+    }
 
-    return (ret);
+    return (r);
+}
+
+
+int
+add_request(struct pool_context *pc,
+            struct fingersum_context *ctx,
+            void *arg,
+            int flags)
+{
+    struct _pool_request *r;
+
+
+    /* Allocate and initialise the job.
+     */
+    r = _request_new(pc, arg);
+    if (r == NULL)
+        return (-1);
+    r->ctx = ctx;
+    r->flags = flags;
+
+    if (_enqueue(pc, r) != 0) {
+        free(r);
+        return (-1);
+    }
+
+    return (0);
 }
 
 
@@ -881,70 +1452,138 @@ get_result(struct pool_context *pc,
     struct _pool_request *r;
 
 
-    for ( ; ; ) {
-        /* Unless no results are expected, wait for a result to become
-         * available.  Cannot hold the pool context's mutex while
-         * waiting.
-         */
-        if (pthread_mutex_lock(&pc->mutex) != 0)
-            return (-1);
-        if (pc->inprogress == 0) {
-            pthread_mutex_unlock(&pc->mutex);
-            errno = ENOMSG;
-            return (-1);
-        }
-        if (pthread_mutex_unlock(&pc->mutex) != 0)
-            return (-1);
+    r = _wait(pc, NULL);
+    if (r == NULL)
+        return (-1);
 
-//        printf("0 ");
-//        fflush(stdout);
+    if (ctx != NULL)
+        *ctx = r->ctx;
+    if (arg != NULL)
+        *arg = r->arg;
+    if (status != NULL)
+        *status = r->status;
 
-        /* XXX See rare hangs here!  Are the threads deadlocked?  The
-         * main thread is not holding on to any locks!  This appears
-         * to be resolved (haven't seen any hangs in a long time).
-         */
-        if (sem_wait(pc->sem) != 0)
-            return (-1);
+    _request_free(r);
+    return (0);
+}
 
-//        printf("1 ");
-//        fflush(stdout);
 
+struct pool_job *
+pool_submit(struct pool_context *pc, void *(*fn)(void *arg), void *arg)
+{
+    struct _pool_request *r;
 
-        /* Extract the result from the queue, and release it.  Store
-         * results if requested.
-         */
-        if (pthread_mutex_lock(&pc->mutex) != 0)
-            return (-1);
 
-        if (SIMPLEQ_EMPTY(&pc->results)) {
-            printf("*** SIMPLEQ BOGUS #4 ***\n");
-            pthread_mutex_unlock(&pc->mutex);
-            errno = ENOMSG;
-            return (-1);
-        }
+    r = _request_new(pc, arg);
+    if (r == NULL)
+        return (NULL);
+    r->fn = fn;
 
-        r = SIMPLEQ_FIRST(&pc->results);
-        if (r == NULL)
-            printf("*** SIMPLEQ BOGUS #5 ***\n");
-        SIMPLEQ_REMOVE_HEAD(&pc->results, requests);
+    if (_enqueue(pc, r) != 0) {
+        free(r);
+        return (NULL);
+    }
 
-        pc->inprogress -= 1;
-        if (pthread_mutex_unlock(&pc->mutex) != 0)
-            return (-1);
+    return ((struct pool_job *)r);
+}
 
-        if (ctx != NULL)
-            *ctx = r->ctx;
-        if (arg != NULL)
-            *arg = r->arg;
-        if (status != NULL)
-            *status = r->status;
 
-        free(r);
-        return (0);
-    }
+struct pool_job *
+pool_then(struct pool_job *job,
+          void *(*fn)(void *arg, void *value),
+          void *arg)
+{
+    struct pool_context *pc;
+    struct _pool_request *c, *r;
+
+
+    r = (struct _pool_request *)job;
+    pc = r->result;
+
+    c = _request_new(pc, arg);
+    if (c == NULL)
+        return (NULL);
+    c->cont = fn;
 
 
-    /* NOTREACHED
+    /* If the job is still pending, attach the continuation; it will
+     * be scheduled by whichever thread completes the job.  Otherwise,
+     * take the job off the results queue and schedule the
+     * continuation right away.  Either way, the continuation takes
+     * the place of the job in the context.
      */
-    return (-1);
+    if (pthread_mutex_lock(&pc->mutex) != 0) {
+        free(c);
+        return (NULL);
+    }
+    if (!pc->active || r->then != NULL) {
+        errno = pc->active ? EINVAL : ECANCELED;
+        pthread_mutex_unlock(&pc->mutex);
+        free(c);
+        return (NULL);
+    }
+
+    if (!r->done) {
+        r->then = c;
+        if (pthread_mutex_unlock(&pc->mutex) != 0)
+            return (NULL);
+        return ((struct pool_job *)c);
+    }
+
+    _unlink(pc, r);
+    r->then = c;
+    if (pthread_mutex_unlock(&pc->mutex) != 0)
+        return (NULL);
+
+    c->value = r->value;
+    c->prev = r;
+    if (_schedule(c) != 0)
+        return (NULL);
+    return ((struct pool_job *)c);
+}
+
+
+int
+pool_wait(struct pool_job *job, void **value)
+{
+    struct _pool_request *r;
+
+
+    r = _wait(((struct _pool_request *)job)->result,
+              (struct _pool_request *)job);
+    if (r == NULL)
+        return (-1);
+
+    if (value != NULL)
+        *value = r->value;
+
+    _request_free(r);
+    return (0);
+}
+
+
+int
+pool_wait_any(struct pool_context *pc, void **arg, void **value)
+{
+    struct _pool_request *r;
+
+
+    r = _wait(pc, NULL);
+    if (r == NULL)
+        return (-1);
+
+    if (arg != NULL)
+        *arg = r->arg;
+    if (value != NULL)
+        *value = r->value;
+
+    _request_free(r);
+    return (0);
+}
+
+
+int
+pool_is_worker(void)
+{
+    return (_self != NULL);
 }
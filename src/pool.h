@@ -40,28 +40,34 @@ POOL_BEGIN_C_DECLS
  * calculations).  It maintains a single, global pool of worker
  * threads.
  *
- * Uses a thread pool to do fingersum in parallel.  Jobs are processed
- * in the order they are submitted.
+ * Uses a thread pool to do fingersum in parallel.  Submitted jobs are
+ * distributed over the workers in turn, without taking any locks.
+ * Each worker processes its own jobs in the order they were
+ * submitted, and steals jobs from the other workers once it runs out.
  *
  * Should be equivalent to plain fingersum with nmemb == 1.  The case
  * nmemb == 0 should work as well.
  *
- * Processing starts in the order jobs are submitted.  Due to the
- * multiprocessing nature, they may not finish in that order, though.
+ * Processing starts roughly in the order jobs are submitted.  Due to
+ * the multiprocessing nature, they may not finish in that order,
+ * though.
  *
  * XXX Maybe better named fspool?  Nah...
  *
- * Implements "first come, first served" (FCFS) scheduling.
+ * Implements work-stealing scheduling.  No named semaphores or other
+ * file system objects are created.
  *
- * XXX Would be nicer if we could accept a callback and user data
- * instead of the ACTIONS enumeration.
+ * Besides the fingersum jobs of the ACTIONS enumeration, arbitrary
+ * function calls can be submitted with pool_submit(), and chained
+ * with pool_then().
  *
  * XXX Review https://en.wikipedia.org/wiki/Monitor_(synchronization)
  *
- * XXX Could have an option to start a new thread whenever no free
- * threads are available, but that probably also requires the ability
- * to reap idle threads.  And then the whole bit about dynamic
- * resizing of a pool becomes an issue.
+ * The pool is shared by all pool contexts, and grows to the largest
+ * size requested from pool_new_pc().  Its size can also be changed at
+ * run time with pool_resize().  Threads that have been idle for a
+ * while exit, and are started again as jobs are submitted while all
+ * remaining threads are busy.
  *
  * All jobs/tasks have the same priority
  *
@@ -98,6 +104,42 @@ struct pool_context *
 pool_new_pc(size_t nmemb);
 
 
+/**
+ * @brief Number of threads suitable for this process
+ *
+ * Returns the value of the @c SNDCHK_THREADS environment variable if
+ * it is set to a non-negative integer.  Otherwise, returns the number
+ * of CPUs the process may run on, as determined by its CPU affinity
+ * mask and, on Linux, by the CPU bandwidth limit (cpu.max) of its
+ * cgroup v2, rounded up.  The result is suitable as the @p nmemb
+ * argument to pool_new_pc() and pool_resize(), and is always at
+ * least one unless set to zero by @c SNDCHK_THREADS.
+ *
+ * @return Number of threads
+ */
+size_t
+pool_nmemb_auto(void);
+
+
+/**
+ * @brief Change the number of threads in the pool
+ *
+ * Unlike pool_new_pc(), which only ever grows the pool,
+ * pool_resize() also shrinks it.  New threads are started
+ * immediately.  Surplus threads finish the jobs they are processing
+ * before they exit, and the jobs queued for them are taken over by
+ * the remaining threads.  The pool keeps at least one thread;
+ * pool_resize() fails with @c EINVAL if @p nmemb is zero.
+ *
+ * @param nmemb Number of threads
+ * @return      0 if successful, -1 otherwise.  If an error occurs,
+ *              the global variable @c errno is set to indicate the
+ *              error.
+ */
+int
+pool_resize(size_t nmemb);
+
+
 /**
  * @brief Release a pool context
  *
@@ -128,9 +170,7 @@ pool_free_pc(struct pool_context *pc);
  * pool_add_request()?  pool_submit()?  submits a job (or a task)?
  * batch_submit()?
  *
- * XXX Idea: return an ID, which can the be used to wait for the job.
- * The wait function should take a special value to indicate waiting
- * for any job.
+ * See pool_submit() for jobs that return a handle.
  *
  * XXX The "corresponding" glib function, gthread_pool_push() takes an
  * addition "GError **error" argument for error reporting.
@@ -178,6 +218,124 @@ get_result(struct pool_context *pc,
            void **arg,
            int *status);
 
+/**
+ * @brief Opaque handle to a job submitted with pool_submit()
+ */
+struct pool_job;
+
+
+/**
+ * @brief Submit a function call to the pool
+ *
+ * Schedules the call @p fn(@p arg) on the worker threads of the pool
+ * and returns a handle to the job.  The value returned by @p fn is
+ * retrieved with pool_wait() or pool_wait_any(), which also release
+ * the handle.  Unless the pool was initialised with <code>nmemb ==
+ * 0</code>, pool_submit() returns immediately.  Otherwise, @p fn is
+ * called before pool_submit() returns.
+ *
+ * Jobs submitted from within a job run on the same workers.  A pool
+ * context should be used either with add_request() and get_result(),
+ * or with pool_submit() and the functions below, but not with both.
+ *
+ * If @p pc is no longer accepting submission, pool_submit() returns
+ * @c NULL and sets the @c errno to @c ECANCELED.
+ *
+ * @param pc  Pointer to an opaque pool context
+ * @param fn  Function to call
+ * @param arg Argument to @p fn
+ * @return    Handle to the job if successful, @c NULL otherwise.  If
+ *            an error occurs, the global variable @c errno is set to
+ *            indicate the error.
+ */
+struct pool_job *
+pool_submit(struct pool_context *pc, void *(*fn)(void *arg), void *arg);
+
+
+/**
+ * @brief Chain a continuation to a job
+ *
+ * Schedules the call @p fn(@p arg, value) as soon as @p job has
+ * completed, where value is the value of @p job.  The continuation
+ * runs on the worker that completed @p job, unless another worker
+ * steals it first.  If @p job has already completed, the continuation
+ * is scheduled immediately.
+ *
+ * The continuation takes the place of @p job: its value is only
+ * available to @p fn, and pool_wait() on @p job fails.  The handle
+ * of @p job remains valid until the continuation has been waited
+ * for, at which point both are released.  A job can have at most one
+ * continuation, but continuations can themselves be chained.
+ *
+ * pool_then() fails with @c EINVAL if @p job already has a
+ * continuation, and with @c ECANCELED if its pool context is no
+ * longer accepting submission.
+ *
+ * @param job Handle to a job that has not yet been waited for
+ * @param fn  Function to call
+ * @param arg First argument to @p fn
+ * @return    Handle to the continuation if successful, @c NULL
+ *            otherwise.  If an error occurs, the global variable @c
+ *            errno is set to indicate the error.
+ */
+struct pool_job *
+pool_then(struct pool_job *job,
+          void *(*fn)(void *arg, void *value),
+          void *arg);
+
+
+/**
+ * @brief Wait for a job to complete
+ *
+ * Blocks until @p job has completed, stores its value in @p value
+ * unless @p value is @c NULL, and releases the handle.  pool_wait()
+ * fails with @c EINVAL if @p job has a continuation.
+ *
+ * @param job   Handle to the job
+ * @param value Pointer to the value of the job, or @c NULL
+ * @return      0 if successful, -1 otherwise.  If an error occurs,
+ *              the global variable @c errno is set to indicate the
+ *              error.
+ */
+int
+pool_wait(struct pool_job *job, void **value);
+
+
+/**
+ * @brief Wait for any job to complete
+ *
+ * Blocks until any job of @p pc has completed, and releases its
+ * handle.  The argument the job was submitted with and its value are
+ * stored in @p arg and @p value, respectively, unless they are @c
+ * NULL.  Jobs are returned in the order they complete.  If all jobs
+ * have been waited for, pool_wait_any() returns @c -1 and sets the
+ * global variable @c errno to @c ENOMSG.
+ *
+ * @param pc    Pointer to an opaque pool context
+ * @param arg   Pointer to the argument of the job, or @c NULL
+ * @param value Pointer to the value of the job, or @c NULL
+ * @return      0 if successful, -1 otherwise.  If an error occurs,
+ *              the global variable @c errno is set to indicate the
+ *              error.
+ */
+int
+pool_wait_any(struct pool_context *pc, void **arg, void **value);
+
+
+/**
+ * @brief Whether the calling thread is a worker of the pool
+ *
+ * A job that runs on the pool must not wait for other jobs with
+ * pool_wait() or pool_wait_any(), because the worker blocks while
+ * the jobs it waits for may be queued behind it.  Callers that may
+ * run either way can use pool_is_worker() to do the work inline
+ * instead.
+ *
+ * @return Non-zero if called from a worker thread, zero otherwise
+ */
+int
+pool_is_worker(void);
+
 POOL_END_C_DECLS
 
 #endif /* !POOL_H */
@@ -0,0 +1,730 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil; tab-width: 8 -*- */
+
+/*-
+ * Copyright © 2019, Johan Hattne
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice appear
+ * in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS.  IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS
+ * OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#    include <config.h>
+#endif
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "server.h"
+#include "simpleq.h"
+
+
+/* A connection from a client.  The connection is shared by the
+ * thread that reads its commands and by its jobs, and is released
+ * when the last of them is done with it.
+ */
+struct _connection
+{
+    struct server_context *ctx;
+
+    /* Commands are read from the stream, which owns the socket.
+     * Replies are sent directly on the socket, one line at a time,
+     * while holding the mutex.
+     */
+    FILE *stream;
+    int fd;
+    pthread_mutex_t mutex;
+
+    /* Number of references to the connection, protected by the mutex
+     * of the server context
+     */
+    size_t refs;
+
+    SIMPLEQ_ENTRY(_connection) connections;
+};
+
+
+/* A job, queued or running
+ */
+struct server_job
+{
+    struct _connection *conn;
+    char *id;
+    char *path;
+    long int priority;
+
+    SIMPLEQ_ENTRY(server_job) jobs;
+};
+
+
+struct server_context
+{
+    /* Path to the socket, and the listening socket
+     */
+    char *path;
+    int fd;
+
+    /* The handler and its argument
+     */
+    server_handler fn;
+    void *arg;
+
+    /* The worker threads
+     */
+    pthread_t *workers;
+    size_t nmemb;
+
+    /* The mutex protects everything below.  The condition variable
+     * is signalled when a job is queued, when a connection is
+     * released, and when the server is shut down.
+     */
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    /* Queued jobs, ordered by decreasing priority, and the open
+     * connections.
+     */
+    SIMPLEQ_HEAD(, server_job) queue;
+    SIMPLEQ_HEAD(, _connection) connections;
+    size_t nconns;
+
+    int shutdown;
+};
+
+
+/* The _vsend() function sends the line "@p type @p id message" on
+ * the connection @p conn, where the message is formatted from @p fmt
+ * and @p ap.  The mutex of the connection must be held by the caller.
+ * Failure because the client has gone away is not an error.
+ */
+static int
+_vsend(struct _connection *conn,
+       const char *type,
+       const char *id,
+       const char *fmt,
+       va_list ap)
+{
+    va_list aq;
+    char *line, *p;
+    size_t len, off;
+    ssize_t n;
+    int len_message;
+
+
+    va_copy(aq, ap);
+    len_message = vsnprintf(NULL, 0, fmt, aq);
+    va_end(aq);
+    if (len_message < 0)
+        return (-1);
+
+    len = strlen(type) + strlen(id) + len_message + 4;
+    line = malloc(len);
+    if (line == NULL)
+        return (-1);
+
+    off = snprintf(line, len, "%s %s", type, id);
+    if (len_message > 0) {
+        line[off++] = ' ';
+        vsnprintf(line + off, len - off, fmt, ap);
+        for (p = line + off; *p != '\0'; p++) {
+            if (*p == '\n' || *p == '\r')
+                *p = ' ';
+        }
+        off += len_message;
+    }
+    line[off++] = '\n';
+
+    for (p = line; off > 0; p += n, off -= n) {
+        n = send(conn->fd, p, off, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR) {
+                n = 0;
+                continue;
+            }
+            free(line);
+            if (errno == EPIPE || errno == ECONNRESET)
+                return (0);
+            return (-1);
+        }
+    }
+
+    free(line);
+    return (0);
+}
+
+
+/* The _send() function is the variadic equivalent of _vsend(), but
+ * takes the mutex of the connection itself.
+ */
+static int
+_send(struct _connection *conn,
+      const char *type,
+      const char *id,
+      const char *fmt,
+      ...)
+{
+    va_list ap;
+    int ret;
+
+    if (pthread_mutex_lock(&conn->mutex) != 0)
+        return (-1);
+    va_start(ap, fmt);
+    ret = _vsend(conn, type, id, fmt, ap);
+    va_end(ap);
+    pthread_mutex_unlock(&conn->mutex);
+
+    return (ret);
+}
+
+
+/* The _send_locked() function is the variadic equivalent of
+ * _vsend().
+ */
+static int
+_send_locked(struct _connection *conn,
+             const char *type,
+             const char *id,
+             const char *fmt,
+             ...)
+{
+    va_list ap;
+    int ret;
+
+    va_start(ap, fmt);
+    ret = _vsend(conn, type, id, fmt, ap);
+    va_end(ap);
+
+    return (ret);
+}
+
+
+/* The _release() function drops a reference to the connection @p
+ * conn, and frees it once the last reference is gone.
+ */
+static void
+_release(struct _connection *conn)
+{
+    struct server_context *ctx;
+    struct _connection *c, *prev;
+    size_t refs;
+
+
+    ctx = conn->ctx;
+    if (pthread_mutex_lock(&ctx->mutex) != 0)
+        return;
+    refs = --conn->refs;
+    if (refs == 0) {
+        prev = NULL;
+        SIMPLEQ_FOREACH(c, &ctx->connections, connections) {
+            if (c == conn)
+                break;
+            prev = c;
+        }
+        if (c != NULL) {
+            if (prev == NULL)
+                SIMPLEQ_REMOVE_HEAD(&ctx->connections, connections);
+            else
+                SIMPLEQ_REMOVE_AFTER(&ctx->connections, prev, connections);
+        }
+        ctx->nconns -= 1;
+        pthread_cond_broadcast(&ctx->cond);
+    }
+    pthread_mutex_unlock(&ctx->mutex);
+
+    if (refs == 0) {
+        fclose(conn->stream);
+        pthread_mutex_destroy(&conn->mutex);
+        free(conn);
+    }
+}
+
+
+static void
+_job_free(struct server_job *job)
+{
+    if (job->id != NULL)
+        free(job->id);
+    if (job->path != NULL)
+        free(job->path);
+    free(job);
+}
+
+
+/* The _cancel() function removes the queued jobs that were submitted
+ * on the connection @p conn with identifier @p id, and tells their
+ * clients.  If @p conn is @c NULL, jobs from all connections are
+ * removed, and if @p id is @c NULL, jobs with any identifier.
+ *
+ * @return The number of jobs cancelled
+ */
+static size_t
+_cancel(struct server_context *ctx, struct _connection *conn, const char *id)
+{
+    SIMPLEQ_HEAD(, server_job) cancelled;
+    struct server_job *job, *prev;
+    size_t n;
+
+
+    SIMPLEQ_INIT(&cancelled);
+    if (pthread_mutex_lock(&ctx->mutex) != 0)
+        return (0);
+    prev = NULL;
+    job = SIMPLEQ_FIRST(&ctx->queue);
+    while (job != NULL) {
+        if ((conn != NULL && job->conn != conn) ||
+            (id != NULL && strcmp(job->id, id) != 0)) {
+            prev = job;
+            job = SIMPLEQ_NEXT(job, jobs);
+            continue;
+        }
+
+        if (prev == NULL)
+            SIMPLEQ_REMOVE_HEAD(&ctx->queue, jobs);
+        else
+            SIMPLEQ_REMOVE_AFTER(&ctx->queue, prev, jobs);
+        SIMPLEQ_INSERT_TAIL(&cancelled, job, jobs);
+        job = prev == NULL ? SIMPLEQ_FIRST(&ctx->queue) : SIMPLEQ_NEXT(prev, jobs);
+    }
+    pthread_mutex_unlock(&ctx->mutex);
+
+    for (n = 0; !SIMPLEQ_EMPTY(&cancelled); n++) {
+        job = SIMPLEQ_FIRST(&cancelled);
+        SIMPLEQ_REMOVE_HEAD(&cancelled, jobs);
+        _send(job->conn, "CANCELLED", job->id, "");
+        _release(job->conn);
+        _job_free(job);
+    }
+
+    return (n);
+}
+
+
+/* The _shutdown() function stops the server from accepting
+ * connections and jobs, cancels all queued jobs, and stops reading
+ * commands from the open connections.  Replies are still sent on the
+ * connections, so that their clients learn how their running jobs
+ * finish.  The accepting thread is woken up by shutting down the
+ * listening socket, or failing that, by a connection of its own.
+ */
+static void
+_shutdown(struct server_context *ctx)
+{
+    struct _connection *conn;
+    struct sockaddr_un addr;
+    int fd;
+
+
+    if (pthread_mutex_lock(&ctx->mutex) != 0)
+        return;
+    ctx->shutdown = 1;
+    SIMPLEQ_FOREACH(conn, &ctx->connections, connections)
+        shutdown(conn->fd, SHUT_RD);
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->mutex);
+
+    shutdown(ctx->fd, SHUT_RDWR);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, ctx->path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd != -1) {
+        connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+        close(fd);
+    }
+
+    _cancel(ctx, NULL, NULL);
+}
+
+
+/* The _submit() function parses the arguments "id priority path" of
+ * the SUBMIT command @p args received on @p conn, and queues the job
+ * behind all jobs of the same or higher priority.  The mutex of the
+ * connection is held while the job is queued, so that QUEUED reaches
+ * the client before anything from the worker that starts the job.
+ */
+static void
+_submit(struct _connection *conn, char *args)
+{
+    struct server_context *ctx;
+    struct server_job *job, *j, *prev;
+    char *end, *id, *path;
+    size_t position;
+    long int priority;
+
+
+    ctx = conn->ctx;
+    id = args;
+    for (end = id; *end != '\0' && !isspace((unsigned char)*end); end++)
+        ;
+    if (end == id || *end == '\0') {
+        _send(conn, "ERROR", id[0] != '\0' ? id : "-", "malformed SUBMIT");
+        return;
+    }
+    *end++ = '\0';
+
+    errno = 0;
+    priority = strtol(end, &path, 10);
+    if (errno != 0 || path == end || !isspace((unsigned char)*path)) {
+        _send(conn, "ERROR", id, "malformed priority");
+        return;
+    }
+    while (isspace((unsigned char)*path))
+        path++;
+    if (*path == '\0') {
+        _send(conn, "ERROR", id, "missing path");
+        return;
+    }
+
+    job = calloc(1, sizeof(struct server_job));
+    if (job == NULL) {
+        _send(conn, "ERROR", id, "%s", strerror(errno));
+        return;
+    }
+    job->conn = conn;
+    job->id = strdup(id);
+    job->path = strdup(path);
+    job->priority = priority;
+    if (job->id == NULL || job->path == NULL) {
+        _job_free(job);
+        _send(conn, "ERROR", id, "%s", strerror(ENOMEM));
+        return;
+    }
+
+    if (pthread_mutex_lock(&conn->mutex) != 0) {
+        _job_free(job);
+        return;
+    }
+    if (pthread_mutex_lock(&ctx->mutex) != 0) {
+        pthread_mutex_unlock(&conn->mutex);
+        _job_free(job);
+        return;
+    }
+    if (ctx->shutdown != 0) {
+        pthread_mutex_unlock(&ctx->mutex);
+        _send_locked(conn, "ERROR", id, "shutting down");
+        pthread_mutex_unlock(&conn->mutex);
+        _job_free(job);
+        return;
+    }
+
+    position = 1;
+    prev = NULL;
+    SIMPLEQ_FOREACH(j, &ctx->queue, jobs) {
+        if (j->priority < priority)
+            break;
+        prev = j;
+        position++;
+    }
+    if (prev == NULL)
+        SIMPLEQ_INSERT_HEAD(&ctx->queue, job, jobs);
+    else
+        SIMPLEQ_INSERT_AFTER(&ctx->queue, prev, job, jobs);
+    conn->refs += 1;
+    pthread_cond_signal(&ctx->cond);
+    pthread_mutex_unlock(&ctx->mutex);
+
+    _send_locked(conn, "QUEUED", id, "%zd", position);
+    pthread_mutex_unlock(&conn->mutex);
+}
+
+
+/* The _serve() function reads commands from the connection @p arg
+ * until the client disconnects or the server is shut down.  The
+ * queued jobs of the connection are then cancelled.
+ */
+static void *
+_serve(void *arg)
+{
+    struct _connection *conn;
+    char *line;
+    size_t size;
+    ssize_t len;
+
+
+    conn = (struct _connection *)arg;
+    line = NULL;
+    size = 0;
+    while ((len = getline(&line, &size, conn->stream)) != -1) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        if (len == 0)
+            continue;
+
+        if (strncmp(line, "SUBMIT ", 7) == 0) {
+            _submit(conn, line + 7);
+        } else if (strncmp(line, "CANCEL ", 7) == 0) {
+            if (_cancel(conn->ctx, conn, line + 7) == 0)
+                _send(conn, "ERROR", line + 7, "no such queued job");
+        } else if (strcmp(line, "SHUTDOWN") == 0) {
+            _shutdown(conn->ctx);
+        } else {
+            _send(conn, "ERROR", "-", "unknown command");
+        }
+    }
+    free(line);
+
+    _cancel(conn->ctx, conn, NULL);
+    _release(conn);
+    return (NULL);
+}
+
+
+/* The _worker() function runs queued jobs, highest priority first,
+ * until the server is shut down.  The shutdown flag is checked under
+ * the same lock as the queue, so that no job is started once
+ * _shutdown() has set it; the jobs still queued are left to
+ * _cancel().
+ */
+static void *
+_worker(void *arg)
+{
+    struct server_context *ctx;
+    struct server_job *job;
+    int status;
+
+
+    ctx = (struct server_context *)arg;
+    for ( ; ; ) {
+        if (pthread_mutex_lock(&ctx->mutex) != 0)
+            return (NULL);
+        while (SIMPLEQ_EMPTY(&ctx->queue) && ctx->shutdown == 0)
+            pthread_cond_wait(&ctx->cond, &ctx->mutex);
+        job = ctx->shutdown == 0 ? SIMPLEQ_FIRST(&ctx->queue) : NULL;
+        if (job != NULL)
+            SIMPLEQ_REMOVE_HEAD(&ctx->queue, jobs);
+        pthread_mutex_unlock(&ctx->mutex);
+        if (job == NULL)
+            return (NULL);
+
+        _send(job->conn, "STARTED", job->id, "");
+        status = ctx->fn(ctx->arg, job, job->path);
+        _send(job->conn, "DONE", job->id, "%d", status);
+
+        _release(job->conn);
+        _job_free(job);
+    }
+}
+
+
+struct server_context *
+server_new(const char *path, size_t nmemb, server_handler fn, void *arg)
+{
+    struct server_context *ctx;
+    struct sockaddr_un addr;
+
+
+    if (nmemb == 0) {
+        errno = EINVAL;
+        return (NULL);
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return (NULL);
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    ctx = calloc(1, sizeof(struct server_context));
+    if (ctx == NULL)
+        return (NULL);
+    ctx->fd = -1;
+    ctx->fn = fn;
+    ctx->arg = arg;
+    ctx->nmemb = nmemb;
+    SIMPLEQ_INIT(&ctx->queue);
+    SIMPLEQ_INIT(&ctx->connections);
+    pthread_mutex_init(&ctx->mutex, NULL);
+    pthread_cond_init(&ctx->cond, NULL);
+
+    ctx->path = strdup(path);
+    ctx->workers = calloc(nmemb, sizeof(pthread_t));
+    if (ctx->path == NULL || ctx->workers == NULL) {
+        server_free(ctx);
+        return (NULL);
+    }
+
+
+    /* A socket left behind by an earlier server that did not exit
+     * cleanly would make bind(2) fail.
+     */
+    if (unlink(path) != 0 && errno != ENOENT) {
+        server_free(ctx);
+        return (NULL);
+    }
+
+    ctx->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (ctx->fd == -1 ||
+        bind(ctx->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(ctx->fd, SOMAXCONN) != 0) {
+        server_free(ctx);
+        return (NULL);
+    }
+
+    return (ctx);
+}
+
+
+void
+server_free(struct server_context *ctx)
+{
+    int errsv;
+
+
+    errsv = errno;
+    if (ctx->fd != -1) {
+        close(ctx->fd);
+        unlink(ctx->path);
+    }
+    if (ctx->workers != NULL)
+        free(ctx->workers);
+    pthread_cond_destroy(&ctx->cond);
+    pthread_mutex_destroy(&ctx->mutex);
+    if (ctx->path != NULL)
+        free(ctx->path);
+    free(ctx);
+    errno = errsv;
+}
+
+
+int
+server_run(struct server_context *ctx)
+{
+    struct _connection *conn;
+    pthread_t thread;
+    size_t i, n;
+    int errsv, fd;
+
+
+    for (n = 0; n < ctx->nmemb; n++) {
+        if (pthread_create(ctx->workers + n, NULL, _worker, ctx) != 0)
+            break;
+    }
+    if (n == 0)
+        return (-1);
+
+
+    /* Accept connections until shut down.  The shutdown flag is
+     * checked under the same lock as the connection is added, so that
+     * _shutdown() sees every connection that has a reader.
+     */
+    errsv = 0;
+    for ( ; ; ) {
+        fd = accept(ctx->fd, NULL, NULL);
+        if (fd == -1 && errsv == 0 && errno != EINTR && errno != ECONNABORTED)
+            errsv = errno;
+
+        if (pthread_mutex_lock(&ctx->mutex) != 0) {
+            if (fd != -1)
+                close(fd);
+            errsv = errno;
+            break;
+        }
+        if (ctx->shutdown != 0) {
+            pthread_mutex_unlock(&ctx->mutex);
+            if (fd != -1)
+                close(fd);
+            errsv = 0;
+            break;
+        }
+        if (fd == -1) {
+            pthread_mutex_unlock(&ctx->mutex);
+            if (errsv != 0)
+                break;
+            continue;
+        }
+
+        conn = calloc(1, sizeof(struct _connection));
+        if (conn == NULL) {
+            pthread_mutex_unlock(&ctx->mutex);
+            close(fd);
+            continue;
+        }
+        conn->ctx = ctx;
+        conn->fd = fd;
+        conn->refs = 1;
+        conn->stream = fdopen(fd, "r");
+        if (conn->stream == NULL) {
+            pthread_mutex_unlock(&ctx->mutex);
+            close(fd);
+            free(conn);
+            continue;
+        }
+        pthread_mutex_init(&conn->mutex, NULL);
+
+        if (pthread_create(&thread, NULL, _serve, conn) != 0) {
+            pthread_mutex_unlock(&ctx->mutex);
+            fclose(conn->stream);
+            pthread_mutex_destroy(&conn->mutex);
+            free(conn);
+            continue;
+        }
+        pthread_detach(thread);
+        SIMPLEQ_INSERT_TAIL(&ctx->connections, conn, connections);
+        ctx->nconns += 1;
+        pthread_mutex_unlock(&ctx->mutex);
+    }
+
+
+    /* If accepting failed, shut down as if asked to.  Then wait for
+     * the running jobs, and for the readers of the connections.
+     */
+    if (errsv != 0)
+        _shutdown(ctx);
+    for (i = 0; i < n; i++)
+        pthread_join(ctx->workers[i], NULL);
+
+    if (pthread_mutex_lock(&ctx->mutex) == 0) {
+        while (ctx->nconns > 0)
+            pthread_cond_wait(&ctx->cond, &ctx->mutex);
+        pthread_mutex_unlock(&ctx->mutex);
+    }
+
+    if (errsv != 0) {
+        errno = errsv;
+        return (-1);
+    }
+    return (0);
+}
+
+
+int
+server_reply(struct server_job *job, const char *type, const char *fmt, ...)
+{
+    va_list ap;
+    int ret;
+
+
+    if (job == NULL)
+        return (0);
+
+    if (pthread_mutex_lock(&job->conn->mutex) != 0)
+        return (-1);
+    va_start(ap, fmt);
+    ret = _vsend(job->conn, type, job->id, fmt, ap);
+    va_end(ap);
+    pthread_mutex_unlock(&job->conn->mutex);
+
+    return (ret);
+}
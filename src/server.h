@@ -0,0 +1,173 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil; tab-width: 8 -*- */
+
+/*-
+ * Copyright © 2019, Johan Hattne
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice appear
+ * in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS.  IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS
+ * OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef SERVER_H
+#define SERVER_H 1
+
+#ifdef __cplusplus
+#  define SERVER_BEGIN_C_DECLS extern "C" {
+#  define SERVER_END_C_DECLS   }
+#else
+#  define SERVER_BEGIN_C_DECLS
+#  define SERVER_END_C_DECLS
+#endif
+
+SERVER_BEGIN_C_DECLS
+
+/**
+ * @file server.h
+ * @brief Job server on a local socket
+ *
+ * The server module accepts jobs over a UNIX domain socket, queues
+ * them by priority, and runs them on a fixed number of worker
+ * threads.  Each job is a path, typically an album directory, which
+ * is passed to a handler supplied by the caller.  The handler reports
+ * progress and results back to the client as the job runs.
+ *
+ * The protocol is line-based.  A client sends one command per line:
+ *
+ * <pre>
+ *   SUBMIT id priority path
+ *   CANCEL id
+ *   SHUTDOWN
+ * </pre>
+ *
+ * The id is chosen by the client and must not contain whitespace.
+ * Jobs with higher priority are started first, jobs with equal
+ * priority in the order they were submitted.  The path is the rest of
+ * the line, and may contain spaces.  Only queued jobs can be
+ * cancelled.  SHUTDOWN cancels all queued jobs, waits for the running
+ * ones, and makes server_run() return.
+ *
+ * The server answers with lines of the form "TYPE id message", and
+ * these arrive asynchronously:
+ *
+ * <pre>
+ *   QUEUED id position
+ *   STARTED id
+ *   PROGRESS id message
+ *   RESULT id message
+ *   DONE id status
+ *   CANCELLED id
+ *   ERROR id message
+ * </pre>
+ *
+ * where PROGRESS and RESULT are sent by the handler, and status is
+ * the value it returned.  The id of an ERROR is "-" if the command
+ * could not be parsed.  When a client disconnects, its queued jobs
+ * are cancelled, and its running jobs run to completion.
+ */
+
+
+/**
+ * @brief Opaque server context
+ */
+struct server_context;
+
+
+/**
+ * @brief Opaque handle to a running job
+ */
+struct server_job;
+
+
+/**
+ * @brief Function that runs a job
+ *
+ * Called on a worker thread of the server, concurrently with other
+ * jobs.
+ *
+ * @param arg  Argument given to server_new()
+ * @param job  Handle to the job, for server_reply()
+ * @param path Path submitted with the job
+ * @return     Status of the job, reported to the client
+ */
+typedef int (*server_handler)(void *arg,
+                              struct server_job *job,
+                              const char *path);
+
+
+/**
+ * @brief Create a server listening on a UNIX domain socket
+ *
+ * Any file at @p path is removed before the socket is bound.  No jobs
+ * are run until server_run() is called.
+ *
+ * @param path  Path to the socket
+ * @param nmemb Number of jobs to run at a time, at least one
+ * @param fn    Function that runs each job
+ * @param arg   First argument to @p fn
+ * @return      Pointer to an opaque server context if successful,
+ *              @c NULL otherwise.  If an error occurs, the global
+ *              variable @c errno is set to indicate the error.
+ */
+struct server_context *
+server_new(const char *path, size_t nmemb, server_handler fn, void *arg);
+
+
+/**
+ * @brief Release a server
+ *
+ * Removes the socket.  Must not be called while server_run() is
+ * running.
+ *
+ * @param ctx Pointer to an opaque server context
+ */
+void
+server_free(struct server_context *ctx);
+
+
+/**
+ * @brief Serve clients until shut down
+ *
+ * Accepts connections and runs the submitted jobs until a client
+ * sends SHUTDOWN.  Returns once all running jobs have completed and
+ * all clients are disconnected.
+ *
+ * @param ctx Pointer to an opaque server context
+ * @return    0 if successful, -1 otherwise.  If an error occurs, the
+ *            global variable @c errno is set to indicate the error.
+ */
+int
+server_run(struct server_context *ctx);
+
+
+/**
+ * @brief Send a line about a job to its client
+ *
+ * Sends "@p type id message" to the client that submitted @p job,
+ * where the message is formatted from @p fmt as by printf(3).  Line
+ * breaks in the message are replaced by spaces.  Nothing is sent if
+ * @p job is @c NULL, so that handlers can be shared with code that
+ * does not run on the server.  A client that has disconnected is not
+ * an error.
+ *
+ * @param job  Handle to a running job, or @c NULL
+ * @param type Type of the line, typically "PROGRESS" or "RESULT"
+ * @param fmt  Format of the message
+ * @return     0 if successful, -1 otherwise.  If an error occurs, the
+ *             global variable @c errno is set to indicate the error.
+ */
+int
+server_reply(struct server_job *job, const char *type, const char *fmt, ...);
+
+SERVER_END_C_DECLS
+
+#endif /* !SERVER_H */
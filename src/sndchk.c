@@ -20,10 +20,13 @@
  * XXX This program works on a cluster of tracks (or files or streams)
  */
 
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/queue.h>
 
+#include <dirent.h>
 #include <err.h>
+#include <errno.h>
 #include <inttypes.h>
 #include <libgen.h>
 #include <limits.h>
@@ -33,8 +36,10 @@
 #include <semaphore.h>
 #include <signal.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h> // XXX for sleep
 #include <wchar.h>
+#include <wctype.h>
 
 #include <musicbrainz5/mb5_c.h>
 
@@ -52,6 +57,7 @@
 #include "musicbrainz.h"
 #include "pool.h"
 #include "ratelimit.h"
+#include "server.h"
 #include "structures.h"
 
 //#define DEBUG 1
@@ -1569,30 +1575,36 @@ _release_recording_at_position(
 }
 
 
-/* Check the offset-finding crc of all streams associated with @p
- * track against the AccurateRip response.  Add the offsets from the
- * matching entry to the disc.
+/* Check the @p nmemb offset-finding crcs in @p crcs, one from each
+ * entry of the AccurateRip response, against all streams associated
+ * with @p track.  Add the offsets of the matching entries to the
+ * disc.
  */
 static int
-_disc_add_chunk(struct fp3_disc *disc,
-                struct fp3_track *track,
-                const struct _chunk *chunk,
-                struct fingersum_context **ctxs)
+_disc_add_crcs(struct fp3_disc *disc,
+               struct fp3_track *track,
+               const uint32_t *crcs,
+               size_t nmemb,
+               struct fingersum_context **ctxs)
 {
-    struct fp3_offset_list *offset_list;
+    struct fingersum_match *matches;
+    ssize_t j, n;
     size_t i;
 
 
     for (i = 0; i < track->nmemb; i++) {
-        offset_list = fingersum_find_offset(
-            ctxs[track->indices[i]], chunk->unk);
-        if (offset_list != NULL) {
-            if (fp3_disc_add_offset_list(disc, offset_list) == NULL) {
-                fp3_free_offset_list(offset_list);
+        n = fingersum_find_offsets(
+            ctxs[track->indices[i]], crcs, nmemb, &matches);
+        if (n < 0)
+            return (-1);
+
+        for (j = 0; j < n; j++) {
+            if (fp3_disc_add_offset(disc, matches[j].offset) != 0) {
+                free(matches);
                 return (-1);
             }
-            fp3_free_offset_list(offset_list);
         }
+        free(matches);
     }
 
     return (0);
@@ -1633,37 +1645,44 @@ _disc_add_eac_track(struct fp3_disc *disc,
 }
 
 
-/* Find the track corresponding to the j:th chunk.  It should not be
- * an error if the track cannot be found, because we can tolerate gaps
- * in the disc at this stage.
+/* Gather the j:th chunk of every entry, and check them against the
+ * track at position j + 1 all at once.  It should not be an error if
+ * an entry has no chunk for a track, because we can tolerate gaps in
+ * the disc at this stage.
  */
 static int
 _disc_add_response(struct fp3_disc *disc,
                    const struct _cache *response,
                    struct fingersum_context **ctxs)
 {
-    const struct _chunk *chunk;
     const struct _entry *entry;
     struct fp3_track *track;
-    size_t i, j, k;
+    uint32_t *crcs;
+    size_t i, j, k, n;
 
 
-    for (i = 0; i < response->nmemb; i++) {
-        entry = response->entries + i;
+    crcs = calloc(response->nmemb > 0 ? response->nmemb : 1, sizeof(uint32_t));
+    if (crcs == NULL)
+        return (-1);
 
-        for (j = 0; j < entry->track_count; j++) {
-            chunk = entry->chunks + j;
+    for (k = 0; k < disc->nmemb; k++) {
+        track = disc->tracks[k];
+        if (track->position < 1)
+            continue;
+        j = track->position - 1;
 
-            for (k = 0; k < disc->nmemb; k++) {
-                track = disc->tracks[k];
-                if (track->position == j + 1) {
-                    if (_disc_add_chunk(disc, track, chunk, ctxs) != 0)
-                        return (-1);
-                    break;
-                }
-            }
+        for (i = n = 0; i < response->nmemb; i++) {
+            entry = response->entries + i;
+            if (j < entry->track_count)
+                crcs[n++] = entry->chunks[j].unk;
+        }
+
+        if (n > 0 && _disc_add_crcs(disc, track, crcs, n, ctxs) != 0) {
+            free(crcs);
+            return (-1);
         }
     }
+    free(crcs);
 
 
     /* NEW STUFF: transport the EAC response -- XXX but this is just
@@ -2868,57 +2887,214 @@ _toc_accuraterip(struct fingersum_context **ctxs,
 
 // *************** DISTANCE STUFF BELOW ***********
 
-/* The levenshtein() function calculates the case-insensitive
- * Levenshtein distance between the two NULL-terminated strings
- * pointed to by @p s and @p t.  This memory-efficient Levenshtein
- * implementation is adapted from "Fast, memory efficient Levenshtein
- * algorithm"
+/* Patterns longer than LEVENSHTEIN_BLOCKS words of 64 characters are
+ * handled by the row-by-row algorithm, which allocates a row.  The
+ * metadata strings compared here are converted into buffers of 1024
+ * wide characters, which fit.
+ */
+#define LEVENSHTEIN_BLOCKS 16
+
+
+/* Bit vectors of the positions of the characters in a block of at
+ * most 64 characters of the pattern, in an open-addressing hash table
+ * with linear probing.  A block has at most 64 distinct characters,
+ * so the table is never more than half full.  Unused slots have a
+ * zero mask.
+ */
+struct _peq
+{
+    wchar_t c[128];
+    uint64_t mask[128];
+};
+
+
+static void
+_peq_init(struct _peq *peq, const wchar_t *p, size_t m)
+{
+    size_t h, i;
+
+    memset(peq->mask, 0, sizeof(peq->mask));
+    for (i = 0; i < m; i++) {
+        for (h = (size_t)p[i] & 127; peq->mask[h] != 0; h = (h + 1) & 127) {
+            if (peq->c[h] == p[i])
+                break;
+        }
+        peq->c[h] = p[i];
+        peq->mask[h] |= (uint64_t)1 << i;
+    }
+}
+
+
+static uint64_t
+_peq_get(const struct _peq *peq, wchar_t c)
+{
+    size_t h;
+
+    for (h = (size_t)c & 127; peq->mask[h] != 0; h = (h + 1) & 127) {
+        if (peq->c[h] == c)
+            return (peq->mask[h]);
+    }
+    return (0);
+}
+
+
+/* The _levenshtein_word() function calculates the distance between
+ * the pattern @p p of length @p m, where 0 < m <= 64, and the text @p
+ * t of length @p n, using the bit-parallel algorithm of Myers
+ * ["A fast bit-vector algorithm for approximate string matching based
+ * on dynamic programming", J ACM 46:395-415 (1999)] in the
+ * formulation of Hyyrö ["Explaining and extending the bit-parallel
+ * approximate string matching algorithm of Myers" (2001)].  The
+ * vertical deltas of an entire column of the dynamic programming
+ * matrix are held in the bit vectors Pv and Mv (positive and
+ * negative), and each character of the text is processed in a
+ * constant number of word operations.  Since the top row of the
+ * matrix counts the characters of the text, a horizontal delta of +1
+ * is shifted in at the top of each column.
+ *
+ * The distance can decrease by at most one per remaining character
+ * of the text, so the computation is abandoned as soon as it cannot
+ * end up at or below @p max.
+ */
+static size_t
+_levenshtein_word(
+    const wchar_t *p, size_t m, const wchar_t *t, size_t n, size_t max)
+{
+    struct _peq peq;
+    uint64_t eq, high, mh, mv, ph, pv, xh, xv;
+    size_t j, score;
+
+
+    _peq_init(&peq, p, m);
+    high = (uint64_t)1 << (m - 1);
+    pv = ~(uint64_t)0;
+    mv = 0;
+    score = m;
+
+    for (j = 0; j < n; j++) {
+        eq = _peq_get(&peq, t[j]);
+        xv = eq | mv;
+        xh = (((eq & pv) + pv) ^ pv) | eq;
+        ph = mv | ~(xh | pv);
+        mh = pv & xh;
+
+        if (ph & high)
+            score += 1;
+        else if (mh & high)
+            score -= 1;
+
+        ph = (ph << 1) | 1;
+        mh = mh << 1;
+        pv = mh | ~(xv | ph);
+        mv = ph & xv;
+
+        if (score > max && score - max > n - j - 1)
+            return (SIZE_MAX);
+    }
+
+    return (score);
+}
+
+
+/* The _levenshtein_blocks() function is _levenshtein_word() for
+ * patterns of more than 64 characters.  The column is split into
+ * blocks of 64 characters, and the horizontal delta at the bottom of
+ * each block is carried into the top of the next, as described by
+ * Hyyrö ["A bit-vector algorithm for computing Levenshtein and
+ * Damerau edit distances", Nordic J Computing 10:29-39 (2003)].  The
+ * pattern must not be longer than LEVENSHTEIN_BLOCKS blocks.
+ */
+static size_t
+_levenshtein_blocks(
+    const wchar_t *p, size_t m, const wchar_t *t, size_t n, size_t max)
+{
+    struct _peq peq[LEVENSHTEIN_BLOCKS];
+    uint64_t mv[LEVENSHTEIN_BLOCKS], pv[LEVENSHTEIN_BLOCKS];
+    uint64_t eq, high, mh, ph, xh, xv;
+    size_t b, j, nmemb, score;
+    int hin, hout;
+
+
+    nmemb = (m + 63) / 64;
+    for (b = 0; b < nmemb; b++) {
+        _peq_init(peq + b, p + 64 * b, b + 1 < nmemb ? 64 : m - 64 * b);
+        pv[b] = ~(uint64_t)0;
+        mv[b] = 0;
+    }
+    score = m;
+
+    for (j = 0; j < n; j++) {
+        hin = +1;
+        for (b = 0; b < nmemb; b++) {
+            high = (uint64_t)1 << (b + 1 < nmemb ? 63 : (m - 1) % 64);
+            eq = _peq_get(peq + b, t[j]);
+
+
+            /* A negative delta carried in from the block above acts
+             * like a match in the first row of the block.
+             */
+            xv = eq | mv[b];
+            if (hin < 0)
+                eq |= 1;
+            xh = (((eq & pv[b]) + pv[b]) ^ pv[b]) | eq;
+            ph = mv[b] | ~(xh | pv[b]);
+            mh = pv[b] & xh;
+
+            hout = 0;
+            if (ph & high)
+                hout = +1;
+            else if (mh & high)
+                hout = -1;
+
+            ph <<= 1;
+            mh <<= 1;
+            if (hin < 0)
+                mh |= 1;
+            else if (hin > 0)
+                ph |= 1;
+            pv[b] = mh | ~(xv | ph);
+            mv[b] = ph & xv;
+            hin = hout;
+        }
+
+        if (hin > 0)
+            score += 1;
+        else if (hin < 0)
+            score -= 1;
+
+        if (score > max && score - max > n - j - 1)
+            return (SIZE_MAX);
+    }
+
+    return (score);
+}
+
+
+/* The _levenshtein_rows() function calculates the distance between
+ * the pattern @p p of length @p m and the text @p t of length @p n
+ * one row at a time, for patterns too long for _levenshtein_blocks().
+ * This memory-efficient Levenshtein implementation is adapted from
+ * "Fast, memory efficient Levenshtein algorithm"
  * [http://www.codeproject.com/Articles/13525/Fast-memory-efficient-Levenshtein-algorithm]
- * by Sten Hjelmqvist.
+ * by Sten Hjelmqvist.  The distance never falls below the smallest
+ * element of a row, so the computation is abandoned once that exceeds
+ * @p max.
  *
  * See also
  * http://en.wikibooks.org/wiki/Algorithm_Implementation/Strings/Levenshtein_distance#C
  * and http://en.wikipedia.org/wiki/Levenshtein_distance
- *
- * XXX Note somewhere that this doesn't scale so well, but that we use
- * it for short strings.
- *
- * XXX This will probably break with Unicode!  The Unicode stuff must
- * be fixed, but it should probably not be case-insensitive!
- *
- * @param s XXX
- * @param t XXX
- * @return  The Levenshtein distance if successful, @c SIZE_MAX
- *          otherwise.  If an error occurs the global variable @c
- *          errno is set to indicate the error.
  */
-size_t
-//levenshtein(const char *s, const char *t)
-levenshtein(const wchar_t *s, const wchar_t *t)
+static size_t
+_levenshtein_rows(
+    const wchar_t *p, size_t m, const wchar_t *t, size_t n, size_t max)
 {
     size_t *v;
-    size_t cost, i, j, m, n, v0j, vj1;
-
-
-    /* Degenerate cases.  If cost in the loop is case-insensitive,
-     * this must be case-insensitive.
-     */
-//    if (strcasecmp(s, t) == 0)
-//    if (wcscasecmp(s, t) == 0)
-    if (wcscmp(s, t) == 0)
-        return (0);
-
-    m = wcslen(s);
-    n = wcslen(t);
-    if (m == 0)
-        return (n);
-    if (n == 0)
-        return (m);
+    size_t cost, i, j, v0j, vj1, v_min;
 
 
     /* Allocate and initialise v, the previous row of distances.  This
-     * row is A[0][i], edit distance for an empty s.  The distance is
-     * just the number of characters to delete from t.
+     * row is A[0][i], edit distance for an empty t.  The distance is
+     * just the number of characters to delete from p.
      */
     v = calloc(m + 1, sizeof(size_t));
     if (v == NULL)
@@ -2930,17 +3106,16 @@ levenshtein(const wchar_t *s, const wchar_t *t)
     for (i = 0; i < n; i++) {
         /* Calculate current row distance from the previous row v.
          * First element of current row distances is A[i + 1][0].
-         * Edit distance is delete(i + 1) characters from s to match
+         * Edit distance is delete(i + 1) characters from p to match
          * empty t.
          */
         v[0] = i + 1;
         v0j = i;
+        v_min = v[0];
 
         for (j = 0; j < m; j++) {
             vj1 = v[j + 1];
-//            cost = tolower(s[j]) == tolower(t[i]) ? 0 : 1;
-//            cost = towlower(s[j]) == towlower(t[i]) ? 0 : 1;
-            cost = s[j] == t[i] ? 0 : 1;
+            cost = p[j] == t[i] ? 0 : 1;
 
 
             /* Use formula to fill in the rest of the row,
@@ -2956,9 +3131,16 @@ levenshtein(const wchar_t *s, const wchar_t *t)
                 v[j + 1] = v[j] + 1;
             if (v0j + cost < v[j + 1])
                 v[j+ 1] = v0j + cost;
+            if (v[j + 1] < v_min)
+                v_min = v[j + 1];
 
             v0j = vj1;
         }
+
+        if (v_min > max) {
+            free(v);
+            return (SIZE_MAX);
+        }
     }
 
     cost = v[m];
@@ -2967,6 +3149,119 @@ levenshtein(const wchar_t *s, const wchar_t *t)
     return (cost);
 }
 
+
+/* The levenshtein_max() function calculates the Levenshtein distance
+ * between the two NULL-terminated strings pointed to by @p s and @p
+ * t, unless it exceeds @p max.  The distance is symmetric, so the
+ * shorter string is taken as the pattern, and the longer one as the
+ * text.  Patterns of up to 64 characters fit in a single machine
+ * word, and the distance is computed in O(n) time; longer patterns
+ * take O(n m / 64) time.  Neither allocates any memory.
+ *
+ * The comparison is exact.  Metadata is case-folded before it is
+ * compared, see _cmp_normalise().
+ *
+ * @param s   First string
+ * @param t   Second string
+ * @param max Largest distance of interest, @c SIZE_MAX for no limit
+ * @return    The Levenshtein distance if it does not exceed @p max,
+ *            @c SIZE_MAX otherwise.  @c SIZE_MAX is also returned if
+ *            an error occurs, in which case the global variable @c
+ *            errno is set to indicate the error.
+ */
+size_t
+levenshtein_max(const wchar_t *s, const wchar_t *t, size_t max)
+{
+    const wchar_t *p;
+    size_t d, m, n;
+
+
+    /* Degenerate cases.  The distance is at least the difference in
+     * length.
+     */
+    if (wcscmp(s, t) == 0)
+        return (0);
+
+    m = wcslen(s);
+    n = wcslen(t);
+    if (m > n) {
+        p = s;
+        s = t;
+        t = p;
+        d = m;
+        m = n;
+        n = d;
+    }
+
+    if (n - m > max)
+        return (SIZE_MAX);
+    if (m == 0)
+        return (n);
+
+    if (m <= 64)
+        return (_levenshtein_word(s, m, t, n, max));
+    if (m <= 64 * LEVENSHTEIN_BLOCKS)
+        return (_levenshtein_blocks(s, m, t, n, max));
+    return (_levenshtein_rows(s, m, t, n, max));
+}
+
+
+/* The levenshtein() function calculates the Levenshtein distance
+ * between the two NULL-terminated strings pointed to by @p s and @p
+ * t.
+ *
+ * @param s First string
+ * @param t Second string
+ * @return  The Levenshtein distance if successful, @c SIZE_MAX
+ *          otherwise.  If an error occurs the global variable @c
+ *          errno is set to indicate the error.
+ */
+size_t
+levenshtein(const wchar_t *s, const wchar_t *t)
+{
+    return (levenshtein_max(s, t, SIZE_MAX));
+}
+
+
+/* The _cmp_normalise() function converts the multibyte string @p s to
+ * a wide string, with leading and trailing white space removed and
+ * every character case-folded.  A @c NULL string is converted to the
+ * empty string.
+ *
+ * XXX towlower(3) is simple case-folding only, and there is no
+ * Unicode normalisation.
+ *
+ * @return The normalised string, which must be freed, or @c NULL on
+ *         failure
+ */
+static wchar_t *
+_cmp_normalise(const char *s)
+{
+    wchar_t *w;
+    size_t i, j, len;
+
+
+    len = s != NULL ? mbstowcs(NULL, s, 0) : 0;
+    if (len == (size_t)-1)
+        len = 0; // XXX Invalid multibyte sequence
+
+    w = calloc(len + 1, sizeof(wchar_t));
+    if (w == NULL)
+        return (NULL);
+    if (len > 0)
+        mbstowcs(w, s, len + 1);
+
+    for (i = 0; i < len && iswspace(w[i]); i++)
+        ;
+    for (j = 0; i < len; i++, j++)
+        w[j] = towlower(w[i]);
+    while (j > 0 && iswspace(w[j - 1]))
+        j--;
+    w[j] = L'\0';
+
+    return (w);
+}
+
 // *************** DISTANCE STUFF ABOVE ***********
 
 
@@ -3929,6 +4224,22 @@ get_mb_values(struct fp3_release *release, size_t medium_position, size_t record
 
 #if 1
     char trial_composer[1024];
+    wchar_t *ref, *trial;
+    size_t len;
+    wchar_t c;
+
+
+    /* The reference and the trials are normalised like the metadata
+     * in the release-distance loop, so that case and surrounding
+     * white space do not count.
+     */
+    ref = _cmp_normalise(composer_ref);
+    if (ref == NULL) {
+        if (artists != NULL)
+            free(artists);
+        metadata_free(metadata);
+        return (NULL);
+    }
 
 //    printf("REFERENCE IS ->%s<-\n", composer_ref);
 //    size_t nmemb_artists_old = nmemb_artists;
@@ -3982,26 +4293,38 @@ get_mb_values(struct fp3_release *release, size_t medium_position, size_t record
                 str2);
 
 
-            /* XXXX composer_ref could be NULL!  If so
-             * strlen(composer_ref) will fail as well, so do
-             * strlen(tst) instead?
+            /* Compare the trial to the reference, truncated to the
+             * length of the trial.  The reference is truncated in
+             * place, and restored after the comparison.
              */
-            char *tst = strdup(composer_ref == NULL ? "" : composer_ref);
+            trial = _cmp_normalise(trial_composer);
+            if (trial == NULL) {
+                free(ref);
+                if (artists != NULL)
+                    free(artists);
+                metadata_free(metadata);
+                return (NULL);
+            }
 
-            if (strlen(tst) > strlen(trial_composer))
-                tst[strlen(trial_composer)] = '\0';
+            len = wcslen(trial);
+            c = L'\0';
+            if (wcslen(ref) > len) {
+                c = ref[len];
+                ref[len] = L'\0';
+            }
 
 //            size_t d = levenshtein(composer_ref, trial_composer);
 
-            wchar_t s1[1024];
-            wchar_t s2[1024];
 
-            mbstowcs(s1, tst, 1024);
-            mbstowcs(s2, trial_composer, 1024);
-            size_t d = levenshtein(s1, s2);
+            /* Only a distance smaller than the best so far matters,
+             * so anything larger is abandoned early.
+             */
+            size_t d = levenshtein_max(ref, trial, d_min > 0 ? d_min - 1 : 0);
 //            size_t d = levenshtein(tst, trial_composer);
 
-            free(tst);
+            if (c != L'\0')
+                ref[len] = c;
+            free(trial);
 
 /*
             if (strlen(composer_ref) > strlen(trial_composer)) {
@@ -4054,6 +4377,7 @@ get_mb_values(struct fp3_release *release, size_t medium_position, size_t record
         nmemb_artists -= 1;
 //        }
     }
+    free(ref);
 #endif
 //    printf("get_mb_values() marker #2\n");
 
@@ -4888,120 +5212,1450 @@ diff_stream(struct fp3_result *result, struct fingersum_context **ctxs)
 }
 
 
-int
-main(int argc, char *argv[])
+/* Argument to _match_releasegroup(): a releasegroup from the AcoustID
+ * response, and everything needed to match its releases against
+ * MusicBrainz and AccurateRip.  The browse request for the
+ * releasegroup is given by the parameters.
+ */
+struct _match_arg
 {
+    struct fp3_releasegroup *releasegroup;
+    struct fingersum_context **ctxs;
+    size_t nmemb;
+    struct musicbrainz_ctx *mb_ctx;
+    struct accuraterip_context *ar_ctx;
+    int num_params;
+    char **param_names;
+    char *param_values[2];
+};
 
-    size_t i;
-    FILE **streams;
+
+/* The _match_releasegroup() function is the node of the dataflow
+ * graph in main() that takes a releasegroup from the MusicBrainz
+ * browse request to the disc/TOC match: it completes each release
+ * from MusicBrainz, and adds the discs that match, along with their
+ * AccurateRip responses.  Nodes for different releasegroups run
+ * concurrently, and share the fingersum and AccurateRip contexts.
+ * Of the fingersum functions, a node only calls
+ * fingersum_get_sectors(), fingersum_find_offsets(), and
+ * fingersum_find_offset_eac(), which take no locks: they read the
+ * duration and the offset-finding data, which are complete once the
+ * fingerprints have been calculated, before the nodes are started.
+ * The caller registers the offsets with fingersum_add_offset() while
+ * nodes are still running; that only changes the list of offsets,
+ * which the nodes do not read, and it holds the mutex of the image
+ * for a track of an image.  The AccurateRip context protects its
+ * response cache with a read-write lock, and serialises the requests
+ * on each of its sessions with a mutex per session.
+ *
+ * @return The releasegroup, or @c NULL if the browse request could
+ *         not be submitted
+ */
+static void *
+_match_releasegroup(void *arg)
+{
+    struct _match_arg *ma;
+    struct fp3_release *release3;
+    struct fp3_releasegroup *releasegroup3;
     struct fingersum_context **ctxs;
-    struct pool_context *pc, *pc2;
+    struct musicbrainz_ctx *mb_ctx;
+    struct accuraterip_context *ar_ctx;
+    Mb5Release Release;
+    char **prutt_names, **prutt_values;
+    size_t j, nmemb;
+    int prutt_num;
 
-#if 0
-    printf("check %zd\n", levenshtein(L"GAMBOL", L"GUMBO"));
-    printf("check %zd\n", levenshtein(L"GUMBO", L"GAMBOL"));
-    printf("check %zd\n", levenshtein(L"nisse", L"nisse"));
-    printf("check %zd\n", levenshtein(L"nisse", L"nisseo"));
-    printf("check %zd\n", levenshtein(L"nisse", L"nisso"));
-    printf("check %zd\n", levenshtein(L"nisse", L"nisseapa"));
-    printf("check %zd\n", levenshtein(L"nisseprutt", L"nisseapa"));
-    printf("check %zd\n", levenshtein(L"nisse", L"niSsEo"));
-    printf("check %zd\n", levenshtein(L"nisse", L"niSsE"));
-    return (0);
-#endif
 
+    ma = (struct _match_arg *)arg;
+    releasegroup3 = ma->releasegroup;
+    ctxs = ma->ctxs;
+    nmemb = ma->nmemb;
+    mb_ctx = ma->mb_ctx;
+    ar_ctx = ma->ar_ctx;
+    prutt_num = ma->num_params;
+    prutt_names = ma->param_names;
+    prutt_values = ma->param_values;
 
-  /* It appears we need to set the locale (see setlocale(3)) to ensure
-   * it's UTF-8 for string conversion stuff mbstowc(3).
-   *
-   * XXX This is probably not the right way to do this.  Read
-   * http://www.cl.cam.ac.uk/~mgk25/unicode.html, the OpenBSD man
-   * pages, and search Mendeley for Unicode.
-   */
-  setlocale(LC_CTYPE, "en_US.UTF-8");
+    releasegroup3->distance = LONG_MAX;
 
 
-    /* Initialise the neon library and its dependencies, must be
-     * called once before the first ne_session_create().  Should be
-     * matched by ne_sock_exit().  Even though neon is not directly
-     * used here, it is initialised here so as to avoid unnecessary
-     * initialisation in the individual modules.  As long as
-     * ne_sock_exit() is called on exit, this should work because of
-     * the reference-counting.
+    /* This is a browse request: entity is release, params
+     * includes "release-group=###", and ID is NULL.  XXX Make
+     * sure musicbrainz_query() returns immediately (it should
+     * just queue the query).
      */
-    if (ne_sock_init() != 0)
-        return (-1);
+    printf("Submitting query for release-group %s [%zd candidates]\n",
+           releasegroup3->id, releasegroup3->nmemb);
+    if (musicbrainz_query(mb_ctx,
+                          "release",
+                          NULL,
+                          "",
+                          prutt_num,
+                          prutt_names,
+                          prutt_values) != 0) {
+        printf("  Submission failed!\n");
+        return (NULL); // XXX Should really exit or something... no point in going on?
+    }
 
-    streams = (FILE **)calloc(
-        argc - 1, sizeof(FILE *));
-    if (streams == NULL)
-        printf("*** FAILURE #1\n"); // XXX This should be done externally!
+    for (j = 0; j < releasegroup3->nmemb; j++) {
+        /* Find the MusicBrainz MediumList corresponding to the
+         * release, and complete the AcoustID response
+         * accordingly.
+         *
+         * XXX If there is no release or no MediumList in
+         * MusicBrainz should probably erase the release here
+         *
+         * This is basically the Brown problem (out of sync).
+         */
+        release3 = releasegroup3->releases[j];
+        printf("MB query for release ->%s<- [%zd/%zd]\n",
+               release3->id, j + 1, releasegroup3->nmemb);
+
+        Release = musicbrainz_get_release(mb_ctx,
+                                          "release",
+                                          NULL, // XXX This probably should not matter... Don't care whether result came from lookup, browse, or search...
+                                          "",
+                                          prutt_num,
+                                          prutt_names,
+                                          prutt_values,
+                                          release3->id);
+        if (Release == NULL) {
+            /* XXX This may actually happen (e.g. if we didn't
+             * exhaust the release-group, or maybe, if the query
+             * just did not complete yet)!  Could it be that we're
+             * out of sync with Acoustid?  Should wait for query
+             * to finish, then exit with hard error if still not
+             * found?
+             */
+            printf("MB Query did not match release!\n");
+            continue; // exit(EXIT_FAILURE);
+        }
 
-    ctxs = (struct fingersum_context **)calloc(
-        argc - 1, sizeof(struct fingersum_context *));
-    if (ctxs == NULL)
-        printf("*** FAILURE #2\n"); // XXX
+        if (_complete_release(
+                release3, Release, nmemb) != 0) {
+            printf("XXX _complete_release() failed!\n");
+        }
 
-    pc = pool_new_pc(4); // XXX Hardcoded!
-    if (pc == NULL) {
-        free(ctxs);
-        printf("*** FAILURE #3\n"); // XXX
-        return (-1);
-    }
+//        printf("*** POST _complete_release() DUMP\n");
+//        fp3_release_dump(release3, 2, 0);
+//        printf("*** POST _complete_release() DUMP\n");
 
+        if (_release_add_discs(
+                release3, ctxs,
+                nmemb, ar_ctx, Release) != 0) {
+            printf("XXX _release_add_discs() failed!\n");
+        }
 
-    /* XXX This must all be released somewhere!
-     *
-     * Track numbers are one-based.  Also acoustid indexes from 1 (see
-     * message on message board).  None of that actually matters here.
-     */
-    for (i = 0; i < argc - 1; i++) {
-        streams[i] = fopen(argv[i + 1], "r");
-        if (streams[i] == NULL) {
-            warn("Failed to open %s", argv[i + 1]);
-            while (i-- > 1) {
-                fingersum_free(ctxs[i]);
-                fclose(streams[i]);
-            }
-            pool_free_pc(pc);
-            free(ctxs);
-            return (-1);
+//        printf("*** POST _release_add_discs() DUMP\n");
+//        fp3_release_dump(release3, 2, 0);
+//        printf("*** POST _release_add_discs() DUMP\n");
+
+
+//        if (_toc_accuraterip(
+//                ctxs, release3, MediumList, &toc_score, ar_ctx) != 0) {
+//            printf("_toc_accuraterip() failed!");
+//            exit(EXIT_FAILURE);
+//        }
+
+
+        // XXX Need this for later; see remark about clone below
+        release3->mb_release = Release;
+
+
+#if 0
+        /* 2016-04-27: Should probably fall back on some version
+         * of this if _toc_accuraterip() fails.  IDEA: position
+         * the tracks using accuraterip.  If that fails use the
+         * sector lengths.  If that fails, use the information
+         * from acoustid.
+         *
+         * XXX Should probably fall back on checking lower bound
+         * using the track length instead!
+         *
+         * XXX At this stage: calculate lower_bound, populate list
+         * of discs with bound and AccurateRip path, calculate
+         * Levenshtein distance.  Next (non-network) loop: eliminate.
+         *
+         * XXX Probably want to do this completely differently:
+         * assign position (track and medium) from recording, then
+         * match against TOC, fall back on matching against track
+         * length (and invert sign).  Populate a list of media and
+         * calculate distance for each disc.  Key discs by discid,
+         * and use the special NULL discid if the TOC-match had to
+         * be done against track lengths.
+         */
+        if (_toc_lower_bound(ctxs, release3, MediumList, &toc_score) != 0) {
+            printf("SILLY HATTNE failed _toc_lower_bound()\n");
+            toc_score.distance = 1000; // XXX LONG_MAX;
+            toc_score.score = 0;
         }
 
-        ctxs[i] = fingersum_new(streams[i]);
-        if (ctxs[i] == NULL) {
-            warn("Failed to read '%s'", argv[i + 1]);
-            while (i-- > 1) {
-                fingersum_free(ctxs[i]);
-                fclose(streams[i]);
-            }
-            pool_free_pc(pc);
-            free(ctxs);
-            return (-1);
+        printf("  Lower bound is %ld %f\n",
+               toc_score.distance, toc_score.score);
+
+        release3->distance = toc_score.distance;
+//        release3->score = toc_score.score;
+
+
+        /* XXX What about the clone business?  Would be good not
+         * to have to worry about this!
+         */
+        release3->mb_release = Release;
+
+        if (toc_score.distance < releasegroup3->distance ||
+            (toc_score.distance == releasegroup3->distance /* &&
+                                                              toc_score.score > releasegroup3->score */)) {
+            releasegroup3->distance = toc_score.distance;
+//            releasegroup3->score = toc_score.score;
         }
+#endif
+    }
 
-        if (add_request(pc, ctxs[i], (void *)i, POOL_ACTION_CHROMAPRINT) != 0) {
-            warn("Failed to queue '%s'", argv[i + 1]);
-            while (i-- > 1) {
-                fingersum_free(ctxs[i]);
-                fclose(streams[i]);
-            }
-            pool_free_pc(pc);
-            free(ctxs);
-            return (-1);
+    return (releasegroup3);
+}
+
+
+/* The _init_cache() function enables the persistent fingersum cache
+ * and the AccurateRip and MusicBrainz response stores in the
+ * directory given by the SNDCHK_CACHE_DIR environment variable, or,
+ * if @p enable is non-zero, in sndchk under the XDG cache directory.
+ * Nothing is written to disk unless one of the two asks for it.  The
+ * responses go into the accuraterip and musicbrainz subdirectories.
+ * An empty SNDCHK_CACHE_DIR disables all of them, even if @p enable
+ * is non-zero.  Setting SNDCHK_CACHE_HASH
+ * to a non-empty value additionally keys the fingersum cache on the
+ * contents of the files, and SNDCHK_MB_MAX_AGE overrides the maximum
+ * age of MusicBrainz responses, in seconds.  Failure to enable any of
+ * them is not fatal.
+ */
+static void
+_init_cache(int enable)
+{
+    const char *age, *base, *env;
+    char *end, *path;
+    size_t len;
+    time_t max_age;
+    long l;
+    int flags;
+
+
+    flags = 0;
+    env = getenv("SNDCHK_CACHE_HASH");
+    if (env != NULL && env[0] != '\0')
+        flags |= FINGERSUM_CACHE_HASH;
+
+    env = getenv("SNDCHK_CACHE_DIR");
+    if (env != NULL) {
+        if (env[0] == '\0')
+            return;
+        base = "";
+    } else if (enable == 0) {
+        return;
+    } else {
+        env = getenv("XDG_CACHE_HOME");
+        if (env != NULL && env[0] != '\0') {
+            base = "/sndchk";
+        } else {
+            env = getenv("HOME");
+            if (env == NULL || env[0] == '\0')
+                return;
+            base = "/.cache/sndchk";
         }
     }
 
+    len = strlen(env) + strlen(base) + strlen("/accuraterip") + 1;
+    path = malloc(len);
+    if (path == NULL)
+        return;
+    snprintf(path, len, "%s%s", env, base);
+    if (fingersum_cache_init(path, flags) != 0)
+        warn("Failed to enable cache in %s", path);
+
+    snprintf(path, len, "%s%s/accuraterip", env, base);
+    if (accuraterip_store_init(
+            path, ACCURATERIP_STORE_TTL, ACCURATERIP_STORE_TTL_404) != 0) {
+        warn("Failed to enable store in %s", path);
+    }
 
-    /* Note that stuff may arrive out of order!
-     *
-     * XXX A progress bar may be better here!
-     *
-     * Keep the thread pool busy!  Immediately submit AccurateRip
-     * calculations, but collect them in a different pool.  Otherwise
-     * Chromaprint and CRC:s become mixed up in the same pool, and it
-     * can happen that the first CRC is finished before the last
-     * Chromaprint is done.
+    max_age = MUSICBRAINZ_STORE_MAX_AGE;
+    age = getenv("SNDCHK_MB_MAX_AGE");
+    if (age != NULL && age[0] != '\0') {
+        l = strtol(age, &end, 10);
+        if (*end == '\0' && l >= 0)
+            max_age = l;
+    }
+
+    snprintf(path, len, "%s%s/musicbrainz", env, base);
+    if (musicbrainz_store_init(path, max_age) != 0)
+        warn("Failed to enable store in %s", path);
+    free(path);
+}
+
+/* Comparison fields of a piece of metadata, as normalised wide
+ * strings.  The status is zero if the fields have not been looked
+ * up, positive if they are set, and negative if the metadata is
+ * missing.
+ */
+struct _cmp_fields
+{
+    wchar_t *title;
+    wchar_t *artist;
+    wchar_t *album;
+    int status;
+};
+
+
+/* Fields for a stream without metadata
+ */
+static const struct _cmp_fields _cmp_empty = { L"", L"", L"", 1 };
+
+
+/* Comparison fields of the tracks on a medium, indexed by zero-based
+ * track position.
+ */
+struct _cmp_medium
+{
+    struct _cmp_fields *tracks;
+    size_t nmemb;
+};
+
+
+/* Comparison fields of the media of a release, indexed by zero-based
+ * medium position.
+ */
+struct _cmp_release
+{
+    struct _cmp_medium *media;
+    size_t nmemb;
+};
+
+
+/* The comparison table holds the metadata of the streams and of the
+ * tracks of every candidate release, converted once per album, so
+ * that the distance between them can be computed without any
+ * conversion, lookup, or allocation.  The releases are in the order
+ * of the result they were built from, releasegroup by releasegroup.
+ */
+struct _cmp_table
+{
+    struct _cmp_fields *streams;
+    size_t n_streams;
+
+    struct _cmp_release *releases;
+    size_t n_releases;
+};
+
+
+static void
+_cmp_fields_clear(struct _cmp_fields *fields)
+{
+    if (fields->title != NULL)
+        free(fields->title);
+    if (fields->artist != NULL)
+        free(fields->artist);
+    if (fields->album != NULL)
+        free(fields->album);
+    fields->title = fields->artist = fields->album = NULL;
+}
+
+
+/* The _cmp_fields_set() function normalises the title, artist, and
+ * album of @p metadata into @p fields, and releases @p metadata.  If
+ * @p metadata is @c NULL, the fields are marked missing.
+ *
+ * @return Zero on success, non-zero otherwise
+ */
+static int
+_cmp_fields_set(struct _cmp_fields *fields, struct metadata *metadata)
+{
+    if (metadata == NULL) {
+        fields->status = -1;
+        return (0);
+    }
+
+    fields->title = _cmp_normalise(metadata->title);
+    fields->artist = _cmp_normalise(metadata->artist);
+    fields->album = _cmp_normalise(metadata->album);
+    metadata_free(metadata);
+
+    if (fields->title == NULL ||
+        fields->artist == NULL ||
+        fields->album == NULL) {
+        _cmp_fields_clear(fields);
+        return (-1);
+    }
+
+    fields->status = 1;
+    return (0);
+}
+
+
+static void
+_cmp_table_free(struct _cmp_table *table)
+{
+    struct _cmp_release *release;
+    size_t i, j, k;
+
+    if (table->streams != NULL) {
+        for (i = 0; i < table->n_streams; i++)
+            _cmp_fields_clear(table->streams + i);
+        free(table->streams);
+    }
+
+    if (table->releases != NULL) {
+        for (i = 0; i < table->n_releases; i++) {
+            release = table->releases + i;
+            for (j = 0; j < release->nmemb; j++) {
+                for (k = 0; k < release->media[j].nmemb; k++)
+                    _cmp_fields_clear(release->media[j].tracks + k);
+                if (release->media[j].tracks != NULL)
+                    free(release->media[j].tracks);
+            }
+            if (release->media != NULL)
+                free(release->media);
+        }
+        free(table->releases);
+    }
+
+    free(table);
+}
+
+
+/* The _cmp_release_build() function looks up the MusicBrainz metadata
+ * of every track position on the discs of @p release3 and stores its
+ * comparison fields in @p release.  A position that occurs on several
+ * discs of a medium is only looked up once.
+ *
+ * @return Zero on success, non-zero otherwise
+ */
+static int
+_cmp_release_build(struct _cmp_release *release,
+                   struct fp3_release *release3)
+{
+    struct _cmp_medium *medium;
+    struct fp3_medium *medium3;
+    struct fp3_track *track3;
+    void *p;
+    size_t k, l, m, mp, tp;
+
+
+    for (k = 0; k < release3->nmemb_media; k++) {
+        medium3 = release3->media[k];
+        mp = medium3->position;
+        if (mp == 0)
+            continue;
+
+        if (mp > release->nmemb) {
+            p = realloc(release->media, mp * sizeof(struct _cmp_medium));
+            if (p == NULL)
+                return (-1);
+            release->media = p;
+            memset(release->media + release->nmemb, 0,
+                   (mp - release->nmemb) * sizeof(struct _cmp_medium));
+            release->nmemb = mp;
+        }
+        medium = release->media + mp - 1;
+
+        for (l = 0; l < medium3->nmemb_discs; l++) {
+            for (m = 0; m < medium3->discs[l]->nmemb; m++) {
+                track3 = medium3->discs[l]->tracks[m];
+                tp = track3->position;
+                if (tp == 0)
+                    continue;
+
+                if (tp > medium->nmemb) {
+                    p = realloc(
+                        medium->tracks, tp * sizeof(struct _cmp_fields));
+                    if (p == NULL)
+                        return (-1);
+                    medium->tracks = p;
+                    memset(medium->tracks + medium->nmemb, 0,
+                           (tp - medium->nmemb) * sizeof(struct _cmp_fields));
+                    medium->nmemb = tp;
+                }
+
+                if (medium->tracks[tp - 1].status != 0)
+                    continue;
+                if (_cmp_fields_set(
+                        medium->tracks + tp - 1,
+                        get_mb_values(release3, mp, tp, NULL)) != 0) {
+                    return (-1);
+                }
+            }
+        }
+    }
+
+    return (0);
+}
+
+
+/* The _cmp_table_new() function builds the comparison table for the
+ * @p nmemb streams in @p ctxs and the releases in @p result3.
+ *
+ * @return The table, or @c NULL on failure
+ */
+static struct _cmp_table *
+_cmp_table_new(struct fingersum_context **ctxs,
+               size_t nmemb,
+               struct fp3_result *result3)
+{
+    struct _cmp_table *table;
+    size_t i, j, n;
+
+
+    table = calloc(1, sizeof(struct _cmp_table));
+    if (table == NULL)
+        return (NULL);
+
+    table->streams = calloc(
+        nmemb > 0 ? nmemb : 1, sizeof(struct _cmp_fields));
+    if (table->streams == NULL) {
+        _cmp_table_free(table);
+        return (NULL);
+    }
+    table->n_streams = nmemb;
+
+    for (i = 0; i < nmemb; i++) {
+        if (_cmp_fields_set(
+                table->streams + i, fingersum_get_metadata(ctxs[i])) != 0) {
+            _cmp_table_free(table);
+            return (NULL);
+        }
+    }
+
+
+    /* Count the releases, and build each one.
+     */
+    n = 0;
+    for (i = 0; i < result3->nmemb; i++)
+        n += result3->releasegroups[i]->nmemb;
+
+    table->releases = calloc(n > 0 ? n : 1, sizeof(struct _cmp_release));
+    if (table->releases == NULL) {
+        _cmp_table_free(table);
+        return (NULL);
+    }
+    table->n_releases = n;
+
+    n = 0;
+    for (i = 0; i < result3->nmemb; i++) {
+        for (j = 0; j < result3->releasegroups[i]->nmemb; j++) {
+            if (_cmp_release_build(
+                    table->releases + n++,
+                    result3->releasegroups[i]->releases[j]) != 0) {
+                _cmp_table_free(table);
+                return (NULL);
+            }
+        }
+    }
+
+    return (table);
+}
+
+
+/* The _cmp_release_distance() function returns the metadata distance
+ * of @p release3, whose comparison fields are those of @p release: the
+ * sum of the Levenshtein distances of the title, artist, and album of
+ * each track to those of every stream assigned to it.  A track
+ * without MusicBrainz metadata adds a large penalty for each of its
+ * streams.  A stream without metadata compares as empty strings.
+ *
+ * Only releases that are at least as close as the best one so far
+ * matter, so the distance is abandoned as soon as it exceeds @p max.
+ * Each comparison is bounded by what remains of @p max after the
+ * distance accumulated so far.
+ *
+ * @return The distance if it does not exceed @p max, @c SIZE_MAX
+ *         otherwise
+ */
+static size_t
+_cmp_release_distance(const struct _cmp_table *table,
+                      const struct _cmp_release *release,
+                      const struct fp3_release *release3,
+                      size_t max)
+{
+    const struct _cmp_fields *mb, *stream;
+    const struct fp3_medium *medium3;
+    const struct fp3_track *track3;
+    const wchar_t *s[3], *t[3];
+    size_t d, distance, i, k, l, m, mp, n, tp;
+
+
+    distance = 0;
+    for (k = 0; k < release3->nmemb_media; k++) {
+        medium3 = release3->media[k];
+        mp = medium3->position;
+
+        for (l = 0; l < medium3->nmemb_discs; l++) {
+            for (m = 0; m < medium3->discs[l]->nmemb; m++) {
+                track3 = medium3->discs[l]->tracks[m];
+                tp = track3->position;
+
+                mb = NULL;
+                if (mp > 0 && mp <= release->nmemb &&
+                    tp > 0 && tp <= release->media[mp - 1].nmemb &&
+                    release->media[mp - 1].tracks[tp - 1].status > 0) {
+                    mb = release->media[mp - 1].tracks + tp - 1;
+                }
+
+                for (n = 0; n < track3->nmemb; n++) {
+                    if (mb == NULL) {
+                        distance += 10000; // XXX
+                        if (distance > max)
+                            return (SIZE_MAX);
+                        continue;
+                    }
+
+                    stream = table->streams + track3->indices[n];
+                    if (stream->status <= 0)
+                        stream = &_cmp_empty;
+
+                    s[0] = stream->title;
+                    s[1] = stream->artist;
+                    s[2] = stream->album;
+                    t[0] = mb->title;
+                    t[1] = mb->artist;
+                    t[2] = mb->album;
+                    for (i = 0; i < 3; i++) {
+                        d = levenshtein_max(s[i], t[i], max - distance);
+                        if (d == SIZE_MAX)
+                            return (SIZE_MAX);
+                        distance += d;
+                    }
+                }
+            }
+        }
+    }
+
+    return (distance);
+}
+
+
+/* Mutex to keep the report of one album from being interleaved with
+ * that of another, when several are processed at once.
+ */
+static pthread_mutex_t _mutex_report = PTHREAD_MUTEX_INITIALIZER;
+
+
+/* The _free_streams() function closes the first @p nmemb streams in
+ * @p streams and releases their fingersum contexts in @p ctxs, along
+ * with the arrays themselves.  Entries that are @c NULL are skipped.
+ */
+static void
+_free_streams(FILE **streams, struct fingersum_context **ctxs, size_t nmemb)
+{
+    size_t i;
+
+    for (i = 0; i < nmemb; i++) {
+        if (ctxs != NULL && ctxs[i] != NULL)
+            fingersum_free(ctxs[i]);
+        if (streams != NULL && streams[i] != NULL)
+            fclose(streams[i]);
+    }
+    if (ctxs != NULL)
+        free(ctxs);
+    if (streams != NULL)
+        free(streams);
+}
+
+
+/* A track of a CUE sheet.  Strings that are not given in the sheet
+ * are @c NULL.
+ */
+struct _cue_track
+{
+    char *title;
+    char *performer;
+    char *songwriter;
+
+    /* Position of INDEX 01 in the image, in sectors of 1/75:th of a
+     * second, or -1 if the sheet does not give one
+     */
+    long int offset;
+
+    /* Track number, as given in the sheet
+     */
+    int number;
+};
+
+
+/* A CUE sheet that describes a single disc image.  Only the audio
+ * tracks are retained.  A relative path to the image in the sheet is
+ * resolved against the directory of the sheet, so that file is usable
+ * from the current directory as is.
+ */
+struct _cue_sheet
+{
+    char *file;
+    char *title;
+    char *performer;
+    char *date;
+    char *genre;
+    struct _cue_track *tracks;
+    size_t nmemb;
+};
+
+
+static void
+_cue_free(struct _cue_sheet *sheet)
+{
+    size_t i;
+
+    for (i = 0; i < sheet->nmemb; i++) {
+        free(sheet->tracks[i].title);
+        free(sheet->tracks[i].performer);
+        free(sheet->tracks[i].songwriter);
+    }
+    free(sheet->tracks);
+    free(sheet->file);
+    free(sheet->title);
+    free(sheet->performer);
+    free(sheet->date);
+    free(sheet->genre);
+    free(sheet);
+}
+
+
+/* The _cue_token() function returns the next token of the line @p *s,
+ * and advances @p *s past it.  A token is either a word, or a string
+ * in double quotes, which may contain whitespace.  The token is
+ * terminated in place.
+ *
+ * @return The token, or @c NULL if the line is exhausted
+ */
+static char *
+_cue_token(char **s)
+{
+    char *p, *token;
+
+    for (p = *s; *p == ' ' || *p == '\t'; p++)
+        ;
+    if (*p == '\0') {
+        *s = p;
+        return (NULL);
+    }
+
+    if (*p == '"') {
+        for (token = ++p; *p != '\0' && *p != '"'; p++)
+            ;
+    } else {
+        for (token = p; *p != '\0' && *p != ' ' && *p != '\t'; p++)
+            ;
+    }
+    if (*p != '\0')
+        *p++ = '\0';
+
+    *s = p;
+    return (token);
+}
+
+
+/* The _cue_set() function replaces the string @p *dst with a copy of
+ * @p value.  A missing value is not an error, and leaves @p *dst
+ * alone.
+ *
+ * @return 0 if successful, -1 otherwise.  If an error occurs, the
+ *         global variable @c errno is set to indicate the error.
+ */
+static int
+_cue_set(char **dst, const char *value)
+{
+    char *p;
+
+    if (value == NULL)
+        return (0);
+    p = strdup(value);
+    if (p == NULL)
+        return (-1);
+    free(*dst);
+    *dst = p;
+    return (0);
+}
+
+
+/* The _cue_read() function reads the CUE sheet @p path.  The sheet
+ * must describe a single image, in which every audio track has an
+ * INDEX 01.  Other tracks, such as the data track of an enhanced CD,
+ * are ignored.  Apart from the FILE, TRACK, and INDEX commands, only
+ * TITLE, PERFORMER, and SONGWRITER, and the DATE and GENRE comments
+ * are understood.
+ *
+ * @return Pointer to the sheet if successful, @c NULL otherwise.  If
+ *         an error occurs, the global variable @c errno is set to
+ *         indicate the error.  If the sheet describes more than one
+ *         file, such as a sheet that accompanies separate tracks, @c
+ *         errno is set to @c ENOTSUP.
+ */
+static struct _cue_sheet *
+_cue_read(const char *path)
+{
+    struct _cue_sheet *sheet;
+    struct _cue_track *track;
+    FILE *stream;
+    char *cmd, *dir, *line, *p, *q, *value;
+    void *r;
+    size_t i, size;
+    ssize_t len;
+    unsigned int ff, mm, ss;
+    int disc, ret;
+
+
+    stream = fopen(path, "r");
+    if (stream == NULL)
+        return (NULL);
+
+    sheet = calloc(1, sizeof(struct _cue_sheet));
+    if (sheet == NULL) {
+        fclose(stream);
+        return (NULL);
+    }
+
+
+    /* Commands that follow a TRACK command apply to that track; if it
+     * is not an audio track, they are ignored.  Commands before the
+     * first TRACK apply to the disc.
+     */
+    line = NULL;
+    size = 0;
+    disc = 1;
+    track = NULL;
+    ret = 0;
+    while (ret == 0 && (len = getline(&line, &size, stream)) != -1) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        p = line;
+        if (strncmp(p, "\xef\xbb\xbf", 3) == 0)
+            p += 3;
+
+        cmd = _cue_token(&p);
+        if (cmd == NULL)
+            continue;
+
+        if (strcmp(cmd, "FILE") == 0) {
+            value = _cue_token(&p);
+            if (sheet->file != NULL) {
+                errno = ENOTSUP;
+                ret = -1;
+            } else if (value == NULL) {
+                errno = EINVAL;
+                ret = -1;
+            } else if (value[0] == '/') {
+                ret = _cue_set(&sheet->file, value);
+            } else {
+                /* dirname(3) may modify its argument.
+                 */
+                q = strdup(path);
+                if (q == NULL) {
+                    ret = -1;
+                    continue;
+                }
+                dir = dirname(q);
+                len = strlen(dir) + strlen(value) + 2;
+                sheet->file = malloc(len);
+                if (sheet->file != NULL)
+                    snprintf(sheet->file, len, "%s/%s", dir, value);
+                else
+                    ret = -1;
+                free(q);
+            }
+
+        } else if (strcmp(cmd, "TRACK") == 0) {
+            value = _cue_token(&p);
+            q = _cue_token(&p);
+            disc = 0;
+            track = NULL;
+            if (value == NULL || q == NULL || strcmp(q, "AUDIO") != 0)
+                continue;
+
+            r = realloc(
+                sheet->tracks,
+                (sheet->nmemb + 1) * sizeof(struct _cue_track));
+            if (r == NULL) {
+                ret = -1;
+                continue;
+            }
+            sheet->tracks = r;
+            track = sheet->tracks + sheet->nmemb++;
+            track->title = NULL;
+            track->performer = NULL;
+            track->songwriter = NULL;
+            track->offset = -1;
+            track->number = atoi(value);
+
+        } else if (strcmp(cmd, "INDEX") == 0) {
+            value = _cue_token(&p);
+            q = _cue_token(&p);
+            if (track == NULL || value == NULL || q == NULL ||
+                atoi(value) != 1) {
+                continue;
+            }
+            if (sscanf(q, "%u:%u:%u", &mm, &ss, &ff) != 3 || ff >= 75) {
+                errno = EINVAL;
+                ret = -1;
+                continue;
+            }
+            track->offset = (60L * mm + ss) * 75 + ff;
+
+        } else if (strcmp(cmd, "TITLE") == 0) {
+            if (track != NULL)
+                ret = _cue_set(&track->title, _cue_token(&p));
+            else if (disc != 0)
+                ret = _cue_set(&sheet->title, _cue_token(&p));
+
+        } else if (strcmp(cmd, "PERFORMER") == 0) {
+            if (track != NULL)
+                ret = _cue_set(&track->performer, _cue_token(&p));
+            else if (disc != 0)
+                ret = _cue_set(&sheet->performer, _cue_token(&p));
+
+        } else if (strcmp(cmd, "SONGWRITER") == 0) {
+            if (track != NULL)
+                ret = _cue_set(&track->songwriter, _cue_token(&p));
+
+        } else if (strcmp(cmd, "REM") == 0 && disc != 0) {
+            q = _cue_token(&p);
+            if (q != NULL && strcmp(q, "DATE") == 0)
+                ret = _cue_set(&sheet->date, _cue_token(&p));
+            else if (q != NULL && strcmp(q, "GENRE") == 0)
+                ret = _cue_set(&sheet->genre, _cue_token(&p));
+        }
+    }
+    free(line);
+
+    if (ret == 0 && ferror(stream)) {
+        errno = EIO;
+        ret = -1;
+    }
+    fclose(stream);
+
+
+    /* The sheet must name the image, and every audio track must start
+     * somewhere within it.
+     */
+    if (ret == 0 && (sheet->file == NULL || sheet->nmemb == 0)) {
+        errno = EINVAL;
+        ret = -1;
+    }
+    for (i = 0; ret == 0 && i < sheet->nmemb; i++) {
+        if (sheet->tracks[i].offset < 0) {
+            errno = EINVAL;
+            ret = -1;
+        }
+    }
+
+    if (ret != 0) {
+        _cue_free(sheet);
+        return (NULL);
+    }
+    return (sheet);
+}
+
+
+/* The _cue_metadata() function attaches the metadata of the track @p
+ * track of the CUE sheet @p sheet to the fingersum context @p ctx.
+ * Track artists default to the artist of the disc.
+ *
+ * @return 0 if successful, -1 otherwise.  If an error occurs, the
+ *         global variable @c errno is set to indicate the error.
+ */
+static int
+_cue_metadata(struct fingersum_context *ctx,
+              const struct _cue_sheet *sheet,
+              const struct _cue_track *track)
+{
+    const char *keys[8], *values[8];
+    char number[16];
+    size_t i;
+
+
+    snprintf(number, sizeof(number), "%d", track->number);
+    keys[0] = "album";        values[0] = sheet->title;
+    keys[1] = "album_artist"; values[1] = sheet->performer;
+    keys[2] = "artist";       values[2] = track->performer != NULL ?
+                                  track->performer : sheet->performer;
+    keys[3] = "composer";     values[3] = track->songwriter;
+    keys[4] = "date";         values[4] = sheet->date;
+    keys[5] = "genre";        values[5] = sheet->genre;
+    keys[6] = "title";        values[6] = track->title;
+    keys[7] = "track";        values[7] = number;
+
+    for (i = 0; i < 8; i++) {
+        if (values[i] != NULL &&
+            fingersum_set_metadata(ctx, keys[i], values[i]) != 0) {
+            return (-1);
+        }
+    }
+
+    return (0);
+}
+
+
+/* The _is_cue() function returns non-zero if @p path looks like a CUE
+ * sheet.
+ */
+static int
+_is_cue(const char *path)
+{
+    size_t len;
+
+    len = strlen(path);
+    return (len > 4 && strcasecmp(path + len - 4, ".cue") == 0);
+}
+
+
+/* The _open_image() function opens the disc image described by the
+ * CUE sheet @p path, and replaces the arrays @p *streams, @p *ctxs,
+ * and @p *names, with ones that hold the @p *nmemb tracks of the
+ * image.  The stream of the image goes last, such that
+ * _free_streams() closes it after all the tracks that share it have
+ * been released.  Tracks are named after the sheet and their number.
+ * The names are allocated along with the array that points to them,
+ * so that free(3) on the array releases both.  If the sheet does not
+ * describe a single image, the arrays are left alone.
+ *
+ * @return 0 if successful, 1 if the sheet does not describe a single
+ *         image, -1 otherwise.  Unless successful, @p *nmemb is zero
+ *         and the arrays hold no streams.  If an error occurs, the
+ *         global variable @c errno is set to indicate the error.
+ */
+static int
+_open_image(const char *path,
+            FILE ***streams,
+            struct fingersum_context ***ctxs,
+            char ***names,
+            size_t *nmemb)
+{
+    struct _cue_sheet *sheet;
+    FILE *stream;
+    long int *offsets;
+    void *p;
+    size_t i, len, n;
+
+
+    *nmemb = 0;
+    sheet = _cue_read(path);
+    if (sheet == NULL)
+        return (errno == ENOTSUP ? 1 : -1);
+
+
+    /* Resize the arrays to the number of tracks.
+     */
+    n = sheet->nmemb;
+    len = strlen(path) + 16;
+    offsets = calloc(n, sizeof(long int));
+    if (offsets == NULL) {
+        _cue_free(sheet);
+        return (-1);
+    }
+    for (i = 0; i < n; i++)
+        offsets[i] = sheet->tracks[i].offset;
+
+    p = realloc(*streams, n * sizeof(FILE *));
+    if (p != NULL) {
+        *streams = p;
+        p = realloc(*ctxs, n * sizeof(struct fingersum_context *));
+    }
+    if (p != NULL) {
+        *ctxs = p;
+        p = realloc(*names, n * (sizeof(char *) + len));
+    }
+    if (p == NULL) {
+        free(offsets);
+        _cue_free(sheet);
+        return (-1);
+    }
+    *names = p;
+
+    for (i = 0; i < n; i++) {
+        (*streams)[i] = NULL;
+        (*ctxs)[i] = NULL;
+        (*names)[i] = (char *)(*names + n) + i * len;
+        snprintf((*names)[i], len, "%s#%02d", path, sheet->tracks[i].number);
+    }
+
+
+    /* Open the image, and attach the metadata of the sheet to its
+     * tracks.
+     */
+    stream = fopen(sheet->file, "r");
+    if (stream == NULL) {
+        warn("Failed to open %s", sheet->file);
+        free(offsets);
+        _cue_free(sheet);
+        return (-1);
+    }
+
+    if (fingersum_new_image(stream, offsets, n, *ctxs) != 0) {
+        warn("Failed to read '%s'", sheet->file);
+        fclose(stream);
+        free(offsets);
+        _cue_free(sheet);
+        return (-1);
+    }
+    free(offsets);
+
+    for (i = 0; i < n; i++) {
+        if (_cue_metadata((*ctxs)[i], sheet, sheet->tracks + i) != 0)
+            break;
+    }
+    if (i < n) {
+        for (i = 0; i < n; i++) {
+            fingersum_free((*ctxs)[i]);
+            (*ctxs)[i] = NULL;
+        }
+        fclose(stream);
+        _cue_free(sheet);
+        return (-1);
+    }
+
+    printf("Image %s [%zd tracks]\n", sheet->file, n);
+    (*streams)[n - 1] = stream;
+    *nmemb = n;
+    _cue_free(sheet);
+
+    return (0);
+}
+
+
+/* Default number of streams that may be open for decoding at a time,
+ * across all albums
+ */
+#define SNDCHK_STREAMS_DEFAULT 16
+
+
+/* The admission controller bounds the number of live fingersum
+ * contexts, i.e. those with an open decoder, over all albums in
+ * flight, as well as their estimated memory.  A stream is admitted
+ * before it is queued on the pool, and parked with fingersum_park()
+ * once its result has been collected, which releases its slot and
+ * its share of the memory budget.  Parked contexts are reopened by
+ * fingersum as needed, so they do not count against the budget.
+ *
+ * An album only waits for a slot when it holds none of its own;
+ * otherwise it collects the results it is already owed first.  That
+ * way, albums cannot deadlock waiting for each other's slots.  A
+ * stream that is larger than the whole memory budget is admitted
+ * once no other stream is live.
+ */
+struct _admission
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    /* Number of admitted streams, and the maximum
+     */
+    size_t live;
+    size_t max;
+
+    /* Estimated memory of the admitted streams, and the budget in
+     * bytes.  A budget of zero means no limit.
+     */
+    size_t bytes;
+    size_t budget;
+};
+
+static struct _admission _admission = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+    0, SNDCHK_STREAMS_DEFAULT, 0, 0
+};
+
+
+/* The _admission_fits() function returns non-zero if a stream of
+ * estimated size @p size can be admitted.  The caller must hold the
+ * mutex of the admission controller.
+ */
+static int
+_admission_fits(size_t size)
+{
+    if (_admission.live >= _admission.max)
+        return (0);
+    if (_admission.live == 0 || _admission.budget == 0)
+        return (1);
+    return (_admission.bytes + size <= _admission.budget);
+}
+
+
+/* The _admission_acquire() function takes a slot for one stream of
+ * estimated size @p size.  If @p wait is non-zero, it blocks until a
+ * slot and enough of the memory budget are available.
+ *
+ * @return 0 if a slot was taken, 1 if none was available, -1 on
+ *         error
+ */
+static int
+_admission_acquire(int wait, size_t size)
+{
+    int ret;
+
+
+    if (pthread_mutex_lock(&_admission.mutex) != 0)
+        return (-1);
+    while (wait != 0 && _admission_fits(size) == 0) {
+        if (pthread_cond_wait(&_admission.cond, &_admission.mutex) != 0) {
+            pthread_mutex_unlock(&_admission.mutex);
+            return (-1);
+        }
+    }
+
+    ret = 1;
+    if (_admission_fits(size) != 0) {
+        _admission.live++;
+        _admission.bytes += size;
+        ret = 0;
+    }
+    if (pthread_mutex_unlock(&_admission.mutex) != 0)
+        return (-1);
+
+    return (ret);
+}
+
+
+/* The _admission_release() function returns the slots of @p nmemb
+ * streams, whose estimated sizes add up to @p size.  Errors are
+ * ignored, because there is nothing that can be done about them here.
+ */
+static void
+_admission_release(size_t nmemb, size_t size)
+{
+    if (nmemb == 0 || pthread_mutex_lock(&_admission.mutex) != 0)
+        return;
+    _admission.live -= nmemb;
+    _admission.bytes -= size;
+    pthread_cond_broadcast(&_admission.cond);
+    pthread_mutex_unlock(&_admission.mutex);
+}
+
+
+/* The _open_files() function creates parked fingersum contexts for
+ * the files in @p paths, such that they hold neither a decoder nor a
+ * file descriptor until they are admitted.  The contexts and the
+ * names of their files are stored consecutively in @p ctxs and @p
+ * names, and their number in @p num_open.  CUE sheets are skipped,
+ * and so are files that cannot be read as audio if @p name is not @c
+ * NULL; see _process_album().
+ *
+ * @return 0 if successful, -1 otherwise
+ */
+static int
+_open_files(const char *name,
+            char * const *paths,
+            size_t nmemb,
+            struct fingersum_context **ctxs,
+            char **names,
+            size_t *num_open)
+{
+    size_t i;
+
+
+    for (i = 0; i < nmemb; i++) {
+        if (_is_cue(paths[i]) != 0)
+            continue;
+
+        ctxs[*num_open] = fingersum_open(paths[i]);
+        if (ctxs[*num_open] == NULL) {
+            if (name != NULL) {
+                printf("Skipping '%s'\n", paths[i]);
+                continue;
+            }
+            warn("Failed to read '%s'", paths[i]);
+            return (-1);
+        }
+        names[*num_open] = paths[i];
+        *num_open += 1;
+
+        if (fingersum_park(ctxs[*num_open - 1]) != 0) {
+            warn("Failed to park '%s'", paths[i]);
+            return (-1);
+        }
+    }
+
+    return (0);
+}
+
+
+/* The _admit_streams() function queues the streams in @p ctxs from
+ * index @p *next on for @p action on @p pc, for as long as the
+ * admission controller has room for them.  The number and the
+ * estimated size of the streams the album holds are counted in @p
+ * live and @p held.  If the album holds no streams, it waits for
+ * room.  If @p image is non-zero, the streams are the tracks of a
+ * disc image, which share a single decoder, and they are not
+ * admitted.  The first track is queued on its own, because its
+ * request decodes the image for all of them.  The other tracks are
+ * only queued once it has been collected.  By then their results are
+ * ready, and their requests complete without holding a worker while
+ * the image is being decoded.
+ *
+ * @return 0 if successful, -1 otherwise
+ */
+static int
+_admit_streams(struct pool_context *pc,
+               struct fingersum_context **ctxs,
+               size_t nmemb,
+               size_t *next,
+               size_t *live,
+               size_t *held,
+               int action,
+               int image)
+{
+    size_t size;
+    int ret;
+
+
+    for ( ; *next < nmemb; *next += 1) {
+        if (image != 0 && *next == 1 && *live > 0)
+            break;
+
+        size = 0;
+        if (image == 0) {
+            size = fingersum_get_size(ctxs[*next]);
+            ret = _admission_acquire(*live == 0, size);
+            if (ret < 0)
+                return (-1);
+            if (ret > 0)
+                break;
+        }
+
+        if (add_request(pc, ctxs[*next], (void *)*next, action) != 0) {
+            if (image == 0)
+                _admission_release(1, size);
+            return (-1);
+        }
+        *live += 1;
+        *held += size;
+    }
+
+    return (0);
+}
+
+
+/* The _process_album() function identifies the album made up of the
+ * @p nmemb files in @p paths, and reports the differences between
+ * their metadata and MusicBrainz.  The MusicBrainz and AccurateRip
+ * contexts, as well as the pool, are shared: several albums may be
+ * processed concurrently.  If @p name is not @c NULL, the album is
+ * part of a batch: files that cannot be read are skipped rather than
+ * being fatal, and the report is headed by @p name.  If one of the
+ * files is a CUE sheet that describes a single disc image, the album
+ * is made up of the tracks of the image instead.  If @p job is
+ * not @c NULL, the album was submitted to the server, and progress
+ * and the releases that remain are reported to its client.
+ *
+ * @return EXIT_SUCCESS if successful, EXIT_FAILURE or -1 otherwise
+ */
+static int
+_process_album(struct musicbrainz_ctx *mb_ctx,
+               struct accuraterip_context *ar_ctx,
+               const char *name,
+               char * const *paths,
+               size_t nmemb,
+               struct server_job *job)
+{
+    FILE **streams;
+    struct fingersum_context **ctxs;
+    struct pool_context *pc;
+    char **names;
+    size_t held, i, live, next, num_open;
+    int image;
+
+
+    streams = (FILE **)calloc(
+        nmemb > 0 ? nmemb : 1, sizeof(FILE *));
+    ctxs = (struct fingersum_context **)calloc(
+        nmemb > 0 ? nmemb : 1, sizeof(struct fingersum_context *));
+    names = (char **)calloc(
+        nmemb > 0 ? nmemb : 1, sizeof(char *));
+    if (streams == NULL || ctxs == NULL || names == NULL) {
+        _free_streams(streams, ctxs, 0);
+        if (names != NULL)
+            free(names);
+        printf("*** FAILURE #1\n"); // XXX This should be done externally!
+        return (-1);
+    }
+
+    pc = pool_new_pc(pool_nmemb_auto());
+    if (pc == NULL) {
+        _free_streams(streams, ctxs, 0);
+        free(names);
+        printf("*** FAILURE #3\n"); // XXX
+        return (-1);
+    }
+
+
+    /* If there is a CUE sheet among the files, the album is a disc
+     * image, and the tracks of the image are the streams.  Sheets that
+     * accompany separate tracks are ignored.  The first request
+     * decodes the whole image, and the requests for the other tracks
+     * follow once it is done; see _admit_streams().
+     */
+    for (i = 0; i < nmemb && _is_cue(paths[i]) == 0; i++)
+        ;
+    num_open = 0;
+    if (i < nmemb &&
+        _open_image(paths[i], &streams, &ctxs, &names, &num_open) < 0) {
+        warn("Failed to read CUE sheet %s", paths[i]);
+        pool_free_pc(pc);
+        _free_streams(streams, ctxs, 0);
+        free(names);
+        return (-1);
+    }
+
+
+    /* The files are opened, and parked right away, up front.  Only as
+     * many streams as the admission controller allows are then queued
+     * for decoding.  The rest are queued as the fingerprints of the
+     * first ones are collected below.
+     *
+     * XXX This must all be released somewhere!
+     *
+     * Track numbers are one-based.  Also acoustid indexes from 1 (see
+     * message on message board).  None of that actually matters
+     * here.
+     *
+     * Album directories may hold cover art, logs, and the like, so in
+     * a batch, files that cannot be read as audio are skipped.  The
+     * streams that remain are numbered consecutively.
+     */
+    image = num_open > 0 ? 1 : 0;
+    if (image == 0 &&
+        _open_files(name, paths, nmemb, ctxs, names, &num_open) != 0) {
+        pool_free_pc(pc);
+        _free_streams(streams, ctxs, num_open);
+        free(names);
+        return (-1);
+    }
+
+    next = 0;
+    live = 0;
+    held = 0;
+    if (_admit_streams(pc, ctxs, num_open, &next, &live, &held,
+                       POOL_ACTION_CHROMAPRINT, image) != 0) {
+        warn("Failed to queue '%s'", names[next]);
+        pool_free_pc(pc);
+        _admission_release(image == 0 ? live : 0, held);
+        _free_streams(streams, ctxs, num_open);
+        free(names);
+        return (-1);
+    }
+
+    if (num_open == 0) {
+        printf("No audio files in %s\n", name != NULL ? name : "album");
+        pool_free_pc(pc);
+        _free_streams(streams, ctxs, 0);
+        free(names);
+        return (EXIT_FAILURE);
+    }
+
+
+    /* Note that stuff may arrive out of order!
+     *
+     * XXX A progress bar may be better here!
+     *
+     * Keep the thread pool busy!  Immediately submit AccurateRip
+     * calculations, but collect them in a different pool.  Otherwise
+     * Chromaprint and CRC:s become mixed up in the same pool, and it
+     * can happen that the first CRC is finished before the last
+     * Chromaprint is done.
      *
      * XXX No point in computing AccurateRip unless its lossless.
      *
@@ -5019,7 +6673,7 @@ main(int argc, char *argv[])
 
 //    size_t *permutation;
 //    permutation = (size_t *)calloc(
-//        argc - 1, sizeof(size_t));
+//        nmemb, sizeof(size_t));
 //    if (permutation == NULL) {
 //        pool_free_pc(pc);
 //        free(ctxs);
@@ -5030,41 +6684,37 @@ main(int argc, char *argv[])
     if (ac == NULL) {
 //        free(permutation);
         pool_free_pc(pc);
-        free(ctxs);
-        return (-1);
-    }
-
-    pc2 = pool_new_pc(4); // XXX Hardcoded!
-    if (pc2 == NULL) {
-        acoustid_free(ac);
-//        free(permutation);
-        pool_free_pc(pc);
-        free(ctxs);
+        _admission_release(image == 0 ? live : 0, held);
+        _free_streams(streams, ctxs, num_open);
+        free(names);
         return (-1);
     }
 
-    for (i = 0; i < argc - 1; i++) {
+    for (i = 0; i < num_open; i++) {
         printf("Fingerprinting... ");
         fflush(stdout);
         if (get_result(pc, &ctx, (void **)(&arg), &status) != 0 ||
             (status & POOL_ACTION_CHROMAPRINT) == 0 ||
             fingersum_get_fingerprint(ctx, NULL, &fingerprint) != 0) {
-            pool_free_pc(pc2);
             acoustid_free(ac);
 //            free(permutation);
             pool_free_pc(pc);
-            free(ctxs);
+            _admission_release(image == 0 ? live : 0, held);
+            _free_streams(streams, ctxs, num_open);
+            free(names);
             return (-1);
         }
-        printf("'%s' OK\n", basename(argv[arg + 1]));
+        printf("'%s' OK\n", basename(names[arg]));
+        server_reply(job, "PROGRESS", "fingerprint %zd/%zd", i + 1, num_open);
 
         if (acoustid_add_fingerprint(
                 ac, fingerprint, fingersum_get_duration(ctx), (size_t)arg) != 0) {
-            pool_free_pc(pc2);
             acoustid_free(ac);
 //            free(permutation);
             pool_free_pc(pc);
-            free(ctxs);
+            _admission_release(image == 0 ? live : 0, held);
+            _free_streams(streams, ctxs, num_open);
+            free(names);
             return (-1);
         }
 
@@ -5073,6 +6723,27 @@ main(int argc, char *argv[])
         free(fingerprint);
 
 
+        /* The stream is not decoded again until its checksums are
+         * needed, so its decoder makes room for the next stream.
+         */
+        if (image == 0) {
+            if (fingersum_park(ctx) != 0)
+                warn("Failed to park '%s'", names[arg]);
+            _admission_release(1, fingersum_get_size(ctx));
+            held -= fingersum_get_size(ctx);
+        }
+        live--;
+        if (_admit_streams(pc, ctxs, num_open, &next, &live, &held,
+                           POOL_ACTION_CHROMAPRINT, image) != 0) {
+            acoustid_free(ac);
+            pool_free_pc(pc);
+            _admission_release(image == 0 ? live : 0, held);
+            _free_streams(streams, ctxs, num_open);
+            free(names);
+            return (-1);
+        }
+
+
         /* This is done later, now.
          */
 #if 0
@@ -5081,20 +6752,22 @@ main(int argc, char *argv[])
             acoustid_free(ac);
 //            free(permutation);
             pool_free_pc(pc);
-            free(ctxs);
+            _free_streams(streams, ctxs, nmemb);
+            free(names);
             return (-1);
         }
 #endif
     }
 
     pool_free_pc(pc);
+    nmemb = num_open;
     result3 = acoustid_request(ac);
     acoustid_free(ac);
     if (result3 == NULL) {
         printf("AcoustID request failed\n");
-        pool_free_pc(pc2);
 //        free(permutation);
-        free(ctxs);
+        _free_streams(streams, ctxs, nmemb);
+        free(names);
         return (EXIT_FAILURE); // XXX CLEANUP!
     }
 
@@ -5104,7 +6777,7 @@ main(int argc, char *argv[])
 /*
     fp3_sort_result(result3);
     if (fp3_permute_result(
-            result3, permutation, argc - 1) != 0) {
+            result3, permutation, nmemb) != 0) {
         pool_free_pc(pc2);
         free(permutation);
         free(ctxs);
@@ -5124,15 +6797,18 @@ main(int argc, char *argv[])
 
     num_matched = _filter_incomplete(result3);
     if (num_matched < 0) {
-        pool_free_pc(pc2);
-        free(ctxs);
+        fp3_free_result(result3);
+        _free_streams(streams, ctxs, nmemb);
+        free(names);
         return (EXIT_FAILURE);
     }
 
+    server_reply(job, "PROGRESS", "acoustid %zd releasegroups", result3->nmemb);
     if (result3->nmemb == 0) {
         printf("No matching releasegroups, exiting...\n");
-        pool_free_pc(pc2);
-        free(ctxs);
+        fp3_free_result(result3);
+        _free_streams(streams, ctxs, nmemb);
+        free(names);
         return (EXIT_SUCCESS);
     }
 
@@ -5166,7 +6842,7 @@ main(int argc, char *argv[])
                "%zd streams missing fingerprints\n",
                num_releases,
                result3->nmemb,
-               argc - 1 - num_matched);
+               nmemb - num_matched);
         break;
 
     case 2:
@@ -5190,8 +6866,9 @@ main(int argc, char *argv[])
          */
         printf("Response from AcoustID:\n");
         if (fp3_result_dump(result3, 2, 0) < 0) {
-            pool_free_pc(pc2);
-            free(ctxs);
+            fp3_free_result(result3);
+            _free_streams(streams, ctxs, nmemb);
+            free(names);
             return (EXIT_FAILURE);
         }
         break;
@@ -5224,24 +6901,14 @@ main(int argc, char *argv[])
      * even though the first disc is there].
      *
      * XXX What about background-fetching from the MusicBrainz
-     * servers?  That should now be implemented.  Could probably
-     * submit the queries in one loop, then wait for them in another.
+     * servers?  That should now be implemented.  The browse queries
+     * are submitted in one loop, then waited for by one node per
+     * releasegroup, see _match_releasegroup().
      */
-    Mb5Release Release;
 //    struct toc_score toc_score;
     int prutt_num;
 //    fp3_recording_list *recordings3;
 
-    struct musicbrainz_ctx *mb_ctx;
-
-    mb_ctx = musicbrainz_new();
-    if (mb_ctx == NULL) {
-        pool_free_pc(pc2);
-        free(ctxs);
-        printf("Failed to initialise mb_ctx\n");
-        return (EXIT_FAILURE);
-    }
-
     /* XXX This appears to not crash, but maybe we won't need all of
      * those here, now.
      */
@@ -5253,93 +6920,92 @@ main(int argc, char *argv[])
                             "recordings", NULL};
     prutt_num = 2;
 
-    struct accuraterip_context *ar_ctx;
     int release_has_matching_discs = 0;
 
-#if 0
-    ar_ctx = accuraterip_new("localhost", 8080);
-#else
-    ar_ctx = accuraterip_new(NULL, 0);
-#endif
-    if (ar_ctx == NULL)
-        ; // XXX
-
+    /* Submit the browse requests for all the release groups up
+     * front, so that the MusicBrainz workers can execute them while
+     * the responses are processed below.  Earlier release groups are
+     * needed earlier.  The submission in _match_releasegroup() is
+     * coalesced with these, and moves the release group being waited
+     * for to the front of the queue.
+     */
     for (i = 0; i < result3->nmemb; i++) {
-        releasegroup3 = result3->releasegroups[i];
-        releasegroup3->distance = LONG_MAX;
-        prutt_values[1] = releasegroup3->id;
-
-
-        /* This is a browse request: entity is release, params
-         * includes "release-group=###", and ID is NULL.  XXX Make
-         * sure musicbrainz_query() returns immediately (it should
-         * just queue the query).
-         */
-        printf("Submitting query for release-group %s [%zd candidates]\n",
-               releasegroup3->id, releasegroup3->nmemb);
-        if (musicbrainz_query(mb_ctx,
-                              "release",
-                              NULL,
-                              "",
-                              prutt_num,
-                              prutt_names,
-                              prutt_values) != 0) {
-            printf("  Submission failed!\n");
-            exit(0); // XXX Should really exit or something... no point in going on?
+        prutt_values[1] = result3->releasegroups[i]->id;
+        if (musicbrainz_query_priority(mb_ctx,
+                                       -(int)i - 1,
+                                       "release",
+                                       NULL,
+                                       "",
+                                       prutt_num,
+                                       prutt_names,
+                                       prutt_values) != 0) {
+            break;
         }
+    }
 
-        for (j = 0; j < releasegroup3->nmemb; j++) {
-            /* Find the MusicBrainz MediumList corresponding to the
-             * release, and complete the AcoustID response
-             * accordingly.
-             *
-             * XXX If there is no release or no MediumList in
-             * MusicBrainz should probably erase the release here
-             *
-             * This is basically the Brown problem (out of sync).
-             */
-            release3 = releasegroup3->releases[j];
-            printf("MB query for release ->%s<- [%zd/%zd]\n",
-                   release3->id, j + 1, releasegroup3->nmemb);
-
-            Release = musicbrainz_get_release(mb_ctx,
-                                              "release",
-                                              NULL, // XXX This probably should not matter... Don't care whether result came from lookup, browse, or search...
-                                              "",
-                                              prutt_num,
-                                              prutt_names,
-                                              prutt_values,
-                                              release3->id);
-            if (Release == NULL) {
-                /* XXX This may actually happen (e.g. if we didn't
-                 * exhaust the release-group, or maybe, if the query
-                 * just did not complete yet)!  Could it be that we're
-                 * out of sync with Acoustid?  Should wait for query
-                 * to finish, then exit with hard error if still not
-                 * found?
-                 */
-                printf("MB Query did not match release!\n");
-                continue; // exit(EXIT_FAILURE);
-            }
+    /* One node per releasegroup: each waits for its browse request,
+     * then matches the discs of its releases, fetching the
+     * AccurateRip responses as it goes.  The nodes run on the pool,
+     * which is otherwise idle at this stage, and are collected in the
+     * order they complete.  Registering the offsets with the streams
+     * is not thread-safe, so that is done here, as each node
+     * completes.
+     */
+    struct _match_arg *match_args;
+    size_t num_matched_releasegroups = 0;
+    int match_failed = 0;
+
+    pc = pool_new_pc(pool_nmemb_auto());
+    match_args = calloc(
+        result3->nmemb > 0 ? result3->nmemb : 1, sizeof(struct _match_arg));
+    if (pc == NULL || match_args == NULL) {
+        printf("Failed to set up releasegroup matching\n"); // XXX
+        if (pc != NULL)
+            pool_free_pc(pc);
+        if (match_args != NULL)
+            free(match_args);
+        fp3_free_result(result3);
+        _free_streams(streams, ctxs, nmemb);
+        free(names);
+        return (EXIT_FAILURE);
+    }
 
-            if (_complete_release(
-                    release3, Release, argc - 1) != 0) {
-                printf("XXX _complete_release() failed!\n");
-            }
+    for (i = 0; i < result3->nmemb; i++) {
+        match_args[i].releasegroup = result3->releasegroups[i];
+        match_args[i].ctxs = ctxs;
+        match_args[i].nmemb = nmemb;
+        match_args[i].mb_ctx = mb_ctx;
+        match_args[i].ar_ctx = ar_ctx;
+        match_args[i].num_params = prutt_num;
+        match_args[i].param_names = prutt_names;
+        match_args[i].param_values[0] = prutt_values[0];
+        match_args[i].param_values[1] = result3->releasegroups[i]->id;
+
+        if (pool_submit(pc, _match_releasegroup, match_args + i) == NULL) {
+            printf("Failed to submit releasegroup %s\n", // XXX
+                   result3->releasegroups[i]->id);
+            match_failed = 1;
+            break;
+        }
+    }
 
-//            printf("*** POST _complete_release() DUMP\n");
-//            fp3_release_dump(release3, 2, 0);
-//            printf("*** POST _complete_release() DUMP\n");
+    for ( ; ; ) {
+        void *arg, *value;
 
-            if (_release_add_discs(
-                    release3, ctxs,
-                    argc - 1, ar_ctx, Release) != 0) {
-                printf("XXX _release_add_discs() failed!\n");
-            }
+        if (pool_wait_any(pc, &arg, &value) != 0)
+            break;
+        if (value == NULL)
+            match_failed = 1; // XXX Should really exit or something... no point in going on?
+        if (match_failed != 0)
+            continue;
 
-//            printf("*** POST _release_add_discs() DUMP\n");
-//            fp3_release_dump(release3, 2, 0);
-//            printf("*** POST _release_add_discs() DUMP\n");
+        server_reply(job, "PROGRESS", "musicbrainz %zd/%zd",
+                     ++num_matched_releasegroups, result3->nmemb);
+        releasegroup3 = ((struct _match_arg *)arg)->releasegroup;
+        for (j = 0; j < releasegroup3->nmemb; j++) {
+            release3 = releasegroup3->releases[j];
+            if (release3->mb_release == NULL)
+                continue;
 
 
             /* Make sure the correct offsets are calculated for each
@@ -5348,74 +7014,25 @@ main(int argc, char *argv[])
              * XXX This may be premature: we may not actually need to
              * calculate all these offsets?
              */
-            if (_add_streams_offset_2(ctxs, release3) != 0)
-                exit (-1); // XXX
+            if (_add_streams_offset_2(ctxs, release3) != 0) {
+                match_failed = 1; // XXX
+                break;
+            }
 
             if (_release_has_matching_discs(release3) != 0) {
                 printf("  setting release_has_matching_discs\n");
                 release_has_matching_discs = 1;
             }
-
-//            if (_toc_accuraterip(
-//                    ctxs, release3, MediumList, &toc_score, ar_ctx) != 0) {
-//                printf("_toc_accuraterip() failed!");
-//                exit(EXIT_FAILURE);
-//            }
-
-
-            // XXX Need this for later; see remark about clone below
-            release3->mb_release = Release;
-
-
-#if 0
-            /* 2016-04-27: Should probably fall back on some version
-             * of this if _toc_accuraterip() fails.  IDEA: position
-             * the tracks using accuraterip.  If that fails use the
-             * sector lengths.  If that fails, use the information
-             * from acoustid.
-             *
-             * XXX Should probably fall back on checking lower bound
-             * using the track length instead!
-             *
-             * XXX At this stage: calculate lower_bound, populate list
-             * of discs with bound and AccurateRip path, calculate
-             * Levenshtein distance.  Next (non-network) loop: eliminate.
-             *
-             * XXX Probably want to do this completely differently:
-             * assign position (track and medium) from recording, then
-             * match against TOC, fall back on matching against track
-             * length (and invert sign).  Populate a list of media and
-             * calculate distance for each disc.  Key discs by discid,
-             * and use the special NULL discid if the TOC-match had to
-             * be done against track lengths.
-             */
-            if (_toc_lower_bound(ctxs, release3, MediumList, &toc_score) != 0) {
-                printf("SILLY HATTNE failed _toc_lower_bound()\n");
-                toc_score.distance = 1000; // XXX LONG_MAX;
-                toc_score.score = 0;
-            }
-
-            printf("  Lower bound is %ld %f\n",
-                   toc_score.distance, toc_score.score);
-
-            release3->distance = toc_score.distance;
-//            release3->score = toc_score.score;
-
-
-            /* XXX What about the clone business?  Would be good not
-             * to have to worry about this!
-             */
-            release3->mb_release = Release;
-
-            if (toc_score.distance < releasegroup3->distance ||
-                (toc_score.distance == releasegroup3->distance /* &&
-                                                                  toc_score.score > releasegroup3->score */)) {
-                releasegroup3->distance = toc_score.distance;
-//                releasegroup3->score = toc_score.score;
-            }
-#endif
         }
     }
+    pool_free_pc(pc);
+    free(match_args);
+    if (match_failed != 0) {
+        fp3_free_result(result3);
+        _free_streams(streams, ctxs, nmemb);
+        free(names);
+        return (EXIT_FAILURE);
+    }
 
 
     /* If there is a release for which all streams are matched in
@@ -5471,19 +7088,95 @@ main(int argc, char *argv[])
 
 
     /* Make sure the correct offsets are calculated for each stream.
-     * Submit each stream for calculation.
+     * Submit each stream for calculation.  This cannot start any
+     * earlier: every remaining release covers all streams, and an
+     * offset added to a stream after its middle region was processed
+     * needs one more pass for its v2 checksum, so each stream must
+     * wait for all the releasegroup nodes above.
      */
 //    if (_add_streams_offset(ctxs, result3) != 0)
 //        exit (-1); // XXX
 
-    for (i = 0; i < argc - 1; i++) {
-        printf("ADDING request %zd %p\n", i, ctxs[i]);
+    pc = pool_new_pc(pool_nmemb_auto());
+    if (pc == NULL) {
+        fp3_free_result(result3);
+        _free_streams(streams, ctxs, nmemb);
+        free(names);
+        printf("Oh no, we're all gonna die... again\n"); // XXX
+        return (-1);
+    }
 
-        if (add_request(pc2, ctxs[i], (void *)i, POOL_ACTION_ACCURATERIP) != 0) {
-            pool_free_pc(pc2);
-            free(ctxs);
-            printf("Oh no, we're all gonna die... again\n"); // XXX
-            return (-1);
+    /* As for the fingerprints, the streams are admitted as the
+     * checksums of the previous ones are collected.
+     */
+    next = 0;
+    live = 0;
+    held = 0;
+    if (_admit_streams(pc, ctxs, nmemb, &next, &live, &held,
+                       POOL_ACTION_ACCURATERIP, image) != 0) {
+        pool_free_pc(pc);
+        _admission_release(image == 0 ? live : 0, held);
+        fp3_free_result(result3);
+        _free_streams(streams, ctxs, nmemb);
+        free(names);
+        printf("Oh no, we're all gonna die... again\n"); // XXX
+        return (-1);
+    }
+
+
+    /* While the streams are being decoded, prefetch the final lookup
+     * of every remaining release from MusicBrainz.  Releases that are
+     * pruned below are looked up in vain, so these go behind
+     * everything else in the queue, and the lookups that are actually
+     * waited for are moved ahead of them.
+     */
+    char *prutt_names2[] = {(char *)"inc"};
+//    char *prutt_values2[] = {(char *)"artist-credits discids media recordings work-rels"}; // XXX May need to do a second lookup to get this to work!  Make a comment to at some point in the future verify whether that's really necessary.  Looks like recording-level-rels is the only one that made a difference?  And work-level-rels makes it crash?
+
+    /* See line 925 in https://git.gnome.org/browse/sound-juicer/tree/libjuicer/sj-metadata-musicbrainz5.c: this is what they're using: "aliases artists artist-credits labels recordings \
+release-groups url-rels discids recording-level-rels work-level-rels work-rels \
+artist-rels"
+     */
+
+    // This works
+//    char *prutt_values2[] ={(char *)"aliases artists artist-credits discids media recordings recording-rels work-rels recording-level-rels work-level-rels artist-rels"};
+
+    // This appears to be the minimum set that works
+//    char *prutt_values2[] ={(char *)"artists artist-credits discids recordings work-rels recording-level-rels work-level-rels artist-rels"};
+
+    // But need release-groups to get the type of a release (or
+    // rather, release-group).
+    char *prutt_values2[] ={(char *)"artists artist-credits discids recordings work-rels recording-level-rels release-groups work-level-rels artist-rels"};
+
+#if 0 // XXX This is from sound-juicer
+    char *prutt_values[] = {(char *)"aliases "
+        "artists "
+        "artist-credits "
+        "labels "
+        "recordings "
+        "release-groups "
+        "url-rels "
+        "discids "
+        "recording-level-rels "
+        "work-level-rels "
+        "work-rels "
+        "artist-rels", NULL};
+#endif
+
+    int prutt_num2 = 1;
+
+    for (i = 0; i < result3->nmemb; i++) {
+        releasegroup3 = result3->releasegroups[i];
+
+        for (j = 0; j < releasegroup3->nmemb; j++) {
+            musicbrainz_query_priority(mb_ctx,
+                                       INT_MIN,
+                                       "release",
+                                       releasegroup3->releases[j]->id,
+                                       "",
+                                       prutt_num2,
+                                       prutt_names2,
+                                       prutt_values2);
         }
     }
 
@@ -5504,24 +7197,43 @@ main(int argc, char *argv[])
      * A minor": is multiprocessing working right, or is it just that
      * we are recalculating the AcoustID fingerprints?
      */
-    for (i = 0; i < argc - 1; i++) {
+    for (i = 0; i < nmemb; i++) {
         struct fingersum_context *ctx;
         void *arg;
         int status;
 
         printf("Checksumming... ");
         fflush(stdout);
-        if (get_result(pc2, &ctx, &arg, &status) != 0)
+        if (get_result(pc, &ctx, &arg, &status) != 0)
             printf("ERROR #1\n"); // XXX
         printf("[%zd: %lu sectors] OK %zd\n",
                (size_t)arg, fingersum_get_sectors(ctx), i);
+        server_reply(job, "PROGRESS", "checksum %zd/%zd", i + 1, nmemb);
 
         if ((status & POOL_ACTION_ACCURATERIP) == 0)
             printf("ERROR #2 %d %d\n", status, POOL_ACTION_ACCURATERIP);
+
+        if (image == 0) {
+            if (fingersum_park(ctx) != 0)
+                printf("ERROR #3\n"); // XXX
+            _admission_release(1, fingersum_get_size(ctx));
+            held -= fingersum_get_size(ctx);
+        }
+        live--;
+        if (_admit_streams(pc, ctxs, nmemb, &next, &live, &held,
+                           POOL_ACTION_ACCURATERIP, image) != 0) {
+            pool_free_pc(pc);
+            _admission_release(image == 0 ? live : 0, held);
+            fp3_free_result(result3);
+            _free_streams(streams, ctxs, nmemb);
+            free(names);
+            printf("Oh no, we're all gonna die... again\n"); // XXX
+            return (-1);
+        }
     }
     printf("Freeing the pool...");
     fflush(stdout);
-    pool_free_pc(pc2);
+    pool_free_pc(pc);
     printf(" OK\n");
 
 
@@ -5580,6 +7292,8 @@ main(int argc, char *argv[])
         releasegroup3 = result3->releasegroups[i];
         printf("AccurateRip releasegroup [%zd/%zd] ->%s<-\n",
                i + 1, result3->nmemb, releasegroup3->id);
+        server_reply(job, "PROGRESS", "accuraterip %zd/%zd",
+                     i + 1, result3->nmemb);
 
         for (j = 0; j < releasegroup3->nmemb; j++) {
             release3 = releasegroup3->releases[j];
@@ -5687,8 +7401,6 @@ main(int argc, char *argv[])
         }
     }
 
-    accuraterip_free(ar_ctx);
-
 
     /* Pruning step, added 2015-11-10: remove all releases with
      * suboptimal matches in AccurateRip.  Otherwise, the levenshtein
@@ -5742,20 +7454,32 @@ main(int argc, char *argv[])
      */
 #if 1
     size_t metadata_min_distance = SIZE_MAX;
-    struct metadata *metadata_mb, *metadata_stream;
     size_t release_distance = 0;
-    size_t k, l, m, n, index;
+    size_t k, l;
+    struct _cmp_table *cmp_table;
     struct fp3_medium *medium3;
-    struct fp3_disc *disc3;
-    struct fp3_track *track3;
 
 
-    for (i = 0; i < result3->nmemb; i++) {
+    /* Convert the metadata of the streams and of the tracks of all
+     * candidate releases once, up front.
+     *
+     * XXX Should probably do the wide-character conversion when the
+     * metadata is read from file.
+     */
+    cmp_table = _cmp_table_new(ctxs, nmemb, result3);
+    if (cmp_table == NULL) {
+        printf("Failed to build metadata comparison table\n"); // XXX
+        fp3_free_result(result3);
+        _free_streams(streams, ctxs, nmemb);
+        free(names);
+        return (EXIT_FAILURE);
+    }
+
+    for (i = 0, l = 0; i < result3->nmemb; i++) {
         releasegroup3 = result3->releasegroups[i];
 
         for (j = 0; j < releasegroup3->nmemb; j++) {
             release3 = releasegroup3->releases[j];
-            release_distance = 0;
 
             fp3_sort_release(release3);
 
@@ -5766,77 +7490,23 @@ main(int argc, char *argv[])
                                           // for Kauffman's Puccini
                                           // album.
 
-                for (l = 0; l < medium3->nmemb_discs; l++) {
-                    disc3 = medium3->discs[l];
-
-//                    fp3_sort_disc(disc3); // XXX Placement!  Have not
-                                          // seen this be necessary
-                                          // quite yet.
-
-                    for (m = 0; m < disc3->nmemb; m++) {
-                        track3 = disc3->tracks[m];
-
-                        for (n = 0; n < track3->nmemb; n++) {
-                            index = track3->indices[n];
-
-                            metadata_stream =
-                                fingersum_get_metadata(ctxs[index]);
-                            if (metadata_stream == NULL)
-                                printf("HORRIBLE FAILURE\n"); // XXX
-
-
-                            /* XXX k should probably be position here!
-                             *
-                             * XXX This will break: need a function to
-                             * get limited metadata (title, artist,
-                             * album).
-                             *
-                             * XXX And should probably do the
-                             * wide-character conversion when the
-                             * metadata is read from file.
-                             */
-                            metadata_mb = get_mb_values(
-                                release3,
-                                medium3->position,
-                                track3->position,
-                                NULL);
-                            if (metadata_mb == NULL) {
-                                release_distance += 10000; // XXX
-                                continue;
-                            }
-
-                            wchar_t s1[1024];
-                            wchar_t s2[1024];
-
-                            if (metadata_stream->title != NULL)
-                                mbstowcs(s1, metadata_stream->title, 1024);
-                            else
-                                s1[0] = '\0';
-                            mbstowcs(s2, metadata_mb->title, 1024);
-                            release_distance += levenshtein(s1, s2);
-
-                            if (metadata_stream->artist != NULL)
-                                mbstowcs(s1, metadata_stream->artist, 1024);
-                            else
-                                s1[0] = '\0';
-                            mbstowcs(s2, metadata_mb->artist, 1024);
-                            release_distance += levenshtein(s1, s2);
-
-                            if (metadata_stream->album != NULL)
-                                mbstowcs(s1, metadata_stream->album, 1024);
-                            else
-                                s1[0] = '\0';
-                            mbstowcs(s2, metadata_mb->album, 1024);
-                            release_distance += levenshtein(s1, s2);
-                        }
-                    }
-                }
-
-                printf("For release ->%s<- have distance %zd\n",
-                       release3->id, release_distance);
-                release3->metadata_distance = release_distance;
+//                fp3_sort_disc() for each disc: XXX Placement!  Have
+//                not seen this be necessary quite yet.
             }
 
+            /* Releases that are farther than the closest one so far
+             * are abandoned early, and get SIZE_MAX as their
+             * distance.
+             */
+            release_distance = _cmp_release_distance(
+                cmp_table,
+                cmp_table->releases + l++,
+                release3,
+                metadata_min_distance);
+            printf("For release ->%s<- have distance %zd\n",
+                   release3->id, release_distance);
+            release3->metadata_distance = release_distance;
+
 
 /*
             printf("HATTNE STUPID CHECK:\n");
@@ -5858,6 +7528,7 @@ main(int argc, char *argv[])
                 metadata_min_distance = release_distance;
         }
     }
+    _cmp_table_free(cmp_table);
 
     for (i = 0; i < result3->nmemb; i++) {
         releasegroup3 = result3->releasegroups[i];
@@ -5894,51 +7565,17 @@ main(int argc, char *argv[])
          * XXX Evil duplication w.r.t. above.
          */
         if (releasegroup3->nmemb == 0) {
-            fp3_erase_releasegroup(result3, i);
-            i--;
-        }
-    }
-#endif
-//    exit(0); // XXX
-
-
-    /* If any release had a match in accuraterip, remove all those
-     * that didn't.  XXX This really calls for the erase() functions!
-     */
-    char *prutt_names2[] = {(char *)"inc"};
-//    char *prutt_values2[] = {(char *)"artist-credits discids media recordings work-rels"}; // XXX May need to do a second lookup to get this to work!  Make a comment to at some point in the future verify whether that's really necessary.  Looks like recording-level-rels is the only one that made a difference?  And work-level-rels makes it crash?
-
-    /* See line 925 in https://git.gnome.org/browse/sound-juicer/tree/libjuicer/sj-metadata-musicbrainz5.c: this is what they're using: "aliases artists artist-credits labels recordings \
-release-groups url-rels discids recording-level-rels work-level-rels work-rels \
-artist-rels"
-     */
-
-    // This works
-//    char *prutt_values2[] ={(char *)"aliases artists artist-credits discids media recordings recording-rels work-rels recording-level-rels work-level-rels artist-rels"};
-
-    // This appears to be the minimum set that works
-//    char *prutt_values2[] ={(char *)"artists artist-credits discids recordings work-rels recording-level-rels work-level-rels artist-rels"};
-
-    // But need release-groups to get the type of a release (or
-    // rather, release-group).
-    char *prutt_values2[] ={(char *)"artists artist-credits discids recordings work-rels recording-level-rels release-groups work-level-rels artist-rels"};
-
-#if 0 // XXX This is from sound-juicer
-    char *prutt_values[] = {(char *)"aliases "
-        "artists "
-        "artist-credits "
-        "labels "
-        "recordings "
-        "release-groups "
-        "url-rels "
-        "discids "
-        "recording-level-rels "
-        "work-level-rels "
-        "work-rels "
-        "artist-rels", NULL};
+            fp3_erase_releasegroup(result3, i);
+            i--;
+        }
+    }
 #endif
+//    exit(0); // XXX
 
-    int prutt_num2 = 1;
+
+    /* If any release had a match in accuraterip, remove all those
+     * that didn't.  XXX This really calls for the erase() functions!
+     */
 
 
     /* XXX Really, we already have all the information we need except
@@ -5975,13 +7612,17 @@ artist-rels"
 
 #if 1
             /*** XXX LOOK UP THE RELEASE AGAIN HERE ***/
-            if (musicbrainz_query(mb_ctx,
-                                  "release",
-                                  release3->id,
-                                  "",
-                                  prutt_num2,
-                                  prutt_names2,
-                                  prutt_values2) != 0) {
+            /* The result is waited for immediately, so it goes ahead
+             * of any prefetched browse requests.
+             */
+            if (musicbrainz_query_priority(mb_ctx,
+                                           1,
+                                           "release",
+                                           release3->id,
+                                           "",
+                                           prutt_num2,
+                                           prutt_names2,
+                                           prutt_values2) != 0) {
                 ; // XXX
             }
 
@@ -6020,15 +7661,38 @@ artist-rels"
 //    fp3_result_dump(result3, 2, 0);
 
 
+    /* Report the releases that remain to the client of the server, if
+     * any.  The diff below only goes to the standard output.
+     */
+    for (i = 0; i < result3->nmemb; i++) {
+        releasegroup3 = result3->releasegroups[i];
+        for (j = 0; j < releasegroup3->nmemb; j++) {
+            release3 = releasegroup3->releases[j];
+            server_reply(job, "RESULT",
+                         "release %s releasegroup %s "
+                         "confidence %d distance %zd",
+                         release3->id,
+                         releasegroup3->id,
+                         release3->confidence_min,
+                         release3->metadata_distance);
+        }
+    }
+
+
     /* XXX Now do the diff against the metadata in the streams.
      *
      * Looks like there are occasional crashes in diff_stream().
      *
      * XXX It would appear we sometimes get here with no releases left!
      */
+    pthread_mutex_lock(&_mutex_report);
+    if (name != NULL)
+        printf("Album %s\n", name);
     printf("Calling diff_stream()\n");
     diff_stream(result3, ctxs);
     printf("Returned from diff_stream()\n");
+    fflush(stdout);
+    pthread_mutex_unlock(&_mutex_report);
 //    exit(0);
 
 
@@ -6037,15 +7701,570 @@ artist-rels"
     printf("Cleaning up...\n");
 //    pool_free_pc(pc2);
 //    acoustid_free(ac);
-    ne_sock_exit();
+    if (mr_best != NULL)
+        _match_release_free(mr_best);
+    fp3_free_result(result3);
+    _free_streams(streams, ctxs, nmemb);
+    free(names);
+
+    return (EXIT_SUCCESS);
+}
+
+
+/* Default number of albums processed at a time in batch mode
+ */
+#define SNDCHK_ALBUMS_DEFAULT 4
+
+
+/* A batch of albums, shared by the threads that process them.  Each
+ * thread takes the next album directory from @c dirs until there are
+ * none left.
+ */
+struct _batch
+{
+    struct musicbrainz_ctx *mb_ctx;
+    struct accuraterip_context *ar_ctx;
+    char **dirs;
+    size_t nmemb;
+    size_t next;
+    size_t failed;
+    pthread_mutex_t mutex;
+};
+
+
+/* Skip hidden files, as well as "." and "..".
+ */
+static int
+_filter_hidden(const struct dirent *entry)
+{
+    return (entry->d_name[0] != '.');
+}
+
+
+/* The _album_files() function lists the regular files in the album
+ * directory @p dir, sorted by name.  The list, as well as the paths
+ * in it, should be freed by the caller.
+ *
+ * @return 0 if successful, -1 otherwise.  If an error occurs, the
+ *         global variable @c errno is set to indicate the error.
+ */
+static int
+_album_files(const char *dir, char ***paths, size_t *nmemb)
+{
+    struct dirent **entries;
+    struct stat sb;
+    char **p;
+    size_t len;
+    int i, n;
+
+
+    n = scandir(dir, &entries, _filter_hidden, alphasort);
+    if (n < 0)
+        return (-1);
+
+    p = calloc(n > 0 ? n : 1, sizeof(char *));
+    if (p == NULL) {
+        for (i = 0; i < n; i++)
+            free(entries[i]);
+        free(entries);
+        return (-1);
+    }
+
+    *nmemb = 0;
+    for (i = 0; i < n; i++) {
+        len = strlen(dir) + strlen(entries[i]->d_name) + 2;
+        p[*nmemb] = malloc(len);
+        if (p[*nmemb] != NULL) {
+            snprintf(p[*nmemb], len, "%s/%s", dir, entries[i]->d_name);
+            if (stat(p[*nmemb], &sb) == 0 && S_ISREG(sb.st_mode))
+                (*nmemb)++;
+            else
+                free(p[*nmemb]);
+        }
+        free(entries[i]);
+    }
+    free(entries);
+
+    *paths = p;
+    return (0);
+}
+
+
+/* The _read_manifest() function appends the album directories listed
+ * in the manifest @p path to @p dirs, which holds @p nmemb entries.
+ * The manifest lists one directory per line; empty lines, and lines
+ * starting with '#', are ignored.  If @p path is "-", the manifest is
+ * read from standard input.
+ *
+ * @return 0 if successful, -1 otherwise.  If an error occurs, the
+ *         global variable @c errno is set to indicate the error.
+ */
+static int
+_read_manifest(const char *path, char ***dirs, size_t *nmemb)
+{
+    FILE *stream;
+    char *line;
+    void *p;
+    size_t size;
+    ssize_t len;
+
+
+    if (strcmp(path, "-") == 0) {
+        stream = stdin;
+    } else {
+        stream = fopen(path, "r");
+        if (stream == NULL)
+            return (-1);
+    }
+
+    line = NULL;
+    size = 0;
+    while ((len = getline(&line, &size, stream)) != -1) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        if (len == 0 || line[0] == '#')
+            continue;
+
+        p = realloc(*dirs, (*nmemb + 1) * sizeof(char *));
+        if (p == NULL)
+            break;
+        *dirs = p;
+        (*dirs)[*nmemb] = strdup(line);
+        if ((*dirs)[*nmemb] == NULL)
+            break;
+        (*nmemb)++;
+    }
+    free(line);
+
+    if (ferror(stream) || !feof(stream)) {
+        if (stream != stdin)
+            fclose(stream);
+        return (-1);
+    }
+    if (stream != stdin)
+        fclose(stream);
+    return (0);
+}
+
+
+/* The _process_directory() function processes the files in the
+ * album directory @p dir as one album, see _process_album().
+ *
+ * @return EXIT_SUCCESS if successful, EXIT_FAILURE or -1 otherwise
+ */
+static int
+_process_directory(struct musicbrainz_ctx *mb_ctx,
+                   struct accuraterip_context *ar_ctx,
+                   const char *dir,
+                   struct server_job *job)
+{
+    char **paths;
+    size_t i, nmemb;
+    int ret;
+
+
+    if (_album_files(dir, &paths, &nmemb) != 0) {
+        warn("Failed to list %s", dir);
+        server_reply(job, "PROGRESS", "failed to list directory: %s",
+                     strerror(errno));
+        return (-1);
+    }
+
+    printf("Processing album %s [%zd files]\n", dir, nmemb);
+    ret = _process_album(mb_ctx, ar_ctx, dir, paths, nmemb, job);
+    for (i = 0; i < nmemb; i++)
+        free(paths[i]);
+    free(paths);
+
+    return (ret);
+}
+
+
+/* The _batch_worker() function processes albums from the batch @p
+ * arg until there are none left.  Albums that cannot be listed or
+ * identified are counted as failed.
+ */
+static void *
+_batch_worker(void *arg)
+{
+    struct _batch *batch;
+    const char *dir;
+    int ret;
+
+
+    batch = (struct _batch *)arg;
+    for ( ; ; ) {
+        pthread_mutex_lock(&batch->mutex);
+        if (batch->next >= batch->nmemb) {
+            pthread_mutex_unlock(&batch->mutex);
+            break;
+        }
+        dir = batch->dirs[batch->next++];
+        pthread_mutex_unlock(&batch->mutex);
+
+        ret = _process_directory(batch->mb_ctx, batch->ar_ctx, dir, NULL);
+        if (ret != EXIT_SUCCESS) {
+            pthread_mutex_lock(&batch->mutex);
+            batch->failed++;
+            pthread_mutex_unlock(&batch->mutex);
+        }
+    }
+
+    return (NULL);
+}
+
+
+/* The _run_batch() function processes the album directories in @p
+ * dirs on @p jobs threads.  All albums share the MusicBrainz and
+ * AccurateRip contexts, the pool, and the caches and response stores
+ * behind them, so HTTP sessions stay open and responses stay warm
+ * from one album to the next.  Having several albums in flight lets
+ * the network-bound stages of one overlap with the decoding of
+ * another.
+ *
+ * XXX Releases handed out by musicbrainz_get_release() for evicted
+ * queries are kept until musicbrainz_free(), so memory still grows
+ * slowly with the number of albums.
+ *
+ * XXX The releasegroup nodes of an album block pool workers while
+ * they wait for MusicBrainz, which delays the fingerprints of other
+ * albums.
+ *
+ * @return EXIT_SUCCESS if all albums were processed successfully,
+ *         EXIT_FAILURE otherwise
+ */
+static int
+_run_batch(struct musicbrainz_ctx *mb_ctx,
+           struct accuraterip_context *ar_ctx,
+           char **dirs,
+           size_t nmemb,
+           size_t jobs)
+{
+    struct _batch batch;
+    pthread_t *threads;
+    size_t i, n;
+
+
+    batch.mb_ctx = mb_ctx;
+    batch.ar_ctx = ar_ctx;
+    batch.dirs = dirs;
+    batch.nmemb = nmemb;
+    batch.next = 0;
+    batch.failed = 0;
+    if (pthread_mutex_init(&batch.mutex, NULL) != 0)
+        return (EXIT_FAILURE);
+
+    if (jobs > nmemb)
+        jobs = nmemb;
+    threads = calloc(jobs > 0 ? jobs : 1, sizeof(pthread_t));
+    if (threads == NULL) {
+        pthread_mutex_destroy(&batch.mutex);
+        return (EXIT_FAILURE);
+    }
+
+
+    /* If no thread can be started, process the albums on this one.
+     */
+    for (n = 0; n < jobs; n++) {
+        if (pthread_create(threads + n, NULL, _batch_worker, &batch) != 0)
+            break;
+    }
+    if (n == 0)
+        _batch_worker(&batch);
+    for (i = 0; i < n; i++)
+        pthread_join(threads[i], NULL);
+    free(threads);
+    pthread_mutex_destroy(&batch.mutex);
+
+    printf("Processed %zd albums, %zd failed\n", nmemb, batch.failed);
+    return (batch.failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+
+/* The _serve_album() function is the handler of the server: it
+ * processes the album directory @p path submitted as @p job.  Only
+ * the contexts of the batch @p arg are used.
+ */
+static int
+_serve_album(void *arg, struct server_job *job, const char *path)
+{
+    struct _batch *batch;
+
+    batch = (struct _batch *)arg;
+    return (_process_directory(batch->mb_ctx, batch->ar_ctx, path, job));
+}
+
+
+/* The _run_server() function processes albums submitted on the UNIX
+ * domain socket @p path, up to @p jobs at a time, until a client
+ * shuts the server down.  Like a batch, all albums share the
+ * contexts, so the pool threads, the caches, the HTTP sessions and
+ * the state of the rate limiters stay warm between requests.  See
+ * server.h for the protocol.
+ *
+ * @return EXIT_SUCCESS if the server was shut down by a client,
+ *         EXIT_FAILURE otherwise
+ */
+static int
+_run_server(struct musicbrainz_ctx *mb_ctx,
+            struct accuraterip_context *ar_ctx,
+            const char *path,
+            size_t jobs)
+{
+    struct server_context *server;
+    struct _batch batch;
+    int ret;
+
+
+    memset(&batch, 0, sizeof(batch));
+    batch.mb_ctx = mb_ctx;
+    batch.ar_ctx = ar_ctx;
+
+    server = server_new(path, jobs, _serve_album, &batch);
+    if (server == NULL) {
+        warn("Failed to listen on %s", path);
+        return (EXIT_FAILURE);
+    }
+
+    printf("Listening on %s\n", path);
+    ret = server_run(server);
+    if (ret != 0)
+        warn("Server failed");
+    server_free(server);
+
+    return (ret == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+
+static void
+_usage(void)
+{
+    fprintf(stderr,
+            "usage: sndchk [-c] [-j albums] [-m megabytes] [-n streams] "
+            "file ...\n"
+            "       sndchk [-c] [-j albums] [-m megabytes] [-n streams] "
+            "[-f manifest] [directory ...]\n"
+            "       sndchk [-c] [-j albums] [-m megabytes] [-n streams] "
+            "-s socket\n"
+            "\n"
+            "  -c  cache results and responses in $XDG_CACHE_HOME/sndchk\n"
+            "      (~/.cache/sndchk); SNDCHK_CACHE_DIR selects another\n"
+            "      directory and enables the cache without -c\n");
+    exit(EXIT_FAILURE);
+}
+
+
+/* With files as arguments, sndchk processes them as one album.  With
+ * directories, or with a manifest of directories, it processes each
+ * directory as an album, up to SNDCHK_ALBUMS of them at a time.
+ * With -s, it runs as a server, and processes the album directories
+ * submitted on the socket.  In all cases, at most SNDCHK_STREAMS
+ * streams are decoded at a time, using an estimated SNDCHK_MEMORY MiB
+ * at most if set.  Results are only cached on disk with -c or
+ * SNDCHK_CACHE_DIR; see _init_cache().
+ */
+int
+main(int argc, char *argv[])
+{
+    struct accuraterip_context *ar_ctx;
+    struct musicbrainz_ctx *mb_ctx;
+    struct stat sb;
+    const char *manifest, *server_path;
+    char **dirs, *end;
+    size_t i, jobs, nmemb;
+    long l;
+    int cache, ch, ret;
+
+#if 0
+    printf("check %zd\n", levenshtein(L"GAMBOL", L"GUMBO"));
+    printf("check %zd\n", levenshtein(L"GUMBO", L"GAMBOL"));
+    printf("check %zd\n", levenshtein(L"nisse", L"nisse"));
+    printf("check %zd\n", levenshtein(L"nisse", L"nisseo"));
+    printf("check %zd\n", levenshtein(L"nisse", L"nisso"));
+    printf("check %zd\n", levenshtein(L"nisse", L"nisseapa"));
+    printf("check %zd\n", levenshtein(L"nisseprutt", L"nisseapa"));
+    printf("check %zd\n", levenshtein(L"nisse", L"niSsEo"));
+    printf("check %zd\n", levenshtein(L"nisse", L"niSsE"));
+    return (0);
+#endif
+
+
+  /* It appears we need to set the locale (see setlocale(3)) to ensure
+   * it's UTF-8 for string conversion stuff mbstowc(3).
+   *
+   * XXX This is probably not the right way to do this.  Read
+   * http://www.cl.cam.ac.uk/~mgk25/unicode.html, the OpenBSD man
+   * pages, and search Mendeley for Unicode.
+   */
+  setlocale(LC_CTYPE, "en_US.UTF-8");
+
+
+    /* The number of albums in flight defaults to SNDCHK_ALBUMS
+     * (SNDCHK_ALBUMS_DEFAULT if unset), and is overridden by -j.
+     */
+    jobs = SNDCHK_ALBUMS_DEFAULT;
+    end = getenv("SNDCHK_ALBUMS");
+    if (end != NULL && end[0] != '\0') {
+        l = strtol(end, &end, 10);
+        if (*end == '\0' && l > 0)
+            jobs = l;
+    }
 
-    for (i = 0; i < argc - 1; i++) {
-        fingersum_free(ctxs[i]);
-        fclose(streams[i]);
+    /* Likewise, the number of streams that may be open for decoding
+     * defaults to SNDCHK_STREAMS (SNDCHK_STREAMS_DEFAULT if unset),
+     * and is overridden by -n.
+     */
+    end = getenv("SNDCHK_STREAMS");
+    if (end != NULL && end[0] != '\0') {
+        l = strtol(end, &end, 10);
+        if (*end == '\0' && l > 0)
+            _admission.max = l;
+    }
+
+    /* The memory budget for the streams being decoded is given in
+     * MiB by SNDCHK_MEMORY, and overridden by -m.  By default, only
+     * the number of streams is bounded.
+     */
+    end = getenv("SNDCHK_MEMORY");
+    if (end != NULL && end[0] != '\0') {
+        l = strtol(end, &end, 10);
+        if (*end == '\0' && l > 0)
+            _admission.budget = (size_t)l * 1024 * 1024;
+    }
+
+    cache = 0;
+    manifest = NULL;
+    server_path = NULL;
+    while ((ch = getopt(argc, argv, "cf:j:m:n:s:")) != -1) {
+        switch (ch) {
+        case 'c':
+            cache = 1;
+            break;
+
+        case 'f':
+            manifest = optarg;
+            break;
+
+        case 's':
+            server_path = optarg;
+            break;
+
+        case 'j':
+            l = strtol(optarg, &end, 10);
+            if (*end != '\0' || l <= 0)
+                _usage();
+            jobs = l;
+            break;
+
+        case 'n':
+            l = strtol(optarg, &end, 10);
+            if (*end != '\0' || l <= 0)
+                _usage();
+            _admission.max = l;
+            break;
+
+        case 'm':
+            l = strtol(optarg, &end, 10);
+            if (*end != '\0' || l <= 0)
+                _usage();
+            _admission.budget = (size_t)l * 1024 * 1024;
+            break;
+
+        default:
+            _usage();
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    if (server_path != NULL && (argc > 0 || manifest != NULL))
+        _usage();
+
+
+    /* Directories are albums of their own; files make up a single
+     * album.  The two do not mix.
+     */
+    dirs = NULL;
+    nmemb = 0;
+    for (i = 0; i < (size_t)argc; i++) {
+        if (stat(argv[i], &sb) == 0 && S_ISDIR(sb.st_mode))
+            nmemb++;
+    }
+    if (nmemb > 0 && nmemb < (size_t)argc) {
+        warnx("Cannot mix files and album directories");
+        _usage();
+    }
+    if (nmemb == 0 && argc > 0 && manifest != NULL) {
+        warnx("Cannot mix files and a manifest");
+        _usage();
+    }
+    if (argc == 0 && manifest == NULL && server_path == NULL)
+        _usage();
+
+    if (manifest != NULL || nmemb > 0) {
+        dirs = calloc(argc > 0 ? argc : 1, sizeof(char *));
+        if (dirs == NULL)
+            err(EXIT_FAILURE, "Failed to allocate album list");
+        for (nmemb = 0; nmemb < (size_t)argc; nmemb++) {
+            dirs[nmemb] = strdup(argv[nmemb]);
+            if (dirs[nmemb] == NULL)
+                err(EXIT_FAILURE, "Failed to allocate album list");
+        }
+        if (manifest != NULL && _read_manifest(manifest, &dirs, &nmemb) != 0)
+            err(EXIT_FAILURE, "Failed to read manifest %s", manifest);
+    }
+
+
+    /* Initialise the neon library and its dependencies, must be
+     * called once before the first ne_session_create().  Should be
+     * matched by ne_sock_exit().  Even though neon is not directly
+     * used here, it is initialised here so as to avoid unnecessary
+     * initialisation in the individual modules.  As long as
+     * ne_sock_exit() is called on exit, this should work because of
+     * the reference-counting.
+     */
+    if (ne_sock_init() != 0)
+        return (-1);
+
+    _init_cache(cache);
+
+
+    /* The MusicBrainz and AccurateRip contexts are shared by all
+     * albums, so their sessions and caches persist between albums.
+     */
+    mb_ctx = musicbrainz_new();
+    if (mb_ctx == NULL) {
+        printf("Failed to initialise mb_ctx\n");
+        ne_sock_exit();
+        return (EXIT_FAILURE);
+    }
+
+#if 0
+    ar_ctx = accuraterip_new("localhost", 8080);
+#else
+    ar_ctx = accuraterip_new(NULL, 0);
+#endif
+    if (ar_ctx == NULL) {
+        printf("Failed to initialise ar_ctx\n");
+        musicbrainz_free(mb_ctx);
+        ne_sock_exit();
+        return (EXIT_FAILURE);
+    }
+
+    if (server_path != NULL) {
+        ret = _run_server(mb_ctx, ar_ctx, server_path, jobs);
+    } else if (dirs == NULL) {
+        ret = _process_album(mb_ctx, ar_ctx, NULL, argv, argc, NULL);
+    } else {
+        ret = _run_batch(mb_ctx, ar_ctx, dirs, nmemb, jobs);
+        for (i = 0; i < nmemb; i++)
+            free(dirs[i]);
+        free(dirs);
     }
-    free(ctxs);
-    free(streams);
+
+    accuraterip_free(ar_ctx);
+    musicbrainz_free(mb_ctx);
+    ne_sock_exit();
 
     printf("Thank you, call again!\n");
-    return (EXIT_SUCCESS);
+    return (ret);
 }
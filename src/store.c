@@ -0,0 +1,135 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil; tab-width: 8 -*- */
+
+/*-
+ * Copyright © 2019, Johan Hattne
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice appear
+ * in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS.  IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS
+ * OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#    include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "store.h"
+
+
+int
+store_mkdir(const char *path)
+{
+    char *p, *q;
+
+    p = strdup(path);
+    if (p == NULL)
+        return (-1);
+
+    for (q = p + 1; ; q++) {
+        if (*q != '/' && *q != '\0')
+            continue;
+
+        if (*q == '/') {
+            *q = '\0';
+            if (mkdir(p, 0755) != 0 && errno != EEXIST) {
+                free(p);
+                return (-1);
+            }
+            *q = '/';
+        } else {
+            if (mkdir(p, 0755) != 0 && errno != EEXIST) {
+                free(p);
+                return (-1);
+            }
+            break;
+        }
+    }
+
+    free(p);
+    errno = 0;
+    return (0);
+}
+
+
+/* The temporary file is hidden, and goes in the same directory as
+ * the record, such that rename(2) does not cross file systems.
+ */
+FILE *
+store_create(const char *path, char **tmp)
+{
+    FILE *stream;
+    char *p;
+    size_t len;
+    int fd;
+
+
+    len = strlen(path) + 9 + 1;
+    *tmp = malloc(len);
+    if (*tmp == NULL)
+        return (NULL);
+    strcpy(*tmp, path);
+    p = strrchr(*tmp, '/');
+    if (p != NULL) {
+        *p = '\0';
+        if (p > *tmp && store_mkdir(*tmp) != 0) {
+            free(*tmp);
+            *tmp = NULL;
+            return (NULL);
+        }
+        strcpy(p, "/.XXXXXXX");
+    } else {
+        strcpy(*tmp, ".XXXXXXX");
+    }
+
+    fd = mkstemp(*tmp);
+    if (fd == -1) {
+        free(*tmp);
+        *tmp = NULL;
+        return (NULL);
+    }
+
+    stream = fdopen(fd, "w");
+    if (stream == NULL) {
+        close(fd);
+        unlink(*tmp);
+        free(*tmp);
+        *tmp = NULL;
+        return (NULL);
+    }
+
+    return (stream);
+}
+
+
+int
+store_commit(FILE *stream, char *tmp, const char *path, int status)
+{
+    int ret;
+
+    ret = 0;
+    if (fclose(stream) != 0 || status != 0 || rename(tmp, path) != 0) {
+        unlink(tmp);
+        ret = -1;
+    }
+
+    free(tmp);
+    return (ret);
+}
@@ -0,0 +1,100 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil; tab-width: 8 -*- */
+
+/*-
+ * Copyright © 2019, Johan Hattne
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice appear
+ * in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS.  IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS
+ * OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef STORE_H
+#define STORE_H 1
+
+#ifdef __cplusplus
+#  define STORE_BEGIN_C_DECLS extern "C" {
+#  define STORE_END_C_DECLS   }
+#else
+#  define STORE_BEGIN_C_DECLS
+#  define STORE_END_C_DECLS
+#endif
+
+STORE_BEGIN_C_DECLS
+
+/**
+ * @file store.h
+ * @brief Files of the on-disk caches
+ *
+ * The fingersum cache and the AccurateRip and MusicBrainz stores all
+ * keep one record per file below a directory of their own.  This
+ * module creates those directories, and writes records such that a
+ * record is either absent or complete: a record is written to a
+ * temporary file next to its final name, and renamed into place once
+ * it has been written in full.
+ */
+
+#include <stdio.h>
+
+
+/**
+ * @brief Create a directory and its parents
+ *
+ * Like mkdir -p, directories that already exist are not an error.
+ *
+ * @param path Path to the directory
+ * @return     0 if successful, -1 otherwise.  If an error occurs, the
+ *             global variable @c errno is set to indicate the error.
+ */
+int
+store_mkdir(const char *path);
+
+
+/**
+ * @brief Start writing a record
+ *
+ * Creates the directory of @p path if needed, and opens a new
+ * temporary file in it for writing.  The record must be finished
+ * with store_commit(), whether it was written successfully or not.
+ *
+ * @param path Final path of the record
+ * @param tmp  Path to the temporary file, which must be passed to
+ *             store_commit()
+ * @return     Stream to write the record to if successful, @c NULL
+ *             otherwise.  If an error occurs, the global variable @c
+ *             errno is set to indicate the error.
+ */
+FILE *
+store_create(const char *path, char **tmp);
+
+
+/**
+ * @brief Finish writing a record
+ *
+ * Closes @p stream, and renames the temporary file @p tmp to @p path
+ * unless @p status is non-zero, i.e. unless writing the record
+ * failed.  Otherwise, or if closing or renaming fails, the temporary
+ * file is removed and any previous record at @p path is left as it
+ * was.  @p tmp is freed in either case.
+ *
+ * @param stream Stream returned by store_create()
+ * @param tmp    Temporary file returned by store_create()
+ * @param path   Final path of the record
+ * @param status 0 if the record was written successfully
+ * @return       0 if the record was installed, -1 otherwise
+ */
+int
+store_commit(FILE *stream, char *tmp, const char *path, int status);
+
+STORE_END_C_DECLS
+
+#endif /* !STORE_H */
@@ -0,0 +1,286 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil; tab-width: 8 -*- */
+
+/*-
+ * Copyright © 2019, Johan Hattne
+ *
+ * Permission to use, copy, modify, and/or distribute this software
+ * for any purpose with or without fee is hereby granted, provided
+ * that the above copyright notice and this permission notice appear
+ * in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS.  IN NO EVENT SHALL THE
+ * AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT, INDIRECT, OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS
+ * OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT,
+ * NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <err.h>
+#include <limits.h>
+#include <string.h>
+
+#include "../src/configuration.h" // XXX path is bad
+
+
+/* Checks _cfg2_hungarian() and the ranking of track configurations
+ * behind _cfg2_rank_configurations() and _cfg2_next_configuration()
+ * against exhaustive enumeration.  The solver is exercised directly,
+ * without any MusicBrainz data, on small random problems where some
+ * tracks share candidate streams and residuals tie.
+ */
+
+#define MAX_ROWS 5
+#define MAX_COLS 6
+#define MAX_CONFIGURATIONS 720
+
+
+/* The _brute() function enumerates all assignments of distinct
+ * columns to the rows @p r through @p n - 1 of the @p n by @p m cost
+ * matrix @p costs, where @p used marks the columns taken by the
+ * previous rows and @p cost is their cost.  The cost of every
+ * assignment that avoids the pairs of cost @p inf is appended to @p
+ * out.
+ */
+static void
+_brute(const long int *costs,
+       size_t n,
+       size_t m,
+       long int inf,
+       size_t r,
+       int *used,
+       long int cost,
+       long int *out,
+       size_t *nmemb)
+{
+    size_t c;
+
+    if (r >= n) {
+        out[(*nmemb)++] = cost;
+        return;
+    }
+
+    for (c = 0; c < m; c++) {
+        if (used[c] != 0 || costs[r * m + c] >= inf)
+            continue;
+        used[c] = 1;
+        _brute(costs, n, m, inf, r + 1, used, cost + costs[r * m + c],
+               out, nmemb);
+        used[c] = 0;
+    }
+}
+
+
+static int
+_long_compar(const void *a, const void *b)
+{
+    long int la, lb;
+
+    la = *(const long int *)a;
+    lb = *(const long int *)b;
+    return (la < lb ? -1 : la > lb ? 1 : 0);
+}
+
+
+/* Random cost matrix, where roughly one in three pairs is not a
+ * candidate and has cost @p inf.  Residuals are small, so that ties
+ * are common.
+ */
+static void
+_random_costs(long int *costs, size_t n, size_t m, long int inf)
+{
+    size_t i;
+
+    for (i = 0; i < n * m; i++)
+        costs[i] = rand() % 3 == 0 ? inf : rand() % 4;
+}
+
+
+static void
+_test_hungarian(size_t trial, size_t n, size_t m)
+{
+    long int costs[MAX_ROWS * MAX_COLS], out[MAX_CONFIGURATIONS];
+    size_t cols[MAX_ROWS];
+    int used[MAX_COLS];
+    size_t i, j, nmemb;
+    long int cost, sum;
+
+
+    /* Every pair is allowed, so that there always is a solution, but
+     * the costs are otherwise random.
+     */
+    for (i = 0; i < n * m; i++)
+        costs[i] = rand() % 100;
+
+    cost = _cfg2_hungarian(costs, n, m, cols);
+    if (cost < 0)
+        err(EXIT_FAILURE, "_cfg2_hungarian()");
+
+    sum = 0;
+    for (i = 0; i < n; i++) {
+        if (cols[i] >= m)
+            errx(EXIT_FAILURE, "Trial %zd: column out of range", trial);
+        for (j = 0; j < i; j++) {
+            if (cols[j] == cols[i])
+                errx(EXIT_FAILURE, "Trial %zd: column assigned twice", trial);
+        }
+        sum += costs[i * m + cols[i]];
+    }
+    if (sum != cost) {
+        errx(EXIT_FAILURE, "Trial %zd: cost %ld, assignment sums to %ld",
+             trial, cost, sum);
+    }
+
+    memset(used, 0, sizeof(used));
+    nmemb = 0;
+    _brute(costs, n, m, LONG_MAX, 0, used, 0, out, &nmemb);
+    qsort(out, nmemb, sizeof(long int), _long_compar);
+    if (cost != out[0]) {
+        errx(EXIT_FAILURE, "Trial %zd: cost %ld, optimum %ld",
+             trial, cost, out[0]);
+    }
+}
+
+
+/* The _test_ranking() function sets up a single medium with @p n
+ * tracks, whose candidate streams are the finite entries of a random
+ * @p n by @p m cost matrix, and checks that the configurations come
+ * out valid, in order of increasing residual, and that every valid
+ * configuration comes out exactly once.
+ */
+static void
+_test_ranking(size_t trial, size_t n, size_t m)
+{
+    long int costs[MAX_ROWS * MAX_COLS], out[MAX_CONFIGURATIONS];
+    size_t seen[MAX_CONFIGURATIONS][MAX_ROWS];
+    struct _cfg2_cfg *cfg;
+    struct _cfg2_track *track;
+    int used[MAX_COLS];
+    size_t c, i, j, k, nmemb, nseen;
+    long int inf, residual;
+    int status;
+
+
+    inf = 1000;
+    _random_costs(costs, n, m, inf);
+
+
+    /* The candidate streams of each track must be in order of
+     * increasing magnitude of the residual, as left by
+     * _cfg2_track_assign().  Tracks without candidates are skipped
+     * by the ranking, so give each row at least one.
+     */
+    cfg = calloc(1, sizeof(struct _cfg2_cfg));
+    if (cfg == NULL)
+        err(EXIT_FAILURE, "calloc()");
+    cfg->n_media = 1;
+    cfg->media = calloc(1, sizeof(struct _cfg2_medium));
+    if (cfg->media == NULL)
+        err(EXIT_FAILURE, "calloc()");
+    cfg->media[0].n_tracks = n;
+    cfg->media[0].tracks = calloc(n, sizeof(struct _cfg2_track));
+    if (cfg->media[0].tracks == NULL)
+        err(EXIT_FAILURE, "calloc()");
+
+    for (i = 0; i < n; i++) {
+        for (c = 0; c < m && costs[i * m + c] >= inf; c++)
+            ;
+        if (c >= m)
+            costs[i * m + rand() % m] = rand() % 4;
+
+        track = cfg->media[0].tracks + i;
+        track->streams = calloc(m, sizeof(struct _cfg2_stream));
+        if (track->streams == NULL)
+            err(EXIT_FAILURE, "calloc()");
+        for (residual = 0; residual < inf; residual++) {
+            for (c = 0; c < m; c++) {
+                if (costs[i * m + c] != residual)
+                    continue;
+                track->streams[track->nmemb].index = c;
+                track->streams[track->nmemb].residual =
+                    track->nmemb % 2 == 0 ? residual : -residual;
+                track->nmemb += 1;
+            }
+        }
+    }
+
+    memset(used, 0, sizeof(used));
+    nmemb = 0;
+    _brute(costs, n, m, inf, 0, used, 0, out, &nmemb);
+    qsort(out, nmemb, sizeof(long int), _long_compar);
+
+
+    /* Enumerate and compare.  The residuals must match the sorted
+     * exhaustive costs one by one.
+     */
+    nseen = 0;
+    for (status = _cfg2_rank_configurations(cfg);
+         status == 0;
+         status = _cfg2_next_configuration(cfg)) {
+        if (nseen >= nmemb) {
+            errx(EXIT_FAILURE, "Trial %zd: more than %zd configurations",
+                 trial, nmemb);
+        }
+        if (_cfg2_configuration_is_valid(cfg) == 0)
+            errx(EXIT_FAILURE, "Trial %zd: invalid configuration", trial);
+
+        residual = _cfg2_residual_configuration(cfg);
+        if (residual != out[nseen]) {
+            errx(EXIT_FAILURE,
+                 "Trial %zd: configuration %zd has residual %ld, "
+                 "expected %ld", trial, nseen, residual, out[nseen]);
+        }
+
+        for (i = 0; i < n; i++) {
+            track = cfg->media[0].tracks + i;
+            seen[nseen][i] = track->streams[track->selected].index;
+        }
+        for (k = 0; k < nseen; k++) {
+            for (j = 0; j < n && seen[k][j] == seen[nseen][j]; j++)
+                ;
+            if (j >= n) {
+                errx(EXIT_FAILURE, "Trial %zd: configuration %zd "
+                     "repeats configuration %zd", trial, nseen, k);
+            }
+        }
+        nseen += 1;
+    }
+
+    if (nseen != nmemb) {
+        errx(EXIT_FAILURE, "Trial %zd: %zd configurations, expected %zd",
+             trial, nseen, nmemb);
+    }
+
+    _cfg2_cfg_free(cfg);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    size_t i, m, n, trial;
+
+
+    /* Fixed seed, so that failures can be reproduced.
+     */
+    srand(1);
+
+    trial = 0;
+    for (n = 1; n <= MAX_ROWS; n++) {
+        for (m = n; m <= MAX_COLS; m++) {
+            for (i = 0; i < 50; i++) {
+                _test_hungarian(trial, n, m);
+                _test_ranking(trial, n, m);
+                trial++;
+            }
+        }
+    }
+
+    printf("Passed %zd trials\n", trial);
+    return (0);
+}
@@ -59,9 +59,10 @@ main(int argc, char *argv[])
     size_t njobs;
 
 
-    /* Default values for command line options.
+    /* Default values for command line options.  The default number
+     * of jobs is the number of CPUs available to the process.
      */
-    njobs = 4;
+    njobs = pool_nmemb_auto();
 
     opterr = 0;
     while ((ch = getopt(argc, argv, optstring)) != -1) {
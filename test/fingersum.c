@@ -27,6 +27,8 @@
 #include <errno.h>
 #include <unistd.h>
 
+#define USE_CRC32 1 // XXX WIP, must match src/fingersum.c
+
 #include "../src/fingersum.h" // XXX path is bad
 #include "../src/pool.h" // XXX path is bad
 
@@ -46,6 +48,7 @@ main(int argc, char *argv[])
     int ch, i, print_checksum, print_duration, print_fingerprint;
 
     struct fp3_ar *result;
+    uint32_t crc, crc_skip_zero;
 
     ssize_t njobs;
 
@@ -128,6 +131,17 @@ main(int argc, char *argv[])
                         "Checksum calculation failed for %s", argv[i]);
                 }
 
+                if (fingersum_get_crc32(ctx, &crc, &crc_skip_zero) != 0) {
+                    fp3_ar_free(result);
+                    fingersum_free(ctx);
+                    fclose(stream);
+                    err(EXIT_FAILURE,
+                        "CRC32 calculation failed for %s", argv[i]);
+                }
+                printf("      CRC32: %08X\n", crc);
+                printf("  Skip zero: %08X\n", crc_skip_zero);
+                fp3_ar_free(result);
+
                 // XXX Broken everywhere! Does not respect the offsets!
 /*
                 printf("Checksum[0]: 0x%08x 0x%08x\n",